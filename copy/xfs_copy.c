@@ -6,13 +6,14 @@
 
 #include "libxfs.h"
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/syscall.h>
 #include <pthread.h>
-#include <signal.h>
 #include <stdarg.h>
 #include "xfs_copy.h"
 #include "libxlog.h"
 #include "libfrog/platform.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/convert.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
 #define uuid_equal(s,d) (platform_uuid_compare((s),(d)) == 0)
@@ -25,6 +26,7 @@ static char		LOGFILE_NAME[] = "/var/tmp/xfs_copy.log.XXXXXX";
 
 static char		*source_name;
 static int		source_fd;
+static dev_t		source_dev;		/* fs holding a source file */
 
 static unsigned int	source_blocksize;	/* source filesystem blocksize */
 static unsigned int	source_sectorsize;	/* source disk sectorsize */
@@ -37,21 +39,41 @@ static unsigned int	num_targets;
 static target_control	*target;
 
 static wbuf		w_buf;
-static wbuf		btree_buf;
-
-static unsigned int	kids;
+static wbuf_pool	pool;
+static int		wblocks;	/* pool buffer size in basic blocks */
 
 static thread_control	glob_masks;
 static thread_args	*targ;
 
-static pthread_mutex_t	mainwait;
+/* progress of the copy, updated by the target writers */
+static pthread_mutex_t	progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static int		howfar;
+
+/* concurrent source readers, and pool buffers per reader */
+#define MAX_READERS	16
+#define BUFS_PER_READER	4
+#define MAX_BUFS	4096	/* upper limit for a -m buffer budget */
+
+/* how the used space is split up between the source readers */
+#define JOBS_PER_READER	4
+#define MIN_JOB_BUFS	16
+
+static extent_list	*ag_used;	/* used space found in each AG */
+static extent_list	used_list;	/* merged used space of the fs */
+static copy_job		*copy_jobs;
 
 #define ACTIVE		1
 #define INACTIVE	2
 
+/* target types */
+#define TARGET_DEVICE	0	/* block device */
+#define TARGET_FILE	1	/* regular file, free space left as holes */
+#define TARGET_OFFLOAD	2	/* file on the source's fs, use copy_file_range */
+
 xfs_off_t	write_log_trailer(int fd, wbuf *w, xfs_mount_t *mp);
 xfs_off_t	write_log_header(int fd, wbuf *w, xfs_mount_t *mp);
 static int	format_logs(struct xfs_mount *);
+static int	bump_bar(int tenths, uint64_t numblocks);
 
 /* general purpose message reporting routine */
 
@@ -61,16 +83,6 @@ static int	format_logs(struct xfs_mount *);
 #define PRE	0x08		/* append strerror string */
 #define LAST	0x10		/* final message we print */
 
-static void
-signal_maskfunc(int addset, int newset)
-{
-	sigset_t set;
-
-	sigemptyset(&set);
-	sigaddset(&set, addset);
-	sigprocmask(newset, &set, NULL);
-}
-
 static void
 do_message(int flags, int code, const char *fmt, ...)
 {
@@ -183,6 +195,57 @@ check_errors(void)
 	}
 }
 
+#ifdef HAVE_COPY_FILE_RANGE
+/*
+ * Have the kernel copy a buffer's range straight from the source file.  On
+ * filesystems that support it (e.g. XFS with reflink) this shares the blocks
+ * instead of copying them.  Issue the raw syscall; we don't want the glibc
+ * buffered copy fallback.
+ */
+static int
+do_copy_range(
+	thread_args	*args,
+	wbuf		*buf)
+{
+	loff_t		src = buf->position;
+	loff_t		dst = buf->position;
+	size_t		len = buf->length;
+	ssize_t		res;
+
+	while (len > 0)  {
+		res = syscall(__NR_copy_file_range, source_fd, &src,
+				args->fd, &dst, len, 0);
+		if (res < 0)  {
+			target[args->id].error = errno;
+			target[args->id].err_type = 0;
+			target[args->id].position = dst;
+			return 1;
+		}
+		if (res == 0)		/* end of the source */
+			break;
+		len -= res;
+	}
+	target[args->id].position = dst;
+	return 0;
+}
+
+/* Can we copy from the source file to this target with copy_file_range? */
+static int
+probe_copy_range(
+	int		fd)
+{
+	loff_t		src = 0;
+	loff_t		dst = 0;
+
+	/* the first block is the primary superblock, rewritten at the end */
+	return syscall(__NR_copy_file_range, source_fd, &src, fd, &dst,
+			source_blocksize, 0) == source_blocksize;
+}
+#else
+# define do_copy_range(a, b)	(1)
+# define probe_copy_range(fd)	(0)
+#endif
+
 /*
  * don't have to worry about alignment and mins because those
  * are taken care of when the buffer's read in
@@ -192,131 +255,174 @@ do_write(
 	thread_args	*args,
 	wbuf		*buf)
 {
-	int		res;
-	int		error = 0;
+	ssize_t		res;
 
 	if (!buf)
 		buf = &w_buf;
 
-	if (target[args->id].position != buf->position)  {
-		if (lseek(args->fd, buf->position, SEEK_SET) < 0)  {
-			error = target[args->id].err_type = 1;
-		} else  {
-			target[args->id].position = buf->position;
-		}
-	}
+	if (buf->clean && target[args->id].type == TARGET_OFFLOAD)
+		return do_copy_range(args, buf);
+	ASSERT(!buf->unread);
 
-	if ((res = write(target[args->id].fd, buf->data,
-				buf->length)) == buf->length)  {
-		target[args->id].position += res;
-	} else  {
-		error = 2;
+	res = pwrite(args->fd, buf->data, buf->length, buf->position);
+	if (res == buf->length)  {
+		target[args->id].position = buf->position + res;
+		return 0;
 	}
 
-	if (error) {
-		target[args->id].error = errno;
-		target[args->id].position = buf->position;
-	}
-	return error;
+	target[args->id].error = res < 0 ? errno : EIO;
+	target[args->id].err_type = 0;
+	target[args->id].position = buf->position;
+	return 1;
 }
 
-static void *
-begin_reader(void *arg)
+/*
+ * Stop writing to a target after an I/O error, and say so right away rather
+ * than leaving it to the summary at the end of the copy.
+ */
+static void
+target_failed(
+	int		id)
 {
-	thread_args	*args = arg;
+	pthread_mutex_lock(&glob_masks.mutex);
+	target[id].state = INACTIVE;
+	pthread_mutex_unlock(&glob_masks.mutex);
 
-	rcu_register_thread();
-	for (;;) {
-		pthread_mutex_lock(&args->wait);
-		if (do_write(args, NULL))
-			goto handle_error;
-	        pthread_mutex_lock(&glob_masks.mutex);
-		if (--glob_masks.num_working == 0)
-			pthread_mutex_unlock(&mainwait);
-		pthread_mutex_unlock(&glob_masks.mutex);
+	if (target[id].err_type == 0)
+		do_warn(
+	_("%s:  write error on target %d \"%s\" at offset %lld\n"),
+			progname, id, target[id].name, target[id].position);
+	else
+		do_warn(
+	_("%s:  lseek error on target %d \"%s\" at offset %lld\n"),
+			progname, id, target[id].name, target[id].position);
+	do_vfatal(target[id].error, _("Aborting target %d - reason"), id);
+}
+
+static wbuf *
+wbuf_get(void)
+{
+	wbuf		*buf;
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.nr_free == 0)
+		pthread_cond_wait(&pool.wait, &pool.lock);
+	buf = pool.free[--pool.nr_free];
+	pthread_mutex_unlock(&pool.lock);
+	return buf;
+}
+
+static void
+wbuf_put(
+	wbuf		*buf)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (--buf->refcount <= 0)  {
+		pool.free[pool.nr_free++] = buf;
+		pthread_cond_signal(&pool.wait);
 	}
-	/* NOTREACHED */
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Each target advances on its own.  The progress bar follows the slowest
+ * target that is still being written.
+ */
+static void
+account_progress(
+	int		id,
+	wbuf		*buf)
+{
+	uint64_t	slowest = UINT64_MAX;
+	int		i;
 
-handle_error:
-	/* error will be logged by primary thread */
+	pthread_mutex_lock(&progress_lock);
+	target[id].blocks += buf->blocks;
+	target[id].bytes += buf->length;
+	gettimeofday(&target[id].stop, NULL);
 
+	/* target states change under the global mask lock */
 	pthread_mutex_lock(&glob_masks.mutex);
-	target[args->id].state = INACTIVE;
-	if (--glob_masks.num_working == 0)
-		pthread_mutex_unlock(&mainwait);
+	for (i = 0; i < num_targets; i++)
+		if (target[i].state != INACTIVE)
+			slowest = min(slowest, target[i].blocks);
 	pthread_mutex_unlock(&glob_masks.mutex);
-	rcu_unregister_thread();
-	pthread_exit(NULL);
-	return NULL;
+	if (slowest != UINT64_MAX)
+		howfar = bump_bar(howfar, slowest);
+	pthread_mutex_unlock(&progress_lock);
 }
 
+/* Report how fast each target was written. */
 static void
-handler(int sig)
+report_targets(void)
 {
-	pid_t	pid;
-	int	status, i;
-
-	pid = wait(&status);
-
-	kids--;
+	double		secs;
+	double		mib;
+	int		i;
 
 	for (i = 0; i < num_targets; i++)  {
-		if (target[i].pid == pid)  {
-			if (target[i].state == INACTIVE)  {
-				/* thread got an I/O error */
-
-				if (target[i].err_type == 0)  {
-					do_warn(
-		_("%s:  write error on target %d \"%s\" at offset %lld\n"),
-						progname, i, target[i].name,
-						target[i].position);
-				} else  {
-					do_warn(
-		_("%s:  lseek error on target %d \"%s\" at offset %lld\n"),
-						progname, i, target[i].name,
-						target[i].position);
-				}
-
-				do_vfatal(target[i].error,
-					_("Aborting target %d - reason"), i);
+		if (target[i].state == INACTIVE)
+			continue;
+		secs = (target[i].stop.tv_sec - target[i].start.tv_sec) +
+		       (target[i].stop.tv_usec - target[i].start.tv_usec) /
+				1000000.0;
+		mib = target[i].bytes / (1024.0 * 1024.0);
+		do_out(_("%s:  wrote %.1f MiB in %.1f seconds (%.1f MiB/s)\n"),
+			target[i].name, mib, secs,
+			secs > 0 ? mib / secs : 0.0);
+	}
+}
 
-				if (kids == 0)  {
-					do_log(
-				_("Aborting XFS copy - no more targets.\n"));
-					check_errors();
-					pthread_exit(NULL);
-				}
+static void *
+begin_writer(void *arg)
+{
+	thread_args	*args = arg;
+	wbuf		*buf;
+	int		active;
 
-				signal(SIGCHLD, handler);
-				return;
-			} else  {
-				/* it just croaked it bigtime, log it */
-
-				do_warn(
-	_("%s:  thread %d died unexpectedly, target \"%s\" incomplete\n"),
-					progname, i, target[i].name);
-				do_warn(_("%s:  offset was probably %lld\n"),
-					progname, target[i].position);
-				do_fatal(target[i].error,
-					_("Aborting XFS copy - reason"));
-				pthread_exit(NULL);
-			}
+	rcu_register_thread();
+	for (;;) {
+		pthread_mutex_lock(&args->lock);
+		while (args->count == 0 && !args->done)
+			pthread_cond_wait(&args->wait, &args->lock);
+		if (args->count == 0)  {
+			pthread_mutex_unlock(&args->lock);
+			break;
 		}
-	}
+		buf = args->queue[args->head];
+		args->head = (args->head + 1) % pool.nr_bufs;
+		args->count--;
+		pthread_mutex_unlock(&args->lock);
+
+		/*
+		 * Once a target has failed we keep draining its queue so that
+		 * the buffers go back to the pool, but write nothing more.
+		 */
+		pthread_mutex_lock(&glob_masks.mutex);
+		active = target[args->id].state != INACTIVE;
+		pthread_mutex_unlock(&glob_masks.mutex);
 
-	/* unknown child -- something very wrong */
+		if (active && do_write(args, buf))  {
+			target_failed(args->id);
+		} else if (active)  {
+			account_progress(args->id, buf);
+		}
+		wbuf_put(buf);
 
-	do_warn(_("%s: Unknown child died (should never happen!)\n"), progname);
-	die_perror();
-	pthread_exit(NULL);
-	signal(SIGCHLD, handler);
+		pthread_mutex_lock(&args->lock);
+		if (--args->inflight == 0)
+			pthread_cond_broadcast(&args->wait);
+		pthread_mutex_unlock(&args->lock);
+	}
+	rcu_unregister_thread();
+	return NULL;
 }
 
 static void
 usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s [-bdV] [-L logfile] source target [target ...]\n"),
+		_("Usage: %s [-bdV] [-L logfile] [-m bufsize] source target [target ...]\n"),
 		progname);
 	exit(1);
 }
@@ -360,8 +466,6 @@ bump_bar(int tenths, uint64_t numblocks)
 	return tenths;
 }
 
-static xfs_off_t source_position = -1;
-
 static wbuf *
 wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 {
@@ -376,14 +480,16 @@ wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 	buf->min_io_size = min_io_size;
 	buf->size = data_size;
 	buf->id = id;
+	buf->clean = 0;
+	buf->unread = 0;
+	buf->blocks = 0;
 	return buf;
 }
 
+/* Expand a buffer's range to satisfy the direct I/O constraints. */
 static void
-read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
+align_wbuf(wbuf *buf)
 {
-	int		res = 0;
-	xfs_off_t	lres = 0;
 	xfs_off_t	newpos;
 	size_t		diff;
 
@@ -396,17 +502,7 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		buf->length += diff;
 	}
 
-	if (source_position != buf->position)  {
-		lres = lseek(fd, buf->position, SEEK_SET);
-		if (lres < 0LL)  {
-			do_warn(_("%s:  lseek failure at offset %lld\n"),
-				progname, source_position);
-			die_perror();
-		}
-		source_position = buf->position;
-	}
-
-	ASSERT(source_position % source_sectorsize == 0);
+	ASSERT(buf->position % source_sectorsize == 0);
 
 	/* round up length for direct I/O if necessary */
 
@@ -418,19 +514,26 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 			buf->length, buf->size);
 		exit(1);
 	}
+}
+
+static void
+read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
+{
+	ssize_t		res = 0;
 
-	if ((res = read(fd, buf->data, buf->length)) < 0)  {
+	align_wbuf(buf);
+
+	if ((res = pread(fd, buf->data, buf->length, buf->position)) < 0)  {
 		do_warn(_("%s:  read failure at offset %lld\n"),
-				progname, source_position);
+				progname, buf->position);
 		die_perror();
 	}
 
 	if (res < buf->length &&
-	    source_position + res == mp->m_sb.sb_dblocks * source_blocksize)
+	    buf->position + res == mp->m_sb.sb_dblocks * source_blocksize)
 		res = buf->length;
 	else
 		ASSERT(res == buf->length);
-	source_position += res;
 	buf->length = res;
 }
 
@@ -481,36 +584,481 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 }
 
 
-static void
-write_wbuf(void)
+/* How many targets have not failed yet. */
+static int
+active_targets(void)
 {
 	int		i;
-	int		badness = 0;
+	int		active = 0;
 
-	/* verify target threads */
+	pthread_mutex_lock(&glob_masks.mutex);
 	for (i = 0; i < num_targets; i++)
 		if (target[i].state != INACTIVE)
-			glob_masks.num_working++;
+			active++;
+	pthread_mutex_unlock(&glob_masks.mutex);
+	return active;
+}
 
-	/* release target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			pthread_mutex_unlock(&targ[i].wait);	/* wake up */
-		else
-			badness++;
+/*
+ * Queue a filled buffer to every active target.  The buffer goes back to the
+ * pool once the last target has written it.
+ */
+static void
+submit_wbuf(
+	wbuf		*buf)
+{
+	thread_args	*args;
+	int		i, slot;
 
 	/*
-	 * If all the targets are inactive then there won't be any io
-	 * threads left to release mainwait.  We're screwed, so bail out.
+	 * If all the targets are inactive then there's nobody left to
+	 * write to.  We're screwed, so bail out.
 	 */
-	if (badness == num_targets) {
+	if (active_targets() == 0)  {
 		check_errors();
 		exit(1);
 	}
 
-	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
-	pthread_mutex_lock(&mainwait);
-	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+	buf->refcount = num_targets;
+	for (i = 0, args = targ; i < num_targets; i++, args++)  {
+		pthread_mutex_lock(&args->lock);
+		slot = (args->head + args->count) % pool.nr_bufs;
+		args->queue[slot] = buf;
+		args->count++;
+		args->inflight++;
+		pthread_cond_broadcast(&args->wait);
+		pthread_mutex_unlock(&args->lock);
+	}
+}
+
+/* Wait for every target to finish writing all queued buffers. */
+static void
+flush_targets(void)
+{
+	thread_args	*args;
+	int		i;
+
+	for (i = 0, args = targ; i < num_targets; i++, args++)  {
+		pthread_mutex_lock(&args->lock);
+		while (args->inflight > 0)
+			pthread_cond_wait(&args->wait, &args->lock);
+		pthread_mutex_unlock(&args->lock);
+	}
+}
+
+/* Tell the target writers that no more buffers are coming. */
+static void
+stop_writers(void)
+{
+	thread_args	*args;
+	int		i;
+
+	for (i = 0, args = targ; i < num_targets; i++, args++)  {
+		pthread_mutex_lock(&args->lock);
+		args->done = 1;
+		pthread_cond_broadcast(&args->wait);
+		pthread_mutex_unlock(&args->lock);
+	}
+	for (i = 0; i < num_targets; i++)
+		pthread_join(target[i].pid, NULL);
+}
+
+/*
+ * If every target still being written can copy straight from the source
+ * file, there is no need to read the data ourselves.
+ */
+static int
+offload_only(void)
+{
+	int		i;
+	int		ret = 1;
+
+	pthread_mutex_lock(&glob_masks.mutex);
+	for (i = 0; i < num_targets; i++)
+		if (target[i].state != INACTIVE &&
+		    target[i].type != TARGET_OFFLOAD)
+			ret = 0;
+	pthread_mutex_unlock(&glob_masks.mutex);
+	return ret;
+}
+
+static int
+wbuf_pool_init(
+	int		nr_bufs,
+	int		data_size,
+	int		data_align,
+	int		min_io_size)
+{
+	int		i;
+
+	pool.bufs = calloc(nr_bufs, sizeof(wbuf));
+	pool.free = calloc(nr_bufs, sizeof(wbuf *));
+	if (!pool.bufs || !pool.free)
+		return -ENOMEM;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wait, NULL);
+
+	for (i = 0; i < nr_bufs; i++)  {
+		if (wbuf_init(&pool.bufs[i], data_size, data_align,
+				min_io_size, i + 2) == NULL)
+			break;
+		/* all buffers must be the same size */
+		data_size = pool.bufs[i].size;
+		pool.free[pool.nr_free++] = &pool.bufs[i];
+	}
+
+	/* a couple of buffers per reader is enough to keep things moving */
+	if (pool.nr_free < 2)
+		return -ENOMEM;
+	pool.nr_bufs = pool.nr_free;
+	return 0;
+}
+
+/*
+ * Record a range of used blocks, merging it with the previous range if they
+ * touch or overlap.  Ranges must be added in ascending order.
+ */
+static void
+extent_add(
+	extent_list	*list,
+	xfs_daddr_t	start,
+	uint64_t	length)
+{
+	used_extent	*last;
+
+	if (list->nr > 0)  {
+		last = &list->ext[list->nr - 1];
+		if (start <= last->start + last->length)  {
+			last->length = max(last->length,
+					start + length - last->start);
+			return;
+		}
+	}
+
+	if (list->nr == list->max)  {
+		list->max = max(64, list->max * 2);
+		list->ext = realloc(list->ext, list->max * sizeof(used_extent));
+		if (!list->ext)  {
+			do_log(_("Couldn't allocate used extent list\n"));
+			die_perror();
+		}
+	}
+	list->ext[list->nr].start = start;
+	list->ext[list->nr].length = length;
+	list->nr++;
+}
+
+/*
+ * Find the used space in one AG: the AG headers, then every range of blocks
+ * that the bnobt says is not free.  Runs on the prepass workqueue, so the
+ * AGFs and bnobt leaves of all AGs are read at the same time.
+ */
+static void
+scan_ag(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	xfs_mount_t		*mp = wq->wq_ctx;
+	extent_list		*used = &ag_used[agno];
+	size_t			min_io_size = pool.bufs[0].min_io_size;
+	ag_header_t		ag_hdr;
+	wbuf			btree_buf;
+	wbuf			hdr_buf;
+	xfs_agf_t		*agf;
+	struct xfs_btree_block	*block;
+	xfs_alloc_ptr_t		*ptr;
+	xfs_alloc_rec_t		*rec_ptr;
+	xfs_agblock_t		bno;
+	xfs_daddr_t		begin, next_begin, ag_begin, new_begin, ag_end;
+	xfs_off_t		pos;
+	uint			btree_levels, current_level;
+	int			i;
+
+	if (wbuf_init(&btree_buf, max(source_blocksize, min_io_size),
+			pool.bufs[0].data_align, min_io_size, 1) == NULL ||
+	    wbuf_init(&hdr_buf, roundup(first_agbno * source_blocksize,
+				min_io_size) + 2 * min_io_size,
+			pool.bufs[0].data_align, min_io_size, 0) == NULL)  {
+		do_log(_("Error initializing btree buf 1\n"));
+		die_perror();
+	}
+
+	/* read in first blocks of the ag */
+
+	read_ag_header(source_fd, agno, &hdr_buf, &ag_hdr, mp,
+		source_blocksize, source_sectorsize);
+
+	/* save what we need (agf) in the btree buffer */
+
+	memmove(btree_buf.data, ag_hdr.xfs_agf, source_sectorsize);
+	agf = (xfs_agf_t *) btree_buf.data;
+
+	/* the ag header is copied, but the first data copy mustn't overlap */
+
+	ASSERT(hdr_buf.position % source_sectorsize == 0);
+	extent_add(used, hdr_buf.position >> BBSHIFT,
+			hdr_buf.length >> BBSHIFT);
+	next_begin = (hdr_buf.position + hdr_buf.length) >> BBSHIFT;
+	ag_begin = next_begin;
+	free(hdr_buf.data);
+
+	/* traverse btree until we get to the leftmost leaf node */
+
+	bno = be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNOi]);
+	current_level = 0;
+	btree_levels = be32_to_cpu(agf->agf_levels[XFS_BTNUM_BNOi]);
+
+	ag_end = XFS_AGB_TO_DADDR(mp, agno,
+			be32_to_cpu(agf->agf_length) - 1)
+			+ source_blocksize / BBSIZE;
+
+	for (;;) {
+		if (current_level >= btree_levels) {
+			do_log(
+		_("Error: current level %d >= btree levels %d\n"),
+				current_level, btree_levels);
+			exit(1);
+		}
+
+		current_level++;
+
+		btree_buf.position = pos = (xfs_off_t)
+			XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
+		btree_buf.length = source_blocksize;
+
+		read_wbuf(source_fd, &btree_buf, mp);
+		block = (struct xfs_btree_block *)
+			 ((char *)btree_buf.data +
+			  pos - btree_buf.position);
+
+		if (be32_to_cpu(block->bb_magic) !=
+		    (xfs_has_crc(mp) ?
+		     XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
+			do_log(_("Bad btree magic 0x%x\n"),
+			        be32_to_cpu(block->bb_magic));
+			exit(1);
+		}
+
+		if (be16_to_cpu(block->bb_level) == 0)
+			break;
+
+		ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1,
+						mp->m_alloc_mxr[1]);
+		bno = be32_to_cpu(ptr[0]);
+	}
+
+	/* handle the rest of the ag */
+
+	for (;;) {
+		if (be16_to_cpu(block->bb_level) != 0)  {
+			do_log(
+		_("WARNING:  source filesystem inconsistent.\n"));
+			do_log(
+		_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
+			exit(1);
+		}
+
+		rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
+		for (i = 0; i < be16_to_cpu(block->bb_numrecs);
+						i++, rec_ptr++)  {
+			/* calculate in daddr's */
+
+			begin = next_begin;
+
+			/*
+			 * protect against pathological case of a
+			 * hole right after the ag header in a
+			 * mis-aligned case
+			 */
+
+			if (begin < ag_begin)
+				begin = ag_begin;
+
+			new_begin = XFS_AGB_TO_DADDR(mp, agno,
+				be32_to_cpu(rec_ptr->ar_startblock));
+			if (new_begin > begin)
+				extent_add(used, begin, new_begin - begin);
+
+			/* round next starting point down */
+
+			new_begin = XFS_AGB_TO_DADDR(mp, agno,
+					be32_to_cpu(rec_ptr->ar_startblock) +
+				 	be32_to_cpu(rec_ptr->ar_blockcount));
+			next_begin = rounddown(new_begin,
+					min_io_size >> BBSHIFT);
+		}
+
+		if (be32_to_cpu(block->bb_u.s.bb_rightsib) == NULLAGBLOCK)
+			break;
+
+		/* read in next btree record block */
+
+		btree_buf.position = pos = (xfs_off_t)
+			XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(
+					block->bb_u.s.bb_rightsib)) << BBSHIFT;
+		btree_buf.length = source_blocksize;
+
+		/* let read_wbuf handle alignment */
+
+		read_wbuf(source_fd, &btree_buf, mp);
+
+		block = (struct xfs_btree_block *)
+			 ((char *) btree_buf.data +
+			  pos - btree_buf.position);
+
+		ASSERT(be32_to_cpu(block->bb_magic) == XFS_ABTB_MAGIC ||
+		       be32_to_cpu(block->bb_magic) == XFS_ABTB_CRC_MAGIC);
+	}
+
+	/*
+	 * include range of used blocks after last range
+	 * of free blocks in AG
+	 */
+	if (next_begin < ag_end)
+		extent_add(used, next_begin, ag_end - next_begin);
+
+	free(btree_buf.data);
+}
+
+/*
+ * Merge the per-AG used extents into one sorted list and cut it into a few
+ * jobs per reader, so that every source reader streams through a large
+ * contiguous part of the device.  Returns the number of jobs.
+ */
+static size_t
+build_copy_jobs(
+	xfs_agnumber_t	num_ags,
+	int		nr_readers,
+	uint64_t	*total_blocks)
+{
+	xfs_agnumber_t	agno;
+	used_extent	*ext;
+	uint64_t	job_blocks;
+	uint64_t	blocks = 0;
+	uint64_t	off, take;
+	size_t		i, nr_jobs = 0;
+	int		open = 0;
+
+	*total_blocks = 0;
+	for (agno = 0; agno < num_ags; agno++)  {
+		for (i = 0; i < ag_used[agno].nr; i++)  {
+			ext = &ag_used[agno].ext[i];
+			extent_add(&used_list, ext->start, ext->length);
+			*total_blocks += ext->length;
+		}
+		free(ag_used[agno].ext);
+	}
+	free(ag_used);
+	ag_used = NULL;
+
+	job_blocks = roundup(*total_blocks / (nr_readers * JOBS_PER_READER),
+			wblocks);
+	job_blocks = max(job_blocks, (uint64_t)wblocks * MIN_JOB_BUFS);
+
+	copy_jobs = calloc(*total_blocks / job_blocks + 1, sizeof(copy_job));
+	if (!copy_jobs)  {
+		do_log(_("Couldn't allocate copy job list\n"));
+		die_perror();
+	}
+
+	for (i = 0; i < used_list.nr; i++)  {
+		ext = &used_list.ext[i];
+		for (off = 0; off < ext->length; off += take)  {
+			if (!open)  {
+				copy_jobs[nr_jobs].first = i;
+				copy_jobs[nr_jobs].start = ext->start + off;
+				blocks = 0;
+				open = 1;
+			}
+			take = min(ext->length - off, job_blocks - blocks);
+			blocks += take;
+			if (blocks == job_blocks)  {
+				copy_jobs[nr_jobs++].end = ext->start + off + take;
+				open = 0;
+			}
+		}
+	}
+	if (open)  {
+		ext = &used_list.ext[used_list.nr - 1];
+		copy_jobs[nr_jobs++].end = ext->start + ext->length;
+	}
+
+	return nr_jobs;
+}
+
+/*
+ * Copy a range of used blocks from the source to all targets, one pool
+ * buffer at a time.  The lower layers take care of alignment.
+ */
+static void
+copy_extent(
+	xfs_mount_t	*mp,
+	xfs_daddr_t	begin,
+	uint64_t	sizeb)
+{
+	xfs_off_t	position = (xfs_off_t)begin << BBSHIFT;
+	uint64_t	size;
+	uint64_t	blocks;
+	wbuf		*buf;
+
+	size = roundup(sizeb << BBSHIFT, pool.bufs[0].min_io_size);
+	while (size > 0)  {
+		buf = wbuf_get();
+		buf->position = position;
+		buf->clean = 1;
+		/* the primary superblock is modified below, so always read it */
+		buf->unread = position != 0 && offload_only();
+		if (size > buf->size)  {
+			buf->length = buf->size;
+			size -= buf->size;
+			sizeb -= wblocks;
+			blocks = wblocks;
+		} else  {
+			buf->length = size;
+			blocks = sizeb;
+			size = 0;
+		}
+
+		if (buf->unread)
+			align_wbuf(buf);
+		else
+			read_wbuf(source_fd, buf, mp);
+
+		/* don't clear the in_progress bit written at the start */
+		if (buf->position == 0)  {
+			((struct xfs_dsb *)buf->data)->sb_inprogress = 1;
+			buf->clean = 0;
+		}
+
+		position = buf->position + buf->length;
+		buf->blocks = blocks;
+		submit_wbuf(buf);
+	}
+}
+
+/* Copy one job's worth of the used extent list, in ascending order. */
+static void
+copy_job_f(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	xfs_mount_t		*mp = wq->wq_ctx;
+	copy_job		*job = &copy_jobs[index];
+	used_extent		*ext;
+	xfs_daddr_t		start, end;
+	size_t			i;
+
+	for (i = job->first; i < used_list.nr; i++)  {
+		ext = &used_list.ext[i];
+		if (ext->start >= job->end)
+			break;
+		start = max(ext->start, job->start);
+		end = min(ext->start + (xfs_daddr_t)ext->length, job->end);
+		if (end > start)
+			copy_extent(mp, start, end - start);
+	}
 }
 
 static void
@@ -551,15 +1099,14 @@ main(int argc, char **argv)
 {
 	int		i, j;
 	int		logfd;
-	int		howfar = 0;
 	int		open_flags;
-	xfs_off_t	pos;
-	size_t		length;
 	int		c;
-	uint64_t	size, sizeb;
-	uint64_t	numblocks = 0;
-	int		wblocks = 0;
 	int		num_threads = 0;
+	int		nr_readers;
+	int		nr_bufs;
+	int		nr_jobs;
+	uint64_t	total_blocks;
+	long long	budget = 0;
 	struct dioattr	d;
 	int		wbuf_size;
 	int		wbuf_align;
@@ -567,7 +1114,6 @@ main(int argc, char **argv)
 	int		source_is_file = 0;
 	int		buffered_output = 0;
 	int		duplicate = 0;
-	uint		btree_levels, current_level;
 	ag_header_t	ag_hdr;
 	xfs_mount_t	*mp;
 	xfs_mount_t	mbuf;
@@ -575,11 +1121,7 @@ main(int argc, char **argv)
 	struct xfs_buf	*sbp;
 	xfs_sb_t	*sb;
 	xfs_agnumber_t	num_ags, agno;
-	xfs_agblock_t	bno;
-	xfs_daddr_t	begin, next_begin, ag_begin, new_begin, ag_end;
-	struct xfs_btree_block *block;
-	xfs_alloc_ptr_t	*ptr;
-	xfs_alloc_rec_t	*rec_ptr;
+	struct workqueue wq;
 	extern char	*optarg;
 	extern int	optind;
 	libxfs_init_t	xargs;
@@ -593,7 +1135,7 @@ main(int argc, char **argv)
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "bdL:V")) != EOF)  {
+	while ((c = getopt(argc, argv, "bdL:m:V")) != EOF)  {
 		switch (c) {
 		case 'b':
 			buffered_output = 1;
@@ -604,6 +1146,11 @@ main(int argc, char **argv)
 		case 'L':
 			logfile_name = optarg;
 			break;
+		case 'm':
+			budget = cvtnum(0, 0, optarg);
+			if (budget <= 0)
+				usage();
+			break;
 		case 'V':
 			printf(_("%s version %s\n"), progname, VERSION);
 			exit(0);
@@ -670,8 +1217,10 @@ main(int argc, char **argv)
 		die_perror();
 	}
 
-	if (S_ISREG(statbuf.st_mode))
+	if (S_ISREG(statbuf.st_mode))  {
 		source_is_file = 1;
+		source_dev = statbuf.st_dev;
+	}
 
 	if (source_is_file && platform_test_xfs_fd(source_fd))  {
 		if (fcntl(source_fd, F_SETFL, open_flags | O_DIRECT) < 0)  {
@@ -866,12 +1415,27 @@ main(int argc, char **argv)
 		if (write_last_block)  {
 			/* ensure regular files are correctly sized */
 
+			target[i].type = TARGET_FILE;
 			if (ftruncate(target[i].fd, mp->m_sb.sb_dblocks *
 						source_blocksize))  {
 				do_log(_("%s:  cannot grow data section.\n"),
 					progname);
 				die_perror();
 			}
+
+			/*
+			 * A file on the same filesystem as a source file can
+			 * have the kernel do the copying for us, sharing the
+			 * blocks where the filesystem supports reflink.
+			 */
+			if (source_is_file &&
+			    fstat(target[i].fd, &statbuf) == 0 &&
+			    statbuf.st_dev == source_dev &&
+			    probe_copy_range(target[i].fd))  {
+				target[i].type = TARGET_OFFLOAD;
+				do_warn(_("%s:  using copy offload for \"%s\"\n"),
+					progname, target[i].name);
+			}
 			if (platform_test_xfs_fd(target[i].fd))  {
 				if (xfsctl(target[i].name, target[i].fd,
 						XFS_IOC_DIOINFO, &d) < 0)  {
@@ -892,6 +1456,7 @@ main(int argc, char **argv)
 
 			/* ensure device files are sufficiently large */
 
+			target[i].type = TARGET_DEVICE;
 			off = mp->m_sb.sb_dblocks * source_blocksize;
 			off -= sizeof(lb);
 			if (pwrite(target[i].fd, lb, sizeof(lb), off) < 0)  {
@@ -910,7 +1475,6 @@ main(int argc, char **argv)
 		do_log(_("Couldn't initialize global thread mask\n"));
 		die_perror();
 	}
-	glob_masks.num_working = 0;
 
 	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
 					wbuf_miniosize, 0) == NULL)  {
@@ -918,30 +1482,34 @@ main(int argc, char **argv)
 		die_perror();
 	}
 
-	wblocks = wbuf_size / BBSIZE;
-
-	if (wbuf_init(&btree_buf, max(source_blocksize, wbuf_miniosize),
-				wbuf_align, wbuf_miniosize, 1) == NULL)  {
-		do_log(_("Error initializing btree buf 1\n"));
-		die_perror();
-	}
+	/*
+	 * Several source readers work on different AGs at once, each of them
+	 * needing a few buffers in flight so that reads and writes overlap.
+	 */
+	num_ags = mp->m_sb.sb_agcount;
+	nr_readers = min(platform_nproc(), MAX_READERS);
+	nr_readers = min(nr_readers, (int)num_ags);
 
-	if (pthread_mutex_init(&mainwait,NULL) != 0)  {
-		do_log(_("Error creating first semaphore.\n"));
+	/*
+	 * The buffer budget is how far the fastest target can run ahead of
+	 * the slowest one before the source readers have to wait.
+	 */
+	nr_bufs = nr_readers * BUFS_PER_READER;
+	if (budget)
+		nr_bufs = max(min(budget / wbuf_size, (long long)MAX_BUFS),
+			      nr_readers * 2LL);
+
+	if (wbuf_pool_init(nr_bufs, wbuf_size,
+				wbuf_align, wbuf_miniosize) != 0)  {
+		do_log(_("Error initializing buffer pool\n"));
 		die_perror();
-		exit(1);
 	}
-	/* need to start out blocking */
-	pthread_mutex_lock(&mainwait);
-
-	/* set up sigchild signal handler */
 
-	signal(SIGCHLD, handler);
-	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+	wblocks = pool.bufs[0].size / BBSIZE;
 
 	/* make children */
 
-	if ((targ = malloc(num_targets * sizeof(thread_args))) == NULL)  {
+	if ((targ = calloc(num_targets, sizeof(thread_args))) == NULL)  {
 		do_log(_("Couldn't malloc space for thread args\n"));
 		die_perror();
 		exit(1);
@@ -953,13 +1521,17 @@ main(int argc, char **argv)
 		else
 			platform_uuid_copy(&tcarg->uuid, &mp->m_sb.sb_uuid);
 
-		if (pthread_mutex_init(&tcarg->wait, NULL) != 0)  {
+		if (pthread_mutex_init(&tcarg->lock, NULL) != 0 ||
+		    pthread_cond_init(&tcarg->wait, NULL) != 0)  {
 			do_log(_("Error creating thread mutex %d\n"), i);
 			die_perror();
 			exit(1);
 		}
-		/* need to start out blocking */
-		pthread_mutex_lock(&tcarg->wait);
+		tcarg->queue = calloc(pool.nr_bufs, sizeof(wbuf *));
+		if (!tcarg->queue)  {
+			do_log(_("Couldn't malloc space for thread queue\n"));
+			die_perror();
+		}
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
@@ -970,7 +1542,7 @@ main(int argc, char **argv)
 		num_threads++;
 
 		if (pthread_create(&target[i].pid, NULL,
-					begin_reader, (void *)tcarg))  {
+					begin_writer, (void *)tcarg))  {
 			do_log(_("Error creating thread for target %d\n"), i);
 			die_perror();
 		}
@@ -978,234 +1550,75 @@ main(int argc, char **argv)
 
 	ASSERT(num_targets == num_threads);
 
-	/* set up statistics */
-
-	num_ags = mp->m_sb.sb_agcount;
-
-	init_bar(mp->m_sb.sb_blocksize / BBSIZE
-			* ((uint64_t)mp->m_sb.sb_dblocks
-			    - (uint64_t)mp->m_sb.sb_fdblocks + 10 * num_ags));
-
-	kids = num_targets;
-
-	for (agno = 0; agno < num_ags && kids > 0; agno++)  {
-		/* read in first blocks of the ag */
-
-		read_ag_header(source_fd, agno, &w_buf, &ag_hdr, mp,
-			source_blocksize, source_sectorsize);
-
-		/* set the in_progress bit for the first AG */
-
-		if (agno == 0)
-			ag_hdr.xfs_sb->sb_inprogress = 1;
-
-		/* save what we need (agf) in the btree buffer */
-
-		memmove(btree_buf.data, ag_hdr.xfs_agf, source_sectorsize);
-		ag_hdr.xfs_agf = (xfs_agf_t *) btree_buf.data;
-		btree_buf.length = source_blocksize;
-
-		/* write the ag header out */
-
-		write_wbuf();
-
-		/* traverse btree until we get to the leftmost leaf node */
-
-		bno = be32_to_cpu(ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi]);
-		current_level = 0;
-		btree_levels = be32_to_cpu(ag_hdr.xfs_agf->
-						agf_levels[XFS_BTNUM_BNOi]);
-
-		ag_end = XFS_AGB_TO_DADDR(mp, agno,
-				be32_to_cpu(ag_hdr.xfs_agf->agf_length) - 1)
-				+ source_blocksize / BBSIZE;
-
-		for (;;) {
-			/* none of this touches the w_buf buffer */
-
-			if (current_level >= btree_levels) {
-				do_log(
-			_("Error: current level %d >= btree levels %d\n"),
-					current_level, btree_levels);
-				exit(1);
-			}
-
-			current_level++;
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			read_wbuf(source_fd, &btree_buf, mp);
-			block = (struct xfs_btree_block *)
-				 ((char *)btree_buf.data +
-				  pos - btree_buf.position);
-
-			if (be32_to_cpu(block->bb_magic) !=
-			    (xfs_has_crc(mp) ?
-			     XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
-				do_log(_("Bad btree magic 0x%x\n"),
-				        be32_to_cpu(block->bb_magic));
-				exit(1);
-			}
-
-			if (be16_to_cpu(block->bb_level) == 0)
-				break;
-
-			ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1,
-							mp->m_alloc_mxr[1]);
-			bno = be32_to_cpu(ptr[0]);
-		}
-
-		/* align first data copy but don't overwrite ag header */
-
-		pos = w_buf.position >> BBSHIFT;
-		length = w_buf.length >> BBSHIFT;
-		next_begin = pos + length;
-		ag_begin = next_begin;
-
-		ASSERT(w_buf.position % source_sectorsize == 0);
-
-		/* handle the rest of the ag */
-
-		for (;;) {
-			if (be16_to_cpu(block->bb_level) != 0)  {
-				do_log(
-			_("WARNING:  source filesystem inconsistent.\n"));
-				do_log(
-			_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
-				exit(1);
-			}
-
-			rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
-			for (i = 0; i < be16_to_cpu(block->bb_numrecs);
-							i++, rec_ptr++)  {
-				/* calculate in daddr's */
-
-				begin = next_begin;
-
-				/*
-				 * protect against pathological case of a
-				 * hole right after the ag header in a
-				 * mis-aligned case
-				 */
-
-				if (begin < ag_begin)
-					begin = ag_begin;
-
-				/*
-				 * round size up to ensure we copy a
-				 * range bigger than required
-				 */
-
-				sizeb = XFS_AGB_TO_DADDR(mp, agno,
-					be32_to_cpu(rec_ptr->ar_startblock)) -
-						begin;
-				size = roundup(sizeb <<BBSHIFT, wbuf_miniosize);
-				if (size > 0)  {
-					/* copy extent */
-
-					w_buf.position = (xfs_off_t)
-						begin << BBSHIFT;
-
-					while (size > 0)  {
-						/*
-						 * let lower layer do alignment
-						 */
-						if (size > w_buf.size)  {
-							w_buf.length = w_buf.size;
-							size -= w_buf.size;
-							sizeb -= wblocks;
-							numblocks += wblocks;
-						} else  {
-							w_buf.length = size;
-							numblocks += sizeb;
-							size = 0;
-						}
-
-						read_wbuf(source_fd, &w_buf, mp);
-						write_wbuf();
-
-						w_buf.position += w_buf.length;
-
-						howfar = bump_bar(
-							howfar, numblocks);
-					}
-				}
-
-				/* round next starting point down */
-
-				new_begin = XFS_AGB_TO_DADDR(mp, agno,
-						be32_to_cpu(rec_ptr->ar_startblock) +
-					 	be32_to_cpu(rec_ptr->ar_blockcount));
-				next_begin = rounddown(new_begin,
-						w_buf.min_io_size >> BBSHIFT);
-			}
-
-			if (be32_to_cpu(block->bb_u.s.bb_rightsib) == NULLAGBLOCK)
-				break;
-
-			/* read in next btree record block */
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(
-						block->bb_u.s.bb_rightsib)) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			/* let read_wbuf handle alignment */
-
-			read_wbuf(source_fd, &btree_buf, mp);
+	if (workqueue_create(&wq, mp, nr_readers))  {
+		do_log(_("Error creating reader threads\n"));
+		die_perror();
+	}
 
-			block = (struct xfs_btree_block *)
-				 ((char *) btree_buf.data +
-				  pos - btree_buf.position);
+	/* find the used space of all AGs in parallel */
 
-			ASSERT(be32_to_cpu(block->bb_magic) == XFS_ABTB_MAGIC ||
-			       be32_to_cpu(block->bb_magic) == XFS_ABTB_CRC_MAGIC);
+	ag_used = calloc(num_ags, sizeof(extent_list));
+	if (!ag_used)  {
+		do_log(_("Couldn't allocate used extent lists\n"));
+		die_perror();
+	}
+	for (agno = 0; agno < num_ags; agno++)  {
+		if (workqueue_add(&wq, scan_ag, agno, NULL))  {
+			do_log(_("Error queueing AG %u\n"), agno);
+			die_perror();
 		}
+	}
+	if (workqueue_terminate(&wq))  {
+		do_log(_("Error waiting for reader threads\n"));
+		die_perror();
+	}
+	workqueue_destroy(&wq);
 
-		/*
-		 * write out range of used blocks after last range
-		 * of free blocks in AG
-		 */
-		if (next_begin < ag_end)  {
-			begin = next_begin;
-
-			sizeb = ag_end - begin;
-			size = roundup(sizeb << BBSHIFT, wbuf_miniosize);
-
-			if (size > 0)  {
-				/* copy extent */
+	/* set up statistics */
 
-				w_buf.position = (xfs_off_t) begin << BBSHIFT;
+	nr_jobs = build_copy_jobs(num_ags, nr_readers, &total_blocks);
+	init_bar(total_blocks);
 
-				while (size > 0)  {
-					/*
-					 * let lower layer do alignment
-					 */
-					if (size > w_buf.size)  {
-						w_buf.length = w_buf.size;
-						size -= w_buf.size;
-						sizeb -= wblocks;
-						numblocks += wblocks;
-					} else  {
-						w_buf.length = size;
-						numblocks += sizeb;
-						size = 0;
-					}
+	for (i = 0; i < num_targets; i++)  {
+		gettimeofday(&target[i].start, NULL);
+		target[i].stop = target[i].start;
+	}
 
-					read_wbuf(source_fd, &w_buf, mp);
-					write_wbuf();
+	/*
+	 * Mark every target in progress before any other data goes out, so
+	 * that an interrupted copy never looks like a valid filesystem.
+	 */
+	read_ag_header(source_fd, 0, &w_buf, &ag_hdr, mp,
+			source_blocksize, source_sectorsize);
+	ag_hdr.xfs_sb->sb_inprogress = 1;
+	for (j = 0, tcarg = targ; j < num_targets; j++, tcarg++)  {
+		sb_update_uuid(mp, &ag_hdr, tcarg);
+		if (do_write(tcarg, NULL))
+			target_failed(j);
+	}
 
-					w_buf.position += w_buf.length;
+	/* stream the used space to the target writers */
 
-					howfar = bump_bar(howfar, numblocks);
-				}
-			}
+	if (workqueue_create(&wq, mp, nr_readers))  {
+		do_log(_("Error creating reader threads\n"));
+		die_perror();
+	}
+	for (j = 0; j < nr_jobs; j++)  {
+		if (workqueue_add(&wq, copy_job_f, j, NULL))  {
+			do_log(_("Error queueing copy job %d\n"), j);
+			die_perror();
 		}
 	}
+	if (workqueue_terminate(&wq))  {
+		do_log(_("Error waiting for reader threads\n"));
+		die_perror();
+	}
+	workqueue_destroy(&wq);
 
-	if (kids > 0)  {
+	/* everything must be on disk before the final superblock update */
+	flush_targets();
+
+	if (active_targets() > 0)  {
 		if (!duplicate)
 			/* write a clean log using the specified UUID */
 			format_logs(mp);
@@ -1233,6 +1646,8 @@ main(int argc, char **argv)
 		bump_bar(100, 0);
 	}
 
+	stop_writers();
+	report_targets();
 	check_errors();
 	libxfs_umount(mp);
 	libxfs_destroy(&xargs);
@@ -1333,6 +1748,11 @@ clear_log(
 	w_buf.position = pos;
 	memset(w_buf.data, 0, w_buf.length);
 
+	/* let the target zero the body of the log without any data transfer */
+	if (end_pos > pos &&
+	    platform_zero_range(tcarg->fd, pos, end_pos - pos) == 0)
+		return;
+
 	while (w_buf.position < end_pos)  {
 		do_write(tcarg, NULL);
 		w_buf.position += w_buf.length;
@@ -1370,13 +1790,13 @@ format_log(
 
 	/*
 	 * Format the entire log into the memory buffer and write it out. If the
-	 * write fails, mark the target inactive so the failure is reported.
+	 * write fails, mark the target inactive and report the failure.
 	 */
 	libxfs_log_clear(NULL, buf->data, logstart, length, &buf->owner->uuid,
 			 xfs_has_logv2(mp) ? 2 : 1,
 			 mp->m_sb.sb_logsunit, XLOG_FMT, cycle, true);
 	if (do_write(buf->owner, buf))
-		target[tcarg->id].state = INACTIVE;
+		target_failed(tcarg->id);
 }
 
 static int
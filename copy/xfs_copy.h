@@ -47,18 +47,65 @@ typedef struct {
 	size_t		length;		/* requested length (bytes) */
 	char		*data;		/* pointer to data buffer */
 	struct t_args	*owner;		/* for non-parallel writes */
+	int		refcount;	/* targets yet to write this buffer */
+	int		clean;		/* unmodified copy of the source */
+	int		unread;		/* data left on the source */
+	uint64_t	blocks;		/* progress made, in basic blocks */
 } wbuf;
 
+/*
+ * Pool of aligned I/O buffers shared by the source readers.  A buffer is
+ * taken from the pool by a reader, filled from the source, queued to every
+ * active target and returned to the pool when the last target has written
+ * it out.
+ */
+typedef struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	wait;		/* waiting for a free buffer */
+	wbuf		*bufs;		/* all buffers in the pool */
+	wbuf		**free;		/* stack of free buffers */
+	int		nr_bufs;
+	int		nr_free;
+} wbuf_pool;
+
+/*
+ * Per-target writer state.  Buffers are queued in a ring that can hold
+ * every buffer in the pool, so queueing never has to wait.
+ */
 typedef struct t_args {
 	int		id;
 	uuid_t		uuid;
-	pthread_mutex_t	wait;
 	int		fd;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wait;		/* queue state changed */
+	wbuf		**queue;	/* ring of buffers to be written */
+	int		head;		/* next buffer to write */
+	int		count;		/* buffers queued */
+	int		inflight;	/* queued plus being written */
+	int		done;		/* no more buffers will be queued */
 } thread_args;
 
+/* A range of used space on the source, in basic blocks. */
+typedef struct {
+	xfs_daddr_t	start;
+	uint64_t	length;
+} used_extent;
+
+typedef struct {
+	used_extent	*ext;
+	size_t		nr;
+	size_t		max;
+} extent_list;
+
+/* A contiguous part of the used extent list that one source reader copies. */
+typedef struct {
+	size_t		first;		/* first extent in the job */
+	xfs_daddr_t	start;		/* job covers [start, end) */
+	xfs_daddr_t	end;
+} copy_job;
+
 typedef struct {
 	pthread_mutex_t mutex;
-	int		num_working;
 	wbuf		*buffer;
 } thread_control;
 
@@ -72,6 +119,11 @@ typedef struct {
 	xfs_off_t	position;
 	pthread_t	pid;
 	int		state;
+	int		type;		/* TARGET_* */
 	int		error;
 	int		err_type;
+	uint64_t	blocks;		/* progress, in basic blocks */
+	uint64_t	bytes;		/* bytes written */
+	struct timeval	start;		/* copy started */
+	struct timeval	stop;		/* last write completed */
 } target_control;
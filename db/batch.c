@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Batch query mode.  Requests are read from stdin one per line, and each is
+ * answered with a single line of JSON on stdout, so that scripts can run
+ * thousands of queries against one filesystem without paying for a new
+ * xfs_db, a new mount and a cold buffer cache every time.
+ *
+ * A request is one or more commands separated by semicolons; they run in
+ * order with the cursor carried over from one to the next, so
+ * "inode 128; print core.size" does what it looks like.  Everything the
+ * commands print is captured and returned in the response, and lines of the
+ * form "name = value" (as printed by the print command) are also broken out
+ * into a JSON object for convenience.
+ *
+ * Requests are read by a separate thread that runs up to BATCH_QUEUE lines
+ * ahead of the one being answered.  For requests that start by selecting a
+ * structure by number (sb, agf, agi, agfl, inode, fsblock, daddr), that
+ * thread also starts readahead of the block, so by the time we get there
+ * the I/O has been done.  It never touches the buffer cache, which only the
+ * main thread uses.
+ */
+
+#include "libxfs.h"
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+#include "type.h"
+#include "faddr.h"
+#include "fprint.h"
+#include "field.h"
+#include "inode.h"
+#include "malloc.h"
+#include "batch.h"
+
+#define BATCH_QUEUE	64
+
+static struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	wait;
+	char		*lines[BATCH_QUEUE];
+	unsigned int	head;		/* next line to be answered */
+	unsigned int	count;
+	bool		eof;
+	bool		stop;		/* no more requests wanted */
+} bq = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.wait		= PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * If the first command of @line selects a structure by number, start
+ * readahead of the blocks that command will read.
+ */
+static void
+batch_prefetch(
+	const char		*line)
+{
+	char			cmd[16];
+	unsigned long long	n;
+	xfs_daddr_t		daddr;
+	int			len = XFS_FSS_TO_BB(mp, 1);
+	int			offset;
+
+	if (sscanf(line, " %15[a-z] %lli", cmd, &n) != 2)
+		return;
+
+	if (!strcmp(cmd, "sb") || !strcmp(cmd, "agf") ||
+	    !strcmp(cmd, "agi") || !strcmp(cmd, "agfl")) {
+		if (n >= mp->m_sb.sb_agcount)
+			return;
+		if (!strcmp(cmd, "sb"))
+			daddr = XFS_AG_DADDR(mp, n, XFS_SB_DADDR);
+		else if (!strcmp(cmd, "agf"))
+			daddr = XFS_AG_DADDR(mp, n, XFS_AGF_DADDR(mp));
+		else if (!strcmp(cmd, "agi"))
+			daddr = XFS_AG_DADDR(mp, n, XFS_AGI_DADDR(mp));
+		else
+			daddr = XFS_AG_DADDR(mp, n, XFS_AGFL_DADDR(mp));
+	} else if (!strcmp(cmd, "inode")) {
+		if (!inode_cluster(n, &daddr, &len, &offset))
+			return;
+	} else if (!strcmp(cmd, "fsblock") || !strcmp(cmd, "fsb")) {
+		if (XFS_FSB_TO_AGNO(mp, n) >= mp->m_sb.sb_agcount ||
+		    XFS_FSB_TO_AGBNO(mp, n) >= mp->m_sb.sb_agblocks)
+			return;
+		daddr = XFS_FSB_TO_DADDR(mp, n);
+		len = blkbb;
+	} else if (!strcmp(cmd, "daddr")) {
+		if (n >= XFS_FSB_TO_BB(mp, mp->m_sb.sb_dblocks))
+			return;
+		daddr = n;
+		len = 1;
+	} else
+		return;
+
+	readahead_blocks(daddr, len);
+}
+
+static void *
+batch_reader(
+	void			*arg)
+{
+	char			*line = NULL;
+	size_t			size = 0;
+	ssize_t			len;
+
+	while ((len = getline(&line, &size, stdin)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		pthread_mutex_lock(&bq.lock);
+		while (bq.count == BATCH_QUEUE && !bq.stop)
+			pthread_cond_wait(&bq.wait, &bq.lock);
+		if (bq.stop) {
+			pthread_mutex_unlock(&bq.lock);
+			free(line);
+			return NULL;
+		}
+		bq.lines[(bq.head + bq.count) % BATCH_QUEUE] = xstrdup(line);
+		bq.count++;
+		pthread_cond_broadcast(&bq.wait);
+		pthread_mutex_unlock(&bq.lock);
+
+		batch_prefetch(line);
+	}
+	free(line);
+
+	pthread_mutex_lock(&bq.lock);
+	bq.eof = true;
+	pthread_cond_broadcast(&bq.wait);
+	pthread_mutex_unlock(&bq.lock);
+	return NULL;
+}
+
+/* Next request, or NULL at the end of the input. */
+static char *
+batch_next(void)
+{
+	char			*line = NULL;
+
+	pthread_mutex_lock(&bq.lock);
+	while (bq.count == 0 && !bq.eof)
+		pthread_cond_wait(&bq.wait, &bq.lock);
+	if (bq.count) {
+		line = bq.lines[bq.head];
+		bq.head = (bq.head + 1) % BATCH_QUEUE;
+		bq.count--;
+		pthread_cond_broadcast(&bq.wait);
+	}
+	pthread_mutex_unlock(&bq.lock);
+	return line;
+}
+
+static void
+json_string(
+	FILE			*f,
+	const char		*s,
+	size_t			len)
+{
+	size_t			i;
+
+	fputc('"', f);
+	for (i = 0; i < len; i++) {
+		unsigned char	c = s[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", f);
+		else if (c == '\t')
+			fputs("\\t", f);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+/* Break out the "name = value" lines of @out; the first of each name wins. */
+static void
+json_fields(
+	FILE			*f,
+	const char		*out)
+{
+	const char		**names = NULL;
+	size_t			*namelens = NULL;
+	int			nr = 0;
+	const char		*line, *eol, *eq;
+	int			i;
+
+	fputc('{', f);
+	for (line = out; *line; line = *eol ? eol + 1 : eol) {
+		eol = strchrnul(line, '\n');
+		eq = strstr(line, " = ");
+		if (!eq || eq > eol || eq == line || memchr(line, ' ', eq - line))
+			continue;
+		for (i = 0; i < nr; i++)
+			if (namelens[i] == eq - line &&
+			    !memcmp(names[i], line, eq - line))
+				break;
+		if (i < nr)
+			continue;
+
+		names = xrealloc(names, (nr + 1) * sizeof(*names));
+		namelens = xrealloc(namelens, (nr + 1) * sizeof(*namelens));
+		names[nr] = line;
+		namelens[nr] = eq - line;
+		if (nr++)
+			fputc(',', f);
+		json_string(f, line, eq - line);
+		fputc(':', f);
+		json_string(f, eq + 3, eol - eq - 3);
+	}
+	fputc('}', f);
+	xfree(names);
+	xfree(namelens);
+}
+
+/*
+ * Split off the first command of a request at a semicolon that isn't quoted;
+ * returns the rest of the request, or NULL if there isn't any.
+ */
+static char *
+batch_split(
+	char			*req)
+{
+	bool			in_string = false;
+
+	for (; *req; req++) {
+		if (*req == '\\' && req[1])
+			req++;
+		else if (*req == '"')
+			in_string = !in_string;
+		else if (*req == ';' && !in_string) {
+			*req = '\0';
+			return req + 1;
+		}
+	}
+	return NULL;
+}
+
+/* Run the commands of one request; returns nonzero if one of them was quit. */
+static int
+batch_request(
+	char			*req)
+{
+	char			*cmd, *next;
+	char			**v;
+	int			c;
+	int			done = 0;
+
+	for (cmd = req; cmd && !done; cmd = next) {
+		next = batch_split(cmd);
+		v = breakline(cmd, &c);
+		if (c)
+			done = command(c, v);
+		xfree(v);
+	}
+	return done;
+}
+
+void
+batch_run(void)
+{
+	pthread_t		reader;
+	struct timespec		start, stop;
+	FILE			*json, *capture;
+	char			*req, *copy, *p;
+	char			*out = NULL;
+	off_t			len;
+	unsigned long long	seq = 0;
+	int			out_fd;
+	int			done = 0;
+	int			error;
+
+	/*
+	 * Commands print to stdout, so point that at a scratch file for the
+	 * duration and send the responses to where stdout used to go.
+	 */
+	fflush(stdout);
+	capture = tmpfile();
+	out_fd = dup(STDOUT_FILENO);
+	if (!capture || out_fd < 0 || !(json = fdopen(out_fd, "w")) ||
+	    dup2(fileno(capture), STDOUT_FILENO) < 0) {
+		fprintf(stderr, _("%s: cannot set up batch output: %s\n"),
+			progname, strerror(errno));
+		exit(1);
+	}
+
+	error = pthread_create(&reader, NULL, batch_reader, NULL);
+	if (error) {
+		fprintf(stderr, _("%s: cannot start batch reader: %s\n"),
+			progname, strerror(error));
+		exit(1);
+	}
+
+	while (!done && (req = batch_next()) != NULL) {
+		for (p = req; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '\0' || *p == '#') {
+			xfree(req);
+			continue;
+		}
+
+		/* breakline chops up its input, so keep the request intact */
+		copy = xstrdup(req);
+		if (ftruncate(STDOUT_FILENO, 0) < 0 ||
+		    lseek(STDOUT_FILENO, 0, SEEK_SET) < 0) {
+			fprintf(stderr, _("%s: cannot reset batch output: %s\n"),
+				progname, strerror(errno));
+			exit(1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		done = batch_request(copy);
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		xfree(copy);
+
+		fflush(stdout);
+		len = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		out = xrealloc(out, max(len, (off_t)0) + 1);
+		if (len < 0 || pread(fileno(capture), out, len, 0) != len)
+			len = 0;
+		out[len] = '\0';
+
+		fprintf(json, "{\"seq\":%llu,\"request\":", ++seq);
+		json_string(json, req, strlen(req));
+		fprintf(json, ",\"usec\":%lld,\"output\":",
+			(stop.tv_sec - start.tv_sec) * 1000000LL +
+			(stop.tv_nsec - start.tv_nsec) / 1000);
+		json_string(json, out, len);
+		fputs(",\"fields\":", json);
+		json_fields(json, out);
+		fputs("}\n", json);
+		fflush(json);
+		xfree(req);
+	}
+	xfree(out);
+
+	/*
+	 * After a quit the reader may be stuck waiting for input that never
+	 * comes, so just tell it to stop and leave it behind.
+	 */
+	if (done) {
+		pthread_mutex_lock(&bq.lock);
+		bq.stop = true;
+		pthread_cond_broadcast(&bq.wait);
+		pthread_mutex_unlock(&bq.lock);
+		pthread_detach(reader);
+	} else
+		pthread_join(reader, NULL);
+
+	fflush(stdout);
+	dup2(out_fd, STDOUT_FILENO);
+	fclose(json);
+	fclose(capture);
+}
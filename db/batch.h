@@ -0,0 +1,7 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Batch query mode: answer requests read from stdin with one line of JSON
+ * each.
+ */
+
+extern void	batch_run(void);
@@ -10,6 +10,7 @@
 #include "io.h"
 #include "type.h"
 #include "input.h"
+#include "malloc.h"
 #include "libfrog/convert.h"
 
 static int refc_maxrecs(struct xfs_mount *mp, int blocklen, int leaf)
@@ -81,10 +82,15 @@ btheight_help(void)
 "\n"
 " Options:\n"
 "   -b -- Override the btree block size.\n"
-"   -n -- Number of records we want to store.\n"
+"   -n -- Number of records we want to store.  May be given more than once.\n"
 "   -w max -- Show only the best case scenario.\n"
 "   -w min -- Show only the worst case scenario.\n"
 "   -w absmax -- Print the maximum possible btree height for all filesystems.\n"
+"   -m -- Measure how full the btrees of this filesystem are, and use that\n"
+"         instead of the best and worst cases.  Without -n, the current\n"
+"         record count of the largest btree is used.\n"
+"   -p pct -- With -m, read this percentage of the leaf blocks (default 10).\n"
+"   -T threads -- With -m, scan this many AGs at once.\n"
 "\n"
 " Supported btree types:\n"
 "   all "
@@ -94,7 +100,7 @@ btheight_help(void)
 	printf("\n");
 }
 
-static void
+static unsigned int
 calc_height(
 	unsigned long long	nr_records,
 	uint			*records_per_block)
@@ -133,6 +139,7 @@ calc_height(
 
 	printf(_("%u level%s, %llu block%s total\n"), level, levels_suffix,
 			total_blocks, totblocks_suffix);
+	return level;
 }
 
 static int
@@ -263,6 +270,7 @@ out:
 #define REPORT_MAX	(1 << 0)
 #define REPORT_MIN	(1 << 1)
 #define REPORT_ABSMAX	(1 << 2)
+#define REPORT_MEASURED	(1 << 3)
 
 static void
 report_absmax(const char *tag)
@@ -348,17 +356,473 @@ _("%s: worst case per %u-byte block: %u records (leaf) / %u keyptrs (node)\n"),
 	}
 }
 
+/*
+ * Measured geometry.  The AG btrees of this filesystem are walked in
+ * parallel, reading all of the node blocks but only a sample of the leaves,
+ * since those are nearly all of the blocks.  How full a root block is says
+ * little about the rest of the tree, so roots don't count towards the fill.
+ */
+enum { BTM_BNO, BTM_CNT, BTM_INO, BTM_FINO, BTM_REFC, BTM_RMAP, BTM_NR };
+
+static const struct {
+	const char	*tag;
+	typnm_t		typ;
+} btm_types[BTM_NR] = {
+	[BTM_BNO]	= { "bnobt",		TYP_BNOBT },
+	[BTM_CNT]	= { "cntbt",		TYP_CNTBT },
+	[BTM_INO]	= { "inobt",		TYP_INOBT },
+	[BTM_FINO]	= { "finobt",		TYP_FINOBT },
+	[BTM_REFC]	= { "refcountbt",	TYP_REFCBT },
+	[BTM_RMAP]	= { "rmapbt",		TYP_RMAPBT },
+};
+
+struct btm_fill {
+	unsigned long long	blocks;
+	unsigned long long	recs;
+};
+
+struct btm_stats {
+	unsigned long long	trees;
+	unsigned long long	leaves;		/* sampled or not */
+	unsigned long long	nodes;
+	unsigned long long	max_records;	/* estimated, largest tree */
+	unsigned int		height;		/* of the tallest tree */
+	unsigned long long	root_leaves;
+	struct btm_fill		leaf;		/* sampled leaves under a node */
+	struct btm_fill		node;		/* nodes under the root */
+};
+
+/* One btree being walked. */
+struct btm_walk {
+	struct btm_stats	*st;
+	int			type;
+	xfs_agnumber_t		agno;
+	unsigned int		root_level;
+	unsigned long long	leaves;
+	unsigned long long	seen;		/* leaf pointers looked at */
+	unsigned long long	sampled;
+	unsigned long long	sampled_recs;
+};
+
+static bool		btm_wanted[BTM_NR];
+static struct btm_stats	btm_stats[BTM_NR];
+static unsigned int	sample_pct;
+static pthread_mutex_t	btm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+btm_maxrecs(
+	int			type,
+	int			leaf)
+{
+	switch (type) {
+	case BTM_BNO:
+	case BTM_CNT:
+		return mp->m_alloc_mxr[leaf == 0];
+	case BTM_INO:
+	case BTM_FINO:
+		return M_IGEO(mp)->inobt_mxr[leaf == 0];
+	case BTM_REFC:
+		return mp->m_refc_mxr[leaf == 0];
+	default:
+		return mp->m_rmap_mxr[leaf == 0];
+	}
+}
+
+/* The @i'th (from 1) pointer of a node block. */
+static xfs_agblock_t
+btm_ptr(
+	int			type,
+	struct xfs_btree_block	*block,
+	int			i)
+{
+	switch (type) {
+	case BTM_BNO:
+	case BTM_CNT:
+		return be32_to_cpu(*XFS_ALLOC_PTR_ADDR(mp, block, i,
+					mp->m_alloc_mxr[1]));
+	case BTM_INO:
+	case BTM_FINO:
+		return be32_to_cpu(*XFS_INOBT_PTR_ADDR(mp, block, i,
+					M_IGEO(mp)->inobt_mxr[1]));
+	case BTM_REFC:
+		return be32_to_cpu(*XFS_REFCOUNT_PTR_ADDR(block, i,
+					mp->m_refc_mxr[1]));
+	default:
+		return be32_to_cpu(*XFS_RMAP_PTR_ADDR(block, i,
+					mp->m_rmap_mxr[1]));
+	}
+}
+
+/* Read the @n'th leaf?  Spread evenly, and always the first of a tree. */
+static inline bool
+sample_leaf(
+	unsigned long long	n)
+{
+	return n == 0 || (n + 1) * sample_pct / 100 != n * sample_pct / 100;
+}
+
+static void
+btm_scan(
+	struct btm_walk		*w,
+	xfs_agblock_t		bno,
+	unsigned int		level)
+{
+	struct btm_stats	*st = w->st;
+	struct xfs_btree_block	*block;
+	bool			root = level == w->root_level;
+	unsigned long long	first;
+	unsigned int		nrecs;
+	unsigned int		i;
+
+	if (bno >= mp->m_sb.sb_agblocks)
+		return;
+	push_cur();
+	set_cur(&typtab[btm_types[w->type].typ],
+		XFS_AGB_TO_DADDR(mp, w->agno, bno), blkbb, DB_RING_IGN, NULL);
+	block = iocur_top->data;
+	if (!block) {
+		dbprintf(_("can't read btree block %u/%u\n"), w->agno, bno);
+		goto out;
+	}
+	nrecs = be16_to_cpu(block->bb_numrecs);
+	if (be16_to_cpu(block->bb_level) != level ||
+	    nrecs > btm_maxrecs(w->type, level == 0))
+		goto out;
+
+	if (level == 0) {
+		if (root) {
+			st->root_leaves++;
+		} else {
+			st->leaf.blocks++;
+			st->leaf.recs += nrecs;
+		}
+		w->sampled++;
+		w->sampled_recs += nrecs;
+		goto out;
+	}
+
+	if (!root) {
+		st->node.blocks++;
+		st->node.recs += nrecs;
+	}
+	st->nodes++;
+
+	if (level > 1) {
+		for (i = 1; i <= nrecs; i++)
+			readahead_blocks(XFS_AGB_TO_DADDR(mp, w->agno,
+					btm_ptr(w->type, block, i)), blkbb);
+		for (i = 1; i <= nrecs; i++)
+			btm_scan(w, btm_ptr(w->type, block, i), level - 1);
+		goto out;
+	}
+
+	/* pick the leaves to read, and start reading them */
+	w->leaves += nrecs;
+	first = w->seen;
+	for (i = 1; i <= nrecs; i++)
+		if (sample_leaf(first + i - 1))
+			readahead_blocks(XFS_AGB_TO_DADDR(mp, w->agno,
+					btm_ptr(w->type, block, i)), blkbb);
+	for (i = 1; i <= nrecs; i++)
+		if (sample_leaf(w->seen++))
+			btm_scan(w, btm_ptr(w->type, block, i), 0);
+out:
+	pop_cur();
+}
+
+static void
+btm_scan_tree(
+	struct btm_stats	*st,
+	int			type,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		root,
+	unsigned int		levels)
+{
+	struct btm_walk		w = {
+		.st		= st,
+		.type		= type,
+		.agno		= agno,
+		.root_level	= levels - 1,
+	};
+	unsigned long long	records;
+
+	if (levels == 0 || levels > mp->m_agbtree_maxlevels)
+		return;
+	btm_scan(&w, root, levels - 1);
+	if (!w.sampled)
+		return;
+	if (levels == 1)
+		w.leaves = 1;
+
+	records = w.sampled_recs * w.leaves / w.sampled;
+	st->trees++;
+	st->leaves += w.leaves;
+	st->height = max(st->height, levels);
+	st->max_records = max(st->max_records, records);
+}
+
+static void
+btm_stats_add(
+	struct btm_stats	*to,
+	struct btm_stats	*from)
+{
+	to->trees += from->trees;
+	to->leaves += from->leaves;
+	to->nodes += from->nodes;
+	to->max_records = max(to->max_records, from->max_records);
+	to->height = max(to->height, from->height);
+	to->root_leaves += from->root_leaves;
+	to->leaf.blocks += from->leaf.blocks;
+	to->leaf.recs += from->leaf.recs;
+	to->node.blocks += from->node.blocks;
+	to->node.recs += from->node.recs;
+}
+
+static void
+btm_ag_worker(
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct btm_stats	st[BTM_NR] = { };
+	struct xfs_agf		*agf;
+	struct xfs_agi		*agi;
+	int			i;
+
+	push_cur();
+	set_cur(&typtab[TYP_AGF], XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
+	agf = iocur_top->data;
+	if (!agf) {
+		dbprintf(_("can't read agf block for ag %u\n"), agno);
+	} else {
+		if (btm_wanted[BTM_BNO])
+			btm_scan_tree(&st[BTM_BNO], BTM_BNO, agno,
+				be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNO]),
+				be32_to_cpu(agf->agf_levels[XFS_BTNUM_BNO]));
+		if (btm_wanted[BTM_CNT])
+			btm_scan_tree(&st[BTM_CNT], BTM_CNT, agno,
+				be32_to_cpu(agf->agf_roots[XFS_BTNUM_CNT]),
+				be32_to_cpu(agf->agf_levels[XFS_BTNUM_CNT]));
+		if (btm_wanted[BTM_RMAP])
+			btm_scan_tree(&st[BTM_RMAP], BTM_RMAP, agno,
+				be32_to_cpu(agf->agf_roots[XFS_BTNUM_RMAP]),
+				be32_to_cpu(agf->agf_levels[XFS_BTNUM_RMAP]));
+		if (btm_wanted[BTM_REFC])
+			btm_scan_tree(&st[BTM_REFC], BTM_REFC, agno,
+				be32_to_cpu(agf->agf_refcount_root),
+				be32_to_cpu(agf->agf_refcount_level));
+	}
+	pop_cur();
+
+	push_cur();
+	set_cur(&typtab[TYP_AGI], XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
+	agi = iocur_top->data;
+	if (!agi) {
+		dbprintf(_("can't read agi block for ag %u\n"), agno);
+	} else {
+		if (btm_wanted[BTM_INO])
+			btm_scan_tree(&st[BTM_INO], BTM_INO, agno,
+				be32_to_cpu(agi->agi_root),
+				be32_to_cpu(agi->agi_level));
+		if (btm_wanted[BTM_FINO])
+			btm_scan_tree(&st[BTM_FINO], BTM_FINO, agno,
+				be32_to_cpu(agi->agi_free_root),
+				be32_to_cpu(agi->agi_free_level));
+	}
+	pop_cur();
+
+	pthread_mutex_lock(&btm_lock);
+	for (i = 0; i < BTM_NR; i++)
+		btm_stats_add(&btm_stats[i], &st[i]);
+	pthread_mutex_unlock(&btm_lock);
+}
+
+static int
+measure(
+	unsigned int		threads)
+{
+	memset(btm_stats, 0, sizeof(btm_stats));
+	return scan_ags_threaded(threads, btm_ag_worker, NULL);
+}
+
+/*
+ * Report the measured geometry, and the shape and cost of a btree of each
+ * of the @targets record counts built to it.  Lookups read a block at each
+ * level.  Inserts also write the leaf; a block at each level splits about
+ * once per its measured record count of inserts below it, and a split
+ * writes the new block and the parent.
+ */
+static void
+report_measured(
+	int			type,
+	unsigned long long	*targets,
+	int			nr_targets)
+{
+	struct btm_stats	*st = &btm_stats[type];
+	const char		*tag = btm_types[type].tag;
+	unsigned int		leaf_max = btm_maxrecs(type, 1);
+	unsigned int		node_max = btm_maxrecs(type, 0);
+	unsigned int		records_per_block[2];
+	unsigned long long	nr_records;
+	double			leaf_fill, node_fill;
+	double			writes, below;
+	unsigned int		levels, l;
+	int			i;
+
+	if (!st->trees) {
+		printf(_("%s: no btree blocks to measure.\n"), tag);
+		return;
+	}
+
+	/*
+	 * Blocks start out half full when they split, so that's the best
+	 * guess for trees that have never grown past their root.
+	 */
+	if (st->leaf.blocks)
+		leaf_fill = (double)st->leaf.recs / st->leaf.blocks / leaf_max;
+	else
+		leaf_fill = 0.5;
+	if (st->node.blocks)
+		node_fill = (double)st->node.recs / st->node.blocks / node_max;
+	else
+		node_fill = leaf_fill;
+	records_per_block[0] = max(1U, (unsigned int)(leaf_fill * leaf_max));
+	records_per_block[1] = max(2U, (unsigned int)(node_fill * node_max));
+
+	printf(
+_("%s: %llu btrees, %llu leaf blocks (%llu read), %llu node blocks, height %u\n"),
+			tag, st->trees, st->leaves,
+			st->leaf.blocks + st->root_leaves, st->nodes,
+			st->height);
+	if (!st->leaf.blocks)
+		printf(
+_("%s: no btree has grown past its root; assuming half full blocks\n"),
+				tag);
+	printf(
+_("%s: measured per %u-byte block: %u records (leaf, %.0f%% full) / %u keyptrs (node, %.0f%% full)\n"),
+			tag, mp->m_sb.sb_blocksize, records_per_block[0],
+			leaf_fill * 100, records_per_block[1],
+			node_fill * 100);
+
+	for (i = 0; i < max(nr_targets, 1); i++) {
+		nr_records = nr_targets ? targets[i] : st->max_records;
+		if (!nr_records)
+			continue;
+		printf(_("%s: at %llu records:\n"), tag, nr_records);
+		levels = calc_height(nr_records, records_per_block);
+
+		writes = 1;
+		below = 1;
+		for (l = 0; l + 1 < levels; l++) {
+			below *= records_per_block[l != 0];
+			writes += 2 / below;
+		}
+		printf(
+_("%s: per operation: lookup %u block reads; insert %u block reads, %.2f block writes\n"),
+				tag, levels, levels, writes);
+	}
+}
+
+static void
+report_all_measured(
+	unsigned long long	*targets,
+	int			nr_targets)
+{
+	int			i;
+
+	for (i = 0; i < BTM_NR; i++)
+		if (btm_wanted[i])
+			report_measured(i, targets, nr_targets);
+}
+
+static bool
+btm_present(
+	int			type)
+{
+	switch (type) {
+	case BTM_FINO:
+		return xfs_has_finobt(mp);
+	case BTM_REFC:
+		return xfs_has_reflink(mp);
+	case BTM_RMAP:
+		return xfs_has_rmapbt(mp);
+	default:
+		return true;
+	}
+}
+
+static void
+measure_types(
+	int			argc,
+	char			**argv,
+	unsigned long long	*targets,
+	int			nr_targets,
+	unsigned int		threads)
+{
+	int			i, j;
+
+	memset(btm_wanted, 0, sizeof(btm_wanted));
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "all")) {
+			for (j = 0; j < BTM_NR; j++)
+				btm_wanted[j] = btm_present(j);
+			continue;
+		}
+		for (j = 0; j < BTM_NR; j++)
+			if (!strcmp(argv[i], btm_types[j].tag))
+				break;
+		if (j == BTM_NR) {
+			fprintf(stderr, _("%s: cannot measure this btree type.\n"),
+					argv[i]);
+			continue;
+		}
+		if (!btm_present(j)) {
+			fprintf(stderr,
+				_("%s: not present on this filesystem.\n"),
+				argv[i]);
+			continue;
+		}
+		btm_wanted[j] = true;
+	}
+
+	if (measure(threads))
+		return;
+	report_all_measured(targets, nr_targets);
+}
+
+/* Report on @tag for each of the @nr_targets record counts. */
+static void
+report_targets(
+	const char		*tag,
+	unsigned int		report_what,
+	unsigned long long	*targets,
+	int			nr_targets,
+	unsigned int		blocksize)
+{
+	int			i;
+
+	if (!nr_targets) {
+		report(tag, report_what, 0, blocksize);
+		return;
+	}
+	for (i = 0; i < nr_targets; i++)
+		report(tag, report_what, targets[i], blocksize);
+}
+
 static void
 report_all(
 	unsigned int		report_what,
-	unsigned long long	nr_records,
+	unsigned long long	*targets,
+	int			nr_targets,
 	unsigned int		blocksize)
 {
 	struct btmap		*m;
 	int			i;
 
 	for (i = 0, m = maps; i < ARRAY_SIZE(maps); i++, m++)
-		report(m->tag, report_what, nr_records, blocksize);
+		report_targets(m->tag, report_what, targets, nr_targets,
+				blocksize);
 }
 
 static int
@@ -367,11 +831,15 @@ btheight_f(
 	char		**argv)
 {
 	long long	blocksize = mp->m_sb.sb_blocksize;
-	uint64_t	nr_records = 0;
+	unsigned long long *targets = NULL;
+	int		nr_targets = 0;
+	unsigned int	threads = 0;
 	int		report_what = REPORT_DEFAULT;
+	bool		bflag = false;
 	int		i, c;
 
-	while ((c = getopt(argc, argv, "b:n:w:")) != -1) {
+	sample_pct = 10;
+	while ((c = getopt(argc, argv, "b:mn:p:T:w:")) != -1) {
 		switch (c) {
 		case 'b':
 			errno = 0;
@@ -380,14 +848,42 @@ btheight_f(
 					optarg);
 			if (errno) {
 				perror(optarg);
-				return 0;
+				goto out;
 			}
+			bflag = true;
+			break;
+		case 'm':
+			report_what = REPORT_MEASURED;
 			break;
 		case 'n':
-			nr_records = cvt_u64(optarg, 0);
+			targets = xrealloc(targets,
+					(nr_targets + 1) * sizeof(*targets));
+			targets[nr_targets] = cvt_u64(optarg, 0);
 			if (errno) {
 				perror(optarg);
-				return 0;
+				goto out;
+			}
+			if (targets[nr_targets] == 0) {
+				fprintf(stderr,
+_("Number of records must be greater than zero.\n"));
+				goto out;
+			}
+			nr_targets++;
+			break;
+		case 'p':
+			sample_pct = cvt_u32(optarg, 0);
+			if (errno || sample_pct < 1 || sample_pct > 100) {
+				fprintf(stderr,
+_("Sample percentage must be between 1 and 100.\n"));
+				goto out;
+			}
+			break;
+		case 'T':
+			threads = cvt_u32(optarg, 0);
+			if (errno || !threads) {
+				fprintf(stderr, _("Bad thread count %s.\n"),
+						optarg);
+				goto out;
 			}
 			break;
 		case 'w':
@@ -399,55 +895,76 @@ btheight_f(
 				report_what = REPORT_ABSMAX;
 			else {
 				btheight_help();
-				return 0;
+				goto out;
 			}
 			break;
 		default:
 			btheight_help();
-			return 0;
+			goto out;
 		}
 	}
 
-	if (report_what != REPORT_ABSMAX && nr_records == 0) {
+	if (report_what == REPORT_MEASURED) {
+		if (bflag) {
+			fprintf(stderr,
+_("Measured btrees have the filesystem block size; -b cannot be used with -m.\n"));
+			goto out;
+		}
+		if (argc == optind) {
+			btheight_help();
+			goto out;
+		}
+		measure_types(argc - optind, argv + optind, targets,
+				nr_targets, threads);
+		goto out;
+	}
+
+	if (report_what != REPORT_ABSMAX && nr_targets == 0) {
 		fprintf(stderr,
 _("Number of records must be greater than zero.\n"));
-		return 0;
+		goto out;
 	}
 
 	if (report_what != REPORT_ABSMAX && blocksize > INT_MAX) {
 		fprintf(stderr,
 _("The largest block size this command will consider is %u bytes.\n"),
 			INT_MAX);
-		return 0;
+		goto out;
 	}
 
 	if (report_what != REPORT_ABSMAX && blocksize < 128) {
 		fprintf(stderr,
 _("The smallest block size this command will consider is 128 bytes.\n"));
-		return 0;
+		goto out;
 	}
 
 	if (argc == optind) {
 		btheight_help();
-		return 0;
+		goto out;
 	}
 
+	/* the maximum height doesn't depend on the record count */
+	if (report_what == REPORT_ABSMAX)
+		nr_targets = 0;
+
 	for (i = optind; i < argc; i++) {
 		if (!strcmp(argv[i], "all")) {
-			report_all(report_what, nr_records, blocksize);
-			return 0;
+			report_all(report_what, targets, nr_targets, blocksize);
+			goto out;
 		}
 	}
 
 	for (i = optind; i < argc; i++)
-		report(argv[i], report_what, nr_records, blocksize);
-
+		report_targets(argv[i], report_what, targets, nr_targets,
+				blocksize);
+out:
+	xfree(targets);
 	return 0;
 }
 
 static const cmdinfo_t btheight_cmd =
 	{ "btheight", "b", btheight_f, 1, -1, 0,
-	  "[-b blksz] [-n recs] [-w max|-w min] btree types...",
+	  "[-b blksz] [-n recs]... [-w max|-w min|-m [-p pct] [-T threads]] btree types...",
 	  N_("compute btree heights"), btheight_help };
 
 void
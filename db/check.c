@@ -20,6 +20,9 @@
 #include "init.h"
 #include "malloc.h"
 #include "dir2.h"
+#include "runmap.h"
+#include "ncheck.h"
+#include "libfrog/convert.h"
 
 typedef enum {
 	IS_USER_QUOTA, IS_PROJECT_QUOTA, IS_GROUP_QUOTA,
@@ -36,6 +39,7 @@ typedef enum {
 	DBM_RLDATA,	DBM_COWDATA,
 	DBM_NDBM
 } dbm_t;
+#define	DBM_BITS	5	/* enough to hold any dbm_t */
 
 typedef struct inodata {
 	struct inodata	*next;
@@ -100,37 +104,52 @@ typedef struct dirhash {
 #define	DIR_HASH_SIZE	1024
 #define	DIR_HASH_FUNC(h,a)	(((h) ^ (a)) % DIR_HASH_SIZE)
 
-static xfs_extlen_t	agffreeblks;
-static xfs_extlen_t	agflongest;
-static uint64_t	agf_aggr_freeblks;	/* aggregate count over all */
-static uint32_t	agfbtreeblks;
-static int		lazycount;
-static xfs_agino_t	agicount;
-static xfs_agino_t	agifreecount;
+/*
+ * blockget scans AGs in parallel.  Everything from here to the next comment
+ * is private to the thread scanning an AG, and is added into the main
+ * thread's copy when the scan of each AG is done; see fold_ag_counts().
+ */
+static __thread xfs_extlen_t	agffreeblks;
+static __thread xfs_extlen_t	agflongest;
+static __thread uint64_t	agf_aggr_freeblks; /* aggregate count over all */
+static __thread uint32_t	agfbtreeblks;
+static __thread int		lazycount;
+static __thread xfs_agino_t	agicount;
+static __thread xfs_agino_t	agifreecount;
+static __thread dirhash_t	**dirhash;
+static __thread int		error;
+static __thread uint64_t	fdblocks;
+static __thread uint64_t	frextents;
+static __thread uint64_t	icount;
+static __thread uint64_t	ifree;
+static __thread unsigned	sbversion;
+static __thread int		sbver_err;
+static __thread int		serious_error;
+
+/*
+ * The block and inode maps and the inode table of each AG (and of the
+ * realtime volume, after the AGs) are protected by that AG's lock, and
+ * the quota tables and summed counts by check_lock.
+ */
+static pthread_mutex_t	*ag_locks;
+static pthread_mutex_t	check_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static xfs_fsblock_t	*blist;
 static int		blist_size;
-static char		**dbmap;	/* really dbm_t:8 */
-static dirhash_t	**dirhash;
-static int		error;
-static uint64_t	fdblocks;
-static uint64_t	frextents;
-static uint64_t	icount;
-static uint64_t	ifree;
+static struct runmap	**dbmap;	/* dbm_t of each block */
 static inodata_t	***inodata;
 static int		inodata_hash_size;
-static inodata_t	***inomap;
+static struct runmap	**inomap;	/* inodata_t * owning each block */
 static int		nflag;
 static int		pflag;
 static int		tflag;
+static unsigned int	nr_threads;
 static qdata_t		**qpdata;
 static int		qpdo;
 static qdata_t		**qudata;
 static int		qudo;
 static qdata_t		**qgdata;
 static int		qgdo;
-static unsigned		sbversion;
-static int		sbver_err;
-static int		serious_error;
 static int		sflag;
 static xfs_suminfo_t	*sumcompute;
 static xfs_suminfo_t	*sumfile;
@@ -175,10 +194,39 @@ static const char	*typename[] = {
 static inline void check_typename(void)
 {
 	BUILD_BUG_ON(ARRAY_SIZE(typename) != DBM_NDBM + 1);
+	BUILD_BUG_ON(DBM_NDBM > (1 << DBM_BITS));
 }
 
 static int		verbose;
 
+static inline void
+lock_ag(
+	xfs_agnumber_t	agno)
+{
+	pthread_mutex_lock(&ag_locks[agno]);
+}
+
+static inline void
+unlock_ag(
+	xfs_agnumber_t	agno)
+{
+	pthread_mutex_unlock(&ag_locks[agno]);
+}
+
+static inline void
+lock_inode(
+	inodata_t	*id)
+{
+	lock_ag(XFS_INO_TO_AGNO(mp, id->ino));
+}
+
+static inline void
+unlock_inode(
+	inodata_t	*id)
+{
+	unlock_ag(XFS_INO_TO_AGNO(mp, id->ino));
+}
+
 #define	CHECK_BLIST(b)	(blist_size && check_blist(b))
 #define	CHECK_BLISTA(a,b)	\
 	(blist_size && check_blist(XFS_AGB_TO_FSB(mp, a, b)))
@@ -204,7 +252,8 @@ typedef void	(*scan_sbtree_f_t)(struct xfs_btree_block *block,
 static void		add_blist(xfs_fsblock_t	bno);
 static void		add_ilist(xfs_ino_t ino);
 static void		addlink_inode(inodata_t *id);
-static void		addname_inode(inodata_t *id, char *name, int namelen);
+static void		addname_inode(inodata_t *id, inodata_t *parent,
+				      char *name, int namelen);
 static void		addparent_inode(inodata_t *id, xfs_ino_t parent);
 static void		blkent_append(blkent_t **entp, xfs_fsblock_t b,
 				      xfs_extlen_t c);
@@ -377,7 +426,7 @@ static const cmdinfo_t	blockfree_cmd =
 	  NULL, N_("free block usage information"), NULL };
 static const cmdinfo_t	blockget_cmd =
 	{ "blockget", "check", blockget_f, 0, -1, 0,
-	  N_("[-s|-v] [-n] [-t] [-b bno]... [-i ino] ..."),
+	  N_("[-s|-v] [-n] [-t] [-T threads] [-b bno]... [-i ino] ..."),
 	  N_("get block usage and check consistency"), NULL };
 static const cmdinfo_t	blocktrash_cmd =
 	{ "blocktrash", NULL, blocktrash_f, 0, -1, 0,
@@ -389,7 +438,7 @@ static const cmdinfo_t	blockuse_cmd =
 	  N_("print usage for current block(s)"), NULL };
 static const cmdinfo_t	ncheck_cmd =
 	{ "ncheck", NULL, ncheck_f, 0, -1, 0,
-	  N_("[-s] [-i ino] ..."),
+	  N_("[-s] [-i ino] ... [-T threads]"),
 	  N_("print inode-name pairs"), NULL };
 
 
@@ -420,23 +469,31 @@ static void
 addlink_inode(
 	inodata_t	*id)
 {
+	lock_inode(id);
 	id->link_add++;
 	if (verbose || id->ilist)
 		dbprintf(_("inode %lld add link, now %u\n"), id->ino,
 			id->link_add);
+	unlock_inode(id);
 }
 
+/* Record the name and the first parent we find for a directory entry. */
 static void
 addname_inode(
 	inodata_t	*id,
+	inodata_t	*parent,
 	char		*name,
 	int		namelen)
 {
-	if (!nflag || id->name)
-		return;
-	id->name = xmalloc(namelen + 1);
-	memcpy(id->name, name, namelen);
-	id->name[namelen] = '\0';
+	lock_inode(id);
+	if (!id->parent)
+		id->parent = parent;
+	if (nflag && !id->name) {
+		id->name = xmalloc(namelen + 1);
+		memcpy(id->name, name, namelen);
+		id->name[namelen] = '\0';
+	}
+	unlock_inode(id);
 }
 
 static void
@@ -447,7 +504,9 @@ addparent_inode(
 	inodata_t	*pid;
 
 	pid = find_inode(parent, 1);
+	lock_inode(id);
 	id->parent = pid;
+	unlock_inode(id);
 	if (verbose || id->ilist || (pid && pid->ilist))
 		dbprintf(_("inode %lld parent %lld\n"), id->ino, parent);
 }
@@ -767,26 +826,146 @@ blockfree_f(
 	}
 	rt = mp->m_sb.sb_rextents != 0;
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		runmap_free(dbmap[c]);
+		runmap_free(inomap[c]);
 		free_inodata(c);
 	}
 	if (rt) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		runmap_free(dbmap[c]);
+		runmap_free(inomap[c]);
 		xfree(sumcompute);
 		xfree(sumfile);
 		sumcompute = sumfile = NULL;
 	}
+	for (c = 0; c <= mp->m_sb.sb_agcount; c++)
+		pthread_mutex_destroy(&ag_locks[c]);
 	xfree(dbmap);
 	xfree(inomap);
 	xfree(inodata);
+	xfree(ag_locks);
 	dbmap = NULL;
 	inomap = NULL;
 	inodata = NULL;
+	ag_locks = NULL;
 	return 0;
 }
 
+/*
+ * Counts from each AG scan, summed into the main thread's copies once all
+ * the AGs have been scanned.
+ */
+struct ag_counts {
+	int		error;
+	int		serious_error;
+	int		sbver_err;
+	int		lazycount;
+	unsigned	sbversion;
+	uint64_t	agf_aggr_freeblks;
+	uint64_t	fdblocks;
+	uint64_t	frextents;
+	uint64_t	icount;
+	uint64_t	ifree;
+};
+
+struct scan_ags {
+	unsigned		sbversion;	/* at the start of the scan */
+	struct ag_counts	totals;
+	int			*sbver_errs;	/* per AG */
+};
+
+/* Add this thread's counts from scanning @agno into the totals. */
+static void
+fold_ag_counts(
+	struct scan_ags		*sa,
+	xfs_agnumber_t		agno)
+{
+	struct ag_counts	*t = &sa->totals;
+
+	pthread_mutex_lock(&check_lock);
+	t->error += error;
+	t->serious_error += serious_error;
+	t->sbver_err += sbver_err;
+	t->lazycount |= lazycount;
+	t->agf_aggr_freeblks += agf_aggr_freeblks;
+	t->fdblocks += fdblocks;
+	t->frextents += frextents;
+	t->icount += icount;
+	t->ifree += ifree;
+	/* inodes can set the attr bit and clear the alignment bit */
+	t->sbversion |= sbversion & XFS_SB_VERSION_ATTRBIT;
+	if (!(sbversion & XFS_SB_VERSION_ALIGNBIT))
+		t->sbversion &= ~XFS_SB_VERSION_ALIGNBIT;
+	pthread_mutex_unlock(&check_lock);
+
+	sa->sbver_errs[agno] = sbver_err;
+}
+
+static void
+scan_ag_worker(
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct scan_ags		*sa = arg;
+
+	error = serious_error = sbver_err = lazycount = 0;
+	agf_aggr_freeblks = fdblocks = frextents = icount = ifree = 0;
+	sbversion = sa->sbversion;
+
+	scan_ag(agno);
+	fold_ag_counts(sa, agno);
+
+	if (dirhash) {
+		dir_hash_done();
+		free(dirhash);
+		dirhash = NULL;
+	}
+}
+
+/*
+ * Scan all the AGs, several at a time.  Each AG's scan only reads that AG's
+ * metadata and the inodes allocated in it, but files and directories can
+ * refer to blocks and inodes in any AG, so the shared maps are locked.
+ * Anything that needs the whole filesystem to have been scanned is checked
+ * afterwards by the main thread.
+ */
+static void
+scan_all_ags(void)
+{
+	struct scan_ags		sa = {
+		.sbversion	= sbversion,
+		.totals.sbversion = sbversion,
+	};
+	xfs_agnumber_t		agno;
+	int			sbyell = 0, sbver_seen = 0;
+
+	sa.sbver_errs = xcalloc(mp->m_sb.sb_agcount, sizeof(int));
+	/* tracing every block makes no sense out of order */
+	if (scan_ags_threaded(verbose ? 1 : nr_threads, scan_ag_worker, &sa))
+		serious_error++;
+
+	error += sa.totals.error;
+	serious_error += sa.totals.serious_error;
+	sbver_err += sa.totals.sbver_err;
+	lazycount |= sa.totals.lazycount;
+	agf_aggr_freeblks += sa.totals.agf_aggr_freeblks;
+	fdblocks += sa.totals.fdblocks;
+	frextents += sa.totals.frextents;
+	icount += sa.totals.icount;
+	ifree += sa.totals.ifree;
+	sbversion = sa.totals.sbversion;
+
+	/* warn as if we'd scanned the AGs in order */
+	for (agno = 0; agno < mp->m_sb.sb_agcount && !sbyell; agno++) {
+		sbver_seen += sa.sbver_errs[agno];
+		if (sbver_seen > 4 && sbver_seen >= agno) {
+			sbyell = 1;
+			dbprintf(_("WARNING: this may be a newer XFS "
+				 "filesystem.\n"));
+		}
+	}
+	xfree(sa.sbver_errs);
+}
+
 /*
  * Check consistency of xfs filesystem contents.
  */
@@ -797,7 +976,6 @@ blockget_f(
 {
 	xfs_agnumber_t	agno;
 	int		oldprefix;
-	int		sbyell;
 
 	if (dbmap) {
 		dbprintf(_("already have block usage information\n"));
@@ -813,14 +991,7 @@ blockget_f(
 	}
 	oldprefix = dbprefix;
 	dbprefix |= pflag;
-	for (agno = 0, sbyell = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		scan_ag(agno);
-		if (sbver_err > 4 && !sbyell && sbver_err >= agno) {
-			sbyell = 1;
-			dbprintf(_("WARNING: this may be a newer XFS "
-				 "filesystem.\n"));
-		}
-	}
+	scan_all_ags();
 	if (blist_size) {
 		xfree(blist);
 		blist = NULL;
@@ -1028,6 +1199,8 @@ blocktrash_f(
 	int		mode;
 	struct timeval	now;
 	char		*p;
+	uint64_t	n;
+	dbm_t		d;
 	xfs_rfsblock_t	randb;
 	uint		seed;
 	int		sopt;
@@ -1174,11 +1347,11 @@ blocktrash_f(
 		goto out;
 	}
 	for (blocks = 0, agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		for (agbno = 0, p = dbmap[agno];
-		     agbno < mp->m_sb.sb_agblocks;
-		     agbno++, p++) {
-			if ((1 << *p) & tmask)
-				blocks++;
+		for (agbno = 0; agbno < mp->m_sb.sb_agblocks; agbno += n) {
+			n = mp->m_sb.sb_agblocks - agbno;
+			d = (dbm_t)runmap_get(dbmap[agno], agbno, &n);
+			if ((1 << d) & tmask)
+				blocks += n;
 		}
 	}
 	if (blocks == 0) {
@@ -1191,18 +1364,23 @@ blocktrash_f(
 		for (bi = 0, agno = 0, done = 0;
 		     !done && agno < mp->m_sb.sb_agcount;
 		     agno++) {
-			for (agbno = 0, p = dbmap[agno];
+			for (agbno = 0;
 			     agbno < mp->m_sb.sb_agblocks;
-			     agbno++, p++) {
-				if (!((1 << *p) & tmask))
+			     agbno += n) {
+				n = mp->m_sb.sb_agblocks - agbno;
+				d = (dbm_t)runmap_get(dbmap[agno], agbno, &n);
+				if (!((1 << d) & tmask))
 					continue;
-				if (bi++ < randb)
+				if (bi + n <= randb) {
+					bi += n;
 					continue;
+				}
 				push_cur();
 				set_cur(NULL,
-					XFS_AGB_TO_DADDR(mp, agno, agbno),
+					XFS_AGB_TO_DADDR(mp, agno,
+						agbno + randb - bi),
 					blkbb, DB_RING_IGN, NULL);
-				blocktrash_b(bit_offset, (dbm_t)*p,
+				blocktrash_b(bit_offset, d,
 					&lentab[random() % lentablen], mode);
 				pop_cur();
 				done = 1;
@@ -1229,6 +1407,8 @@ blockuse_f(
 	inodata_t	*i;
 	char		*p;
 	int		shownames;
+	uint64_t	n;
+	dbm_t		d;
 
 	if (!dbmap) {
 		dbprintf(_("must run blockget first\n"));
@@ -1263,11 +1443,13 @@ blockuse_f(
 		}
 	}
 	while (agbno <= end) {
-		p = &dbmap[agno][agbno];
-		i = inomap[agno][agbno];
+		n = 1;
+		d = (dbm_t)runmap_get(dbmap[agno], agbno, &n);
+		n = 1;
+		i = (inodata_t *)(uintptr_t)runmap_get(inomap[agno], agbno, &n);
 		dbprintf(_("block %llu (%u/%u) type %s"),
 			(xfs_fsblock_t)XFS_AGB_TO_FSB(mp, agno, agbno),
-			agno, agbno, typename[(dbm_t)*p]);
+			agno, agbno, typename[d]);
 		if (i) {
 			dbprintf(_(" inode %lld"), i->ino);
 			if (shownames && (p = inode_name(i->ino, NULL))) {
@@ -1314,27 +1496,30 @@ check_dbmap(
 	dbm_t		type,
 	int		ignore_reflink)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, j;
+	uint64_t	n;
 	dbm_t		d;
 
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
+	for (i = 0; i < len; i += n) {
 		if (!dbmap_boundscheck(agno, agbno + i)) {
 			dbprintf(_("block %u/%u beyond end of expected area\n"),
 				agno, agbno + i);
 			error++;
 			break;
 		}
-		d = (dbm_t)*p;
+		n = len - i;
+		d = (dbm_t)runmap_get(dbmap[agno], agbno + i, &n);
 		if (ignore_reflink && (d == DBM_UNKNOWN || d == DBM_DATA ||
 				       d == DBM_RLDATA))
 			continue;
-		if ((dbm_t)*p != type) {
-			if (!sflag || CHECK_BLISTA(agno, agbno + i)) {
+		if (d == type)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLISTA(agno, agbno + j)) {
 				dbprintf(_("block %u/%u expected type %s got "
 					 "%s\n"),
-					agno, agbno + i, typename[type],
-					typename[(dbm_t)*p]);
+					agno, agbno + j, typename[type],
+					typename[d]);
 			}
 			error++;
 		}
@@ -1359,25 +1544,25 @@ check_inomap(
 	xfs_extlen_t	len,
 	xfs_ino_t	c_ino)
 {
-	xfs_extlen_t	i;
-	inodata_t	**idp;
+	xfs_extlen_t	i, j;
+	uint64_t	n;
+	inodata_t	*id;
 	int		rval;
 
-	if (!check_range(agno, agbno, len))  {
-		dbprintf(_("blocks %u/%u..%u claimed by inode %lld\n"),
-			agno, agbno, agbno + len - 1, c_ino);
-		return 0;
-	}
-	for (i = 0, rval = 1, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		if (*idp && !(*idp)->isreflink) {
-			if (!sflag || (*idp)->ilist ||
-			    CHECK_BLISTA(agno, agbno + i))
+	for (i = 0, rval = 1; i < len; i += n) {
+		n = len - i;
+		id = (inodata_t *)(uintptr_t)runmap_get(inomap[agno],
+				agbno + i, &n);
+		if (!id || id->isreflink)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || id->ilist || CHECK_BLISTA(agno, agbno + j))
 				dbprintf(_("block %u/%u claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					agno, agbno + i, c_ino, (*idp)->ino);
+					agno, agbno + j, c_ino, id->ino);
 			error++;
-			rval = 0;
 		}
+		rval = 0;
 	}
 	return rval;
 }
@@ -1499,22 +1684,27 @@ check_rdbmap(
 	xfs_extlen_t	len,
 	dbm_t		type)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, j;
+	uint64_t	n;
+	dbm_t		d;
 
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
+	for (i = 0; i < len; i += n) {
 		if (!rdbmap_boundscheck(bno + i)) {
 			dbprintf(_("rtblock %llu beyond end of expected area\n"),
 				bno + i);
 			error++;
 			break;
 		}
-		if ((dbm_t)*p != type) {
-			if (!sflag || CHECK_BLIST(bno + i))
+		n = len - i;
+		d = (dbm_t)runmap_get(dbmap[mp->m_sb.sb_agcount], bno + i, &n);
+		if (d == type)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLIST(bno + j))
 				dbprintf(_("rtblock %llu expected type %s got "
 					 "%s\n"),
-					bno + i, typename[type],
-					typename[(dbm_t)*p]);
+					bno + j, typename[type],
+					typename[d]);
 			error++;
 		}
 	}
@@ -1526,8 +1716,9 @@ check_rinomap(
 	xfs_extlen_t	len,
 	xfs_ino_t	c_ino)
 {
-	xfs_extlen_t	i;
-	inodata_t	**idp;
+	xfs_extlen_t	i, j;
+	uint64_t	n;
+	inodata_t	*id;
 	int		rval;
 
 	if (!check_rrange(bno, len)) {
@@ -1535,17 +1726,20 @@ check_rinomap(
 			bno, bno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		if (*idp) {
-			if (!sflag || (*idp)->ilist || CHECK_BLIST(bno + i))
+	for (i = 0, rval = 1; i < len; i += n) {
+		n = len - i;
+		id = (inodata_t *)(uintptr_t)runmap_get(
+				inomap[mp->m_sb.sb_agcount], bno + i, &n);
+		if (!id)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || id->ilist || CHECK_BLIST(bno + j))
 				dbprintf(_("rtblock %llu claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					bno + i, c_ino, (*idp)->ino);
+					bno + j, c_ino, id->ino);
 			error++;
-			rval = 0;
 		}
+		rval = 0;
 	}
 	return rval;
 }
@@ -1645,34 +1839,40 @@ check_set_dbmap(
 	xfs_agnumber_t	c_agno,
 	xfs_agblock_t	c_agbno)
 {
-	xfs_extlen_t	i;
+	xfs_extlen_t	i, j;
+	uint64_t	n;
 	int		mayprint;
-	char		*p;
+	dbm_t		d;
 
 	if (!check_range(agno, agbno, len))  {
 		dbprintf(_("blocks %u/%u..%u claimed by block %u/%u\n"), agno,
 			agbno, agbno + len - 1, c_agno, c_agbno);
 		return;
 	}
+	lock_ag(agno);
 	check_dbmap(agno, agbno, len, type1, is_reflink(type2));
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
+	for (i = 0; i < len; i += n) {
 		if (!dbmap_boundscheck(agno, agbno + i)) {
 			dbprintf(_("block %u/%u beyond end of expected area\n"),
 				agno, agbno + i);
 			error++;
 			break;
 		}
-		if (*p == DBM_RLDATA && type2 == DBM_DATA)
-			;	/* do nothing */
-		else if (*p == DBM_DATA && type2 == DBM_DATA)
-			*p = (char)DBM_RLDATA;
+		n = len - i;
+		d = (dbm_t)runmap_get(dbmap[agno], agbno + i, &n);
+		/* a second data owner makes it shared */
+		if (type2 == DBM_DATA && (d == DBM_DATA || d == DBM_RLDATA))
+			d = DBM_RLDATA;
 		else
-			*p = (char)type2;
-		if (mayprint && (verbose || CHECK_BLISTA(agno, agbno + i)))
-			dbprintf(_("setting block %u/%u to %s\n"), agno, agbno + i,
-				typename[type2]);
-	}
+			d = type2;
+		runmap_set(dbmap[agno], agbno + i, n, d);
+		for (j = i; mayprint && j < i + n; j++)
+			if (verbose || CHECK_BLISTA(agno, agbno + j))
+				dbprintf(_("setting block %u/%u to %s\n"),
+					agno, agbno + j, typename[type2]);
+	}
+	unlock_ag(agno);
 }
 
 static void
@@ -1684,24 +1884,25 @@ check_set_rdbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_rrange(bno, len))
 		return;
+	lock_ag(mp->m_sb.sb_agcount);
 	check_rdbmap(bno, len, type1);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
+	for (i = 0; i < len; i++) {
 		if (!rdbmap_boundscheck(bno + i)) {
 			dbprintf(_("rtblock %llu beyond end of expected area\n"),
 				bno + i);
 			error++;
 			break;
 		}
-		*p = (char)type2;
 		if (mayprint && (verbose || CHECK_BLIST(bno + i)))
 			dbprintf(_("setting rtblock %llu to %s\n"),
 				bno + i, typename[type2]);
 	}
+	runmap_set(dbmap[mp->m_sb.sb_agcount], bno, i, type2);
+	unlock_ag(mp->m_sb.sb_agcount);
 }
 
 static void
@@ -1737,16 +1938,21 @@ checknot_dbmap(
 	xfs_extlen_t	len,
 	int		typemask)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, j;
+	uint64_t	n;
+	dbm_t		d;
 
 	if (!check_range(agno, agbno, len))
 		return;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
-			if (!sflag || CHECK_BLISTA(agno, agbno + i))
+	for (i = 0; i < len; i += n) {
+		n = len - i;
+		d = (dbm_t)runmap_get(dbmap[agno], agbno + i, &n);
+		if (!((1 << d) & typemask))
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLISTA(agno, agbno + j))
 				dbprintf(_("block %u/%u type %s not expected\n"),
-					agno, agbno + i, typename[(dbm_t)*p]);
+					agno, agbno + j, typename[d]);
 			error++;
 		}
 	}
@@ -1758,16 +1964,21 @@ checknot_rdbmap(
 	xfs_extlen_t	len,
 	int		typemask)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, j;
+	uint64_t	n;
+	dbm_t		d;
 
 	if (!check_rrange(bno, len))
 		return;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
-			if (!sflag || CHECK_BLIST(bno + i))
+	for (i = 0; i < len; i += n) {
+		n = len - i;
+		d = (dbm_t)runmap_get(dbmap[mp->m_sb.sb_agcount], bno + i, &n);
+		if (!((1 << d) & typemask))
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLIST(bno + j))
 				dbprintf(_("rtblock %llu type %s not expected\n"),
-					bno + i, typename[(dbm_t)*p]);
+					bno + j, typename[d]);
 			error++;
 		}
 	}
@@ -1872,18 +2083,21 @@ find_inode(
 		return NULL;
 	htab = inodata[agno];
 	ih = agino % inodata_hash_size;
+	lock_ag(agno);
 	ent = htab[ih];
 	while (ent) {
 		if (ent->ino == ino)
-			return ent;
+			goto out_unlock;
 		ent = ent->next;
 	}
 	if (!add)
-		return NULL;
+		goto out_unlock;
 	ent = xcalloc(1, sizeof(*ent));
 	ent->ino = ino;
 	ent->next = htab[ih];
 	htab[ih] = ent;
+out_unlock:
+	unlock_ag(agno);
 	return ent;
 }
 
@@ -1933,24 +2147,30 @@ init(
 	dbmap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*dbmap));
 	inomap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*inomap));
 	inodata = xmalloc(mp->m_sb.sb_agcount * sizeof(*inodata));
+	ag_locks = xmalloc((mp->m_sb.sb_agcount + 1) * sizeof(*ag_locks));
+	for (c = 0; c <= mp->m_sb.sb_agcount; c++)
+		pthread_mutex_init(&ag_locks[c], NULL);
 	inodata_hash_size =
 		(int)max(min(mp->m_sb.sb_icount /
 				(INODATA_AVG_HASH_LENGTH * mp->m_sb.sb_agcount),
 			     MAX_INODATA_HASH_SIZE),
 			 MIN_INODATA_HASH_SIZE);
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**inomap));
+		dbmap[c] = runmap_alloc(mp->m_sb.sb_agblocks, DBM_BITS);
+		inomap[c] = runmap_alloc(mp->m_sb.sb_agblocks,
+				sizeof(inodata_t *) * NBBY);
 		inodata[c] = xcalloc(inodata_hash_size, sizeof(**inodata));
 	}
 	if (rt) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**inomap));
+		dbmap[c] = runmap_alloc(mp->m_sb.sb_rblocks, DBM_BITS);
+		inomap[c] = runmap_alloc(mp->m_sb.sb_rblocks,
+				sizeof(inodata_t *) * NBBY);
 		sumfile = xcalloc(mp->m_rsumsize, 1);
 		sumcompute = xcalloc(mp->m_rsumsize, 1);
 	}
 	nflag = sflag = tflag = verbose = optind = 0;
-	while ((c = getopt(argc, argv, "b:i:npstv")) != EOF) {
+	nr_threads = 0;
+	while ((c = getopt(argc, argv, "b:i:npstT:v")) != EOF) {
 		switch (c) {
 		case 'b':
 			bno = strtoll(optarg, NULL, 10);
@@ -1972,6 +2192,13 @@ init(
 		case 't':
 			tflag = 1;
 			break;
+		case 'T':
+			nr_threads = cvt_u32(optarg, 0);
+			if (errno || !nr_threads) {
+				dbprintf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -1982,6 +2209,7 @@ init(
 	}
 	error = sbver_err = serious_error = 0;
 	fdblocks = frextents = icount = ifree = 0;
+	agf_aggr_freeblks = lazycount = 0;
 	sbversion = XFS_SB_VERSION_4;
 	/*
 	 * Note that inoalignmt == 0 is valid when fsb size is large enough for
@@ -2044,14 +2272,11 @@ ncheck_f(
 	xfs_ino_t	ino;
 	char		*p;
 	int		security;
+	unsigned int	threads = 0;
 
-	if (!inodata || !nflag) {
-		dbprintf(_("must run blockget -n first\n"));
-		return 0;
-	}
 	security = optind = ilist_size = 0;
 	ilist = NULL;
-	while ((c = getopt(argc, argv, "i:s")) != EOF) {
+	while ((c = getopt(argc, argv, "i:sT:")) != EOF) {
 		switch (c) {
 		case 'i':
 			ino = strtoll(optarg, NULL, 10);
@@ -2062,12 +2287,26 @@ ncheck_f(
 		case 's':
 			security = 1;
 			break;
+		case 'T':
+			threads = cvt_u32(optarg, 0);
+			if (errno || !threads) {
+				dbprintf(_("bad thread count %s\n"), optarg);
+				xfree(ilist);
+				return 0;
+			}
+			break;
 		default:
 			dbprintf(_("bad option -%c for ncheck command\n"), c);
 			xfree(ilist);
 			return 0;
 		}
 	}
+	/* without blockget -n, read the names straight from the directories */
+	if (!inodata || !nflag) {
+		ncheck_scan(ilist, ilist_size, security, threads);
+		xfree(ilist);
+		return 0;
+	}
 	if (ilist) {
 		for (ilp = ilist; ilp < &ilist[ilist_size]; ilp++) {
 			ino = *ilp;
@@ -2517,12 +2756,9 @@ process_data_dir_v2(
 				parent = cid ? lino : NULLFSINO;
 			(*dotdot)++;
 		} else if (dep->namelen != 1 || dep->name[0] != '.') {
-			if (cid != NULL) {
-				if (!cid->parent)
-					cid->parent = id;
-				addname_inode(cid, (char *)dep->name,
+			if (cid != NULL)
+				addname_inode(cid, id, (char *)dep->name,
 					dep->namelen);
-			}
 		} else {
 			if (lino != id->ino) {
 				if (!sflag || v)
@@ -2937,7 +3173,9 @@ process_inode(
 		break;
 	}
 
+	lock_inode(id);
 	id->isreflink = !!(diflags2 & XFS_DIFLAG2_REFLINK);
+	unlock_inode(id);
 	setlink_inode(id, nlink, type == DBM_DIR, security);
 
 	switch (dip->di_format) {
@@ -3752,9 +3990,8 @@ process_sf_dir_v2(
 			error++;
 		} else {
 			addlink_inode(cid);
-			if (!cid->parent)
-				cid->parent = id;
-			addname_inode(cid, (char *)sfe->name, sfe->namelen);
+			addname_inode(cid, id, (char *)sfe->name,
+					sfe->namelen);
 		}
 		if (v)
 			dbprintf(_("dir %lld entry %*.*s offset %d %lld\n"),
@@ -3822,12 +4059,14 @@ quota_add(
 	xfs_qcnt_t	ic,
 	xfs_qcnt_t	rc)
 {
+	pthread_mutex_lock(&check_lock);
 	if (qudo && usrid != NULL)
 		quota_add1(qudata, *usrid, dq, bc, ic, rc);
 	if (qgdo && grpid != NULL)
 		quota_add1(qgdata, *grpid, dq, bc, ic, rc);
 	if (qpdo && prjid != NULL)
 		quota_add1(qpdata, *prjid, dq, bc, ic, rc);
+	pthread_mutex_unlock(&check_lock);
 }
 
 static void
@@ -4918,19 +5157,25 @@ set_inomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
-	if (!check_inomap(agno, agbno, len, id->ino))
+	if (!check_range(agno, agbno, len))  {
+		dbprintf(_("blocks %u/%u..%u claimed by inode %lld\n"),
+			agno, agbno, agbno + len - 1, id->ino);
 		return;
+	}
+	lock_ag(agno);
+	if (!check_inomap(agno, agbno, len, id->ino))
+		goto out_unlock;
+	runmap_set(inomap[agno], agbno, len, (uintptr_t)id);
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		*idp = id;
-		if (mayprint &&
-		    (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i))
 			dbprintf(_("setting inode to %lld for block %u/%u\n"),
 				id->ino, agno, agbno + i);
 	}
+out_unlock:
+	unlock_ag(agno);
 }
 
 static void
@@ -4949,20 +5194,20 @@ set_rinomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
+	lock_ag(mp->m_sb.sb_agcount);
 	if (!check_rinomap(bno, len, id->ino))
-		return;
+		goto out_unlock;
+	runmap_set(inomap[mp->m_sb.sb_agcount], bno, len, (uintptr_t)id);
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		*idp = id;
-		if (mayprint && (verbose || id->ilist || CHECK_BLIST(bno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLIST(bno + i))
 			dbprintf(_("setting inode to %lld for rtblock %llu\n"),
 				id->ino, bno + i);
 	}
+out_unlock:
+	unlock_ag(mp->m_sb.sb_agcount);
 }
 
 static void
@@ -4972,9 +5217,11 @@ setlink_inode(
 	int		isdir,
 	int		security)
 {
+	lock_inode(id);
 	id->link_set = nlink;
 	id->isdir = isdir;
 	id->security = security;
+	unlock_inode(id);
 	if (verbose || id->ilist)
 		dbprintf(_("inode %lld nlink %u %s dir\n"), id->ino, nlink,
 			isdir ? "is" : "not");
@@ -31,6 +31,7 @@
 #include "metadump.h"
 #include "output.h"
 #include "print.h"
+#include "profile.h"
 #include "quit.h"
 #include "sb.h"
 #include "write.h"
@@ -66,6 +67,8 @@ command(
 {
 	char		*cmd;
 	const cmdinfo_t	*ct;
+	struct profile_snap ps;
+	int		done;
 
 	cmd = argv[0];
 	ct = find_command(cmd);
@@ -85,7 +88,13 @@ command(
 		return 0;
 	}
 	platform_getoptreset();
-	return ct->cfunc(argc, argv);
+	if (!profiling)
+		return ct->cfunc(argc, argv);
+
+	profile_begin(&ps);
+	done = ct->cfunc(argc, argv);
+	profile_end(ct->name, &ps);
+	return done;
 }
 
 const cmdinfo_t *
@@ -122,6 +131,7 @@ init_commands(void)
 	frag_init();
 	freesp_init();
 	fsmap_init();
+	fsusage_init();
 	help_init();
 	hash_init();
 	info_init();
@@ -134,6 +144,7 @@ init_commands(void)
 	namei_init();
 	output_init();
 	print_init();
+	profile_init();
 	quit_init();
 	sb_init();
 	type_init();
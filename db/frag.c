@@ -14,6 +14,7 @@
 #include "type.h"
 #include "init.h"
 #include "malloc.h"
+#include "libfrog/convert.h"
 
 typedef struct extent {
 	xfs_fileoff_t	startoff;
@@ -30,14 +31,20 @@ typedef	struct extmap {
 
 static int		aflag;
 static int		dflag;
-static uint64_t	extcount_actual;
-static uint64_t	extcount_ideal;
+static __thread uint64_t extcount_actual;
+static __thread uint64_t extcount_ideal;
 static int		fflag;
 static int		lflag;
 static int		qflag;
 static int		Rflag;
 static int		rflag;
 static int		vflag;
+static unsigned int	nr_threads;
+
+/* Extent counts of all AGs scanned so far. */
+static pthread_mutex_t	frag_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t		total_actual;
+static uint64_t		total_ideal;
 
 typedef void	(*scan_lbtree_f_t)(struct xfs_btree_block *block,
 				   int			level,
@@ -77,7 +84,7 @@ static void		scanfunc_ino(struct xfs_btree_block *block, int level,
 
 static const cmdinfo_t	frag_cmd =
 	{ "frag", NULL, frag_f, 0, -1, 0,
-	  "[-a] [-d] [-f] [-l] [-q] [-R] [-r] [-v]",
+	  "[-a] [-d] [-f] [-l] [-q] [-R] [-r] [-v] [-T threads]",
 	  "get file fragmentation data", NULL };
 
 static extmap_t *
@@ -138,6 +145,31 @@ frag_init(void)
 	add_command(&frag_cmd);
 }
 
+static void
+scan_ag_worker(
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	extcount_actual = extcount_ideal = 0;
+	scan_ag(agno);
+
+	pthread_mutex_lock(&frag_lock);
+	total_actual += extcount_actual;
+	total_ideal += extcount_ideal;
+	pthread_mutex_unlock(&frag_lock);
+}
+
+/*
+ * Scan the AGs several at a time.  Each AG's inodes are independent of the
+ * others, so all the threads share is the totals.
+ */
+static void
+scan_all_ags(void)
+{
+	/* per-inode output is only useful in inode order */
+	scan_ags_threaded(vflag ? 1 : nr_threads, scan_ag_worker, NULL);
+}
+
 /*
  * Get file fragmentation information.
  */
@@ -146,22 +178,20 @@ frag_f(
 	int		argc,
 	char		**argv)
 {
-	xfs_agnumber_t	agno;
 	double		answer;
 
 	if (!init(argc, argv))
 		return 0;
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		scan_ag(agno);
-	if (extcount_actual)
-		answer = (double)(extcount_actual - extcount_ideal) * 100.0 /
-			 (double)extcount_actual;
+	scan_all_ags();
+	if (total_actual)
+		answer = (double)(total_actual - total_ideal) * 100.0 /
+			 (double)total_actual;
 	else
 		answer = 0.0;
 	dbprintf(_("actual %llu, ideal %llu, fragmentation factor %.2f%%\n"),
-		extcount_actual, extcount_ideal, answer);
+		total_actual, total_ideal, answer);
 	dbprintf(_("Note, this number is largely meaningless.\n"));
-	answer = (double)extcount_actual / (double)extcount_ideal;
+	answer = (double)total_actual / (double)total_ideal;
 	dbprintf(_("Files on this filesystem average %.2f extents per file\n"),
 		answer);
 	return 0;
@@ -175,8 +205,9 @@ init(
 	int		c;
 
 	aflag = dflag = fflag = lflag = qflag = Rflag = rflag = vflag = 0;
+	nr_threads = 0;
 	optind = 0;
-	while ((c = getopt(argc, argv, "adflqRrv")) != EOF) {
+	while ((c = getopt(argc, argv, "adflqRrT:v")) != EOF) {
 		switch (c) {
 		case 'a':
 			aflag = 1;
@@ -199,6 +230,13 @@ init(
 		case 'r':
 			rflag = 1;
 			break;
+		case 'T':
+			nr_threads = cvt_u32(optarg, 0);
+			if (errno || !nr_threads) {
+				dbprintf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			break;
 		case 'v':
 			vflag = 1;
 			break;
@@ -209,7 +247,7 @@ init(
 	}
 	if (!aflag && !dflag && !fflag && !lflag && !qflag && !Rflag && !rflag)
 		aflag = dflag = fflag = lflag = qflag = Rflag = rflag = 1;
-	extcount_actual = extcount_ideal = 0;
+	total_actual = total_ideal = 0;
 	return 1;
 }
 
@@ -249,6 +287,9 @@ process_btinode(
 	}
 	pp = XFS_BMDR_PTR_ADDR(dib, 1,
 		libxfs_bmdr_maxrecs(XFS_DFORK_SIZE(dip, mp, whichfork), 0));
+	for (i = 0; i < be16_to_cpu(dib->bb_numrecs); i++)
+		readahead_blocks(XFS_FSB_TO_DADDR(mp,
+				get_unaligned_be64(&pp[i])), blkbb);
 	for (i = 0; i < be16_to_cpu(dib->bb_numrecs); i++)
 		scan_lbtree(get_unaligned_be64(&pp[i]),
 			 be16_to_cpu(dib->bb_level), scanfunc_bmap, extmapp,
@@ -448,6 +489,9 @@ scanfunc_bmap(
 		return;
 	}
 	pp = XFS_BMBT_PTR_ADDR(mp, block, 1, mp->m_bmap_dmxr[0]);
+	for (i = 0; i < nrecs; i++)
+		readahead_blocks(XFS_FSB_TO_DADDR(mp, be64_to_cpu(pp[i])),
+				blkbb);
 	for (i = 0; i < nrecs; i++)
 		scan_lbtree(be64_to_cpu(pp[i]), level, scanfunc_bmap, extmapp,
 									btype);
@@ -483,6 +527,13 @@ scanfunc_ino(
 
 	if (level == 0) {
 		rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+		/* start reading all the inode chunks in this leaf */
+		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++) {
+			agino = be32_to_cpu(rp[i].ir_startino);
+			readahead_blocks(XFS_AGB_TO_DADDR(mp, seqno,
+					XFS_AGINO_TO_AGBNO(mp, agino)),
+					XFS_FSB_TO_BB(mp, igeo->ialloc_blks));
+		}
 		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++) {
 			agino = be32_to_cpu(rp[i].ir_startino);
 			agbno = XFS_AGINO_TO_AGBNO(mp, agino);
@@ -523,6 +574,9 @@ next_buf:
 		return;
 	}
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, igeo->inobt_mxr[1]);
+	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
+		readahead_blocks(XFS_AGB_TO_DADDR(mp, seqno,
+				be32_to_cpu(pp[i])), blkbb);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, scanfunc_ino,
 								TYP_INOBT);
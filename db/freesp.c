@@ -12,6 +12,7 @@
 #include "output.h"
 #include "init.h"
 #include "malloc.h"
+#include "libfrog/convert.h"
 
 typedef struct histent
 {
@@ -51,12 +52,22 @@ static int		histcount;
 static int		multsize;
 static int		seen1;
 static int		summaryflag;
+static unsigned int	nr_threads;
 static long long	totblocks;
 static long long	totexts;
 
+/*
+ * Each thread adds the AG it is scanning to its own copy of the histogram,
+ * which is folded into the totals above when the AG is done.
+ */
+static pthread_mutex_t	freesp_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread histent_t *ag_hist;
+static __thread long long ag_blocks;
+static __thread long long ag_exts;
+
 static const cmdinfo_t	freesp_cmd =
 	{ "freesp", NULL, freesp_f, 0, -1, 0,
-	  "[-bcdfs] [-A alignment] [-a agno]... [-e binsize] [-h h1]... [-m binmult]",
+	  "[-bcdfs] [-A alignment] [-a agno]... [-e binsize] [-h h1]... [-m binmult] [-T threads]",
 	  "summarize free space for filesystem", NULL };
 
 static int
@@ -73,6 +84,46 @@ inaglist(
 	return 0;
 }
 
+static void
+scan_ag_worker(
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	int			i;
+
+	if (!inaglist(agno))
+		return;
+
+	ag_hist = xmalloc(histcount * sizeof(*ag_hist));
+	for (i = 0; i < histcount; i++) {
+		ag_hist[i] = hist[i];
+		ag_hist[i].count = ag_hist[i].blocks = 0;
+	}
+	ag_blocks = ag_exts = 0;
+
+	scan_ag(agno);
+
+	pthread_mutex_lock(&freesp_lock);
+	for (i = 0; i < histcount; i++) {
+		hist[i].count += ag_hist[i].count;
+		hist[i].blocks += ag_hist[i].blocks;
+	}
+	totblocks += ag_blocks;
+	totexts += ag_exts;
+	pthread_mutex_unlock(&freesp_lock);
+
+	xfree(ag_hist);
+	ag_hist = NULL;
+}
+
+/* Scan the selected AGs several at a time. */
+static void
+scan_all_ags(void)
+{
+	/* the extent dump is only useful in disk order */
+	scan_ags_threaded(dumpflag ? 1 : nr_threads, scan_ag_worker, NULL);
+}
+
 /*
  * Report on freespace usage in xfs filesystem.
  */
@@ -81,18 +132,13 @@ freesp_f(
 	int		argc,
 	char		**argv)
 {
-	xfs_agnumber_t	agno;
-
 	if (!init(argc, argv))
 		return 0;
 
 	if (dumpflag)
 		dbprintf("%8s %8s %8s\n", "agno", "agbno", "len");
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)  {
-		if (inaglist(agno))
-			scan_ag(agno);
-	}
+	scan_all_ags();
 	if (histcount)
 		printhist();
 	if (summaryflag) {
@@ -132,11 +178,11 @@ init(
 	int		speced = 0;
 
 	agcount = countflag = dumpflag = equalsize = multsize = optind = 0;
-	histcount = seen1 = summaryflag = 0;
+	histcount = seen1 = summaryflag = nr_threads = 0;
 	totblocks = totexts = 0;
 	aglist = NULL;
 	hist = NULL;
-	while ((c = getopt(argc, argv, "A:a:bcde:h:m:s")) != EOF) {
+	while ((c = getopt(argc, argv, "A:a:bcde:h:m:sT:")) != EOF) {
 		switch (c) {
 		case 'A':
 			alignment = atoi(optarg);
@@ -177,6 +223,13 @@ init(
 		case 's':
 			summaryflag = 1;
 			break;
+		case 'T':
+			nr_threads = cvt_u32(optarg, 0);
+			if (errno || !nr_threads) {
+				dbprintf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			break;
 		default:
 			return usage();
 		}
@@ -193,7 +246,7 @@ static int
 usage(void)
 {
 	dbprintf(_("freesp arguments: [-bcds] [-a agno] [-e binsize] [-h h1]... "
-		 "[-m binmult]\n"));
+		 "[-m binmult] [-T threads]\n"));
 	return 0;
 }
 
@@ -278,6 +331,21 @@ scan_sbtree(
 	pop_cur();
 }
 
+/* Start reading all the children of a node before we visit the first. */
+static void
+readahead_ptrs(
+	xfs_agf_t	*agf,
+	xfs_alloc_ptr_t	*pp,
+	int		nrecs)
+{
+	xfs_agnumber_t	seqno = be32_to_cpu(agf->agf_seqno);
+	int		i;
+
+	for (i = 0; i < nrecs; i++)
+		readahead_blocks(XFS_AGB_TO_DADDR(mp, seqno,
+				be32_to_cpu(pp[i])), blkbb);
+}
+
 /*ARGSUSED*/
 static void
 scanfunc_bno(
@@ -303,6 +371,7 @@ scanfunc_bno(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	readahead_ptrs(agf, pp, be16_to_cpu(block->bb_numrecs));
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), typ, level, scanfunc_bno);
 }
@@ -331,6 +400,7 @@ scanfunc_cnt(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	readahead_ptrs(agf, pp, be16_to_cpu(block->bb_numrecs));
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), typ, level, scanfunc_cnt);
 }
@@ -355,21 +425,29 @@ addtohist(
 	xfs_agblock_t	agbno,
 	xfs_extlen_t	len)
 {
-	int		i;
+	int		i, lo, hi;
 
 	if (alignment && (XFS_AGB_TO_FSB(mp,agno,agbno) % alignment))
 		return;
 
 	if (dumpflag)
 		dbprintf("%8d %8d %8d\n", agno, agbno, len);
-	totexts++;
-	totblocks += len;
-	for (i = 0; i < histcount; i++) {
-		if (hist[i].high >= len) {
-			hist[i].count++;
-			hist[i].blocks += len;
-			break;
-		}
+	ag_exts++;
+	ag_blocks += len;
+
+	/* the bins are sorted, so find the first one that @len fits in */
+	lo = 0;
+	hi = histcount;
+	while (lo < hi) {
+		i = (lo + hi) / 2;
+		if (ag_hist[i].high >= len)
+			hi = i;
+		else
+			lo = i + 1;
+	}
+	if (lo < histcount) {
+		ag_hist[lo].count++;
+		ag_hist[lo].blocks += len;
 	}
 }
 
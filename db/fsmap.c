@@ -4,102 +4,328 @@
  * Author: Darrick J. Wong <darrick.wong@oracle.com>
  */
 #include "libxfs.h"
+#include <stdarg.h>
 #include "command.h"
 #include "fsmap.h"
 #include "output.h"
 #include "init.h"
+#include "malloc.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/convert.h"
 
-struct fsmap_info {
+/*
+ * Each AG in the range is queried by a worker thread, which spools the
+ * mappings it finds to a temporary file.  The command thread prints the
+ * spools in AG order as they complete, so the output is the same as if the
+ * AGs had been done one after the other, but the btree walks overlap.  AGs
+ * are only queued up to one per thread ahead of the one being printed, and
+ * each spool is closed once printed, so the number of open spools does not
+ * grow with the AG count.
+ */
+struct fsmap_ag {
+	FILE			*spool;
 	unsigned long long	nr;
-	xfs_agnumber_t		agno;
+	int			error;
+	const char		*what;		/* what failed */
+	bool			done;
+};
+
+/*
+ * Binary output: a header, then one fixed size record per mapping, all
+ * big-endian like everything else on disk.
+ */
+#define FSMAP_BIN_MAGIC		"XFSFSMAP"
+#define FSMAP_BIN_VERSION	1
+
+struct fsmap_bin_head {
+	char			magic[8];
+	__be32			version;
+	__be32			blocksize;
+	__be32			agcount;
+	__be32			agblocks;
 };
 
+#define FSMAP_BIN_BMBT		(1U << 0)
+#define FSMAP_BIN_ATTRFORK	(1U << 1)
+#define FSMAP_BIN_UNWRITTEN	(1U << 2)
+
+struct fsmap_bin_rec {
+	__be32			agno;
+	__be32			agbno;
+	__be32			len;
+	__be32			flags;
+	__be64			owner;
+	__be64			offset;
+};
+
+static struct fsmap_ag		*fsmap_ags;
+static struct xfs_rmap_irec	fsmap_low, fsmap_high;
+static xfs_agnumber_t		fsmap_start_ag, fsmap_end_ag;
+static pthread_mutex_t		fsmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		fsmap_done = PTHREAD_COND_INITIALIZER;
+
 static int
 fsmap_fn(
 	struct xfs_btree_cur		*cur,
 	const struct xfs_rmap_irec	*rec,
 	void				*priv)
 {
-	struct fsmap_info		*info = priv;
+	struct fsmap_ag			*fa = priv;
+
+	if (fwrite(rec, sizeof(*rec), 1, fa->spool) != 1)
+		return -errno;
+	fa->nr++;
+	return 0;
+}
+
+static void
+fsmap_ag_worker(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct fsmap_ag		*fa = &fsmap_ags[agno - fsmap_start_ag];
+	struct xfs_rmap_irec	low = fsmap_low;
+	struct xfs_rmap_irec	high = fsmap_high;
+	struct xfs_btree_cur	*bt_cur;
+	struct xfs_buf		*agbp;
+	struct xfs_perag	*pag;
+	int			error;
+
+	if (agno != fsmap_start_ag)
+		low.rm_startblock = 0;
+	if (agno != fsmap_end_ag)
+		high.rm_startblock = -1U;
+
+	pag = libxfs_perag_get(mp, agno);
+	fa->spool = tmpfile();
+	if (!fa->spool) {
+		fa->error = errno;
+		fa->what = _("creating a spool file");
+		goto out;
+	}
+
+	error = -libxfs_alloc_read_agf(pag, NULL, 0, &agbp);
+	if (error) {
+		fa->error = error;
+		fa->what = _("reading AGF");
+		goto out;
+	}
+
+	bt_cur = libxfs_rmapbt_init_cursor(mp, NULL, agbp, pag);
+	if (!bt_cur) {
+		libxfs_buf_relse(agbp);
+		fa->error = ENOMEM;
+		fa->what = _("creating a btree cursor");
+		goto out;
+	}
+
+	error = -libxfs_rmap_query_range(bt_cur, &low, &high, fsmap_fn, fa);
+	libxfs_btree_del_cursor(bt_cur,
+			error ? XFS_BTREE_ERROR : XFS_BTREE_NOERROR);
+	libxfs_buf_relse(agbp);
+	if (error) {
+		fa->error = error;
+		fa->what = _("querying fsmap btree");
+		goto out;
+	}
+	if (fflush(fa->spool) || fseeko(fa->spool, 0, SEEK_SET)) {
+		fa->error = errno;
+		fa->what = _("writing the spool file");
+	}
+out:
+	libxfs_perag_put(pag);
+	pthread_mutex_lock(&fsmap_lock);
+	fa->done = true;
+	pthread_cond_broadcast(&fsmap_done);
+	pthread_mutex_unlock(&fsmap_lock);
+}
+
+/* With -b, stdout carries the binary records, so complain on stderr. */
+static void
+fsmap_error(
+	bool			binary,
+	const char		*fmt,
+	...)
+{
+	char			msg[256];
+	va_list			ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (binary)
+		fputs(msg, stderr);
+	else
+		dbprintf("%s", msg);
+}
+
+/* Print one mapping; returns zero or the error writing binary output. */
+static int
+fsmap_print(
+	xfs_agnumber_t		agno,
+	struct xfs_rmap_irec	*rec,
+	unsigned long long	nr,
+	bool			binary)
+{
+	struct fsmap_bin_rec	brec;
+	unsigned int		flags = 0;
 
-	dbprintf(_("%llu: %u/%u len %u owner %lld offset %llu bmbt %d attrfork %d extflag %d\n"),
-		info->nr, info->agno, rec->rm_startblock,
-		rec->rm_blockcount, rec->rm_owner, rec->rm_offset,
-		!!(rec->rm_flags & XFS_RMAP_BMBT_BLOCK),
-		!!(rec->rm_flags & XFS_RMAP_ATTR_FORK),
-		!!(rec->rm_flags & XFS_RMAP_UNWRITTEN));
-	info->nr++;
+	if (!binary) {
+		dbprintf(_("%llu: %u/%u len %u owner %lld offset %llu bmbt %d attrfork %d extflag %d\n"),
+			nr, agno, rec->rm_startblock,
+			rec->rm_blockcount, rec->rm_owner, rec->rm_offset,
+			!!(rec->rm_flags & XFS_RMAP_BMBT_BLOCK),
+			!!(rec->rm_flags & XFS_RMAP_ATTR_FORK),
+			!!(rec->rm_flags & XFS_RMAP_UNWRITTEN));
+		return 0;
+	}
 
+	if (rec->rm_flags & XFS_RMAP_BMBT_BLOCK)
+		flags |= FSMAP_BIN_BMBT;
+	if (rec->rm_flags & XFS_RMAP_ATTR_FORK)
+		flags |= FSMAP_BIN_ATTRFORK;
+	if (rec->rm_flags & XFS_RMAP_UNWRITTEN)
+		flags |= FSMAP_BIN_UNWRITTEN;
+	brec.agno = cpu_to_be32(agno);
+	brec.agbno = cpu_to_be32(rec->rm_startblock);
+	brec.len = cpu_to_be32(rec->rm_blockcount);
+	brec.flags = cpu_to_be32(flags);
+	brec.owner = cpu_to_be64(rec->rm_owner);
+	brec.offset = cpu_to_be64(rec->rm_offset);
+	if (fwrite(&brec, sizeof(brec), 1, stdout) != 1)
+		return errno ? errno : EIO;
 	return 0;
 }
 
+/* Start the query of an AG; a failure to queue it shows up as its error. */
+static void
+fsmap_queue_ag(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno)
+{
+	struct fsmap_ag		*fa = &fsmap_ags[agno - fsmap_start_ag];
+	int			error;
+
+	error = -workqueue_add(wq, fsmap_ag_worker, agno, NULL);
+	if (error) {
+		pthread_mutex_lock(&fsmap_lock);
+		fa->error = error;
+		fa->what = _("starting the query");
+		fa->done = true;
+		pthread_mutex_unlock(&fsmap_lock);
+	}
+}
+
 static void
 fsmap(
 	xfs_fsblock_t		start_fsb,
-	xfs_fsblock_t		end_fsb)
+	xfs_fsblock_t		end_fsb,
+	unsigned int		threads,
+	bool			binary)
 {
-	struct fsmap_info	info;
-	xfs_agnumber_t		start_ag;
-	xfs_agnumber_t		end_ag;
+	struct workqueue	wq;
+	struct fsmap_bin_head	head;
+	struct xfs_rmap_irec	rec;
+	struct fsmap_ag		*fa;
+	unsigned long long	nr = 0;
+	xfs_agnumber_t		nr_ags, agno, next_ag;
 	xfs_daddr_t		eofs;
-	struct xfs_rmap_irec	low = {0};
-	struct xfs_rmap_irec	high = {0};
-	struct xfs_btree_cur	*bt_cur;
-	struct xfs_buf		*agbp;
-	struct xfs_perag	*pag;
+	bool			failed = false;
+	bool			locking;
 	int			error;
 
 	eofs = XFS_FSB_TO_BB(mp, mp->m_sb.sb_dblocks);
 	if (XFS_FSB_TO_DADDR(mp, end_fsb) >= eofs)
 		end_fsb = XFS_DADDR_TO_FSB(mp, eofs - 1);
 
-	low.rm_startblock = XFS_FSB_TO_AGBNO(mp, start_fsb);
-	high.rm_startblock = -1U;
-	high.rm_owner = ULLONG_MAX;
-	high.rm_offset = ULLONG_MAX;
-	high.rm_flags = XFS_RMAP_ATTR_FORK | XFS_RMAP_BMBT_BLOCK | XFS_RMAP_UNWRITTEN;
-
-	start_ag = XFS_FSB_TO_AGNO(mp, start_fsb);
-	end_ag = XFS_FSB_TO_AGNO(mp, end_fsb);
-
-	info.nr = 0;
-	for_each_perag_range(mp, start_ag, end_ag, pag) {
-		if (pag->pag_agno == end_ag)
-			high.rm_startblock = XFS_FSB_TO_AGBNO(mp, end_fsb);
-
-		error = -libxfs_alloc_read_agf(pag, NULL, 0, &agbp);
-		if (error) {
-			libxfs_perag_put(pag);
-			dbprintf(_("Error %d while reading AGF.\n"), error);
-			return;
-		}
+	memset(&fsmap_low, 0, sizeof(fsmap_low));
+	memset(&fsmap_high, 0, sizeof(fsmap_high));
+	fsmap_low.rm_startblock = XFS_FSB_TO_AGBNO(mp, start_fsb);
+	fsmap_high.rm_startblock = XFS_FSB_TO_AGBNO(mp, end_fsb);
+	fsmap_high.rm_owner = ULLONG_MAX;
+	fsmap_high.rm_offset = ULLONG_MAX;
+	fsmap_high.rm_flags = XFS_RMAP_ATTR_FORK | XFS_RMAP_BMBT_BLOCK |
+			      XFS_RMAP_UNWRITTEN;
 
-		bt_cur = libxfs_rmapbt_init_cursor(mp, NULL, agbp, pag);
-		if (!bt_cur) {
-			libxfs_buf_relse(agbp);
-			libxfs_perag_put(pag);
-			dbprintf(_("Not enough memory.\n"));
-			return;
-		}
+	fsmap_start_ag = XFS_FSB_TO_AGNO(mp, start_fsb);
+	fsmap_end_ag = XFS_FSB_TO_AGNO(mp, end_fsb);
+	if (fsmap_end_ag < fsmap_start_ag)
+		return;
+	nr_ags = fsmap_end_ag - fsmap_start_ag + 1;
+
+	if (!threads)
+		threads = platform_nproc();
+	threads = min(threads, nr_ags);
 
-		info.agno = pag->pag_agno;
-		error = -libxfs_rmap_query_range(bt_cur, &low, &high,
-				fsmap_fn, &info);
-		if (error) {
-			libxfs_btree_del_cursor(bt_cur, XFS_BTREE_ERROR);
-			libxfs_buf_relse(agbp);
-			libxfs_perag_put(pag);
-			dbprintf(_("Error %d while querying fsmap btree.\n"),
-				error);
-			return;
+	fsmap_ags = xcalloc(nr_ags, sizeof(*fsmap_ags));
+	/* the threads share the buffer cache */
+	locking = libxfs_buf_set_locking(threads > 1);
+	error = -workqueue_create(&wq, NULL, threads);
+	if (error) {
+		fsmap_error(binary, _("cannot create fsmap threads: %s\n"),
+				strerror(error));
+		goto out;
+	}
+
+	if (binary) {
+		memcpy(head.magic, FSMAP_BIN_MAGIC, sizeof(head.magic));
+		head.version = cpu_to_be32(FSMAP_BIN_VERSION);
+		head.blocksize = cpu_to_be32(mp->m_sb.sb_blocksize);
+		head.agcount = cpu_to_be32(mp->m_sb.sb_agcount);
+		head.agblocks = cpu_to_be32(mp->m_sb.sb_agblocks);
+		if (fwrite(&head, sizeof(head), 1, stdout) != 1) {
+			fsmap_error(binary, _("Error %d while %s.\n"),
+					errno ? errno : EIO,
+					_("writing binary output"));
+			failed = true;
 		}
+	}
 
-		libxfs_btree_del_cursor(bt_cur, XFS_BTREE_NOERROR);
-		libxfs_buf_relse(agbp);
+	/* print each AG as soon as it and all the ones before it are done */
+	next_ag = fsmap_start_ag;
+	for (agno = fsmap_start_ag; agno <= fsmap_end_ag && !failed; agno++) {
+		while (next_ag <= fsmap_end_ag && next_ag - agno < threads)
+			fsmap_queue_ag(&wq, next_ag++);
+
+		fa = &fsmap_ags[agno - fsmap_start_ag];
+		pthread_mutex_lock(&fsmap_lock);
+		while (!fa->done)
+			pthread_cond_wait(&fsmap_done, &fsmap_lock);
+		pthread_mutex_unlock(&fsmap_lock);
 
-		if (pag->pag_agno == start_ag)
-			low.rm_startblock = 0;
+		if (fa->error) {
+			fsmap_error(binary, _("Error %d while %s.\n"),
+					fa->error, fa->what);
+			failed = true;
+			break;
+		}
+		while (fread(&rec, sizeof(rec), 1, fa->spool) == 1) {
+			error = fsmap_print(agno, &rec, nr++, binary);
+			if (error) {
+				fsmap_error(binary, _("Error %d while %s.\n"),
+						error,
+						_("writing binary output"));
+				failed = true;
+				break;
+			}
+		}
+		fclose(fa->spool);
+		fa->spool = NULL;
 	}
+	if (fflush(stdout) && binary && !failed)
+		fsmap_error(binary, _("Error %d while %s.\n"), errno,
+				_("writing binary output"));
+
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+out:
+	libxfs_buf_set_locking(locking);
+	for (agno = 0; agno < nr_ags; agno++)
+		if (fsmap_ags[agno].spool)
+			fclose(fsmap_ags[agno].spool);
+	xfree(fsmap_ags);
+	fsmap_ags = NULL;
 }
 
 static int
@@ -111,24 +337,42 @@ fsmap_f(
 	int			c;
 	xfs_fsblock_t		start_fsb = 0;
 	xfs_fsblock_t		end_fsb = NULLFSBLOCK;
+	unsigned int		threads = 0;
+	bool			binary = false;
 
-	if (!xfs_has_rmapbt(mp)) {
-		dbprintf(_("Filesystem does not support reverse mapping btree.\n"));
-		return 0;
-	}
-
-	while ((c = getopt(argc, argv, "")) != EOF) {
+	optind = 0;
+	while ((c = getopt(argc, argv, "bT:")) != EOF) {
 		switch (c) {
+		case 'b':
+			binary = true;
+			break;
+		case 'T':
+			threads = cvt_u32(optarg, 0);
+			if (errno || !threads) {
+				fsmap_error(binary,
+						_("Bad fsmap thread count %s.\n"),
+						optarg);
+				return 0;
+			}
+			break;
 		default:
-			dbprintf(_("Bad option for fsmap command.\n"));
+			fsmap_error(binary,
+					_("Bad option for fsmap command.\n"));
 			return 0;
 		}
 	}
 
+	if (!xfs_has_rmapbt(mp)) {
+		fsmap_error(binary,
+	_("Filesystem does not support reverse mapping btree.\n"));
+		return 0;
+	}
+
 	if (argc > optind) {
 		start_fsb = strtoull(argv[optind], &p, 0);
 		if (*p != '\0' || start_fsb >= mp->m_sb.sb_dblocks) {
-			dbprintf(_("Bad fsmap start_fsb %s.\n"), argv[optind]);
+			fsmap_error(binary, _("Bad fsmap start_fsb %s.\n"),
+					argv[optind]);
 			return 0;
 		}
 	}
@@ -136,19 +380,26 @@ fsmap_f(
 	if (argc > optind + 1) {
 		end_fsb = strtoull(argv[optind + 1], &p, 0);
 		if (*p != '\0') {
-			dbprintf(_("Bad fsmap end_fsb %s.\n"), argv[optind + 1]);
+			fsmap_error(binary, _("Bad fsmap end_fsb %s.\n"),
+					argv[optind + 1]);
 			return 0;
 		}
 	}
 
-	fsmap(start_fsb, end_fsb);
+	if (argc > optind + 2) {
+		fsmap_error(binary,
+				_("Too many arguments for fsmap command.\n"));
+		return 0;
+	}
+
+	fsmap(start_fsb, end_fsb, threads, binary);
 
 	return 0;
 }
 
 static const cmdinfo_t	fsmap_cmd =
-	{ "fsmap", NULL, fsmap_f, 0, 2, 0,
-	  N_("[start_fsb] [end_fsb]"),
+	{ "fsmap", NULL, fsmap_f, 0, -1, 0,
+	  N_("[-b] [-T threads] [start_fsb] [end_fsb]"),
 	  N_("display reverse mapping(s)"), NULL };
 
 void
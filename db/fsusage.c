@@ -0,0 +1,871 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Offline space accounting: how much space each user, group and project
+ * owns and how it is spread over file sizes, gathered in one pass over the
+ * inode btrees and block maps of an unmounted filesystem or metadump image.
+ */
+
+#include "libxfs.h"
+#include "bmap.h"
+#include "command.h"
+#include "io.h"
+#include "output.h"
+#include "type.h"
+#include "init.h"
+#include "malloc.h"
+#include "libfrog/convert.h"
+
+/* Space counts, all but inodes in filesystem blocks. */
+struct usage {
+	uint64_t		inodes;
+	uint64_t		blocks;		/* everything, as in di_nblocks */
+	uint64_t		extents;	/* data fork mappings */
+	uint64_t		written;	/* data fork blocks with data */
+	uint64_t		unwritten;	/* preallocated data fork blocks */
+	uint64_t		sparse;		/* holes below EOF */
+	uint64_t		shared;		/* data blocks shared by reflink */
+};
+
+struct usage_ent {
+	uint32_t		id;
+	bool			used;
+	struct usage		u;
+};
+
+/* Usage by user, group or project id; open addressing, linear probing. */
+struct usage_tab {
+	unsigned int		size;		/* power of two */
+	unsigned int		nr;
+	struct usage_ent	*ents;
+};
+
+/* Files of size zero, then one class per power of two. */
+#define NR_SIZE_CLASSES		65
+
+struct usage_set {
+	struct usage		total;
+	struct usage_tab	users;
+	struct usage_tab	groups;
+	struct usage_tab	projects;
+	struct usage		sizes[NR_SIZE_CLASSES];
+};
+
+/* What we are adding up for the inode being looked at. */
+struct inode_usage {
+	struct usage		u;
+	xfs_fileoff_t		eof;		/* blocks below EOF */
+	xfs_filblks_t		mapped;		/* of which are mapped */
+	bool			reflink;
+};
+
+/* A range of an AG that more than one file owns. */
+struct shared_ext {
+	xfs_agblock_t		start;
+	xfs_extlen_t		len;
+};
+
+struct shared_ag {
+	unsigned int		nr;
+	unsigned int		max;
+	struct shared_ext	*exts;
+};
+
+enum { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+static int			uflag, gflag, pflag, sflag;
+static int			format;
+static unsigned int		nr_threads;
+static struct shared_ag		*shared;
+static struct usage_set		totals;
+static pthread_mutex_t		usage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int	fsusage_f(int argc, char **argv);
+
+static const cmdinfo_t	fsusage_cmd =
+	{ "fsusage", NULL, fsusage_f, 0, -1, 0,
+	  "[-ugps] [-c|-j] [-T threads]",
+	  "report space used by owner, project and file size", NULL };
+
+static void
+usage_add(
+	struct usage		*to,
+	const struct usage	*from)
+{
+	to->inodes += from->inodes;
+	to->blocks += from->blocks;
+	to->extents += from->extents;
+	to->written += from->written;
+	to->unwritten += from->unwritten;
+	to->sparse += from->sparse;
+	to->shared += from->shared;
+}
+
+static struct usage *
+usage_tab_get(
+	struct usage_tab	*t,
+	uint32_t		id)
+{
+	unsigned int		i;
+
+	if ((t->nr + 1) * 2 > t->size) {
+		struct usage_tab	old = *t;
+
+		t->size = max(old.size * 2, 64U);
+		t->nr = 0;
+		t->ents = xcalloc(t->size, sizeof(*t->ents));
+		for (i = 0; i < old.size; i++)
+			if (old.ents[i].used)
+				*usage_tab_get(t, old.ents[i].id) =
+						old.ents[i].u;
+		xfree(old.ents);
+	}
+
+	for (i = (id * 2654435761U) & (t->size - 1);
+	     t->ents[i].used;
+	     i = (i + 1) & (t->size - 1)) {
+		if (t->ents[i].id == id)
+			return &t->ents[i].u;
+	}
+	t->ents[i].used = true;
+	t->ents[i].id = id;
+	t->nr++;
+	return &t->ents[i].u;
+}
+
+static void
+usage_tab_merge(
+	struct usage_tab	*to,
+	struct usage_tab	*from)
+{
+	unsigned int		i;
+
+	for (i = 0; i < from->size; i++)
+		if (from->ents[i].used)
+			usage_add(usage_tab_get(to, from->ents[i].id),
+					&from->ents[i].u);
+}
+
+static void
+usage_set_free(
+	struct usage_set	*set)
+{
+	xfree(set->users.ents);
+	xfree(set->groups.ents);
+	xfree(set->projects.ents);
+	memset(set, 0, sizeof(*set));
+}
+
+static inline int
+size_class(
+	uint64_t		size)
+{
+	return size ? libxfs_highbit64(size) + 1 : 0;
+}
+
+/* Number of blocks in the range that some other file maps as well. */
+static xfs_filblks_t
+shared_blocks(
+	xfs_fsblock_t		fsbno,
+	xfs_filblks_t		len)
+{
+	xfs_agnumber_t		agno = XFS_FSB_TO_AGNO(mp, fsbno);
+	xfs_agblock_t		agbno = XFS_FSB_TO_AGBNO(mp, fsbno);
+	xfs_agblock_t		end = agbno + len;
+	struct shared_ag	*sa;
+	struct shared_ext	*se;
+	unsigned int		lo, hi, mid;
+	xfs_filblks_t		count = 0;
+
+	if (agno >= mp->m_sb.sb_agcount)
+		return 0;
+	sa = &shared[agno];
+
+	/* first shared extent ending after @agbno */
+	lo = 0;
+	hi = sa->nr;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (sa->exts[mid].start + sa->exts[mid].len <= agbno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (se = &sa->exts[lo]; se < &sa->exts[sa->nr] && se->start < end;
+	     se++)
+		count += min(se->start + se->len, end) - max(se->start, agbno);
+	return count;
+}
+
+static void
+account_extents(
+	struct inode_usage	*iu,
+	xfs_bmbt_rec_t		*rp,
+	int			nrecs)
+{
+	xfs_fileoff_t		o;
+	xfs_fsblock_t		s;
+	xfs_filblks_t		c;
+	int			f;
+	int			i;
+
+	for (i = 0; i < nrecs; i++) {
+		convert_extent(&rp[i], &o, &s, &c, &f);
+		iu->u.extents++;
+		if (f)
+			iu->u.unwritten += c;
+		else
+			iu->u.written += c;
+		if (o < iu->eof)
+			iu->mapped += min(c, iu->eof - o);
+		if (iu->reflink)
+			iu->u.shared += shared_blocks(s, c);
+	}
+}
+
+static bool
+fsbno_ok(
+	xfs_fsblock_t		fsbno)
+{
+	return XFS_FSB_TO_AGNO(mp, fsbno) < mp->m_sb.sb_agcount &&
+	       XFS_FSB_TO_AGBNO(mp, fsbno) < mp->m_sb.sb_agblocks;
+}
+
+static void
+scan_bmbt(
+	struct inode_usage	*iu,
+	xfs_fsblock_t		bno,
+	int			level)
+{
+	struct xfs_btree_block	*block;
+	xfs_bmbt_ptr_t		*pp;
+	int			nrecs;
+	int			i;
+
+	if (!fsbno_ok(bno))
+		return;
+	push_cur();
+	set_cur(&typtab[TYP_BMAPBTD], XFS_FSB_TO_DADDR(mp, bno), blkbb,
+		DB_RING_IGN, NULL);
+	block = iocur_top->data;
+	if (!block) {
+		dbprintf(_("can't read btree block %u/%u\n"),
+			XFS_FSB_TO_AGNO(mp, bno), XFS_FSB_TO_AGBNO(mp, bno));
+		goto out;
+	}
+	nrecs = be16_to_cpu(block->bb_numrecs);
+	if (be16_to_cpu(block->bb_level) != level ||
+	    nrecs > mp->m_bmap_dmxr[level != 0])
+		goto out;
+
+	if (level == 0) {
+		account_extents(iu, XFS_BMBT_REC_ADDR(mp, block, 1), nrecs);
+		goto out;
+	}
+	pp = XFS_BMBT_PTR_ADDR(mp, block, 1, mp->m_bmap_dmxr[1]);
+	for (i = 0; i < nrecs; i++)
+		if (fsbno_ok(be64_to_cpu(pp[i])))
+			readahead_blocks(XFS_FSB_TO_DADDR(mp,
+					be64_to_cpu(pp[i])), blkbb);
+	for (i = 0; i < nrecs; i++)
+		scan_bmbt(iu, be64_to_cpu(pp[i]), level - 1);
+out:
+	pop_cur();
+}
+
+static void
+scan_data_fork(
+	struct inode_usage	*iu,
+	struct xfs_dinode	*dip)
+{
+	xfs_bmdr_block_t	*dib;
+	xfs_bmbt_ptr_t		*pp;
+	int			maxrecs;
+	int			level, nrecs;
+	int			i;
+
+	switch (XFS_DFORK_FORMAT(dip, XFS_DATA_FORK)) {
+	case XFS_DINODE_FMT_EXTENTS:
+		maxrecs = XFS_DFORK_DSIZE(dip, mp) / sizeof(xfs_bmbt_rec_t);
+		account_extents(iu, (xfs_bmbt_rec_t *)XFS_DFORK_DPTR(dip),
+				min((xfs_extnum_t)maxrecs,
+				    xfs_dfork_nextents(dip, XFS_DATA_FORK)));
+		break;
+	case XFS_DINODE_FMT_BTREE:
+		dib = (xfs_bmdr_block_t *)XFS_DFORK_DPTR(dip);
+		level = be16_to_cpu(dib->bb_level);
+		nrecs = be16_to_cpu(dib->bb_numrecs);
+		maxrecs = libxfs_bmdr_maxrecs(XFS_DFORK_DSIZE(dip, mp),
+				level == 0);
+		if (nrecs > maxrecs)
+			break;
+		if (level == 0) {
+			account_extents(iu, XFS_BMDR_REC_ADDR(dib, 1), nrecs);
+			break;
+		}
+		pp = XFS_BMDR_PTR_ADDR(dib, 1, maxrecs);
+		for (i = 0; i < nrecs; i++)
+			if (fsbno_ok(get_unaligned_be64(&pp[i])))
+				readahead_blocks(XFS_FSB_TO_DADDR(mp,
+					get_unaligned_be64(&pp[i])), blkbb);
+		for (i = 0; i < nrecs; i++)
+			scan_bmbt(iu, get_unaligned_be64(&pp[i]), level - 1);
+		break;
+	}
+}
+
+static void
+account_inode(
+	struct usage_set	*set,
+	struct xfs_dinode	*dip)
+{
+	struct inode_usage	iu = { };
+	uint16_t		mode = be16_to_cpu(dip->di_mode);
+	uint64_t		size = be64_to_cpu(dip->di_size);
+	uint32_t		prid = 0;
+
+	if (be16_to_cpu(dip->di_magic) != XFS_DINODE_MAGIC ||
+	    !libxfs_dinode_good_version(mp, dip->di_version) || !mode)
+		return;
+
+	if (dip->di_version > 1)
+		prid = (uint32_t)be16_to_cpu(dip->di_projid_hi) << 16 |
+				 be16_to_cpu(dip->di_projid_lo);
+	if (S_ISREG(mode))
+		iu.eof = XFS_B_TO_FSB(mp, size);
+	/* realtime files can't share blocks */
+	iu.reflink = xfs_has_v3inodes(mp) &&
+		     (be64_to_cpu(dip->di_flags2) & XFS_DIFLAG2_REFLINK) &&
+		     !(be16_to_cpu(dip->di_flags) & XFS_DIFLAG_REALTIME);
+
+	iu.u.inodes = 1;
+	iu.u.blocks = be64_to_cpu(dip->di_nblocks);
+	scan_data_fork(&iu, dip);
+	if (iu.eof > iu.mapped)
+		iu.u.sparse = iu.eof - iu.mapped;
+
+	usage_add(&set->total, &iu.u);
+	usage_add(usage_tab_get(&set->users, be32_to_cpu(dip->di_uid)),
+			&iu.u);
+	usage_add(usage_tab_get(&set->groups, be32_to_cpu(dip->di_gid)),
+			&iu.u);
+	usage_add(usage_tab_get(&set->projects, prid), &iu.u);
+	usage_add(&set->sizes[size_class(size)], &iu.u);
+}
+
+static void
+scan_inode_chunk(
+	struct usage_set	*set,
+	xfs_agnumber_t		agno,
+	xfs_inobt_rec_t		*rp)
+{
+	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	xfs_agino_t		agino = be32_to_cpu(rp->ir_startino);
+	xfs_agblock_t		agbno = XFS_AGINO_TO_AGBNO(mp, agino);
+	xfs_agblock_t		end_agbno = agbno + igeo->ialloc_blks;
+	int			off = XFS_AGINO_TO_OFFSET(mp, agino);
+	int			blks_per_buf;
+	int			inodes_per_buf;
+	int			ioff, j;
+
+	if (xfs_has_sparseinodes(mp))
+		blks_per_buf = igeo->blocks_per_cluster;
+	else
+		blks_per_buf = igeo->ialloc_blks;
+	inodes_per_buf = min(XFS_FSB_TO_INO(mp, blks_per_buf),
+			     XFS_INODES_PER_CHUNK);
+
+	push_cur();
+	for (ioff = 0;
+	     agbno < end_agbno && ioff < XFS_INODES_PER_CHUNK;
+	     agbno += blks_per_buf, ioff += inodes_per_buf) {
+		if (xfs_inobt_is_sparse_disk(rp, ioff))
+			continue;
+		set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
+			XFS_FSB_TO_BB(mp, blks_per_buf), DB_RING_IGN, NULL);
+		if (!iocur_top->data) {
+			dbprintf(_("can't read inode block %u/%u\n"),
+				agno, agbno);
+			continue;
+		}
+		for (j = 0; j < inodes_per_buf; j++) {
+			if (XFS_INOBT_IS_FREE_DISK(rp, ioff + j))
+				continue;
+			account_inode(set, (struct xfs_dinode *)
+					((char *)iocur_top->data +
+					 ((off + j) << mp->m_sb.sb_inodelog)));
+		}
+	}
+	pop_cur();
+}
+
+static void
+scan_inobt(
+	struct usage_set	*set,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		bno,
+	int			level)
+{
+	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	struct xfs_btree_block	*block;
+	xfs_inobt_rec_t		*rp;
+	xfs_inobt_ptr_t		*pp;
+	int			nrecs;
+	int			i;
+
+	if (bno >= mp->m_sb.sb_agblocks)
+		return;
+	push_cur();
+	set_cur(&typtab[TYP_INOBT], XFS_AGB_TO_DADDR(mp, agno, bno), blkbb,
+		DB_RING_IGN, NULL);
+	block = iocur_top->data;
+	if (!block) {
+		dbprintf(_("can't read btree block %u/%u\n"), agno, bno);
+		goto out;
+	}
+	nrecs = be16_to_cpu(block->bb_numrecs);
+	if (be16_to_cpu(block->bb_level) != level ||
+	    nrecs > igeo->inobt_mxr[level != 0])
+		goto out;
+
+	if (level == 0) {
+		rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+		/* start reading all the inode chunks in this leaf */
+		for (i = 0; i < nrecs; i++)
+			readahead_blocks(XFS_AGB_TO_DADDR(mp, agno,
+				XFS_AGINO_TO_AGBNO(mp,
+					be32_to_cpu(rp[i].ir_startino))),
+				XFS_FSB_TO_BB(mp, igeo->ialloc_blks));
+		for (i = 0; i < nrecs; i++)
+			scan_inode_chunk(set, agno, &rp[i]);
+		goto out;
+	}
+	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, igeo->inobt_mxr[1]);
+	for (i = 0; i < nrecs; i++)
+		readahead_blocks(XFS_AGB_TO_DADDR(mp, agno,
+				be32_to_cpu(pp[i])), blkbb);
+	for (i = 0; i < nrecs; i++)
+		scan_inobt(set, agno, be32_to_cpu(pp[i]), level - 1);
+out:
+	pop_cur();
+}
+
+static void
+scan_refcountbt(
+	struct shared_ag	*sa,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		bno,
+	int			level)
+{
+	struct xfs_btree_block	*block;
+	struct xfs_refcount_rec	*rp;
+	xfs_refcount_ptr_t	*pp;
+	xfs_agblock_t		start;
+	int			nrecs;
+	int			i;
+
+	if (bno >= mp->m_sb.sb_agblocks)
+		return;
+	push_cur();
+	set_cur(&typtab[TYP_REFCBT], XFS_AGB_TO_DADDR(mp, agno, bno), blkbb,
+		DB_RING_IGN, NULL);
+	block = iocur_top->data;
+	if (!block) {
+		dbprintf(_("can't read btree block %u/%u\n"), agno, bno);
+		goto out;
+	}
+	nrecs = be16_to_cpu(block->bb_numrecs);
+	if (be16_to_cpu(block->bb_level) != level ||
+	    nrecs > mp->m_refc_mxr[level != 0])
+		goto out;
+
+	if (level == 0) {
+		rp = XFS_REFCOUNT_REC_ADDR(block, 1);
+		for (i = 0; i < nrecs; i++) {
+			start = be32_to_cpu(rp[i].rc_startblock);
+			/* CoW staging extents belong to nobody yet */
+			if (start >= XFS_REFC_COW_START ||
+			    be32_to_cpu(rp[i].rc_refcount) < 2)
+				continue;
+			if (sa->nr == sa->max) {
+				sa->max = max(sa->max * 2, 64U);
+				sa->exts = xrealloc(sa->exts,
+						sa->max * sizeof(*sa->exts));
+			}
+			sa->exts[sa->nr].start = start;
+			sa->exts[sa->nr].len = be32_to_cpu(rp[i].rc_blockcount);
+			sa->nr++;
+		}
+		goto out;
+	}
+	pp = XFS_REFCOUNT_PTR_ADDR(block, 1, mp->m_refc_mxr[1]);
+	for (i = 0; i < nrecs; i++)
+		readahead_blocks(XFS_AGB_TO_DADDR(mp, agno,
+				be32_to_cpu(pp[i])), blkbb);
+	for (i = 0; i < nrecs; i++)
+		scan_refcountbt(sa, agno, be32_to_cpu(pp[i]), level - 1);
+out:
+	pop_cur();
+}
+
+static int
+shared_ext_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct shared_ext	*ea = a, *eb = b;
+
+	if (ea->start < eb->start)
+		return -1;
+	return ea->start > eb->start;
+}
+
+static void
+load_shared_worker(
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct shared_ag	*sa = &shared[agno];
+	xfs_agf_t		*agf;
+
+	push_cur();
+	set_cur(&typtab[TYP_AGF], XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
+	agf = iocur_top->data;
+	if (!agf)
+		dbprintf(_("can't read agf block for ag %u\n"), agno);
+	else if (agf->agf_refcount_root)
+		scan_refcountbt(sa, agno, be32_to_cpu(agf->agf_refcount_root),
+				be32_to_cpu(agf->agf_refcount_level) - 1);
+	pop_cur();
+
+	/* a corrupt btree may be out of order, and we binary search this */
+	qsort(sa->exts, sa->nr, sizeof(*sa->exts), shared_ext_cmp);
+}
+
+static void
+scan_ag_worker(
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct usage_set	set = { };
+	xfs_agi_t		*agi;
+	int			i;
+
+	push_cur();
+	set_cur(&typtab[TYP_AGI], XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
+	agi = iocur_top->data;
+	if (!agi)
+		dbprintf(_("can't read agi block for ag %u\n"), agno);
+	else
+		scan_inobt(&set, agno, be32_to_cpu(agi->agi_root),
+				be32_to_cpu(agi->agi_level) - 1);
+	pop_cur();
+
+	pthread_mutex_lock(&usage_lock);
+	usage_add(&totals.total, &set.total);
+	usage_tab_merge(&totals.users, &set.users);
+	usage_tab_merge(&totals.groups, &set.groups);
+	usage_tab_merge(&totals.projects, &set.projects);
+	for (i = 0; i < NR_SIZE_CLASSES; i++)
+		usage_add(&totals.sizes[i], &set.sizes[i]);
+	pthread_mutex_unlock(&usage_lock);
+
+	usage_set_free(&set);
+}
+
+static int
+usage_ent_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct usage_ent	*ea = a, *eb = b;
+
+	if (ea->id < eb->id)
+		return -1;
+	return ea->id > eb->id;
+}
+
+/* The used entries of @t in id order; caller frees. */
+static struct usage_ent *
+usage_tab_sorted(
+	struct usage_tab	*t)
+{
+	struct usage_ent	*ents;
+	unsigned int		i, n = 0;
+
+	ents = xmalloc(max(t->nr, 1U) * sizeof(*ents));
+	for (i = 0; i < t->size; i++)
+		if (t->ents[i].used)
+			ents[n++] = t->ents[i];
+	qsort(ents, n, sizeof(*ents), usage_ent_cmp);
+	return ents;
+}
+
+/* Smallest and largest file size in a size class. */
+static void
+size_class_range(
+	int			c,
+	uint64_t		*lo,
+	uint64_t		*hi)
+{
+	*lo = c ? 1ULL << (c - 1) : 0;
+	*hi = c ? *lo + (*lo - 1) : 0;
+}
+
+/* Size class bound with a binary unit, e.g. "4K" */
+static char *
+size_label(
+	char			*buf,
+	uint64_t		bytes)
+{
+	static const char	units[] = "KMGTPE";
+	int			u = -1;
+
+	while (bytes >= 1024 && !(bytes & 1023) && u < 5) {
+		bytes >>= 10;
+		u++;
+	}
+	if (u < 0)
+		sprintf(buf, "%llu", (unsigned long long)bytes);
+	else
+		sprintf(buf, "%llu%c", (unsigned long long)bytes, units[u]);
+	return buf;
+}
+
+static void
+print_usage_text(
+	const char		*id,
+	struct usage		*u)
+{
+	dbprintf("%12s %10llu %12llu %10llu %12llu %12llu %12llu %12llu\n",
+		id, u->inodes, u->blocks, u->extents, u->written,
+		u->unwritten, u->sparse, u->shared);
+}
+
+static void
+print_usage_csv(
+	const char		*kind,
+	const char		*id,
+	const char		*lo,
+	const char		*hi,
+	struct usage		*u)
+{
+	dbprintf("%s,%s,%s,%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+		kind, id, lo, hi, u->inodes, u->blocks, u->extents,
+		u->written, u->unwritten, u->sparse, u->shared);
+}
+
+static void
+print_usage_json(
+	struct usage		*u)
+{
+	dbprintf("\"inodes\":%llu,\"blocks\":%llu,\"extents\":%llu,"
+		 "\"written\":%llu,\"unwritten\":%llu,\"sparse\":%llu,"
+		 "\"shared\":%llu}",
+		u->inodes, u->blocks, u->extents, u->written,
+		u->unwritten, u->sparse, u->shared);
+}
+
+static void
+report_tab(
+	const char		*kind,
+	struct usage_tab	*t)
+{
+	struct usage_ent	*ents = usage_tab_sorted(t);
+	char			id[16];
+	unsigned int		i;
+
+	switch (format) {
+	case FMT_TEXT:
+		dbprintf(_("by %s:\n"), kind);
+		dbprintf("%12s %10s %12s %10s %12s %12s %12s %12s\n",
+			_("id"), _("inodes"), _("blocks"), _("extents"),
+			_("written"), _("unwritten"), _("sparse"), _("shared"));
+		break;
+	case FMT_JSON:
+		dbprintf(",\"%ss\":[", kind);
+		break;
+	}
+	for (i = 0; i < t->nr; i++) {
+		snprintf(id, sizeof(id), "%u", ents[i].id);
+		switch (format) {
+		case FMT_TEXT:
+			print_usage_text(id, &ents[i].u);
+			break;
+		case FMT_CSV:
+			print_usage_csv(kind, id, "", "", &ents[i].u);
+			break;
+		case FMT_JSON:
+			dbprintf("%s\n{\"id\":%s,", i ? "," : "", id);
+			print_usage_json(&ents[i].u);
+			break;
+		}
+	}
+	if (format == FMT_JSON)
+		dbprintf("]");
+	xfree(ents);
+}
+
+static void
+report_sizes(void)
+{
+	char			lo_s[32], hi_s[32], label[32];
+	uint64_t		lo, hi;
+	bool			first = true;
+	int			c;
+
+	switch (format) {
+	case FMT_TEXT:
+		dbprintf(_("by file size:\n"));
+		dbprintf("%12s %10s %12s %10s %12s %12s %12s %12s\n",
+			_("size"), _("inodes"), _("blocks"), _("extents"),
+			_("written"), _("unwritten"), _("sparse"), _("shared"));
+		break;
+	case FMT_JSON:
+		dbprintf(",\"sizes\":[");
+		break;
+	}
+	for (c = 0; c < NR_SIZE_CLASSES; c++) {
+		if (!totals.sizes[c].inodes)
+			continue;
+		size_class_range(c, &lo, &hi);
+		switch (format) {
+		case FMT_TEXT:
+			if (c < 2)
+				size_label(label, lo);
+			else if (hi == UINT64_MAX)	/* no upper bound */
+				snprintf(label, sizeof(label), "%s+",
+					size_label(lo_s, lo));
+			else
+				snprintf(label, sizeof(label), "%s-%s",
+					size_label(lo_s, lo),
+					size_label(hi_s, hi + 1));
+			print_usage_text(label, &totals.sizes[c]);
+			break;
+		case FMT_CSV:
+			snprintf(lo_s, sizeof(lo_s), "%llu",
+					(unsigned long long)lo);
+			snprintf(hi_s, sizeof(hi_s), "%llu",
+					(unsigned long long)hi);
+			print_usage_csv("size", "", lo_s, hi_s,
+					&totals.sizes[c]);
+			break;
+		case FMT_JSON:
+			dbprintf("%s\n{\"min\":%llu,\"max\":%llu,",
+				first ? "" : ",", (unsigned long long)lo,
+				(unsigned long long)hi);
+			print_usage_json(&totals.sizes[c]);
+			break;
+		}
+		first = false;
+	}
+	if (format == FMT_JSON)
+		dbprintf("]");
+}
+
+static void
+report(void)
+{
+	switch (format) {
+	case FMT_TEXT:
+		dbprintf(_("blocks are %u bytes\n"), mp->m_sb.sb_blocksize);
+		dbprintf("%12s %10s %12s %10s %12s %12s %12s %12s\n",
+			"", _("inodes"), _("blocks"), _("extents"),
+			_("written"), _("unwritten"), _("sparse"), _("shared"));
+		print_usage_text(_("total"), &totals.total);
+		break;
+	case FMT_CSV:
+		dbprintf("kind,id,min_size,max_size,inodes,blocks,extents,"
+			 "written,unwritten,sparse,shared\n");
+		print_usage_csv("total", "", "", "", &totals.total);
+		break;
+	case FMT_JSON:
+		dbprintf("{\"blocksize\":%u,\"total\":{",
+			mp->m_sb.sb_blocksize);
+		print_usage_json(&totals.total);
+		break;
+	}
+	if (uflag)
+		report_tab("user", &totals.users);
+	if (gflag)
+		report_tab("group", &totals.groups);
+	if (pflag)
+		report_tab("project", &totals.projects);
+	if (sflag)
+		report_sizes();
+	if (format == FMT_JSON)
+		dbprintf("}\n");
+}
+
+static int
+fsusage_f(
+	int			argc,
+	char			**argv)
+{
+	xfs_agnumber_t		agno;
+	int			c;
+
+	uflag = gflag = pflag = sflag = nr_threads = 0;
+	format = FMT_TEXT;
+	optind = 0;
+	while ((c = getopt(argc, argv, "cgjpsT:u")) != EOF) {
+		switch (c) {
+		case 'c':
+			format = FMT_CSV;
+			break;
+		case 'g':
+			gflag = 1;
+			break;
+		case 'j':
+			format = FMT_JSON;
+			break;
+		case 'p':
+			pflag = 1;
+			break;
+		case 's':
+			sflag = 1;
+			break;
+		case 'T':
+			nr_threads = cvt_u32(optarg, 0);
+			if (errno || !nr_threads) {
+				dbprintf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			break;
+		case 'u':
+			uflag = 1;
+			break;
+		default:
+			dbprintf(_("bad option for fsusage command\n"));
+			return 0;
+		}
+	}
+	if (optind != argc) {
+		dbprintf(_("bad option for fsusage command\n"));
+		return 0;
+	}
+	if (!uflag && !gflag && !pflag && !sflag)
+		uflag = gflag = pflag = sflag = 1;
+
+	shared = xcalloc(mp->m_sb.sb_agcount, sizeof(*shared));
+	if (xfs_has_reflink(mp) &&
+	    scan_ags_threaded(nr_threads, load_shared_worker, NULL))
+		goto out;
+	if (scan_ags_threaded(nr_threads, scan_ag_worker, NULL))
+		goto out;
+	report();
+out:
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		xfree(shared[agno].exts);
+	xfree(shared);
+	shared = NULL;
+	usage_set_free(&totals);
+	return 0;
+}
+
+void
+fsusage_init(void)
+{
+	add_command(&fsusage_cmd);
+}
@@ -15,7 +15,9 @@
 #include "sig.h"
 #include "output.h"
 #include "malloc.h"
+#include "profile.h"
 #include "type.h"
+#include "batch.h"
 
 static char		**cmdline;
 static int		ncmdline;
@@ -24,6 +26,7 @@ int			blkbb;
 int			exitcode;
 int			expert_mode;
 static int		force;
+static int		batch_mode;
 static struct xfs_mount	xmount;
 struct xfs_mount	*mp;
 static struct xlog	xlog;
@@ -33,7 +36,7 @@ static void
 usage(void)
 {
 	fprintf(stderr, _(
-		"Usage: %s [-ifFrxV] [-p prog] [-l logdev] [-c cmd]... device\n"
+		"Usage: %s [-BifFPrxV] [-p prog] [-l logdev] [-c cmd]... device\n"
 		), progname);
 	exit(1);
 }
@@ -54,8 +57,11 @@ init(
 	textdomain(PACKAGE);
 
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "c:fFip:rxVl:")) != EOF) {
+	while ((c = getopt(argc, argv, "Bc:fFip:PrxVl:")) != EOF) {
 		switch (c) {
+		case 'B':
+			batch_mode = 1;
+			break;
 		case 'c':
 			cmdline = xrealloc(cmdline, (ncmdline+1)*sizeof(char*));
 			cmdline[ncmdline++] = optarg;
@@ -72,6 +78,9 @@ init(
 		case 'p':
 			progname = optarg;
 			break;
+		case 'P':
+			profile_start();
+			break;
 		case 'r':
 			x.isreadonly = LIBXFS_ISREADONLY;
 			break;
@@ -88,7 +97,7 @@ init(
 			usage();
 		}
 	}
-	if (optind + 1 != argc)
+	if (optind + 1 != argc || (batch_mode && ncmdline))
 		usage();
 
 	fsdevice = argv[optind];
@@ -195,6 +204,11 @@ main(
 		goto close_devices;
 	}
 
+	if (batch_mode) {
+		batch_run();
+		goto close_devices;
+	}
+
 	pushfile(stdin);
 	while (!done) {
 		if ((input = fetchline()) == NULL)
@@ -212,6 +226,7 @@ close_devices:
 	 */
 	while (iocur_sp > start_iocur_sp)
 		pop_cur();
+	profile_exit();
 	libxfs_umount(mp);
 	libxfs_destroy(&x);
 
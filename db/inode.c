@@ -832,32 +832,32 @@ inode_u_symlink_count(
  * does, and that avoids buffer cache issues caused by overlapping buffers. This
  * can be seen clearly when trying to read the root inode. Much of this logic is
  * similar to libxfs_imap().
+ *
+ * Find the inode cluster buffer that holds @ino and the offset of the inode
+ * in it, in inodes.  Returns false if @ino can't be a valid inode number.
  */
-void
-set_cur_inode(
-	xfs_ino_t		ino)
+bool
+inode_cluster(
+	xfs_ino_t		ino,
+	xfs_daddr_t		*daddr,
+	int			*numblks,
+	int			*offset)
 {
 	xfs_agblock_t		agbno;
 	xfs_agino_t		agino;
 	xfs_agnumber_t		agno;
-	struct xfs_dinode	*dip;
-	int			offset;
-	int			numblks = blkbb;
 	xfs_agblock_t		cluster_agbno;
 	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
 
-
 	agno = XFS_INO_TO_AGNO(mp, ino);
 	agino = XFS_INO_TO_AGINO(mp, ino);
 	agbno = XFS_AGINO_TO_AGBNO(mp, agino);
-	offset = XFS_AGINO_TO_OFFSET(mp, agino);
+	*offset = XFS_AGINO_TO_OFFSET(mp, agino);
+	*numblks = blkbb;
 	if (agno >= mp->m_sb.sb_agcount || agbno >= mp->m_sb.sb_agblocks ||
-	    offset >= mp->m_sb.sb_inopblock ||
-	    XFS_AGINO_TO_INO(mp, agno, agino) != ino) {
-		dbprintf(_("bad inode number %lld\n"), ino);
-		return;
-	}
-	cur_agno = agno;
+	    *offset >= mp->m_sb.sb_inopblock ||
+	    XFS_AGINO_TO_INO(mp, agno, agino) != ino)
+		return false;
 
 	if (igeo->inode_cluster_size > mp->m_sb.sb_blocksize &&
 	    igeo->inoalign_mask) {
@@ -869,11 +869,30 @@ set_cur_inode(
 		cluster_agbno = chunk_agbno +
 			((offset_agbno / M_IGEO(mp)->blocks_per_cluster) *
 			 M_IGEO(mp)->blocks_per_cluster);
-		offset += ((agbno - cluster_agbno) * mp->m_sb.sb_inopblock);
-		numblks = XFS_FSB_TO_BB(mp, M_IGEO(mp)->blocks_per_cluster);
+		*offset += ((agbno - cluster_agbno) * mp->m_sb.sb_inopblock);
+		*numblks = XFS_FSB_TO_BB(mp, M_IGEO(mp)->blocks_per_cluster);
 	} else
 		cluster_agbno = agbno;
 
+	*daddr = XFS_AGB_TO_DADDR(mp, agno, cluster_agbno);
+	return true;
+}
+
+void
+set_cur_inode(
+	xfs_ino_t		ino)
+{
+	struct xfs_dinode	*dip;
+	xfs_daddr_t		daddr;
+	int			offset;
+	int			numblks;
+
+	if (!inode_cluster(ino, &daddr, &numblks, &offset)) {
+		dbprintf(_("bad inode number %lld\n"), ino);
+		return;
+	}
+	cur_agno = XFS_INO_TO_AGNO(mp, ino);
+
 	/*
 	 * First set_cur to the block with the inode
 	 * then use off_cur to get the right part of the buffer.
@@ -881,8 +900,7 @@ set_cur_inode(
 	ASSERT(typtab[TYP_INODE].typnm == TYP_INODE);
 
 	/* ingore ring update here, do it explicitly below */
-	set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, cluster_agbno),
-		numblks, DB_RING_IGN, NULL);
+	set_cur(&typtab[TYP_INODE], daddr, numblks, DB_RING_IGN, NULL);
 	off_cur(offset << mp->m_sb.sb_inodelog, mp->m_sb.sb_inodesize);
 	if (!iocur_top->data)
 		return;
@@ -22,4 +22,6 @@ extern typnm_t	inode_next_type(void);
 extern int	inode_size(void *obj, int startoff, int idx);
 extern int	inode_u_size(void *obj, int startoff, int idx);
 extern void	xfs_inode_set_crc(struct xfs_buf *);
+extern bool	inode_cluster(xfs_ino_t ino, xfs_daddr_t *daddr, int *numblks,
+			      int *offset);
 extern void	set_cur_inode(xfs_ino_t ino);
@@ -18,6 +18,8 @@
 #include "malloc.h"
 #include "crc.h"
 #include "bit.h"
+#include "namei.h"
+#include "libfrog/workqueue.h"
 
 static int	pop_f(int argc, char **argv);
 static void     pop_help(void);
@@ -51,10 +53,15 @@ static const cmdinfo_t  ring_cmd =
 	{ "ring", NULL, ring_f, 0, 1, 0, NULL,
 	  N_("show position ring or move to a specific entry"), ring_help };
 
-iocur_t	*iocur_base;
-iocur_t	*iocur_top;
-int	iocur_sp = -1;
-int	iocur_len;
+/*
+ * The location stack is per thread so that commands can walk different
+ * parts of the filesystem in parallel, each thread with its own cursors.
+ * Only the main thread's stack is visible to the user.
+ */
+__thread iocur_t	*iocur_base;
+__thread iocur_t	*iocur_top;
+__thread int		iocur_sp = -1;
+__thread int		iocur_len;
 
 #define RING_ENTRIES 20
 static iocur_t iocur_ring[RING_ENTRIES];
@@ -117,6 +124,94 @@ pop_cur(void)
 	}
 }
 
+/* Release all of a worker thread's location stack before it exits. */
+static void
+free_cur_stack(void)
+{
+	while (iocur_sp > 0)
+		pop_cur();
+	if (iocur_sp == 0)
+		pop_cur();
+	xfree(iocur_base);
+	iocur_base = iocur_top = NULL;
+	iocur_sp = -1;
+	iocur_len = 0;
+}
+
+struct ag_scan {
+	scan_ag_fn		fn;
+	void			*arg;
+};
+
+static void
+scan_ag_worker(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct ag_scan		*as = wq->wq_ctx;
+
+	as->fn(agno, as->arg);
+	/* the next AG might be scanned by a different thread */
+	free_cur_stack();
+}
+
+/*
+ * Call @fn on every AG, running up to @threads of them at once, or one per
+ * CPU if @threads is zero.  Each thread has its own location stack, but the
+ * buffer cache is shared, so buffer locking is on while the threads run.
+ * Returns zero, or an error if not every AG could be scanned.
+ */
+int
+scan_ags_threaded(
+	unsigned int		threads,
+	scan_ag_fn		fn,
+	void			*arg)
+{
+	struct ag_scan		as = { .fn = fn, .arg = arg };
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	bool			locking;
+	int			err;
+
+	if (!threads)
+		threads = platform_nproc();
+	threads = min(threads, mp->m_sb.sb_agcount);
+
+	locking = libxfs_buf_set_locking(threads > 1);
+	err = -workqueue_create(&wq, &as, threads);
+	if (err) {
+		dbprintf(_("cannot create scan threads: %s\n"), strerror(err));
+		goto out;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		err = -workqueue_add(&wq, scan_ag_worker, agno, NULL);
+		if (err) {
+			dbprintf(_("cannot scan ag %u: %s\n"), agno,
+					strerror(err));
+			break;
+		}
+	}
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+out:
+	libxfs_buf_set_locking(locking);
+	return err;
+}
+
+/*
+ * Ask the kernel to start reading @len basic blocks at @bno, so that a later
+ * set_cur() of them finds the data already in the page cache.
+ */
+void
+readahead_blocks(
+	xfs_daddr_t	bno,
+	int		len)
+{
+	posix_fadvise(libxfs_device_to_fd(mp->m_ddev_targp->bt_bdev),
+			BBTOB(bno), BBTOB(len), POSIX_FADV_WILLNEED);
+}
+
 /*ARGSUSED*/
 static int
 pop_f(
@@ -497,6 +592,8 @@ write_cur(void)
 		write_cur_bbs();
 	else
 		write_cur_buf();
+	/* we may just have changed a directory */
+	dcache_purge();
 
 	/* If we didn't write the crc automatically, re-check inode validity */
 	if (xfs_has_crc(mp) &&
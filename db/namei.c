@@ -14,6 +14,7 @@
 #include "fprint.h"
 #include "field.h"
 #include "inode.h"
+#include "namei.h"
 
 /* Path lookup */
 
@@ -80,21 +81,90 @@ path_parse(
 	return dirpath;
 }
 
-/* Given a directory and a structured path, walk the path and set the cursor. */
+/*
+ * Cache of recent directory lookups, so that walking the same paths again
+ * and again, as one does when poking around a filesystem, doesn't read the
+ * same directory blocks and inodes every time.  It is direct mapped and
+ * small; anything written through the io cursor might have changed a
+ * directory, so that empties it.
+ */
+#define DCACHE_SIZE	4096
+
+struct dcache_ent {
+	xfs_ino_t	dir;		/* zero if unused */
+	xfs_ino_t	ino;
+	uint8_t		namelen;
+	unsigned char	name[MAXNAMELEN];
+};
+
+static struct dcache_ent	dcache[DCACHE_SIZE];
+
+static struct dcache_ent *
+dcache_slot(
+	xfs_ino_t		dir,
+	const struct xfs_name	*xname)
+{
+	uint64_t		h;
+
+	h = (dir ^ libxfs_da_hashname(xname->name, xname->len)) *
+			0x9e3779b97f4a7c15ULL;
+	return &dcache[(h >> 32) & (DCACHE_SIZE - 1)];
+}
+
+static bool
+dcache_lookup(
+	xfs_ino_t		dir,
+	const struct xfs_name	*xname,
+	xfs_ino_t		*ino)
+{
+	struct dcache_ent	*de = dcache_slot(dir, xname);
+
+	if (de->dir != dir || de->namelen != xname->len ||
+	    memcmp(de->name, xname->name, xname->len))
+		return false;
+	*ino = de->ino;
+	return true;
+}
+
+static void
+dcache_add(
+	xfs_ino_t		dir,
+	const struct xfs_name	*xname,
+	xfs_ino_t		ino)
+{
+	struct dcache_ent	*de;
+
+	if (xname->len <= 0 || xname->len >= MAXNAMELEN)
+		return;
+	de = dcache_slot(dir, xname);
+	de->dir = dir;
+	de->ino = ino;
+	de->namelen = xname->len;
+	memcpy(de->name, xname->name, xname->len);
+}
+
+void
+dcache_purge(void)
+{
+	memset(dcache, 0, sizeof(dcache));
+}
+
+/*
+ * Given a directory and a structured path, walk the path and set the cursor.
+ * A cached component doesn't need its directory read at all, so each inode
+ * is only read if the cache can't answer for the component after it.
+ */
 static int
 path_navigate(
 	struct xfs_mount	*mp,
 	xfs_ino_t		rootino,
 	struct dirpath		*dirpath)
 {
-	struct xfs_inode	*dp;
+	struct xfs_inode	*dp = NULL;
 	xfs_ino_t		ino = rootino;
+	xfs_ino_t		child;
 	unsigned int		i;
-	int			error;
-
-	error = -libxfs_iget(mp, NULL, ino, 0, &dp);
-	if (error)
-		return error;
+	int			error = 0;
 
 	for (i = 0; i < dirpath->depth; i++) {
 		struct xfs_name	xname = {
@@ -102,31 +172,32 @@ path_navigate(
 			.len	= strlen(dirpath->path[i]),
 		};
 
+		if (dcache_lookup(ino, &xname, &child)) {
+			ino = child;
+			continue;
+		}
+
+		error = -libxfs_iget(mp, NULL, ino, 0, &dp);
+		if (error)
+			return error;
+
 		if (!S_ISDIR(VFS_I(dp)->i_mode)) {
 			error = ENOTDIR;
 			goto rele;
 		}
 
-		error = -libxfs_dir_lookup(NULL, dp, &xname, &ino, NULL);
+		error = -libxfs_dir_lookup(NULL, dp, &xname, &child, NULL);
 		if (error)
 			goto rele;
-		if (!xfs_verify_ino(mp, ino)) {
+		if (!xfs_verify_ino(mp, child)) {
 			error = EFSCORRUPTED;
 			goto rele;
 		}
 
 		libxfs_irele(dp);
 		dp = NULL;
-
-		error = -libxfs_iget(mp, NULL, ino, 0, &dp);
-		switch (error) {
-		case EFSCORRUPTED:
-		case EFSBADCRC:
-		case 0:
-			break;
-		default:
-			return error;
-		}
+		dcache_add(ino, &xname, child);
+		ino = child;
 	}
 
 	set_cur_inode(ino);
@@ -242,13 +313,15 @@ get_dstr(
 
 static void
 dir_emit(
-	struct xfs_mount	*mp,
+	struct xfs_inode	*dp,
 	xfs_dir2_dataptr_t	off,
 	char			*name,
 	ssize_t			namelen,
 	xfs_ino_t		ino,
-	uint8_t			dtype)
+	uint8_t			dtype,
+	void			*priv)
 {
+	struct xfs_mount	*mp = dp->i_mount;
 	char			*display_name;
 	struct xfs_name		xname = { .name = name };
 	const char		*dstr = get_dstr(mp, dtype);
@@ -274,6 +347,10 @@ dir_emit(
 	}
 	hash = libxfs_dir2_hashname(mp, &xname);
 
+	/* remember the names, in case the next command looks one of them up */
+	if (namelen >= 0 && good && libxfs_verify_ino(mp, ino))
+		dcache_add(dp->i_ino, &xname, ino);
+
 	dbprintf("%-10u %-18llu %-14s 0x%08llx %3d %s %s\n", off & 0xFFFFFFFF,
 			ino, dstr, hash, xname.len,
 			display_name, good ? _("(good)") : _("(corrupt)"));
@@ -284,7 +361,9 @@ dir_emit(
 
 static int
 list_sfdir(
-	struct xfs_da_args		*args)
+	struct xfs_da_args		*args,
+	dir_emit_t			emit,
+	void				*priv)
 {
 	struct xfs_inode		*dp = args->dp;
 	struct xfs_mount		*mp = dp->i_mount;
@@ -301,13 +380,13 @@ list_sfdir(
 	/* . and .. entries */
 	off = xfs_dir2_db_off_to_dataptr(geo, geo->datablk,
 			geo->data_entry_offset);
-	dir_emit(args->dp->i_mount, off, ".", -1, dp->i_ino, XFS_DIR3_FT_DIR);
+	emit(dp, off, ".", -1, dp->i_ino, XFS_DIR3_FT_DIR, priv);
 
 	ino = libxfs_dir2_sf_get_parent_ino(sfp);
 	off = xfs_dir2_db_off_to_dataptr(geo, geo->datablk,
 			geo->data_entry_offset +
 			libxfs_dir2_data_entsize(mp, sizeof(".") - 1));
-	dir_emit(args->dp->i_mount, off, "..", -1, ino, XFS_DIR3_FT_DIR);
+	emit(dp, off, "..", -1, ino, XFS_DIR3_FT_DIR, priv);
 
 	/* Walk everything else. */
 	sfep = xfs_dir2_sf_firstentry(sfp);
@@ -317,8 +396,8 @@ list_sfdir(
 		off = xfs_dir2_db_off_to_dataptr(geo, geo->datablk,
 				xfs_dir2_sf_get_offset(sfep));
 
-		dir_emit(args->dp->i_mount, off, (char *)sfep->name,
-				sfep->namelen, ino, filetype);
+		emit(dp, off, (char *)sfep->name, sfep->namelen, ino,
+				filetype, priv);
 		sfep = libxfs_dir2_sf_nextentry(mp, sfp, sfep);
 	}
 
@@ -328,7 +407,9 @@ list_sfdir(
 /* List entries in block format directory. */
 static int
 list_blockdir(
-	struct xfs_da_args	*args)
+	struct xfs_da_args	*args,
+	dir_emit_t		emit,
+	void			*priv)
 {
 	struct xfs_inode	*dp = args->dp;
 	struct xfs_mount	*mp = dp->i_mount;
@@ -359,8 +440,8 @@ list_blockdir(
 		diroff = xfs_dir2_db_off_to_dataptr(geo, geo->datablk, offset);
 		offset += libxfs_dir2_data_entsize(mp, dep->namelen);
 		filetype = libxfs_dir2_data_get_ftype(dp->i_mount, dep);
-		dir_emit(mp, diroff, (char *)dep->name, dep->namelen,
-				be64_to_cpu(dep->inumber), filetype);
+		emit(dp, diroff, (char *)dep->name, dep->namelen,
+				be64_to_cpu(dep->inumber), filetype, priv);
 	}
 
 	libxfs_trans_brelse(args->trans, bp);
@@ -370,7 +451,9 @@ list_blockdir(
 /* List entries in leaf format directory. */
 static int
 list_leafdir(
-	struct xfs_da_args	*args)
+	struct xfs_da_args	*args,
+	dir_emit_t		emit,
+	void			*priv)
 {
 	struct xfs_bmbt_irec	map;
 	struct xfs_iext_cursor	icur;
@@ -388,6 +471,14 @@ list_leafdir(
 	if (error)
 		return error;
 
+	/* Start reading all the data blocks; we want every one of them. */
+	for_each_xfs_iext(ifp, &icur, &map) {
+		if (map.br_startoff >= geo->leafblk)
+			break;
+		readahead_blocks(XFS_FSB_TO_DADDR(mp, map.br_startblock),
+				XFS_FSB_TO_BB(mp, map.br_blockcount));
+	}
+
 	while (dabno < geo->leafblk) {
 		unsigned int	offset;
 		unsigned int	length;
@@ -424,9 +515,9 @@ list_leafdir(
 			offset += libxfs_dir2_data_entsize(mp, dep->namelen);
 			filetype = libxfs_dir2_data_get_ftype(mp, dep);
 
-			dir_emit(mp, xfs_dir2_byte_to_dataptr(dirboff + offset),
+			emit(dp, xfs_dir2_byte_to_dataptr(dirboff + offset),
 					(char *)dep->name, dep->namelen,
-					be64_to_cpu(dep->inumber), filetype);
+					be64_to_cpu(dep->inumber), filetype, priv);
 		}
 
 		dabno += XFS_DADDR_TO_FSB(mp, bp->b_length);
@@ -440,10 +531,12 @@ list_leafdir(
 	return error;
 }
 
-/* Read the directory, display contents. */
+/* Read the directory, passing each entry to @emit. */
 int
-listdir(
-	struct xfs_inode	*dp)
+walkdir(
+	struct xfs_inode	*dp,
+	dir_emit_t		emit,
+	void			*priv)
 {
 	struct xfs_da_args	args = {
 		.dp		= dp,
@@ -453,15 +546,15 @@ listdir(
 	int			isblock;
 
 	if (dp->i_df.if_format == XFS_DINODE_FMT_LOCAL)
-		return list_sfdir(&args);
+		return list_sfdir(&args, emit, priv);
 
 	error = -libxfs_dir2_isblock(&args, &isblock);
 	if (error)
 		return error;
 
 	if (isblock)
-		return list_blockdir(&args);
-	return list_leafdir(&args);
+		return list_blockdir(&args, emit, priv);
+	return list_leafdir(&args, emit, priv);
 }
 
 /* List the inode number of the currently selected inode. */
@@ -500,7 +593,7 @@ ls_cur(
 	if (tag)
 		dbprintf(_("%s:\n"), tag);
 
-	error = listdir(dp);
+	error = walkdir(dp, dir_emit, NULL);
 	if (error)
 		goto rele;
 
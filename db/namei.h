@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Directory walking shared by the path, ls and ncheck commands, and the
+ * cache of recent path lookups.
+ */
+
+/*
+ * Called for each entry of a directory.  A negative @namelen means that
+ * @name is a null-terminated string made up for "." or ".." rather than
+ * one read from the directory.
+ */
+typedef void (*dir_emit_t)(struct xfs_inode *dp, xfs_dir2_dataptr_t off,
+		char *name, ssize_t namelen, xfs_ino_t ino, uint8_t dtype,
+		void *priv);
+
+extern int	walkdir(struct xfs_inode *dp, dir_emit_t emit, void *priv);
+extern void	dcache_purge(void);
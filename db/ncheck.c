@@ -0,0 +1,547 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Reverse inode lookup without blockget.  The directory tree is read once
+ * from the root down, each directory being handed to a pool of threads as
+ * soon as its name is known.  The names wanted from a directory are printed
+ * together, in inode number order, as soon as that directory has been read,
+ * so memory only grows with the number of directories.  The threads finish
+ * directories in no particular order.
+ *
+ * If directory entries don't record file types, or only setuid and special
+ * files are wanted, we need to know more about the inodes than the entries
+ * tell us.  In that case the inode btrees are scanned first for the numbers
+ * of the directories and of the files that -s asks for.
+ */
+
+#include "libxfs.h"
+#include "command.h"
+#include "output.h"
+#include "init.h"
+#include "io.h"
+#include "type.h"
+#include "faddr.h"
+#include "fprint.h"
+#include "field.h"
+#include "inode.h"
+#include "malloc.h"
+#include "namei.h"
+#include "ncheck.h"
+#include "libfrog/workqueue.h"
+
+struct ino_list {
+	xfs_ino_t		*inos;
+	size_t			nr;
+	size_t			max;
+};
+
+/* A directory waiting to be read. */
+struct ncheck_dir {
+	xfs_ino_t		ino;
+	char			path[];		/* "" for the root */
+};
+
+/* A name to be printed once its directory has been read. */
+struct ncheck_name {
+	xfs_ino_t		ino;
+	char			*path;		/* "/." appended for directories */
+};
+
+struct ncheck_walk {
+	struct workqueue	*wq;
+	struct ncheck_dir	*dir;
+	struct ncheck_name	*names;		/* wanted names in @dir */
+	size_t			nr;
+	size_t			max;
+};
+
+static bool			has_ftype;
+static bool			security;
+static struct ino_list		*ag_dirs;	/* filled in by the prescan */
+static struct ino_list		*ag_secure;
+static struct ino_list		dirs;
+static struct ino_list		secure;
+static struct ino_list		wanted;
+
+/* Directories queued so far; open addressing, zero marks a free slot. */
+static struct {
+	xfs_ino_t		*inos;
+	size_t			size;		/* power of two */
+	size_t			nr;
+} seen;
+
+static pthread_mutex_t		ncheck_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		ncheck_idle = PTHREAD_COND_INITIALIZER;
+static unsigned long		pending;	/* directories not yet read */
+
+static void
+ino_list_add(
+	struct ino_list		*l,
+	xfs_ino_t		ino)
+{
+	if (l->nr == l->max) {
+		l->max = max(l->max * 2, (size_t)64);
+		l->inos = xrealloc(l->inos, l->max * sizeof(*l->inos));
+	}
+	l->inos[l->nr++] = ino;
+}
+
+static int
+ino_cmp(
+	const void		*a,
+	const void		*b)
+{
+	xfs_ino_t		ia = *(const xfs_ino_t *)a;
+	xfs_ino_t		ib = *(const xfs_ino_t *)b;
+
+	if (ia < ib)
+		return -1;
+	return ia > ib;
+}
+
+static bool
+ino_list_has(
+	struct ino_list		*l,
+	xfs_ino_t		ino)
+{
+	return bsearch(&ino, l->inos, l->nr, sizeof(*l->inos), ino_cmp);
+}
+
+/* Join the per-AG lists into one sorted list, freeing them. */
+static void
+ino_list_merge(
+	struct ino_list		*to,
+	struct ino_list		*from)
+{
+	xfs_agnumber_t		agno;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		to->inos = xrealloc(to->inos,
+				(to->nr + from[agno].nr) * sizeof(*to->inos));
+		memcpy(&to->inos[to->nr], from[agno].inos,
+				from[agno].nr * sizeof(*to->inos));
+		to->nr += from[agno].nr;
+		xfree(from[agno].inos);
+	}
+	/* inobt order already, unless the inobt is corrupt */
+	qsort(to->inos, to->nr, sizeof(*to->inos), ino_cmp);
+}
+
+static void
+found_add(
+	struct ncheck_walk	*w,
+	xfs_ino_t		ino,
+	const char		*path,
+	size_t			len,
+	bool			isdir)
+{
+	char			*p;
+
+	p = xmalloc(len + (isdir ? 3 : 1));
+	memcpy(p, path, len);
+	strcpy(p + len, isdir ? "/." : "");
+
+	if (w->nr == w->max) {
+		w->max = max(w->max * 2, (size_t)64);
+		w->names = xrealloc(w->names, w->max * sizeof(*w->names));
+	}
+	w->names[w->nr].ino = ino;
+	w->names[w->nr].path = p;
+	w->nr++;
+}
+
+static int
+name_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct ncheck_name *na = a, *nb = b;
+
+	if (na->ino != nb->ino)
+		return na->ino < nb->ino ? -1 : 1;
+	return strcmp(na->path, nb->path);
+}
+
+/*
+ * Print the names found in one directory in inode order, keeping them
+ * together in the output, then forget them.
+ */
+static void
+found_print(
+	struct ncheck_walk	*w)
+{
+	size_t			i;
+
+	qsort(w->names, w->nr, sizeof(*w->names), name_cmp);
+	flockfile(stdout);
+	for (i = 0; i < w->nr; i++) {
+		dbprintf("%11llu %s\n", w->names[i].ino, w->names[i].path);
+		xfree(w->names[i].path);
+	}
+	funlockfile(stdout);
+	xfree(w->names);
+}
+
+/* Add @ino to the set of queued directories; false if it was there. */
+static bool
+seen_add(
+	xfs_ino_t		ino)
+{
+	size_t			i;
+
+	if ((seen.nr + 1) * 2 > seen.size) {
+		xfs_ino_t	*old = seen.inos;
+		size_t		old_size = seen.size;
+
+		seen.size = max(old_size * 2, (size_t)1024);
+		seen.inos = xcalloc(seen.size, sizeof(*seen.inos));
+		seen.nr = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i])
+				seen_add(old[i]);
+		xfree(old);
+	}
+
+	for (i = (ino * 0x9e3779b97f4a7c15ULL >> 32) & (seen.size - 1);
+	     seen.inos[i];
+	     i = (i + 1) & (seen.size - 1)) {
+		if (seen.inos[i] == ino)
+			return false;
+	}
+	seen.inos[i] = ino;
+	seen.nr++;
+	return true;
+}
+
+/*
+ * Prescan: collect the directories (if the entries can't tell us) and the
+ * setuid, setgid and special files (for -s) from the inode chunks.
+ */
+static void
+prescan_inode_chunk(
+	xfs_agnumber_t		agno,
+	xfs_inobt_rec_t		*rp)
+{
+	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	xfs_agino_t		agino = be32_to_cpu(rp->ir_startino);
+	xfs_agblock_t		agbno = XFS_AGINO_TO_AGBNO(mp, agino);
+	xfs_agblock_t		end_agbno = agbno + igeo->ialloc_blks;
+	int			off = XFS_AGINO_TO_OFFSET(mp, agino);
+	struct xfs_dinode	*dip;
+	xfs_ino_t		ino;
+	uint16_t		mode;
+	int			blks_per_buf;
+	int			inodes_per_buf;
+	int			ioff, j;
+
+	if (xfs_has_sparseinodes(mp))
+		blks_per_buf = igeo->blocks_per_cluster;
+	else
+		blks_per_buf = igeo->ialloc_blks;
+	inodes_per_buf = min(XFS_FSB_TO_INO(mp, blks_per_buf),
+			     XFS_INODES_PER_CHUNK);
+
+	push_cur();
+	for (ioff = 0;
+	     agbno < end_agbno && ioff < XFS_INODES_PER_CHUNK;
+	     agbno += blks_per_buf, ioff += inodes_per_buf) {
+		if (xfs_inobt_is_sparse_disk(rp, ioff))
+			continue;
+		set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
+			XFS_FSB_TO_BB(mp, blks_per_buf), DB_RING_IGN, NULL);
+		if (!iocur_top->data) {
+			dbprintf(_("can't read inode block %u/%u\n"),
+				agno, agbno);
+			continue;
+		}
+		for (j = 0; j < inodes_per_buf; j++) {
+			if (XFS_INOBT_IS_FREE_DISK(rp, ioff + j))
+				continue;
+			dip = (struct xfs_dinode *)((char *)iocur_top->data +
+					((off + j) << mp->m_sb.sb_inodelog));
+			mode = be16_to_cpu(dip->di_mode);
+			if (be16_to_cpu(dip->di_magic) != XFS_DINODE_MAGIC ||
+			    !mode)
+				continue;
+			ino = XFS_AGINO_TO_INO(mp, agno, agino + ioff + j);
+			if (S_ISDIR(mode)) {
+				if (!has_ftype)
+					ino_list_add(&ag_dirs[agno], ino);
+			} else if (!security)
+				continue;
+			else if (!S_ISREG(mode) && !S_ISLNK(mode))
+				ino_list_add(&ag_secure[agno], ino);
+			else if (S_ISREG(mode) && (mode & (S_ISUID | S_ISGID)))
+				ino_list_add(&ag_secure[agno], ino);
+		}
+	}
+	pop_cur();
+}
+
+static void
+prescan_inobt(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		bno,
+	int			level)
+{
+	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	struct xfs_btree_block	*block;
+	xfs_inobt_rec_t		*rp;
+	xfs_inobt_ptr_t		*pp;
+	int			nrecs;
+	int			i;
+
+	if (bno >= mp->m_sb.sb_agblocks)
+		return;
+	push_cur();
+	set_cur(&typtab[TYP_INOBT], XFS_AGB_TO_DADDR(mp, agno, bno), blkbb,
+		DB_RING_IGN, NULL);
+	block = iocur_top->data;
+	if (!block) {
+		dbprintf(_("can't read btree block %u/%u\n"), agno, bno);
+		goto out;
+	}
+	nrecs = be16_to_cpu(block->bb_numrecs);
+	if (be16_to_cpu(block->bb_level) != level ||
+	    nrecs > igeo->inobt_mxr[level != 0])
+		goto out;
+
+	if (level == 0) {
+		rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+		for (i = 0; i < nrecs; i++)
+			readahead_blocks(XFS_AGB_TO_DADDR(mp, agno,
+				XFS_AGINO_TO_AGBNO(mp,
+					be32_to_cpu(rp[i].ir_startino))),
+				XFS_FSB_TO_BB(mp, igeo->ialloc_blks));
+		for (i = 0; i < nrecs; i++)
+			prescan_inode_chunk(agno, &rp[i]);
+		goto out;
+	}
+	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, igeo->inobt_mxr[1]);
+	for (i = 0; i < nrecs; i++)
+		readahead_blocks(XFS_AGB_TO_DADDR(mp, agno,
+				be32_to_cpu(pp[i])), blkbb);
+	for (i = 0; i < nrecs; i++)
+		prescan_inobt(agno, be32_to_cpu(pp[i]), level - 1);
+out:
+	pop_cur();
+}
+
+static void
+prescan_ag_worker(
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	xfs_agi_t		*agi;
+
+	push_cur();
+	set_cur(&typtab[TYP_AGI], XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
+	agi = iocur_top->data;
+	if (!agi)
+		dbprintf(_("can't read agi block for ag %u\n"), agno);
+	else
+		prescan_inobt(agno, be32_to_cpu(agi->agi_root),
+				be32_to_cpu(agi->agi_level) - 1);
+	pop_cur();
+}
+
+static int
+prescan(
+	unsigned int		threads)
+{
+	int			err;
+
+	ag_dirs = xcalloc(mp->m_sb.sb_agcount, sizeof(*ag_dirs));
+	ag_secure = xcalloc(mp->m_sb.sb_agcount, sizeof(*ag_secure));
+
+	err = scan_ags_threaded(threads, prescan_ag_worker, NULL);
+	ino_list_merge(&dirs, ag_dirs);
+	ino_list_merge(&secure, ag_secure);
+	xfree(ag_dirs);
+	xfree(ag_secure);
+	ag_dirs = ag_secure = NULL;
+	return err;
+}
+
+static void	ncheck_dir_worker(struct workqueue *wq, uint32_t index,
+				  void *arg);
+
+/* Queue a directory to be read, unless it has been already. */
+static void
+queue_dir(
+	struct workqueue	*wq,
+	xfs_ino_t		ino,
+	const char		*path,
+	size_t			len)
+{
+	struct ncheck_dir	*nd;
+	xfs_daddr_t		daddr;
+	int			blkbbs, offset;
+	int			err;
+
+	pthread_mutex_lock(&ncheck_lock);
+	if (!seen_add(ino)) {
+		pthread_mutex_unlock(&ncheck_lock);
+		return;
+	}
+	pending++;
+	pthread_mutex_unlock(&ncheck_lock);
+
+	if (inode_cluster(ino, &daddr, &blkbbs, &offset))
+		readahead_blocks(daddr, blkbbs);
+
+	nd = xmalloc(sizeof(*nd) + len + 1);
+	nd->ino = ino;
+	memcpy(nd->path, path, len);
+	nd->path[len] = '\0';
+	err = -workqueue_add(wq, ncheck_dir_worker, 0, nd);
+	if (err) {
+		dbprintf(_("cannot queue directory inode %llu: %s\n"), ino,
+				strerror(err));
+		xfree(nd);
+		pthread_mutex_lock(&ncheck_lock);
+		if (--pending == 0)
+			pthread_cond_broadcast(&ncheck_idle);
+		pthread_mutex_unlock(&ncheck_lock);
+	}
+}
+
+static void
+ncheck_entry(
+	struct xfs_inode	*dp,
+	xfs_dir2_dataptr_t	off,
+	char			*name,
+	ssize_t			namelen,
+	xfs_ino_t		ino,
+	uint8_t			dtype,
+	void			*priv)
+{
+	struct ncheck_walk	*w = priv;
+	const char		*dir = w->dir->path;
+	size_t			dirlen = strlen(dir);
+	char			*path;
+	size_t			len;
+	bool			isdir;
+
+	/* shortform directories make up their "." and ".." */
+	if (namelen < 0)
+		return;
+	if ((namelen == 1 && name[0] == '.') ||
+	    (namelen == 2 && name[0] == '.' && name[1] == '.'))
+		return;
+	if (!libxfs_verify_dir_ino(mp, ino))
+		return;
+
+	if (has_ftype)
+		isdir = dtype == XFS_DIR3_FT_DIR;
+	else
+		isdir = ino_list_has(&dirs, ino);
+
+	len = dirlen + (dirlen != 0) + namelen;
+	path = xmalloc(len + 1);
+	if (dirlen) {
+		memcpy(path, dir, dirlen);
+		path[dirlen] = '/';
+	}
+	memcpy(path + len - namelen, name, namelen);
+	path[len] = '\0';
+
+	if (wanted.nr ? ino_list_has(&wanted, ino) :
+	    !security || ino_list_has(&secure, ino))
+		found_add(w, ino, path, len, isdir);
+	if (isdir)
+		queue_dir(w->wq, ino, path, len);
+	xfree(path);
+}
+
+static void
+ncheck_dir_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct ncheck_walk	w = { .wq = wq, .dir = arg };
+	struct xfs_inode	*dp;
+	int			error;
+
+	error = -libxfs_iget(mp, NULL, w.dir->ino, 0, &dp);
+	if (!error) {
+		if (S_ISDIR(VFS_I(dp)->i_mode))
+			error = walkdir(dp, ncheck_entry, &w);
+		else
+			error = ENOTDIR;
+		libxfs_irele(dp);
+	}
+	if (error)
+		dbprintf(_("can't read directory inode %llu: %s\n"),
+				w.dir->ino, strerror(error));
+	found_print(&w);
+	xfree(w.dir);
+
+	pthread_mutex_lock(&ncheck_lock);
+	if (--pending == 0)
+		pthread_cond_broadcast(&ncheck_idle);
+	pthread_mutex_unlock(&ncheck_lock);
+}
+
+/*
+ * Print the inode numbers and path names of everything reachable from the
+ * root, or just of the inodes in @ilist, or of the setuid, setgid and
+ * special files if @sec is set.  Each directory's names come out together
+ * in inode number order, and a file with several links is listed under each
+ * of its names.
+ */
+void
+ncheck_scan(
+	xfs_ino_t		*ilist,
+	int			ilist_size,
+	bool			sec,
+	unsigned int		threads)
+{
+	struct workqueue	wq;
+	bool			locking;
+	int			err;
+
+	has_ftype = xfs_has_ftype(mp);
+	security = sec && !ilist_size;
+	if (!threads)
+		threads = platform_nproc();
+
+	/* the threads share the buffer cache */
+	locking = libxfs_buf_set_locking(threads > 1);
+
+	if ((!has_ftype || security) && prescan(threads))
+		goto out;
+
+	wanted.nr = ilist_size;
+	wanted.inos = xmalloc(max(ilist_size, 1) * sizeof(xfs_ino_t));
+	memcpy(wanted.inos, ilist, ilist_size * sizeof(xfs_ino_t));
+	qsort(wanted.inos, wanted.nr, sizeof(xfs_ino_t), ino_cmp);
+
+	err = -workqueue_create(&wq, NULL, threads);
+	if (err) {
+		dbprintf(_("cannot create scan threads: %s\n"), strerror(err));
+		goto out;
+	}
+	/*
+	 * Directories are queued by the threads reading their parents, so
+	 * wait for the queue to drain for good before shutting it down.
+	 */
+	queue_dir(&wq, mp->m_sb.sb_rootino, "", 0);
+	pthread_mutex_lock(&ncheck_lock);
+	while (pending)
+		pthread_cond_wait(&ncheck_idle, &ncheck_lock);
+	pthread_mutex_unlock(&ncheck_lock);
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+out:
+	xfree(dirs.inos);
+	xfree(secure.inos);
+	xfree(wanted.inos);
+	xfree(seen.inos);
+	memset(&dirs, 0, sizeof(dirs));
+	memset(&secure, 0, sizeof(secure));
+	memset(&wanted, 0, sizeof(wanted));
+	memset(&seen, 0, sizeof(seen));
+	libxfs_buf_set_locking(locking);
+}
@@ -0,0 +1,8 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Inode number to path name lookup by walking the directory tree, for
+ * ncheck without blockget.
+ */
+
+extern void	ncheck_scan(xfs_ino_t *ilist, int ilist_size, bool security,
+			    unsigned int threads);
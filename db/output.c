@@ -32,17 +32,20 @@ dbprintf(const char *fmt, ...)
 		return 0;
 	va_start(ap, fmt);
 	blockint();
+	/* keep the prefix with its message, and the log in the same order */
+	flockfile(stdout);
 	i = 0;
 	if (dbprefix)
 		i += printf("%s: ", fsdevice);
 	i += vprintf(fmt, ap);
-	unblockint();
 	va_end(ap);
 	if (log_file) {
 		va_start(ap, fmt);
 		vfprintf(log_file, fmt, ap);
 		va_end(ap);
 	}
+	funlockfile(stdout);
+	unblockint();
 	return i;
 }
 
@@ -0,0 +1,319 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Per-command elapsed time and I/O accounting for xfs_db.  While profiling
+ * is on, each command run is timed and charged with the buffer cache
+ * lookups and the disk reads and writes it caused, so that slow commands
+ * against large filesystems or metadump images can be told apart from
+ * ones that are merely waiting on the disk.
+ */
+
+#include "libxfs.h"
+#include "command.h"
+#include "output.h"
+#include "init.h"
+#include "malloc.h"
+#include "profile.h"
+
+struct prof_ent {
+	const char		*name;
+	unsigned long long	calls;
+	double			elapsed;	/* seconds */
+	double			max;
+	struct profile_io	io;
+	unsigned long long	hits;
+	unsigned long long	misses;
+};
+
+bool			profiling;
+static bool		profile_verbose;
+static bool		profile_atexit;
+static struct prof_ent	*prof_ents;
+static unsigned int	nr_prof_ents;
+
+static int		profile_f(int argc, char **argv);
+static void		profile_help(void);
+
+static const cmdinfo_t	profile_cmd =
+	{ "profile", NULL, profile_f, 0, 2, 0, N_("[-v] [on|off|reset]"),
+	  N_("time commands and count the I/O they do"), profile_help };
+
+static void
+profile_help(void)
+{
+	dbprintf(_(
+"\n"
+" Keep elapsed time, buffer cache and disk I/O totals for each command.\n"
+"\n"
+" With no arguments, print the totals gathered so far, slowest commands first.\n"
+" 'on' starts profiling, 'off' stops it and 'reset' forgets the totals.\n"
+" -v -- with 'on', also print one line per command as it finishes\n"
+"\n"
+" Starting xfs_db with -P turns profiling on and prints the totals at exit.\n"
+"\n"
+));
+}
+
+static double
+ts_diff(
+	const struct timespec	*a,
+	const struct timespec	*b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static void
+add_buftarg_io(
+	struct profile_io	*io,
+	struct xfs_buftarg	*btp)
+{
+	pthread_mutex_lock(&btp->lock);
+	io->reads += btp->reads;
+	io->read_bytes += btp->bytes_read;
+	io->writes += btp->writes;
+	io->write_bytes += btp->bytes_written;
+	pthread_mutex_unlock(&btp->lock);
+}
+
+static void
+snap(
+	struct profile_snap	*ps)
+{
+	clock_gettime(CLOCK_MONOTONIC, &ps->start);
+	memset(&ps->io, 0, sizeof(ps->io));
+	if (mp && mp->m_ddev_targp) {
+		add_buftarg_io(&ps->io, mp->m_ddev_targp);
+		if (mp->m_logdev_targp != mp->m_ddev_targp)
+			add_buftarg_io(&ps->io, mp->m_logdev_targp);
+		if (mp->m_rtdev_targp != mp->m_ddev_targp)
+			add_buftarg_io(&ps->io, mp->m_rtdev_targp);
+	}
+	ps->hits = libxfs_bcache ? libxfs_bcache->c_hits : 0;
+	ps->misses = libxfs_bcache ? libxfs_bcache->c_misses : 0;
+}
+
+void
+profile_begin(
+	struct profile_snap	*ps)
+{
+	snap(ps);
+}
+
+static struct prof_ent *
+find_ent(
+	const char		*cmd)
+{
+	unsigned int		i;
+
+	for (i = 0; i < nr_prof_ents; i++)
+		if (prof_ents[i].name == cmd)
+			return &prof_ents[i];
+
+	prof_ents = xrealloc(prof_ents, (nr_prof_ents + 1) * sizeof(*prof_ents));
+	memset(&prof_ents[nr_prof_ents], 0, sizeof(*prof_ents));
+	prof_ents[nr_prof_ents].name = cmd;
+	return &prof_ents[nr_prof_ents++];
+}
+
+static double
+mib(
+	unsigned long long	bytes)
+{
+	return (double)bytes / 1048576;
+}
+
+static double
+hit_pct(
+	unsigned long long	hits,
+	unsigned long long	misses)
+{
+	if (hits + misses == 0)
+		return 0;
+	return (double)hits * 100 / (hits + misses);
+}
+
+void
+profile_end(
+	const char		*cmd,
+	const struct profile_snap *ps)
+{
+	struct profile_snap	now;
+	struct prof_ent		*pe;
+	struct prof_ent		d;
+
+	/* Don't let the profile command itself clutter the report. */
+	if (cmd == profile_cmd.name)
+		return;
+
+	snap(&now);
+	d.elapsed = ts_diff(&ps->start, &now.start);
+	d.io.reads = now.io.reads - ps->io.reads;
+	d.io.read_bytes = now.io.read_bytes - ps->io.read_bytes;
+	d.io.writes = now.io.writes - ps->io.writes;
+	d.io.write_bytes = now.io.write_bytes - ps->io.write_bytes;
+	d.hits = now.hits - ps->hits;
+	d.misses = now.misses - ps->misses;
+
+	pe = find_ent(cmd);
+	pe->calls++;
+	pe->elapsed += d.elapsed;
+	pe->max = max(pe->max, d.elapsed);
+	pe->io.reads += d.io.reads;
+	pe->io.read_bytes += d.io.read_bytes;
+	pe->io.writes += d.io.writes;
+	pe->io.write_bytes += d.io.write_bytes;
+	pe->hits += d.hits;
+	pe->misses += d.misses;
+
+	if (profile_verbose)
+		fprintf(stderr,
+_("profile: %s %.6fs reads %llu (%.2f MiB) writes %llu (%.2f MiB) cache %llu/%llu\n"),
+			cmd, d.elapsed,
+			d.io.reads, mib(d.io.read_bytes),
+			d.io.writes, mib(d.io.write_bytes),
+			d.hits, d.hits + d.misses);
+}
+
+static int
+ent_compare(
+	const void		*a,
+	const void		*b)
+{
+	const struct prof_ent	*pa = a;
+	const struct prof_ent	*pb = b;
+
+	if (pa->elapsed > pb->elapsed)
+		return -1;
+	if (pa->elapsed < pb->elapsed)
+		return 1;
+	return strcmp(pa->name, pb->name);
+}
+
+typedef int (*print_fn)(const char *fmt, ...);
+
+static int
+eprintf(
+	const char		*fmt,
+	...)
+{
+	va_list			ap;
+	int			ret;
+
+	va_start(ap, fmt);
+	ret = vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+static void
+print_ent(
+	print_fn		pr,
+	const struct prof_ent	*pe)
+{
+	pr("%-12s %7llu %10.3f %10.3f %9llu %9.1f %9llu %9.1f %6.1f\n",
+			pe->name, pe->calls, pe->elapsed, pe->max,
+			pe->io.reads, mib(pe->io.read_bytes),
+			pe->io.writes, mib(pe->io.write_bytes),
+			hit_pct(pe->hits, pe->misses));
+}
+
+static void
+report(
+	print_fn		pr)
+{
+	struct prof_ent		tot = { .name = _("total") };
+	unsigned int		i;
+
+	if (nr_prof_ents == 0) {
+		pr(_("no commands profiled\n"));
+		return;
+	}
+
+	qsort(prof_ents, nr_prof_ents, sizeof(*prof_ents), ent_compare);
+
+	pr("%-12s %7s %10s %10s %9s %9s %9s %9s %6s\n",
+			_("command"), _("calls"), _("secs"), _("max"),
+			_("reads"), _("read_MiB"), _("writes"), _("write_MiB"),
+			_("hit%"));
+	for (i = 0; i < nr_prof_ents; i++) {
+		const struct prof_ent	*pe = &prof_ents[i];
+
+		print_ent(pr, pe);
+		tot.calls += pe->calls;
+		tot.elapsed += pe->elapsed;
+		tot.max = max(tot.max, pe->max);
+		tot.io.reads += pe->io.reads;
+		tot.io.read_bytes += pe->io.read_bytes;
+		tot.io.writes += pe->io.writes;
+		tot.io.write_bytes += pe->io.write_bytes;
+		tot.hits += pe->hits;
+		tot.misses += pe->misses;
+	}
+	if (nr_prof_ents > 1)
+		print_ent(pr, &tot);
+}
+
+static int
+profile_f(
+	int		argc,
+	char		**argv)
+{
+	bool		verbose = false;
+	int		c;
+
+	while ((c = getopt(argc, argv, "v")) != -1) {
+		switch (c) {
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			profile_help();
+			return 0;
+		}
+	}
+
+	if (optind == argc) {
+		report(dbprintf);
+		return 0;
+	}
+	if (optind + 1 != argc) {
+		profile_help();
+		return 0;
+	}
+
+	if (!strcmp(argv[optind], "on")) {
+		profiling = true;
+		profile_verbose = verbose;
+	} else if (!strcmp(argv[optind], "off")) {
+		profiling = false;
+	} else if (!strcmp(argv[optind], "reset")) {
+		xfree(prof_ents);
+		prof_ents = NULL;
+		nr_prof_ents = 0;
+	} else {
+		dbprintf(_("bad profile argument %s\n"), argv[optind]);
+		exitcode = 1;
+	}
+	return 0;
+}
+
+/* Called for -P: profile everything and report on the way out. */
+void
+profile_exit(void)
+{
+	if (!profile_atexit)
+		return;
+	report(eprintf);
+}
+
+void
+profile_init(void)
+{
+	add_command(&profile_cmd);
+}
+
+void
+profile_start(void)
+{
+	profiling = true;
+	profile_atexit = true;
+}
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Per-command elapsed time and I/O accounting for xfs_db.
+ */
+
+/* Disk I/O totals, summed over the devices of the filesystem. */
+struct profile_io {
+	unsigned long long	reads;
+	unsigned long long	read_bytes;
+	unsigned long long	writes;
+	unsigned long long	write_bytes;
+};
+
+struct profile_snap {
+	struct timespec		start;
+	struct profile_io	io;
+	unsigned long long	hits;
+	unsigned long long	misses;
+};
+
+extern bool	profiling;
+
+extern void	profile_init(void);
+extern void	profile_start(void);
+extern void	profile_begin(struct profile_snap *ps);
+extern void	profile_end(const char *cmd, const struct profile_snap *ps);
+extern void	profile_exit(void);
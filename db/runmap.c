@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Run-length encoded value map for block ownership tracking.
+ *
+ * The map is cut into chunks of RUNMAP_CHUNK_SIZE entries.  Each chunk
+ * starts out as a sorted array of runs of equal, non-zero values.  Most
+ * filesystems have long runs of free space, metadata and file data, so this
+ * costs a few bytes per extent rather than per block.  If a chunk collects
+ * more runs than would fit in a bit-packed array of its values, it is
+ * converted into one, which bounds the worst case to @bits per entry.
+ */
+
+#include "libxfs.h"
+#include "malloc.h"
+#include "runmap.h"
+
+#define RUNMAP_CHUNK_SHIFT	16
+#define RUNMAP_CHUNK_SIZE	(1U << RUNMAP_CHUNK_SHIFT)
+#define RUNMAP_CHUNK_MASK	(RUNMAP_CHUNK_SIZE - 1)
+
+struct run {
+	uint32_t		start;		/* offset in the chunk */
+	uint32_t		len;
+	uint64_t		value;
+};
+
+struct chunk {
+	uint32_t		nr_runs;
+	uint32_t		max_runs;
+	struct run		*runs;
+	uint64_t		*dense;		/* packed values, if not NULL */
+};
+
+struct runmap {
+	uint64_t		nr;
+	unsigned int		bits;
+	unsigned int		per_word;	/* values in each dense word */
+	uint64_t		mask;
+	unsigned int		dense_runs;	/* run count to go dense at */
+	uint64_t		nr_chunks;
+	struct chunk		chunks[];
+};
+
+struct runmap *
+runmap_alloc(
+	uint64_t		nr,
+	unsigned int		bits)
+{
+	struct runmap		*rm;
+	uint64_t		nr_chunks;
+
+	ASSERT(bits > 0 && bits <= 64);
+
+	nr_chunks = howmany(nr, RUNMAP_CHUNK_SIZE);
+	rm = xcalloc(1, sizeof(*rm) + nr_chunks * sizeof(struct chunk));
+	rm->nr = nr;
+	rm->bits = bits;
+	rm->per_word = 64 / bits;
+	rm->mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+	rm->dense_runs = howmany(RUNMAP_CHUNK_SIZE, rm->per_word) *
+			sizeof(uint64_t) / sizeof(struct run);
+	rm->nr_chunks = nr_chunks;
+	return rm;
+}
+
+void
+runmap_free(
+	struct runmap		*rm)
+{
+	uint64_t		i;
+
+	if (!rm)
+		return;
+	for (i = 0; i < rm->nr_chunks; i++) {
+		xfree(rm->chunks[i].runs);
+		xfree(rm->chunks[i].dense);
+	}
+	xfree(rm);
+}
+
+/* Number of entries in chunk @c; only the last one can be short. */
+static inline uint32_t
+chunk_entries(
+	struct runmap		*rm,
+	uint64_t		c)
+{
+	return min(rm->nr - (c << RUNMAP_CHUNK_SHIFT),
+		   (uint64_t)RUNMAP_CHUNK_SIZE);
+}
+
+static inline uint64_t
+dense_get(
+	struct runmap		*rm,
+	struct chunk		*ch,
+	uint32_t		off)
+{
+	uint64_t		word = ch->dense[off / rm->per_word];
+
+	return (word >> ((off % rm->per_word) * rm->bits)) & rm->mask;
+}
+
+static inline void
+dense_set(
+	struct runmap		*rm,
+	struct chunk		*ch,
+	uint32_t		off,
+	uint64_t		value)
+{
+	uint64_t		*word = &ch->dense[off / rm->per_word];
+	unsigned int		shift = (off % rm->per_word) * rm->bits;
+
+	*word = (*word & ~(rm->mask << shift)) | ((value & rm->mask) << shift);
+}
+
+/* Index of the first run ending after @off. */
+static uint32_t
+run_search(
+	struct chunk		*ch,
+	uint32_t		off)
+{
+	uint32_t		lo = 0, hi = ch->nr_runs;
+
+	while (lo < hi) {
+		uint32_t	mid = (lo + hi) / 2;
+
+		if (ch->runs[mid].start + ch->runs[mid].len <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Return the value at @idx.  On entry @len is the most entries the caller is
+ * interested in; on return it is the number of entries from @idx onwards
+ * that have the same value, up to that limit or the end of the chunk.
+ */
+uint64_t
+runmap_get(
+	struct runmap		*rm,
+	uint64_t		idx,
+	uint64_t		*len)
+{
+	uint64_t		c = idx >> RUNMAP_CHUNK_SHIFT;
+	struct chunk		*ch = &rm->chunks[c];
+	uint32_t		off = idx & RUNMAP_CHUNK_MASK;
+	uint32_t		end = chunk_entries(rm, c);
+	uint32_t		i;
+	uint64_t		value;
+
+	ASSERT(idx < rm->nr);
+	ASSERT(*len > 0);
+
+	end = min((uint64_t)end, off + *len);
+
+	if (ch->dense) {
+		value = dense_get(rm, ch, off);
+		for (i = off + 1; i < end; i++)
+			if (dense_get(rm, ch, i) != value)
+				break;
+		*len = i - off;
+		return value;
+	}
+
+	i = run_search(ch, off);
+	if (i < ch->nr_runs && ch->runs[i].start <= off) {
+		*len = min(ch->runs[i].start + ch->runs[i].len, end) - off;
+		return ch->runs[i].value;
+	}
+	*len = (i < ch->nr_runs ? min(ch->runs[i].start, end) : end) - off;
+	return 0;
+}
+
+static void
+chunk_make_dense(
+	struct runmap		*rm,
+	struct chunk		*ch)
+{
+	uint32_t		i, j;
+
+	ch->dense = xcalloc(howmany(RUNMAP_CHUNK_SIZE, rm->per_word),
+			sizeof(uint64_t));
+	for (i = 0; i < ch->nr_runs; i++)
+		for (j = 0; j < ch->runs[i].len; j++)
+			dense_set(rm, ch, ch->runs[i].start + j,
+					ch->runs[i].value);
+	xfree(ch->runs);
+	ch->runs = NULL;
+	ch->nr_runs = ch->max_runs = 0;
+}
+
+/* Replace the runs overlapping [off, off + len) with @value. */
+static void
+chunk_set(
+	struct runmap		*rm,
+	struct chunk		*ch,
+	uint32_t		off,
+	uint32_t		len,
+	uint64_t		value)
+{
+	struct run		new[3];
+	uint32_t		end = off + len;
+	uint32_t		lo, hi;
+	int			nr_new = 0, i, j;
+
+	if (ch->dense) {
+		for (i = 0; i < len; i++)
+			dense_set(rm, ch, off + i, value);
+		return;
+	}
+
+	/* runs [lo, hi) overlap the range */
+	lo = run_search(ch, off);
+	for (hi = lo; hi < ch->nr_runs && ch->runs[hi].start < end; hi++)
+		;
+
+	/* keep the parts of the first and last runs outside the range */
+	if (lo < hi && ch->runs[lo].start < off) {
+		new[nr_new] = ch->runs[lo];
+		new[nr_new++].len = off - ch->runs[lo].start;
+	}
+	if (value) {
+		new[nr_new].start = off;
+		new[nr_new].len = len;
+		new[nr_new++].value = value;
+	}
+	if (lo < hi && ch->runs[hi - 1].start + ch->runs[hi - 1].len > end) {
+		new[nr_new] = ch->runs[hi - 1];
+		new[nr_new].start = end;
+		new[nr_new++].len = ch->runs[hi - 1].start +
+				    ch->runs[hi - 1].len - end;
+	}
+
+	/* merge with the neighbouring runs */
+	if (nr_new && lo > 0 &&
+	    ch->runs[lo - 1].start + ch->runs[lo - 1].len == new[0].start &&
+	    ch->runs[lo - 1].value == new[0].value) {
+		lo--;
+		new[0].len += new[0].start - ch->runs[lo].start;
+		new[0].start = ch->runs[lo].start;
+	}
+	if (nr_new && hi < ch->nr_runs &&
+	    new[nr_new - 1].start + new[nr_new - 1].len ==
+			ch->runs[hi].start &&
+	    new[nr_new - 1].value == ch->runs[hi].value) {
+		new[nr_new - 1].len += ch->runs[hi].len;
+		hi++;
+	}
+	for (i = 0, j = 1; j < nr_new; j++) {
+		if (new[i].start + new[i].len == new[j].start &&
+		    new[i].value == new[j].value)
+			new[i].len += new[j].len;
+		else
+			new[++i] = new[j];
+	}
+	if (nr_new)
+		nr_new = i + 1;
+
+	if (ch->nr_runs - (hi - lo) + nr_new > ch->max_runs) {
+		ch->max_runs = max(ch->max_runs * 2, 4U);
+		ch->runs = xrealloc(ch->runs,
+				ch->max_runs * sizeof(struct run));
+	}
+	memmove(&ch->runs[lo + nr_new], &ch->runs[hi],
+			(ch->nr_runs - hi) * sizeof(struct run));
+	memcpy(&ch->runs[lo], new, nr_new * sizeof(struct run));
+	ch->nr_runs = ch->nr_runs - (hi - lo) + nr_new;
+
+	if (ch->nr_runs > rm->dense_runs)
+		chunk_make_dense(rm, ch);
+}
+
+/* Set @len entries from @idx to @value; zero clears them. */
+void
+runmap_set(
+	struct runmap		*rm,
+	uint64_t		idx,
+	uint64_t		len,
+	uint64_t		value)
+{
+	uint64_t		c;
+	uint32_t		off, n;
+
+	ASSERT(idx + len <= rm->nr);
+	ASSERT((value & rm->mask) == value);
+
+	while (len > 0) {
+		c = idx >> RUNMAP_CHUNK_SHIFT;
+		off = idx & RUNMAP_CHUNK_MASK;
+		n = min(len, (uint64_t)(RUNMAP_CHUNK_SIZE - off));
+		chunk_set(rm, &rm->chunks[c], off, n, value);
+		idx += n;
+		len -= n;
+	}
+}
@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * A map from a range of block numbers to small values, kept as runs of
+ * equal values and switching to a bit-packed array only where the runs
+ * get too fragmented to be worth it.  Unset entries read as zero.
+ */
+
+struct runmap;
+
+extern struct runmap	*runmap_alloc(uint64_t nr, unsigned int bits);
+extern void		runmap_free(struct runmap *rm);
+extern uint64_t		runmap_get(struct runmap *rm, uint64_t idx,
+				   uint64_t *len);
+extern void		runmap_set(struct runmap *rm, uint64_t idx,
+				   uint64_t len, uint64_t value);
@@ -139,6 +139,21 @@ platform_discard_blocks(int fd, uint64_t start, uint64_t len)
 	return 0;
 }
 
+#ifndef BLKZEROOUT
+#define BLKZEROOUT	_IO(0x12,127)
+#endif
+
+/* Have a block device write zeroes to a range, without data transfer. */
+static __inline__ int
+platform_zero_out(int fd, uint64_t start, uint64_t len)
+{
+	uint64_t range[2] = { start, len };
+
+	if (ioctl(fd, BLKZEROOUT, &range) < 0)
+		return -errno;
+	return 0;
+}
+
 #define ENOATTR		ENODATA	/* Attribute not found */
 #define EFSCORRUPTED	EUCLEAN	/* Filesystem is corrupted */
 #define EFSBADCRC	EBADMSG	/* Bad CRC detected */
@@ -194,6 +209,29 @@ platform_zero_range(
 #define platform_zero_range(fd, s, l)	(-EOPNOTSUPP)
 #endif
 
+/*
+ * Zero a range by deallocating it.  For block devices this only succeeds if
+ * the device can unmap the range and guarantee that it reads back as zeroes.
+ */
+#if defined(FALLOC_FL_PUNCH_HOLE)
+static inline int
+platform_unmap_range(
+	int		fd,
+	xfs_off_t	start,
+	size_t		len)
+{
+	int ret;
+
+	ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			start, len);
+	if (!ret)
+		return 0;
+	return -errno;
+}
+#else
+#define platform_unmap_range(fd, s, l)	(-EOPNOTSUPP)
+#endif
+
 /*
  * Use SIGKILL to simulate an immediate program crash, without a chance to run
  * atexit handlers.
@@ -11,6 +11,8 @@
 #include "libfrog/fsgeom.h"
 #include "libfrog/bulkstat.h"
 #include "libfrog/paths.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/latency.h"
 #include "io.h"
 #include "input.h"
 
@@ -72,6 +74,9 @@ bulkstat_help(void)
 "   -e <ino>   Stop after this inode.\n"
 "   -n <nr>    Ask for this many results at once.\n"
 "   -s <ino>   Inode to start with.\n"
+"   -T <nr>    Scan all AGs with this many threads and report the inode\n"
+"              rate and ioctl latency instead of the inodes; with -d, also\n"
+"              report each AG.\n"
 "   -v <ver>   Use this version of the ioctl (1 or 5).\n"));
 }
 
@@ -92,6 +97,193 @@ set_xfd_flags(
 	}
 }
 
+/*
+ * Parallel scans (-T): every AG is one work item, and however many threads
+ * were asked for pull AGs off the queue until all of them have been walked.
+ * Nothing is printed per record; this is for measuring how fast the kernel
+ * hands out inodes at a given batch size and concurrency.
+ */
+struct bulk_ag {
+	unsigned long long	records;	/* inodes or inode groups */
+	unsigned long long	inodes;
+	unsigned long long	calls;
+	uint64_t		ns;
+	int			error;
+};
+
+struct bulk_scan {
+	struct xfs_fd		xfd;		/* copied for each AG */
+	bool			inumbers;
+	uint32_t		batch_size;
+	struct latency_hist	lat;
+	struct bulk_ag		*ags;
+};
+
+static void
+bulk_scan_ag(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct bulk_scan	*scan = wq->wq_ctx;
+	struct bulk_ag		*ag = &scan->ags[agno];
+	struct xfs_fd		xfd = scan->xfd;
+	struct xfs_bulkstat_req	*breq = NULL;
+	struct xfs_inumbers_req	*ireq = NULL;
+	uint64_t		start = latency_now();
+	int			ret;
+
+	if (scan->inumbers) {
+		ret = -xfrog_inumbers_alloc_req(scan->batch_size, 0, &ireq);
+		if (!ret)
+			xfrog_inumbers_set_ag(ireq, agno);
+	} else {
+		ret = -xfrog_bulkstat_alloc_req(scan->batch_size, 0, &breq);
+		if (!ret)
+			xfrog_bulkstat_set_ag(breq, agno);
+	}
+	if (ret) {
+		ag->error = ret;
+		return;
+	}
+
+	for (;;) {
+		uint64_t	t = latency_now();
+		uint32_t	ocount;
+		uint32_t	i;
+
+		if (scan->inumbers)
+			ret = -xfrog_inumbers(&xfd, ireq);
+		else
+			ret = -xfrog_bulkstat(&xfd, breq);
+		ag->calls++;
+		if (ret)
+			break;
+		latency_hist_add(&scan->lat, latency_now() - t);
+
+		ocount = scan->inumbers ? ireq->hdr.ocount : breq->hdr.ocount;
+		if (ocount == 0)
+			break;
+		ag->records += ocount;
+		if (!scan->inumbers)
+			ag->inodes += ocount;
+		else
+			for (i = 0; i < ocount; i++)
+				ag->inodes += ireq->inumbers[i].xi_alloccount;
+	}
+
+	ag->error = ret;
+	ag->ns = latency_now() - start;
+	free(breq);
+	free(ireq);
+}
+
+static int
+bulk_scan(
+	struct xfs_fd		*xfd,
+	bool			inumbers,
+	uint32_t		batch_size,
+	unsigned int		nr_threads,
+	bool			verbose)
+{
+	struct bulk_scan	scan = {
+		.xfd		= *xfd,
+		.inumbers	= inumbers,
+		.batch_size	= batch_size,
+	};
+	struct workqueue	wq;
+	struct timeval		t1, t2;
+	const char		*what = inumbers ? "xfrog_inumbers" :
+						   "xfrog_bulkstat";
+	unsigned long long	records = 0, inodes = 0, calls = 0;
+	uint32_t		agcount = xfd->fsgeom.agcount;
+	char			ts[64];
+	uint32_t		agno;
+	int			ret;
+
+	scan.ags = calloc(agcount, sizeof(struct bulk_ag));
+	if (!scan.ags) {
+		perror("calloc");
+		return -1;
+	}
+	ret = -latency_hist_init(&scan.lat);
+	if (ret) {
+		xfrog_perror(ret, "latency_hist_init");
+		free(scan.ags);
+		return -1;
+	}
+
+	gettimeofday(&t1, NULL);
+	ret = -workqueue_create(&wq, &scan, nr_threads);
+	if (ret) {
+		xfrog_perror(ret, "creating bulk scan threads");
+		goto out;
+	}
+	for (agno = 0; agno < agcount && !ret; agno++)
+		ret = -workqueue_add(&wq, bulk_scan_ag, agno, NULL);
+	if (ret)
+		xfrog_perror(ret, "queueing bulk scan");
+	if (workqueue_terminate(&wq) && !ret)
+		ret = EIO;
+	workqueue_destroy(&wq);
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+	if (ret)
+		goto out;
+
+	for (agno = 0; agno < agcount; agno++) {
+		struct bulk_ag	*ag = &scan.ags[agno];
+
+		if (ag->error) {
+			fprintf(stderr, _("AG %u: "), agno);
+			xfrog_perror(ag->error, what);
+			ret = ag->error;
+		}
+		records += ag->records;
+		inodes += ag->inodes;
+		calls += ag->calls;
+		if (verbose)
+			printf(
+_("AG %u: %llu inodes in %llu records, %llu calls, %.6f sec\n"),
+				agno, ag->inodes, ag->records, ag->calls,
+				ag->ns / 1e9);
+	}
+
+	timestr(&t2, ts, sizeof(ts), 0);
+	if (inumbers)
+		printf(
+_("%llu inode groups (%llu inodes) in %u AGs, %u threads, batch %u; %s\n"),
+			records, inodes, agcount, nr_threads, batch_size, ts);
+	else
+		printf(_("%llu inodes in %u AGs, %u threads, batch %u; %s\n"),
+			inodes, agcount, nr_threads, batch_size, ts);
+	printf(_("%.1f inodes/sec, %.1f calls/sec\n"),
+		tdiv((double)inodes, t2), tdiv((double)calls, t2));
+	latency_print(_("ioctl latency"), &scan.lat, 0);
+out:
+	latency_hist_free(&scan.lat);
+	free(scan.ags);
+	return ret ? -1 : 0;
+}
+
+/* -T scans all of every AG, so it can't take -a, -s or -e. */
+static int
+check_scan_args(
+	unsigned int		nr_threads,
+	bool			has_agno,
+	uint64_t		startino,
+	uint64_t		endino)
+{
+	if (!nr_threads)
+		return 0;
+	if (has_agno || startino != 0 || endino != -1ULL) {
+		fprintf(stderr,
+_("-T scans every AG; it cannot be combined with -a, -s or -e.\n"));
+		return -1;
+	}
+	return 0;
+}
+
 static int
 bulkstat_f(
 	int			argc,
@@ -105,13 +297,14 @@ bulkstat_f(
 	uint32_t		agno = 0;
 	uint32_t		ver = 0;
 	bool			has_agno = false;
+	unsigned int		nr_threads = 0;
 	bool			debug = false;
 	bool			quiet = false;
 	unsigned int		i;
 	int			c;
 	int			ret;
 
-	while ((c = getopt(argc, argv, "a:de:n:qs:v:")) != -1) {
+	while ((c = getopt(argc, argv, "a:de:n:qs:T:v:")) != -1) {
 		switch (c) {
 		case 'a':
 			agno = cvt_u32(optarg, 10);
@@ -148,6 +341,14 @@ bulkstat_f(
 				return 1;
 			}
 			break;
+		case 'T':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno || !nr_threads) {
+				fprintf(stderr, _("bad thread count %s\n"),
+						optarg);
+				return 1;
+			}
+			break;
 		case 'v':
 			ver = cvt_u32(optarg, 10);
 			if (errno) {
@@ -168,6 +369,10 @@ bulkstat_f(
 		bulkstat_help();
 		return 0;
 	}
+	if (check_scan_args(nr_threads, has_agno, startino, endino)) {
+		exitcode = 1;
+		return 0;
+	}
 
 	ret = -xfd_prepare_geometry(&xfd);
 	if (ret) {
@@ -176,6 +381,13 @@ bulkstat_f(
 		return 0;
 	}
 
+	if (nr_threads) {
+		set_xfd_flags(&xfd, ver);
+		if (bulk_scan(&xfd, false, batch_size, nr_threads, debug))
+			exitcode = 1;
+		return 0;
+	}
+
 	ret = -xfrog_bulkstat_alloc_req(batch_size, startino, &breq);
 	if (ret) {
 		xfrog_perror(ret, "alloc bulkreq");
@@ -351,6 +563,9 @@ inumbers_help(void)
 "   -e <ino>   Stop after this inode.\n"
 "   -n <nr>    Ask for this many results at once.\n"
 "   -s <ino>   Inode to start with.\n"
+"   -T <nr>    Scan all AGs with this many threads and report the inode\n"
+"              rate and ioctl latency instead of the groups; with -d, also\n"
+"              report each AG.\n"
 "   -v <ver>   Use this version of the ioctl (1 or 5).\n"));
 }
 
@@ -367,12 +582,13 @@ inumbers_f(
 	uint32_t		agno = 0;
 	uint32_t		ver = 0;
 	bool			has_agno = false;
+	unsigned int		nr_threads = 0;
 	bool			debug = false;
 	unsigned int		i;
 	int			c;
 	int			ret;
 
-	while ((c = getopt(argc, argv, "a:de:n:s:v:")) != -1) {
+	while ((c = getopt(argc, argv, "a:de:n:s:T:v:")) != -1) {
 		switch (c) {
 		case 'a':
 			agno = cvt_u32(optarg, 10);
@@ -406,6 +622,14 @@ inumbers_f(
 				return 1;
 			}
 			break;
+		case 'T':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno || !nr_threads) {
+				fprintf(stderr, _("bad thread count %s\n"),
+						optarg);
+				return 1;
+			}
+			break;
 		case 'v':
 			ver = cvt_u32(optarg, 10);
 			if (errno) {
@@ -426,6 +650,10 @@ inumbers_f(
 		bulkstat_help();
 		return 0;
 	}
+	if (check_scan_args(nr_threads, has_agno, startino, endino)) {
+		exitcode = 1;
+		return 0;
+	}
 
 	ret = -xfd_prepare_geometry(&xfd);
 	if (ret) {
@@ -434,6 +662,13 @@ inumbers_f(
 		return 0;
 	}
 
+	if (nr_threads) {
+		set_xfd_flags(&xfd, ver);
+		if (bulk_scan(&xfd, true, batch_size, nr_threads, debug))
+			exitcode = 1;
+		return 0;
+	}
+
 	ret = -xfrog_inumbers_alloc_req(batch_size, startino, &ireq);
 	if (ret) {
 		xfrog_perror(ret, "alloc inumbersreq");
@@ -505,14 +740,14 @@ void
 bulkstat_init(void)
 {
 	bulkstat_cmd.args =
-_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-v version]");
+_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-T threads] [-v version]");
 	bulkstat_cmd.oneline = _("Bulk stat of inodes in a filesystem");
 
 	bulkstat_single_cmd.args = _("[-d] [-v version] inum...");
 	bulkstat_single_cmd.oneline = _("Stat one inode in a filesystem");
 
 	inumbers_cmd.args =
-_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-v version]");
+_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-T threads] [-v version]");
 	inumbers_cmd.oneline = _("Query inode groups in a filesystem");
 
 	add_command(&bulkstat_cmd);
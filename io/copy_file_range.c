@@ -41,6 +41,9 @@ copy_file_range_cmd(int fd, long long *src_off, long long *dst_off, size_t len)
 	loff_t ret;
 
 	do {
+		uint64_t	lat = latency_start();
+		long long	start = *dst_off;
+
 		ret = syscall(__NR_copy_file_range, fd, src_off,
 				file->fd, dst_off, len, 0);
 		if (ret == -1) {
@@ -48,6 +51,7 @@ copy_file_range_cmd(int fd, long long *src_off, long long *dst_off, size_t len)
 			return errno;
 		} else if (ret == 0)
 			break;
+		latency_end(lat, start, ret);
 		len -= ret;
 	} while (len > 0);
 
@@ -165,7 +169,10 @@ copy_range_f(int argc, char **argv)
 			len = sz - src_off;
 	}
 
+	latency_begin("copy_range");
 	ret = copy_file_range_cmd(fd, &src_off, &dst_off, len);
+	if (!ret)
+		latency_report(0);
 out:
 	close(fd);
 	if (ret < 0)
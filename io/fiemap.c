@@ -239,6 +239,7 @@ fiemap_f(
 	off64_t		range_end = -1LL;	/* mapping end*/
 	size_t		fsblocksize, fssectsize;
 	struct stat	st;
+	uint64_t	lat;
 
 	init_cvtnum(&fsblocksize, &fssectsize);
 
@@ -297,6 +298,7 @@ fiemap_f(
 
 	printf("%s:\n", file->name);
 
+	latency_begin("fiemap");
 	while (!done) {
 		memset(fiemap, 0, map_size);
 		fiemap->fm_flags = fiemap_flags;
@@ -304,6 +306,7 @@ fiemap_f(
 		fiemap->fm_length = range_end - last_logical;
 		fiemap->fm_extent_count = EXTENT_BATCH;
 
+		lat = latency_start();
 		ret = ioctl(file->fd, FS_IOC_FIEMAP, (unsigned long)fiemap);
 		if (ret < 0) {
 			fprintf(stderr, "%s: ioctl(FS_IOC_FIEMAP) [\"%s\"]: "
@@ -312,6 +315,7 @@ fiemap_f(
 			exitcode = 1;
 			return 0;
 		}
+		latency_end(lat, last_logical, fiemap->fm_length);
 
 		/* No more extents to map, exit */
 		if (!fiemap->fm_mapped_extents)
@@ -382,6 +386,7 @@ fiemap_f(
 
 out:
 	free(fiemap);
+	latency_report(0);
 	return 0;
 }
 
@@ -12,30 +12,145 @@
 static cmdinfo_t fsync_cmd;
 static cmdinfo_t fdatasync_cmd;
 
+static void
+fsync_help(void)
+{
+	printf(_(
+"\n"
+" flushes the open file's data and metadata (fsync) or just what is needed\n"
+" to read the data back (fdatasync) to stable storage\n"
+"\n"
+" -T N -- call it from N threads at once and report the rate per thread\n"
+" -M   -- with -T, thread i syncs the i'th open file (counting on from the\n"
+"         current one) instead of all syncing this one\n"
+" -c N -- with -T, each thread syncs N times (default 1)\n"
+" -q   -- with -T, don't print the timings\n"
+" -C   -- with -T, print the timings in compact form\n"
+"\n"));
+}
+
 static int
-fsync_f(
+fsync_thread(
+	struct io_thread	*t)
+{
+	struct io_threads	*it = t->parent;
+	long			*count = it->priv;
+	long			i;
+
+	for (i = 0; i < *count; i++) {
+		uint64_t	lat = latency_start();
+
+		if ((it->sync == IO_THREADS_FSYNC ? fsync(t->fd) :
+						     fdatasync(t->fd)) < 0) {
+			t->error = errno;
+			perror(it->sync == IO_THREADS_FSYNC ? "fsync" :
+							       "fdatasync");
+			return -1;
+		}
+		latency_end(lat, 0, 0);
+		t->ops++;
+	}
+	return 0;
+}
+
+static int
+sync_f(
 	int			argc,
-	char			**argv)
+	char			**argv,
+	int			how)
 {
-	if (fsync(file->fd) < 0) {
-		perror("fsync");
+	struct io_threads	threads = { .sync = how };
+	const cmdinfo_t		*ct;
+	long			count = 1;
+	char			*sp;
+	int			Cflag = 0, qflag = 0;
+	int			c;
+
+	ct = how == IO_THREADS_FSYNC ? &fsync_cmd : &fdatasync_cmd;
+	while ((c = getopt(argc, argv, "c:CMqT:")) != EOF) {
+		switch (c) {
+		case 'c':
+			count = strtol(optarg, &sp, 0);
+			if (!sp || sp == optarg || count < 1) {
+				printf(_("non-numeric count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'M':
+			threads.per_file = 1;
+			break;
+		case 'q':
+			qflag = 1;
+			break;
+		case 'T':
+			threads.nr = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || threads.nr < 1) {
+				printf(_("non-numeric thread count -- %s\n"),
+					optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(ct);
+		}
+	}
+	if (optind != argc ||
+	    (!threads.nr && (threads.per_file || count != 1))) {
 		exitcode = 1;
+		return command_usage(ct);
+	}
+
+	latency_begin(ct->name);
+	if (!threads.nr) {
+		uint64_t	lat = latency_start();
+
+		if ((how == IO_THREADS_FSYNC ? fsync(file->fd) :
+					       fdatasync(file->fd)) < 0) {
+			perror(ct->name);
+			exitcode = 1;
+			return 0;
+		}
+		latency_end(lat, 0, 0);
+		latency_report(Cflag);
 		return 0;
 	}
+
+	threads.fn = fsync_thread;
+	threads.priv = &count;
+	if (io_threads_setup(&threads, 0, 0, 0, 0) < 0) {
+		exitcode = 1;
+		return 0;
+	}
+	if (io_threads_run(&threads))
+		exitcode = 1;
+	else if (!qflag) {
+		io_threads_report(&threads, "synced", 0, 0, Cflag);
+		latency_report(Cflag);
+	}
+	io_threads_free(&threads);
 	return 0;
 }
 
+static int
+fsync_f(
+	int			argc,
+	char			**argv)
+{
+	return sync_f(argc, argv, IO_THREADS_FSYNC);
+}
+
 static int
 fdatasync_f(
 	int			argc,
 	char			**argv)
 {
-	if (fdatasync(file->fd) < 0) {
-		perror("fdatasync");
-		exitcode = 1;
-		return 0;
-	}
-	return 0;
+	return sync_f(argc, argv, IO_THREADS_FDATASYNC);
 }
 
 void
@@ -44,14 +159,20 @@ fsync_init(void)
 	fsync_cmd.name = "fsync";
 	fsync_cmd.altname = "s";
 	fsync_cmd.cfunc = fsync_f;
+	fsync_cmd.argmax = -1;
 	fsync_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	fsync_cmd.args = _("[-T N [-M] [-c count] [-qC]]");
+	fsync_cmd.help = fsync_help;
 	fsync_cmd.oneline =
 		_("calls fsync(2) to flush all in-core file state to disk");
 
 	fdatasync_cmd.name = "fdatasync";
 	fdatasync_cmd.altname = "ds";
 	fdatasync_cmd.cfunc = fdatasync_f;
+	fdatasync_cmd.argmax = -1;
 	fdatasync_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	fdatasync_cmd.args = _("[-T N [-M] [-c count] [-qC]]");
+	fdatasync_cmd.help = fsync_help;
 	fdatasync_cmd.oneline =
 		_("calls fdatasync(2) to flush the files in-core data to disk");
 
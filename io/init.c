@@ -62,8 +62,10 @@ init_commands(void)
 	imap_init();
 	inject_init();
 	label_init();
+	latency_init();
 	log_writes_init();
 	madvise_init();
+	mdbench_init();
 	mincore_init();
 	mmap_init();
 	open_init();
@@ -85,6 +87,7 @@ init_commands(void)
 	sync_init();
 	sync_range_init();
 	truncate_init();
+	uring_init();
 	utimes_init();
 	crc32cselftest_init();
 }
@@ -88,6 +88,68 @@ extern int		read_buffer(int, off64_t, long long, long long *,
 					int, int);
 extern void		dump_buffer(off64_t, ssize_t);
 
+/*
+ * Parallel data commands (-T): one io_thread per worker, all sharing the
+ * io_threads that describes the job.
+ */
+#define IO_THREADS_FSYNC	1
+#define IO_THREADS_FDATASYNC	2
+
+struct io_threads;
+
+struct io_thread {
+	struct io_threads	*parent;
+	pthread_t		tid;
+	int			idx;
+	int			fd;		/* file this thread works on */
+	off64_t			offset;		/* start of this thread's range */
+	long long		count;		/* bytes in this thread's range */
+	long long		total;		/* bytes actually moved */
+	int			ops;
+	int			error;		/* errno of the first failure */
+	struct timeval		elapsed;
+	void			*buf;		/* private bsize buffer */
+};
+
+struct io_threads {
+	int			nr;
+	int			per_file;	/* thread i uses open file i */
+	int			write;
+	int			sync;		/* IO_THREADS_* at the end */
+	int			direction;
+	size_t			bsize;		/* bytes per I/O */
+	size_t			align;		/* slice alignment if no bsize */
+	unsigned int		zeed;
+	int			(*fn)(struct io_thread *t);
+	void			*priv;
+	struct io_thread	*threads;
+	struct timeval		elapsed;
+};
+
+extern int		io_threads_setup(struct io_threads *, off64_t,
+					long long, int, unsigned int);
+extern void		io_threads_free(struct io_threads *);
+extern int		io_threads_run(struct io_threads *);
+extern int		io_thread_rw(struct io_thread *);
+extern void		io_threads_report(struct io_threads *, const char *,
+					off64_t, long long, int);
+extern int		io_threads_rw_f(struct io_threads *, off64_t,
+					long long, unsigned int, int, int);
+
+/*
+ * Per-operation latency percentiles (the latency command)
+ */
+struct latency_hist;
+
+extern bool		latency_on;
+extern uint64_t		latency_now(void);
+extern uint64_t		latency_start(void);
+extern void		latency_end(uint64_t, long long, long long);
+extern void		latency_begin(const char *);
+extern void		latency_report(int);
+extern void		latency_print(const char *, const struct latency_hist *,
+					int);
+
 extern void		attr_init(void);
 extern void		bmap_init(void);
 extern void		encrypt_init(void);
@@ -100,6 +162,8 @@ extern void		help_init(void);
 extern void		imap_init(void);
 extern void		inject_init(void);
 extern void		label_init(void);
+extern void		latency_init(void);
+extern void		mdbench_init(void);
 extern void		mmap_init(void);
 extern void		open_init(void);
 extern void		parent_init(void);
@@ -152,6 +216,12 @@ extern void		copy_range_init(void);
 #define copy_range_init()	do { } while (0)
 #endif
 
+#ifdef HAVE_IO_URING
+extern void		uring_init(void);
+#else
+#define uring_init()	do { } while (0)
+#endif
+
 #ifdef HAVE_SYNC_FILE_RANGE
 extern void		sync_range_init(void);
 #else
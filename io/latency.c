@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Per-operation latency reporting for the data commands.  While it is on,
+ * every pread, pwrite, sendfile, copy_range, reflink, dedupe, fsync, fiemap
+ * or readdir call a command makes is timed into a histogram, and the
+ * command follows its usual throughput report with the percentiles.
+ * Averages hide exactly the tail latencies we usually care about.
+ */
+
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+#include "libfrog/latency.h"
+
+static cmdinfo_t latency_cmd;
+
+bool				latency_on;
+static struct latency_hist	lat_hist;
+static const char		*lat_op;
+static FILE			*lat_raw;
+static char			*lat_raw_name;
+
+static const double		lat_pcts[] = { 50, 90, 99, 99.9 };
+#define NR_PCTS			(sizeof(lat_pcts) / sizeof(lat_pcts[0]))
+
+static void
+latency_help(void)
+{
+	printf(_(
+"\n"
+" times every I/O, sync or mapping call made by the data commands\n"
+"\n"
+" Example:\n"
+" 'latency on' then 'pread -R 0 1g' - random reads, followed by the latency\n"
+"                                     percentiles of the individual reads\n"
+"\n"
+" While latency reporting is on, pread, pwrite, aread, awrite, sendfile,\n"
+" copy_range, reflink, dedupe, fsync, fdatasync, fiemap and readdir record\n"
+" how long each call they make takes, and print the minimum, mean, 50th,\n"
+" 90th, 99th and 99.9th percentile and maximum after their usual output\n"
+" (as one CSV line, in microseconds, when the command was given -C).\n"
+" Percentiles are accurate to within about 2%%.\n"
+" -r file -- with 'on', also append every sample to file as CSV:\n"
+"            command,offset,length,nanoseconds\n"
+"\n"
+" With no argument, say whether latency reporting is on.\n"
+"\n"));
+}
+
+/* Monotonic clock in nanoseconds; never zero. */
+uint64_t
+latency_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+uint64_t
+latency_start(void)
+{
+	if (!latency_on)
+		return 0;
+	return latency_now();
+}
+
+void
+latency_end(
+	uint64_t		start,
+	long long		offset,
+	long long		len)
+{
+	uint64_t		ns;
+
+	if (!start)
+		return;
+	ns = latency_now() - start;
+	latency_hist_add(&lat_hist, ns);
+	if (lat_raw)
+		fprintf(lat_raw, "%s,%lld,%lld,%llu\n", lat_op, offset, len,
+				(unsigned long long)ns);
+}
+
+/* Forget the last command's samples and start on a new one. */
+void
+latency_begin(
+	const char		*op)
+{
+	if (!latency_on)
+		return;
+	latency_hist_reset(&lat_hist);
+	lat_op = op;
+}
+
+static void
+fmt_ns(
+	uint64_t		ns,
+	char			*buf,
+	size_t			len)
+{
+	if (ns < 1000)
+		snprintf(buf, len, "%lluns", (unsigned long long)ns);
+	else if (ns < 1000000)
+		snprintf(buf, len, "%.1fus", ns / 1000.0);
+	else if (ns < 1000000000)
+		snprintf(buf, len, "%.2fms", ns / 1000000.0);
+	else
+		snprintf(buf, len, "%.3fs", ns / 1000000000.0);
+}
+
+/*
+ * Print the percentiles of any histogram, headed by tag.  Commands that
+ * always measure latency (bulkstat -T, mdbench) keep their own histograms
+ * and print them through here too.
+ */
+void
+latency_print(
+	const char		*tag,
+	const struct latency_hist *lh,
+	int			compact)
+{
+	uint64_t		vals[NR_PCTS];
+	uint64_t		avg;
+	char			s[NR_PCTS + 3][32];
+	unsigned int		i;
+
+	if (!lh->count)
+		return;
+
+	avg = lh->sum / lh->count;
+	for (i = 0; i < NR_PCTS; i++)
+		vals[i] = latency_hist_pct(lh, lat_pcts[i]);
+
+	if (compact) {	/* ops,min,avg,p50,p90,p99,p99.9,max in usec */
+		printf("%llu,%.3f,%.3f", (unsigned long long)lh->count,
+				lh->min / 1000.0, avg / 1000.0);
+		for (i = 0; i < NR_PCTS; i++)
+			printf(",%.3f", vals[i] / 1000.0);
+		printf(",%.3f\n", lh->max / 1000.0);
+		return;
+	}
+
+	fmt_ns(lh->min, s[0], sizeof(s[0]));
+	fmt_ns(avg, s[1], sizeof(s[1]));
+	for (i = 0; i < NR_PCTS; i++)
+		fmt_ns(vals[i], s[i + 2], sizeof(s[i + 2]));
+	fmt_ns(lh->max, s[i + 2], sizeof(s[i + 2]));
+	printf(_("%s: %llu ops; min %s avg %s p50 %s p90 %s p99 %s p99.9 %s max %s\n"),
+		tag, (unsigned long long)lh->count, s[0], s[1], s[2], s[3],
+		s[4], s[5], s[6]);
+}
+
+void
+latency_report(
+	int			compact)
+{
+	if (!latency_on)
+		return;
+	if (lat_raw)
+		fflush(lat_raw);
+	latency_print(_("latency"), &lat_hist, compact);
+}
+
+static void
+latency_raw_close(void)
+{
+	if (lat_raw)
+		fclose(lat_raw);
+	lat_raw = NULL;
+	free(lat_raw_name);
+	lat_raw_name = NULL;
+}
+
+static int
+latency_f(
+	int			argc,
+	char			**argv)
+{
+	char			*raw = NULL;
+	int			c;
+
+	while ((c = getopt(argc, argv, "r:")) != EOF) {
+		switch (c) {
+		case 'r':
+			raw = optarg;
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&latency_cmd);
+		}
+	}
+	if (optind == argc && !raw) {
+		if (!latency_on)
+			printf(_("latency reporting is off\n"));
+		else if (lat_raw_name)
+			printf(_("latency reporting is on, samples go to %s\n"),
+				lat_raw_name);
+		else
+			printf(_("latency reporting is on\n"));
+		return 0;
+	}
+	if (optind != argc - 1 ||
+	    (raw && strcmp(argv[optind], "on"))) {
+		exitcode = 1;
+		return command_usage(&latency_cmd);
+	}
+
+	if (!strcmp(argv[optind], "off")) {
+		latency_on = false;
+		latency_raw_close();
+		return 0;
+	}
+	if (strcmp(argv[optind], "on")) {
+		exitcode = 1;
+		return command_usage(&latency_cmd);
+	}
+
+	if (!lat_hist.buckets && latency_hist_init(&lat_hist)) {
+		perror("latency");
+		exitcode = 1;
+		return 0;
+	}
+	latency_raw_close();
+	if (raw) {
+		lat_raw = fopen(raw, "a");
+		if (!lat_raw) {
+			perror(raw);
+			exitcode = 1;
+			return 0;
+		}
+		lat_raw_name = strdup(raw);
+		if (ftell(lat_raw) == 0)
+			fprintf(lat_raw, "command,offset,length,nsec\n");
+	}
+	latency_on = true;
+	return 0;
+}
+
+void
+latency_init(void)
+{
+	latency_cmd.name = "latency";
+	latency_cmd.cfunc = latency_f;
+	latency_cmd.argmin = 0;
+	latency_cmd.argmax = 3;
+	latency_cmd.flags = CMD_NOFILE_OK | CMD_NOMAP_OK | CMD_FOREIGN_OK |
+			    CMD_FLAG_ONESHOT;
+	latency_cmd.args = _("[-r file] [on|off]");
+	latency_cmd.oneline =
+		_("report per-operation latency percentiles for data commands");
+	latency_cmd.help = latency_help;
+
+	add_command(&latency_cmd);
+}
@@ -0,0 +1,537 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Metadata microbenchmarks.  mdbench builds a directory tree of a given
+ * fan-out and depth under the open directory, then runs create, stat,
+ * setxattr, readdir, rename and unlink storms over a set of files spread
+ * across its leaf directories, on as many threads as asked for.  Each
+ * phase reports its operation rate and latency percentiles, so that AG
+ * and log scalability can be compared across kernels and machines.
+ */
+
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+#include "libfrog/latency.h"
+
+#include <dirent.h>
+#include <sys/xattr.h>
+
+static cmdinfo_t mdbench_cmd;
+
+enum mdbench_phase {
+	MD_CREATE,
+	MD_STAT,
+	MD_SETXATTR,
+	MD_READDIR,
+	MD_RENAME,
+	MD_UNLINK,
+	MD_NR_PHASES,
+};
+
+static const char *mdbench_phases[MD_NR_PHASES] = {
+	[MD_CREATE]	= "create",
+	[MD_STAT]	= "stat",
+	[MD_SETXATTR]	= "setxattr",
+	[MD_READDIR]	= "readdir",
+	[MD_RENAME]	= "rename",
+	[MD_UNLINK]	= "unlink",
+};
+
+#define MDBENCH_XATTR	"user.mdbench"
+
+struct mdbench {
+	char			top[64];	/* tree root, under the open dir */
+	const char		*dirpath;	/* path of the open dir */
+	long long		nr_files;
+	unsigned int		width;		/* subdirectories per directory */
+	unsigned int		depth;		/* levels below the root */
+	long long		nr_leaves;
+	size_t			xattr_size;
+	char			*xattr_buf;
+	char			prefix;		/* 'f', or 'r' once renamed */
+	bool			cleanup;	/* unlinking leftovers, untimed */
+	enum mdbench_phase	phase;
+	struct latency_hist	lat;
+};
+
+static void
+mdbench_help(void)
+{
+	printf(_(
+"\n"
+" run metadata operation storms over a directory tree\n"
+"\n"
+" Example:\n"
+" 'mdbench -T 8 -n 100000 -w 16' - 8 threads create, stat, setxattr, list,\n"
+"       rename and unlink 100000 files spread over 16 directories\n"
+"\n"
+" The open file must be a directory.  A tree is built below it, fanning out\n"
+" to width subdirectories per level for depth levels, and the files are\n"
+" spread evenly over the leaf directories, each leaf getting a run of\n"
+" consecutive files.  The files are split between the threads the same way,\n"
+" so a tree with at least as many leaves as threads gives every thread its\n"
+" own directories, while -w 1 -d 0 makes them all share one directory.\n"
+"\n"
+" The phases run in the order given, each one to completion on all threads,\n"
+" and default to: create stat setxattr readdir rename unlink\n"
+" readdir lists each leaf directory once; the other phases do one operation\n"
+" per file.  Each phase reports operations per second and the latency\n"
+" percentiles of its operations.  The tree and anything left in it are\n"
+" removed at the end unless -k is given.\n"
+"\n"
+" -T threads -- run on this many threads (default 1)\n"
+" -n files   -- total number of files (default 10000)\n"
+" -w width   -- subdirectories per directory level (default 4)\n"
+" -d depth   -- levels of subdirectories below the tree root (default 1)\n"
+" -x bytes   -- size of the value setxattr sets (default 64)\n"
+" -k         -- keep the tree afterwards\n"
+" -C         -- print one CSV line per phase:\n"
+"               phase,threads,ops,seconds,ops/sec, then the latency\n"
+"               ops,min,avg,p50,p90,p99,p99.9,max in microseconds\n"
+"\n"));
+}
+
+/* Path of leaf directory leaf below the tree root, one level per digit. */
+static int
+mdbench_dirpath(
+	struct mdbench		*mb,
+	long long		leaf,
+	unsigned int		levels,
+	char			*buf,
+	size_t			len)
+{
+	unsigned int		i;
+	int			n;
+
+	n = snprintf(buf, len, "%s", mb->top);
+	for (i = levels; i > 0; i--) {
+		long long	div = 1;
+		unsigned int	j;
+
+		for (j = 1; j < i; j++)
+			div *= mb->width;
+		n += snprintf(buf + n, len - n, "/%lld",
+				(leaf / div) % mb->width);
+	}
+	return n;
+}
+
+/* Consecutive files share a leaf, so each thread's slice is clustered. */
+static int
+mdbench_filepath(
+	struct mdbench		*mb,
+	long long		idx,
+	char			prefix,
+	char			*buf,
+	size_t			len)
+{
+	long long		leaf = idx * mb->nr_leaves / mb->nr_files;
+	int			n;
+
+	n = mdbench_dirpath(mb, leaf, mb->depth, buf, len);
+	return n + snprintf(buf + n, len - n, "/%c%lld", prefix, idx);
+}
+
+static inline char
+mdbench_renamed(
+	char			prefix)
+{
+	return prefix == 'f' ? 'r' : 'f';
+}
+
+static int
+mdbench_readdir(
+	struct io_thread	*t,
+	struct mdbench		*mb)
+{
+	char			path[PATH_MAX];
+	long long		leaf;
+
+	for (leaf = t->idx; leaf < mb->nr_leaves; leaf += t->parent->nr) {
+		struct dirent	*dirent;
+		DIR		*dir;
+		uint64_t	start;
+		int		fd;
+
+		mdbench_dirpath(mb, leaf, mb->depth, path, sizeof(path));
+		start = latency_now();
+		fd = openat(t->fd, path, O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || !(dir = fdopendir(fd))) {
+			t->error = errno;
+			perror(path);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		while ((dirent = readdir(dir)) != NULL)
+			t->total++;
+		closedir(dir);
+		latency_hist_add(&mb->lat, latency_now() - start);
+		t->ops++;
+	}
+	return 0;
+}
+
+static int
+mdbench_thread(
+	struct io_thread	*t)
+{
+	struct mdbench		*mb = t->parent->priv;
+	char			path[PATH_MAX];
+	char			newpath[PATH_MAX];
+	char			xpath[PATH_MAX];
+	long long		i;
+
+	if (mb->phase == MD_READDIR)
+		return mdbench_readdir(t, mb);
+
+	for (i = t->offset; i < t->offset + t->count; i++) {
+		struct stat	st;
+		uint64_t	start;
+		int		error = 0;
+		int		fd;
+
+		mdbench_filepath(mb, i, mb->prefix, path, sizeof(path));
+		start = latency_now();
+		switch (mb->phase) {
+		case MD_CREATE:
+			fd = openat(t->fd, path, O_CREAT | O_EXCL | O_WRONLY,
+					0644);
+			if (fd < 0)
+				error = -1;
+			else
+				close(fd);
+			break;
+		case MD_STAT:
+			error = fstatat(t->fd, path, &st, AT_SYMLINK_NOFOLLOW);
+			break;
+		case MD_SETXATTR:
+			/* There is no setxattrat, so go by the full path. */
+			if (snprintf(xpath, sizeof(xpath), "%s/%s",
+					mb->dirpath, path) >= sizeof(xpath)) {
+				errno = ENAMETOOLONG;
+				error = -1;
+				break;
+			}
+			error = lsetxattr(xpath, MDBENCH_XATTR, mb->xattr_buf,
+					mb->xattr_size, 0);
+			break;
+		case MD_RENAME:
+			mdbench_filepath(mb, i, mdbench_renamed(mb->prefix),
+					newpath, sizeof(newpath));
+			error = renameat(t->fd, path, t->fd, newpath);
+			break;
+		case MD_UNLINK:
+			error = unlinkat(t->fd, path, 0);
+			if (error && mb->cleanup && errno == ENOENT)
+				continue;
+			break;
+		default:
+			break;
+		}
+		if (error) {
+			t->error = errno;
+			if (!mb->cleanup)
+				perror(path);
+			return -1;
+		}
+		latency_hist_add(&mb->lat, latency_now() - start);
+		t->ops++;
+	}
+	return 0;
+}
+
+/* Make every directory of the tree, the root first, or remove them all. */
+static int
+mdbench_tree(
+	struct mdbench		*mb,
+	int			dirfd,
+	bool			remove)
+{
+	char			path[PATH_MAX];
+	unsigned int		level;
+
+	if (!remove && mkdirat(dirfd, mb->top, 0755) < 0) {
+		perror(mb->top);
+		return -1;
+	}
+	for (level = 1; level <= mb->depth; level++) {
+		unsigned int	l = remove ? mb->depth + 1 - level : level;
+		long long	nr = 1;
+		long long	i;
+
+		for (i = 0; i < l; i++)
+			nr *= mb->width;
+		for (i = 0; i < nr; i++) {
+			mdbench_dirpath(mb, i, l, path, sizeof(path));
+			if (!remove && mkdirat(dirfd, path, 0755) < 0) {
+				perror(path);
+				mdbench_tree(mb, dirfd, true);
+				return -1;
+			}
+			if (remove && unlinkat(dirfd, path, AT_REMOVEDIR) < 0 &&
+			    errno != ENOENT) {
+				perror(path);
+				return -1;
+			}
+		}
+	}
+	if (remove && unlinkat(dirfd, mb->top, AT_REMOVEDIR) < 0) {
+		perror(mb->top);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+mdbench_report(
+	struct io_threads	*it,
+	struct mdbench		*mb,
+	int			compact)
+{
+	const char		*name = mdbench_phases[mb->phase];
+	long long		entries = 0;
+	long long		ops = 0;
+	char			ts[64];
+	int			i;
+
+	for (i = 0; i < it->nr; i++) {
+		ops += it->threads[i].ops;
+		entries += it->threads[i].total;
+	}
+
+	if (compact) {
+		timestr(&it->elapsed, ts, sizeof(ts), VERBOSE_FIXED_TIME);
+		printf("%s,%d,%lld,%s,%.3f,", name, it->nr, ops, ts,
+			tdiv((double)ops, it->elapsed));
+		if (mb->lat.count)
+			latency_print(name, &mb->lat, 1);
+		else
+			printf("0,0,0,0,0,0,0,0\n");
+		return;
+	}
+
+	timestr(&it->elapsed, ts, sizeof(ts), 0);
+	if (mb->phase == MD_READDIR)
+		printf(_("%s: %lld dirs, %lld entries; %s (%.4f dirs/sec)\n"),
+			name, ops, entries, ts, tdiv((double)ops, it->elapsed));
+	else
+		printf(_("%s: %lld ops; %s (%.4f ops/sec)\n"),
+			name, ops, ts, tdiv((double)ops, it->elapsed));
+	latency_print(_("latency"), &mb->lat, 0);
+}
+
+static int
+mdbench_run(
+	struct io_threads	*it,
+	struct mdbench		*mb,
+	enum mdbench_phase	phase)
+{
+	int			i;
+
+	for (i = 0; i < it->nr; i++) {
+		it->threads[i].ops = 0;
+		it->threads[i].total = 0;
+		it->threads[i].error = 0;
+	}
+	latency_hist_reset(&mb->lat);
+	mb->phase = phase;
+	return io_threads_run(it);
+}
+
+static int
+mdbench_f(
+	int			argc,
+	char			**argv)
+{
+	struct mdbench		mb = {
+		.nr_files	= 10000,
+		.width		= 4,
+		.depth		= 1,
+		.xattr_size	= 64,
+		.prefix		= 'f',
+	};
+	struct io_threads	threads = {
+		.nr		= 1,
+		.align		= 1,
+		.fn		= mdbench_thread,
+		.priv		= &mb,
+	};
+	enum mdbench_phase	phases[64];
+	int			nr_phases = 0;
+	bool			created = false;
+	bool			keep = false;
+	int			compact = 0;
+	struct stat		st;
+	long long		nr;
+	char			*sp;
+	int			error = 0;
+	int			c, i, p;
+
+	while ((c = getopt(argc, argv, "Cd:kn:T:w:x:")) != EOF) {
+		switch (c) {
+		case 'C':
+			compact = 1;
+			break;
+		case 'd':
+			mb.depth = strtoul(optarg, &sp, 0);
+			if (*sp || mb.depth > 16) {
+				printf(_("bad depth %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'n':
+			mb.nr_files = cvtnum(1, 1, optarg);
+			if (mb.nr_files < 1) {
+				printf(_("bad file count %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'T':
+			threads.nr = strtoul(optarg, &sp, 0);
+			if (*sp || threads.nr < 1) {
+				printf(_("bad thread count %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'w':
+			mb.width = strtoul(optarg, &sp, 0);
+			if (*sp || mb.width < 1) {
+				printf(_("bad width %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'x':
+			mb.xattr_size = cvtnum(1, 1, optarg);
+			if ((long long)mb.xattr_size < 0 ||
+			    mb.xattr_size > XATTR_SIZE_MAX) {
+				printf(_("bad xattr size %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&mdbench_cmd);
+		}
+	}
+
+	for (; optind < argc; optind++) {
+		for (p = 0; p < MD_NR_PHASES; p++)
+			if (!strcmp(argv[optind], mdbench_phases[p]))
+				break;
+		if (p == MD_NR_PHASES || nr_phases == 64) {
+			printf(_("unknown phase %s\n"), argv[optind]);
+			exitcode = 1;
+			return 0;
+		}
+		phases[nr_phases++] = p;
+	}
+	if (!nr_phases)
+		for (p = 0; p < MD_NR_PHASES; p++)
+			phases[nr_phases++] = p;
+
+	if (fstat(file->fd, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		printf(_("%s: not a directory\n"), file->name);
+		exitcode = 1;
+		return 0;
+	}
+
+	/*
+	 * Every leaf needs at least one file; stop before width^depth can
+	 * overflow.  This also bounds the products in mdbench_tree() and
+	 * mdbench_dirpath().
+	 */
+	for (i = 0, nr = 1; i < mb.depth; i++) {
+		if (nr > mb.nr_files / mb.width) {
+			printf(_("width %u depth %u is more leaf directories "
+				 "than %lld files\n"), mb.width, mb.depth,
+				mb.nr_files);
+			exitcode = 1;
+			return 0;
+		}
+		nr *= mb.width;
+	}
+	mb.nr_leaves = nr;
+	mb.dirpath = file->name;
+	snprintf(mb.top, sizeof(mb.top), "mdbench.%d", getpid());
+
+	mb.xattr_buf = malloc(max(mb.xattr_size, (size_t)1));
+	if (!mb.xattr_buf) {
+		perror("malloc");
+		exitcode = 1;
+		return 0;
+	}
+	memset(mb.xattr_buf, 'x', mb.xattr_size);
+	error = -1;
+	if (latency_hist_init(&mb.lat)) {
+		perror("latency_hist_init");
+		goto out_buf;
+	}
+	if (io_threads_setup(&threads, 0, mb.nr_files, 0, 0) < 0)
+		goto out_hist;
+	if (mdbench_tree(&mb, file->fd, false) < 0)
+		goto out_threads;
+
+	for (i = 0; i < nr_phases; i++) {
+		error = mdbench_run(&threads, &mb, phases[i]);
+		if (phases[i] == MD_CREATE)
+			created = true;
+		else if (phases[i] == MD_UNLINK && !error)
+			created = false;
+		if (phases[i] == MD_RENAME)
+			mb.prefix = mdbench_renamed(mb.prefix);
+		if (error)
+			break;
+		mdbench_report(&threads, &mb, compact);
+	}
+
+	if (!keep) {
+		/* Unlink whatever the phases left behind, untimed. */
+		mb.cleanup = true;
+		if (created) {
+			mdbench_run(&threads, &mb, MD_UNLINK);
+			/* A failed rename leaves files under both names. */
+			mb.prefix = mdbench_renamed(mb.prefix);
+			mdbench_run(&threads, &mb, MD_UNLINK);
+		}
+		if (mdbench_tree(&mb, file->fd, true) < 0)
+			error = -1;
+	} else if (!compact) {
+		printf(_("tree kept in %s/%s\n"), file->name, mb.top);
+	}
+
+out_threads:
+	io_threads_free(&threads);
+out_hist:
+	latency_hist_free(&mb.lat);
+out_buf:
+	free(mb.xattr_buf);
+	if (error)
+		exitcode = 1;
+	return 0;
+}
+
+void
+mdbench_init(void)
+{
+	mdbench_cmd.name = "mdbench";
+	mdbench_cmd.cfunc = mdbench_f;
+	mdbench_cmd.argmin = 0;
+	mdbench_cmd.argmax = -1;
+	mdbench_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK | CMD_FLAG_ONESHOT;
+	mdbench_cmd.args =
+_("[-T threads] [-n files] [-w width] [-d depth] [-x bytes] [-kC] [phase...]");
+	mdbench_cmd.oneline = _("run create, stat, rename and unlink storms");
+	mdbench_cmd.help = mdbench_help;
+
+	add_command(&mdbench_cmd);
+}
@@ -40,6 +40,11 @@ pread_help(void)
 #ifdef HAVE_PREADV
 " -V N -- use vectored IO with N iovecs of blocksize each (preadv)\n"
 #endif
+" -T N -- read with N threads, each taking an equal slice of the range and\n"
+"         using its own buffer; totals are followed by one line per thread;\n"
+"         cannot be combined with -v or -V\n"
+" -M   -- with -T, thread i reads the whole range from the i'th open file\n"
+"         (counting on from the current one) instead of a slice of this one\n"
 "\n"
 " When in \"random\" mode, the number of read operations will equal the\n"
 " number required to do a complete forward/backward scan of the range.\n"
@@ -203,10 +208,16 @@ do_pread(
 	long long	count,
 	size_t		buffer_size)
 {
-	if (!vectors)
-		return pread(fd, io_buffer, min(count, buffer_size), offset);
+	uint64_t	lat = latency_start();
+	ssize_t		bytes;
 
-	return do_preadv(fd, offset, count);
+	if (!vectors)
+		bytes = pread(fd, io_buffer, min(count, buffer_size), offset);
+	else
+		bytes = do_preadv(fd, offset, count);
+	if (bytes > 0)
+		latency_end(lat, offset, bytes);
+	return bytes;
 }
 
 static int
@@ -373,16 +384,18 @@ pread_f(
 	long long	count, total, tmp;
 	size_t		fsblocksize, fssectsize;
 	struct timeval	t1, t2;
+	struct io_threads threads = { 0 };
 	char		*sp;
 	int		Cflag, qflag, uflag, vflag;
 	int		eof = 0, direction = IO_FORWARD;
 	int		c;
 
 	Cflag = qflag = uflag = vflag = 0;
+	vectors = 0;
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:BCFRquvV:Z:")) != EOF) {
+	while ((c = getopt(argc, argv, "b:BCFMqRT:uvV:Z:")) != EOF) {
 		switch (c) {
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
@@ -405,9 +418,21 @@ pread_f(
 		case 'R':
 			direction = IO_RANDOM;
 			break;
+		case 'M':
+			threads.per_file = 1;
+			break;
 		case 'q':
 			qflag = 1;
 			break;
+		case 'T':
+			threads.nr = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || threads.nr < 1) {
+				printf(_("non-numeric thread count -- %s\n"),
+					optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'u':
 			uflag = 1;
 			break;
@@ -438,7 +463,8 @@ pread_f(
 			return command_usage(&pread_cmd);
 		}
 	}
-	if (optind != argc - 2) {
+	if (optind != argc - 2 || (threads.per_file && !threads.nr) ||
+	    (threads.nr && (vflag || vectors))) {
 		exitcode = 1;
 		return command_usage(&pread_cmd);
 	}
@@ -461,6 +487,20 @@ pread_f(
 		return 0;
 	}
 
+	latency_begin("pread");
+	if (threads.nr) {
+		if (eof) {
+			printf(_("-T needs an explicit offset and length\n"));
+			exitcode = 1;
+			return 0;
+		}
+		threads.direction = direction;
+		threads.bsize = bsize;
+		threads.zeed = zeed;
+		return io_threads_rw_f(&threads, offset, count, 0xabababab,
+				qflag, Cflag);
+	}
+
 	if (alloc_buffer(bsize, uflag, 0xabababab) < 0) {
 		exitcode = 1;
 		return 0;
@@ -495,6 +535,7 @@ pread_f(
 	t2 = tsub(t2, t1);
 
 	report_io_times("read", &t2, (long long)offset, count, total, c, Cflag);
+	latency_report(Cflag);
 	return 0;
 }
 
@@ -507,7 +548,8 @@ pread_init(void)
 	pread_cmd.argmin = 2;
 	pread_cmd.argmax = -1;
 	pread_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	pread_cmd.args = _("[-b bs] [-qv] [-i N] [-FBR [-Z N]] off len");
+	pread_cmd.args =
+		_("[-b bs] [-qv] [-i N] [-FBR [-Z N]] [-T N [-M]] off len");
 	pread_cmd.oneline = _("reads a number of bytes at a specified offset");
 	pread_cmd.help = pread_help;
 
@@ -47,6 +47,10 @@ pwrite_help(void)
 " -N   -- Perform the pwritev2() with RWF_NOWAIT\n"
 " -D   -- Perform the pwritev2() with RWF_DSYNC\n"
 #endif
+" -T N -- write with N threads, each taking an equal slice of the range and\n"
+"         using its own buffer; with -w or -W every thread syncs at the end\n"
+" -M   -- with -T, thread i writes the whole range of the i'th open file\n"
+"         (counting on from the current one) instead of a slice of this one\n"
 "\n"));
 }
 
@@ -102,10 +106,16 @@ do_pwrite(
 	size_t		buffer_size,
 	int		pwritev2_flags)
 {
-	if (!vectors)
-		return pwrite(fd, io_buffer, min(count, buffer_size), offset);
+	uint64_t	lat = latency_start();
+	ssize_t		bytes;
 
-	return do_pwritev(fd, offset, count, pwritev2_flags);
+	if (!vectors)
+		bytes = pwrite(fd, io_buffer, min(count, buffer_size), offset);
+	else
+		bytes = do_pwritev(fd, offset, count, pwritev2_flags);
+	if (bytes > 0)
+		latency_end(lat, offset, bytes);
+	return bytes;
 }
 
 static int
@@ -280,6 +290,7 @@ pwrite_f(
 	unsigned int	zeed = 0, seed = 0xcdcdcdcd;
 	size_t		fsblocksize, fssectsize;
 	struct timeval	t1, t2;
+	struct io_threads threads = { .write = 1 };
 	char		*sp, *infile = NULL;
 	int		Cflag, qflag, uflag, dflag, wflag, Wflag;
 	int		direction = IO_FORWARD;
@@ -287,10 +298,11 @@ pwrite_f(
 	int		pwritev2_flags = 0;
 
 	Cflag = qflag = uflag = dflag = wflag = Wflag = 0;
+	vectors = 0;
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:BCdDf:Fi:NqRs:OS:uV:wWZ:")) != EOF) {
+	while ((c = getopt(argc, argv, "b:BCdDf:Fi:MNqRs:OS:T:uV:wWZ:")) != EOF) {
 		switch (c) {
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
@@ -323,6 +335,9 @@ pwrite_f(
 		case 'i':
 			infile = optarg;
 			break;
+		case 'M':
+			threads.per_file = 1;
+			break;
 #ifdef HAVE_PWRITEV2
 		case 'N':
 			pwritev2_flags |= RWF_NOWAIT;
@@ -350,6 +365,15 @@ pwrite_f(
 		case 'q':
 			qflag = 1;
 			break;
+		case 'T':
+			threads.nr = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || threads.nr < 1) {
+				printf(_("non-numeric thread count -- %s\n"),
+					optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'u':
 			uflag = 1;
 			break;
@@ -396,6 +420,12 @@ pwrite_f(
 		exitcode = 1;
 		return command_usage(&pwrite_cmd);
 	}
+	if ((threads.per_file && !threads.nr) ||
+	    (threads.nr && (infile || direction == IO_ONCE ||
+			    pwritev2_flags || vectors))) {
+		exitcode = 1;
+		return command_usage(&pwrite_cmd);
+	}
 	offset = cvtnum(fsblocksize, fssectsize, argv[optind]);
 	if (offset < 0) {
 		printf(_("non-numeric offset argument -- %s\n"), argv[optind]);
@@ -410,6 +440,19 @@ pwrite_f(
 		return 0;
 	}
 
+	latency_begin("pwrite");
+	if (threads.nr) {
+		threads.direction = direction;
+		threads.bsize = bsize;
+		threads.zeed = zeed;
+		if (Wflag)
+			threads.sync = IO_THREADS_FSYNC;
+		else if (wflag)
+			threads.sync = IO_THREADS_FDATASYNC;
+		return io_threads_rw_f(&threads, offset, count, seed, qflag,
+				Cflag);
+	}
+
 	if (alloc_buffer(bsize, uflag, seed) < 0) {
 		exitcode = 1;
 		return 0;
@@ -468,6 +511,7 @@ pwrite_f(
 
 	report_io_times("wrote", &t2, (long long)offset, count, total, c,
 			Cflag);
+	latency_report(Cflag);
 done:
 	if (infile)
 		close(fd);
@@ -484,7 +528,7 @@ pwrite_init(void)
 	pwrite_cmd.argmax = -1;
 	pwrite_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
 	pwrite_cmd.args =
-_("[-i infile [-qdDwNOW] [-s skip]] [-b bs] [-S seed] [-FBR [-Z N]] [-V N] off len");
+_("[-i infile [-qdDwNOW] [-s skip]] [-b bs] [-S seed] [-FBR [-Z N]] [-V N] [-T N [-M]] off len");
 	pwrite_cmd.oneline =
 		_("writes a number of bytes at a specified offset");
 	pwrite_cmd.help = pwrite_help;
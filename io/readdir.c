@@ -92,9 +92,12 @@ read_directory(
 
 	*total = 0;
 	while (*total < length) {
+		uint64_t	lat = latency_start();
+
 		dirent = readdir(dir);
 		if (!dirent)
 			break;
+		latency_end(lat, offset, dirent->d_reclen);
 
 #ifdef _DIRENT_HAVE_D_RECLEN
 		*total += dirent->d_reclen;
@@ -174,6 +177,7 @@ readdir_f(
 		offset = telldir(dir);
 	}
 
+	latency_begin("readdir");
 	gettimeofday(&t1, NULL);
 	cnt = read_directory(dir, offset, length, verbose, &total);
 	gettimeofday(&t2, NULL);
@@ -190,6 +194,7 @@ readdir_f(
 	printf(_("read %llu bytes from offset %lld\n"), total, offset);
 	printf(_("%s, %d ops, %s (%s/sec and %.4f ops/sec)\n"),
 		s1, cnt, ts, s2, tdiv(cnt, t2));
+	latency_report(0);
 
 	return 0;
 }
@@ -60,6 +60,8 @@ dedupe_ioctl(
 	info->logical_offset = doffset;
 
 	while (args->length > 0 || !*ops) {
+		uint64_t	lat = latency_start();
+
 		error = ioctl(fd, XFS_IOC_FILE_EXTENT_SAME, args);
 		if (error) {
 			perror("XFS_IOC_FILE_EXTENT_SAME");
@@ -81,6 +83,7 @@ dedupe_ioctl(
 		     info->bytes_deduped > args->length))
 			break;
 
+		latency_end(lat, info->logical_offset, info->bytes_deduped);
 		(*ops)++;
 		args->logical_offset += info->bytes_deduped;
 		info->logical_offset += info->bytes_deduped;
@@ -155,6 +158,7 @@ dedupe_f(
 		return 0;
 	}
 
+	latency_begin("dedupe");
 	gettimeofday(&t1, NULL);
 	total = dedupe_ioctl(fd, soffset, doffset, count, &ops);
 	if (ops == 0 || quiet_flag)
@@ -164,6 +168,7 @@ dedupe_f(
 
 	report_io_times("deduped", &t2, (long long)doffset, count, total, ops,
 			condensed);
+	latency_report(condensed);
 done:
 	close(fd);
 	return 0;
@@ -183,12 +188,20 @@ reflink_help(void)
                                     position 4096\n\
  'reflink some_file' - links all bytes from some_file into the open file\n\
                        at position 0\n\
+ 'reflink -T 8 -b 64k some_file 0 0 1g' - eight threads each link an eighth\n\
+                       of the first 1GiB, 64KiB at a time\n\
 \n\
  Reflink a range of blocks from a given input file to the open file.  Both\n\
  files share the same range of physical disk blocks; a write to the shared\n\
  range of either file should result in the write landing in a new block and\n\
  that range of the file being remapped (i.e. copy-on-write).  Both files\n\
  must reside on the same filesystem.\n\
+\n\
+ -T N  -- split the range between N threads, each with its own timing\n\
+ -M    -- with -T, thread i links the whole range into the i'th open file\n\
+          (counting on from the current one)\n\
+ -b bs -- with -T, link bs bytes per call instead of a whole slice at once;\n\
+          bs must be a multiple of the filesystem block size\n\
 "));
 }
 
@@ -201,6 +214,7 @@ reflink_ioctl(
 	int			*ops)
 {
 	struct xfs_clone_args	args;
+	uint64_t		lat = latency_start();
 	int			error;
 
 	if (soffset == 0 && doffset == 0 && len == 0) {
@@ -216,11 +230,51 @@ reflink_ioctl(
 		if (error)
 			perror("XFS_IOC_CLONE_RANGE");
 	}
-	if (!error)
+	if (!error) {
+		latency_end(lat, doffset, len);
 		(*ops)++;
+	}
 	return error ? 0 : len;
 }
 
+/* Where the source of a threaded reflink is, relative to the target. */
+struct reflink_job {
+	int		fd;
+	off64_t		soffset;
+	off64_t		doffset;
+};
+
+static int
+reflink_thread(
+	struct io_thread	*t)
+{
+	struct io_threads	*it = t->parent;
+	struct reflink_job	*job = it->priv;
+	struct xfs_clone_args	args;
+	off64_t			off = t->offset;
+	off64_t			end = t->offset + t->count;
+	uint64_t		lat;
+
+	while (off < end) {
+		args.src_fd = job->fd;
+		args.src_offset = job->soffset + (off - job->doffset);
+		args.src_length = it->bsize ?
+				min((off64_t)it->bsize, end - off) : end - off;
+		args.dest_offset = off;
+		lat = latency_start();
+		if (ioctl(t->fd, XFS_IOC_CLONE_RANGE, &args)) {
+			t->error = errno;
+			perror("XFS_IOC_CLONE_RANGE");
+			return -1;
+		}
+		latency_end(lat, off, args.src_length);
+		t->ops++;
+		t->total += args.src_length;
+		off += args.src_length;
+	}
+	return 0;
+}
+
 static int
 reflink_f(
 	int		argc,
@@ -232,20 +286,53 @@ reflink_f(
 	int		condensed, quiet_flag;
 	size_t		fsblocksize, fssectsize;
 	struct timeval	t1, t2;
+	struct io_threads threads = { 0 };
+	struct reflink_job job;
+	char		*sp;
+	long long	tmp;
 	int		c, ops = 0, fd = -1;
 
 	condensed = quiet_flag = 0;
 	doffset = soffset = 0;
 	init_cvtnum(&fsblocksize, &fssectsize);
 
-	while ((c = getopt(argc, argv, "Cq")) != EOF) {
+	while ((c = getopt(argc, argv, "b:CMqT:")) != EOF) {
 		switch (c) {
+		case 'b':
+			tmp = cvtnum(fsblocksize, fssectsize, optarg);
+			if (tmp < 0) {
+				printf(_("non-numeric bsize -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			/* clone ranges must start on a block boundary */
+			if (tmp == 0 || tmp % fsblocksize) {
+				printf(
+_("bsize %s is not a multiple of the filesystem block size %zu\n"),
+					optarg, fsblocksize);
+				exitcode = 1;
+				return 0;
+			}
+			threads.bsize = tmp;
+			break;
 		case 'C':
 			condensed = 1;
 			break;
+		case 'M':
+			threads.per_file = 1;
+			break;
 		case 'q':
 			quiet_flag = 1;
 			break;
+		case 'T':
+			threads.nr = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || threads.nr < 1) {
+				printf(_("non-numeric thread count -- %s\n"),
+					optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		default:
 			exitcode = 1;
 			return command_usage(&reflink_cmd);
@@ -255,6 +342,12 @@ reflink_f(
 		exitcode = 1;
 		return command_usage(&reflink_cmd);
 	}
+	/* Threads need a range to share out. */
+	if ((threads.nr && optind != argc - 4) ||
+	    ((threads.per_file || threads.bsize) && !threads.nr)) {
+		exitcode = 1;
+		return command_usage(&reflink_cmd);
+	}
 	infile = argv[optind];
 	optind++;
 	if (optind == argc)
@@ -287,6 +380,29 @@ clone_all:
 		return 0;
 	}
 
+	latency_begin("reflink");
+	if (threads.nr) {
+		job.fd = fd;
+		job.soffset = soffset;
+		job.doffset = doffset;
+		threads.fn = reflink_thread;
+		threads.align = fsblocksize;
+		threads.priv = &job;
+		if (io_threads_setup(&threads, doffset, count, 0, 0) < 0) {
+			exitcode = 1;
+			goto done;
+		}
+		if (io_threads_run(&threads))
+			exitcode = 1;
+		else if (!quiet_flag) {
+			io_threads_report(&threads, "linked", doffset, count,
+					condensed);
+			latency_report(condensed);
+		}
+		io_threads_free(&threads);
+		goto done;
+	}
+
 	gettimeofday(&t1, NULL);
 	total = reflink_ioctl(fd, soffset, doffset, count, &ops);
 	if (ops == 0)
@@ -299,6 +415,7 @@ clone_all:
 
 	report_io_times("linked", &t2, (long long)doffset, count, total, ops,
 			condensed);
+	latency_report(condensed);
 done:
 	close(fd);
 	return 0;
@@ -314,7 +431,7 @@ reflink_init(void)
 	reflink_cmd.argmax = -1;
 	reflink_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK | CMD_FLAG_ONESHOT;
 	reflink_cmd.args =
-_("infile [src_off dst_off len]");
+_("[-T N [-M] [-b bs]] infile [src_off dst_off len]");
 	reflink_cmd.oneline =
 		_("reflinks an entire file, or a number of bytes at a specified offset");
 	reflink_cmd.help = reflink_help;
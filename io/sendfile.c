@@ -45,6 +45,9 @@ send_buffer(
 
 	*total = 0;
 	while (count > 0) {
+		uint64_t	lat = latency_start();
+		off64_t		start = off;
+
 		bytes = sendfile(file->fd, fd, &off, bytes_remaining);
 		if (bytes == 0)
 			break;
@@ -52,6 +55,7 @@ send_buffer(
 			perror("sendfile");
 			return -1;
 		}
+		latency_end(lat, start, bytes);
 		ops++;
 		*total += bytes;
 		if (bytes >= bytes_remaining)
@@ -140,6 +144,7 @@ sendfile_f(
 		count = stat.st_size;
 	}
 
+	latency_begin("sendfile");
 	gettimeofday(&t1, NULL);
 	c = send_buffer(offset, count, fd, &total);
 	if (c < 0) {
@@ -153,6 +158,7 @@ sendfile_f(
 	t2 = tsub(t2, t1);
 
 	report_io_times("sent", &t2, (long long)offset, count, total, c, Cflag);
+	latency_report(Cflag);
 done:
 	if (infile)
 		close(fd);
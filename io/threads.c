@@ -0,0 +1,304 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Run a data command on several threads at once (-T), each with its own
+ * buffer and either its own slice of the range or its own open file, so
+ * that xfs_io can drive contention on the inode, AG and log locks in a
+ * repeatable way.
+ */
+
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+#include "libfrog/convert.h"
+
+int
+io_threads_setup(
+	struct io_threads	*it,
+	off64_t			offset,
+	long long		count,
+	int			alloc_bufs,
+	unsigned int		seed)
+{
+	long long		align = it->bsize ? it->bsize : it->align;
+	long long		shard;
+	int			cur = file - filetable;
+	int			i;
+
+	if (it->nr < 1) {
+		printf(_("thread count must be at least 1\n"));
+		return -1;
+	}
+	if (it->per_file && filecount < it->nr) {
+		printf(_("need %d open files for %d threads, have %d\n"),
+			it->nr, it->nr, filecount);
+		return -1;
+	}
+
+	it->threads = calloc(it->nr, sizeof(struct io_thread));
+	if (!it->threads) {
+		perror("calloc");
+		return -1;
+	}
+
+	/* Without -M the threads split the range in aligned slices. */
+	if (align < 1)
+		align = 1;
+	if (it->per_file)
+		shard = count;
+	else
+		shard = ((count + it->nr - 1) / it->nr + align - 1) /
+				align * align;
+
+	for (i = 0; i < it->nr; i++) {
+		struct io_thread	*t = &it->threads[i];
+
+		t->idx = i;
+		t->parent = it;
+		t->fd = it->per_file ? filetable[(cur + i) % filecount].fd :
+				       file->fd;
+		if (it->per_file) {
+			t->offset = offset;
+			t->count = count;
+		} else {
+			t->offset = offset + min(count, (long long)i * shard);
+			t->count = min(shard, offset + count - t->offset);
+		}
+		if (alloc_bufs && it->bsize) {
+			t->buf = memalign(pagesize, it->bsize);
+			if (!t->buf) {
+				perror("memalign");
+				io_threads_free(it);
+				return -1;
+			}
+			memset(t->buf, seed, it->bsize);
+		}
+	}
+	return 0;
+}
+
+void
+io_threads_free(
+	struct io_threads	*it)
+{
+	int			i;
+
+	if (!it->threads)
+		return;
+	for (i = 0; i < it->nr; i++)
+		free(it->threads[i].buf);
+	free(it->threads);
+	it->threads = NULL;
+}
+
+static void *
+io_thread_main(
+	void			*arg)
+{
+	struct io_thread	*t = arg;
+	struct timeval		t1, t2;
+
+	gettimeofday(&t1, NULL);
+	if (t->parent->fn(t) < 0 && !t->error)
+		t->error = EIO;
+	gettimeofday(&t2, NULL);
+	t->elapsed = tsub(t2, t1);
+	return NULL;
+}
+
+/* Start every thread, wait for them all, and return the first error. */
+int
+io_threads_run(
+	struct io_threads	*it)
+{
+	struct timeval		t1, t2;
+	int			started = 0;
+	int			error = 0;
+	int			i;
+
+	gettimeofday(&t1, NULL);
+	for (i = 0; i < it->nr; i++) {
+		error = pthread_create(&it->threads[i].tid, NULL,
+				io_thread_main, &it->threads[i]);
+		if (error) {
+			fprintf(stderr, _("creating thread %d: %s\n"), i,
+					strerror(error));
+			break;
+		}
+		started++;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(it->threads[i].tid, NULL);
+		if (!error && it->threads[i].error)
+			error = it->threads[i].error;
+	}
+	gettimeofday(&t2, NULL);
+	it->elapsed = tsub(t2, t1);
+	return error;
+}
+
+/*
+ * Move data through one thread's slice in bsize pieces, in the direction
+ * asked for.  Random mode does as many I/Os as a sequential pass would.
+ */
+int
+io_thread_rw(
+	struct io_thread	*t)
+{
+	struct io_threads	*it = t->parent;
+	unsigned int		rseed = it->zeed + t->idx;
+	long long		nr = (t->count + it->bsize - 1) / it->bsize;
+	long long		i;
+
+	for (i = 0; i < nr; i++) {
+		long long	blk;
+		off64_t		off;
+		size_t		len;
+		ssize_t		bytes;
+		uint64_t	lat;
+
+		switch (it->direction) {
+		case IO_RANDOM:
+			blk = rand_r(&rseed) % nr;
+			break;
+		case IO_BACKWARD:
+			blk = nr - 1 - i;
+			break;
+		default:
+			blk = i;
+			break;
+		}
+		off = t->offset + blk * it->bsize;
+		len = min((long long)it->bsize, t->offset + t->count - off);
+
+		lat = latency_start();
+		if (it->write)
+			bytes = pwrite(t->fd, t->buf, len, off);
+		else
+			bytes = pread(t->fd, t->buf, len, off);
+		if (bytes < 0) {
+			t->error = errno;
+			perror(it->write ? "pwrite" : "pread");
+			return -1;
+		}
+		if (bytes == 0)
+			break;
+		latency_end(lat, off, bytes);
+		t->ops++;
+		t->total += bytes;
+		if (bytes < (ssize_t)len && it->direction != IO_RANDOM)
+			break;
+	}
+
+	if (it->write && it->sync) {
+		uint64_t	lat = latency_start();
+
+		if ((it->sync == IO_THREADS_FSYNC ? fsync(t->fd) :
+						     fdatasync(t->fd)) < 0) {
+			t->error = errno;
+			perror(it->sync == IO_THREADS_FSYNC ? "fsync" :
+							       "fdatasync");
+			return -1;
+		}
+		latency_end(lat, 0, 0);
+	}
+	return 0;
+}
+
+static void
+report_thread(
+	const char		*verb,
+	struct io_thread	*t,
+	int			compact)
+{
+	char			s1[64], s2[64], ts[64];
+
+	timestr(&t->elapsed, ts, sizeof(ts), compact ? VERBOSE_FIXED_TIME : 0);
+	if (compact) {	/* thread,bytes,ops,time,bytes/sec,ops/sec */
+		printf("%d,%lld,%d,%s,%.3f,%.3f\n", t->idx,
+			t->total, t->ops, ts,
+			tdiv((double)t->total, t->elapsed),
+			tdiv((double)t->ops, t->elapsed));
+		return;
+	}
+	if (!t->parent->bsize && !t->count) {
+		printf(_("thread %d: %s, %d ops; %s (%.4f ops/sec)\n"),
+			t->idx, verb, t->ops, ts,
+			tdiv((double)t->ops, t->elapsed));
+		return;
+	}
+	cvtstr((double)t->total, s1, sizeof(s1));
+	cvtstr(tdiv((double)t->total, t->elapsed), s2, sizeof(s2));
+	printf(_("thread %d: %s %lld/%lld bytes at offset %lld\n"),
+		t->idx, verb, t->total, t->count, (long long)t->offset);
+	printf(_("thread %d: %s, %d ops; %s (%s/sec and %.4f ops/sec)\n"),
+		t->idx, s1, t->ops, ts, s2, tdiv((double)t->ops, t->elapsed));
+}
+
+/*
+ * Print the totals over all threads, then each thread on its own.  Jobs
+ * that move no data (fsync) just get the operation rates.
+ */
+void
+io_threads_report(
+	struct io_threads	*it,
+	const char		*verb,
+	off64_t			offset,
+	long long		count,
+	int			compact)
+{
+	long long		total = 0;
+	int			ops = 0;
+	int			i;
+
+	for (i = 0; i < it->nr; i++) {
+		total += it->threads[i].total;
+		ops += it->threads[i].ops;
+	}
+	if (it->per_file)
+		count *= it->nr;
+	if (!it->bsize && !count && !compact) {
+		char		ts[64];
+
+		timestr(&it->elapsed, ts, sizeof(ts), 0);
+		printf(_("%s, %d ops; %s (%.4f ops/sec)\n"), verb, ops, ts,
+			tdiv((double)ops, it->elapsed));
+	} else {
+		report_io_times(verb, &it->elapsed, (long long)offset, count,
+				total, ops, compact);
+	}
+	for (i = 0; i < it->nr; i++)
+		report_thread(verb, &it->threads[i], compact);
+}
+
+/* pread and pwrite -T: split the range, run the threads, report. */
+int
+io_threads_rw_f(
+	struct io_threads	*it,
+	off64_t			offset,
+	long long		count,
+	unsigned int		seed,
+	int			quiet,
+	int			compact)
+{
+	int			error;
+
+	it->fn = io_thread_rw;
+	if (it->direction == IO_RANDOM && !it->zeed)
+		it->zeed = time(NULL);
+	if (io_threads_setup(it, offset, count, 1, seed) < 0) {
+		exitcode = 1;
+		return 0;
+	}
+
+	error = io_threads_run(it);
+	if (error)
+		exitcode = 1;
+	else if (!quiet) {
+		io_threads_report(it, it->write ? "wrote" : "read", offset,
+				count, compact);
+		latency_report(compact);
+	}
+	io_threads_free(it);
+	return 0;
+}
@@ -0,0 +1,654 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * aread and awrite: pread and pwrite with many I/Os in flight at once,
+ * submitted through io_uring.  We talk to the kernel with the raw system
+ * calls so that xfs_io doesn't need liburing.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+static cmdinfo_t aread_cmd;
+static cmdinfo_t awrite_cmd;
+
+#define URING_DEFAULT_DEPTH	32
+
+/* Our view of the rings the kernel shares with us. */
+struct uring {
+	int			fd;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	size_t			sqes_sz;
+	unsigned int		inflight;	/* I/Os the kernel still owns */
+};
+
+/* What to do, and how. */
+struct uring_job {
+	int			write;
+	int			direction;
+	unsigned int		depth;
+	int			fixed_bufs;
+	int			fixed_file;
+	int			polled;
+	size_t			bsize;
+	off64_t			start;		/* lowest offset in the range */
+	off64_t			end;		/* first offset past the range */
+	long long		nr_ops;
+	unsigned int		seed;		/* write buffer fill */
+	unsigned int		zeed;		/* random offsets */
+};
+
+static void
+aread_help(void)
+{
+	printf(_(
+"\n"
+" reads a range of bytes with many reads in flight at once (io_uring)\n"
+"\n"
+" Example:\n"
+" 'aread -Q 64 -R 0 1g' - 4k random reads over the first 1GiB, 64 at a time\n"
+"\n"
+" Works like pread, except that up to a queue depth of reads are submitted\n"
+" before waiting for any of them to complete.\n"
+" -b bs -- read in blocks of bs bytes (default is the filesystem blocksize)\n"
+" -Q N  -- keep up to N reads in flight (default 32)\n"
+" -B    -- read backwards through the range from offset (backwards N bytes)\n"
+" -F    -- read forwards through the range of bytes from offset (default)\n"
+" -R    -- read at random offsets in the range of bytes\n"
+" -Z N  -- zeed the random number generator (used when reading randomly)\n"
+" -r    -- register the buffers with the kernel (fixed buffers)\n"
+" -f    -- register the file with the kernel (fixed file)\n"
+" -p    -- poll for completions instead of waiting for interrupts; the file\n"
+"          must be open for direct I/O\n"
+" -q    -- quiet mode, do not write anything to standard output\n"
+" -C    -- print the timing statistics in compact form\n"
+"\n"
+" As with pread, random mode issues as many reads as a sequential pass over\n"
+" the range would, and any block may be read more than once.\n"
+"\n"));
+}
+
+static void
+awrite_help(void)
+{
+	printf(_(
+"\n"
+" writes a range of bytes with many writes in flight at once (io_uring)\n"
+"\n"
+" Example:\n"
+" 'awrite -Q 16 -b 1m 0 1g' - writes 1GiB in 1MiB blocks, 16 at a time\n"
+"\n"
+" Works like pwrite, except that up to a queue depth of writes are submitted\n"
+" before waiting for any of them to complete.  The buffers are filled with\n"
+" a set pattern (0xcdcdcdcd).\n"
+" -b bs -- write in blocks of bs bytes (default is the filesystem blocksize)\n"
+" -Q N  -- keep up to N writes in flight (default 32)\n"
+" -S N  -- use an alternate seed number for filling the write buffers\n"
+" -B    -- write backwards through the range from offset (backwards N bytes)\n"
+" -F    -- write forwards through the range of bytes from offset (default)\n"
+" -R    -- write at random offsets in the specified range of bytes\n"
+" -Z N  -- zeed the random number generator (used when writing randomly)\n"
+" -r    -- register the buffers with the kernel (fixed buffers)\n"
+" -f    -- register the file with the kernel (fixed file)\n"
+" -p    -- poll for completions instead of waiting for interrupts; the file\n"
+"          must be open for direct I/O\n"
+" -q    -- quiet mode, do not write anything to standard output\n"
+" -C    -- print the timing statistics in compact form\n"
+"\n"));
+}
+
+static int
+uring_setup(
+	struct uring		*ur,
+	unsigned int		depth,
+	int			polled)
+{
+	struct io_uring_params	p = { 0 };
+	int			error;
+
+	if (polled)
+		p.flags |= IORING_SETUP_IOPOLL;
+	ur->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (ur->fd < 0)
+		return -errno;
+
+	ur->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur->cq_ring_sz = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ur->sq_ring_sz = ur->cq_ring_sz = max(ur->sq_ring_sz,
+						      ur->cq_ring_sz);
+
+	ur->sq_ring = mmap(NULL, ur->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ring == MAP_FAILED) {
+		error = -errno;
+		goto out_close;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ring = ur->sq_ring;
+	} else {
+		ur->cq_ring = mmap(NULL, ur->cq_ring_sz,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ur->fd,
+				IORING_OFF_CQ_RING);
+		if (ur->cq_ring == MAP_FAILED) {
+			error = -errno;
+			goto out_sq;
+		}
+	}
+
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		error = -errno;
+		goto out_cq;
+	}
+
+	ur->sq_head = ur->sq_ring + p.sq_off.head;
+	ur->sq_tail = ur->sq_ring + p.sq_off.tail;
+	ur->sq_mask = ur->sq_ring + p.sq_off.ring_mask;
+	ur->sq_array = ur->sq_ring + p.sq_off.array;
+	ur->cq_head = ur->cq_ring + p.cq_off.head;
+	ur->cq_tail = ur->cq_ring + p.cq_off.tail;
+	ur->cq_mask = ur->cq_ring + p.cq_off.ring_mask;
+	ur->cqes = ur->cq_ring + p.cq_off.cqes;
+	return 0;
+
+out_cq:
+	if (ur->cq_ring != ur->sq_ring)
+		munmap(ur->cq_ring, ur->cq_ring_sz);
+out_sq:
+	munmap(ur->sq_ring, ur->sq_ring_sz);
+out_close:
+	close(ur->fd);
+	return error;
+}
+
+static void
+uring_teardown(
+	struct uring		*ur)
+{
+	munmap(ur->sqes, ur->sqes_sz);
+	if (ur->cq_ring != ur->sq_ring)
+		munmap(ur->cq_ring, ur->cq_ring_sz);
+	munmap(ur->sq_ring, ur->sq_ring_sz);
+	close(ur->fd);
+}
+
+static int
+uring_register(
+	struct uring		*ur,
+	unsigned int		opcode,
+	void			*arg,
+	unsigned int		nr_args)
+{
+	if (syscall(__NR_io_uring_register, ur->fd, opcode, arg, nr_args) < 0)
+		return -errno;
+	return 0;
+}
+
+/* Where and how much the i'th I/O of the job transfers. */
+static void
+uring_op_range(
+	struct uring_job	*job,
+	long long		i,
+	off64_t			*off,
+	size_t			*len)
+{
+	off64_t			o;
+
+	switch (job->direction) {
+	case IO_RANDOM:
+		o = job->start + (random() % job->nr_ops) * job->bsize;
+		break;
+	case IO_BACKWARD:
+		o = job->end - (i + 1) * job->bsize;
+		if (o < job->start) {
+			*off = job->start;
+			*len = job->end - i * job->bsize - job->start;
+			return;
+		}
+		break;
+	default:
+		o = job->start + i * job->bsize;
+		break;
+	}
+	*off = o;
+	*len = min((off64_t)job->bsize, job->end - o);
+}
+
+static int
+uring_run(
+	struct uring		*ur,
+	struct uring_job	*job,
+	int			fd,
+	void			**bufs,
+	long long		*total)
+{
+	unsigned int		*free_slots;
+	struct {
+		uint64_t	lat;
+		off64_t		off;
+	}			*issued;	/* per slot, for latency */
+	unsigned int		nr_free = job->depth;
+	unsigned int		inflight = 0;
+	long long		next = 0;
+	int			ops = 0;
+	int			error = 0;
+	unsigned int		i;
+
+	free_slots = malloc(job->depth * sizeof(unsigned int));
+	issued = calloc(job->depth, sizeof(*issued));
+	if (!free_slots || !issued) {
+		free(free_slots);
+		free(issued);
+		return -ENOMEM;
+	}
+	for (i = 0; i < job->depth; i++)
+		free_slots[i] = i;
+
+	*total = 0;
+	while ((next < job->nr_ops && !error) || inflight) {
+		unsigned int	tail, head, to_submit = 0;
+		int		ret;
+
+		/* Fill every free slot with the next I/O. */
+		tail = *ur->sq_tail;
+		while (nr_free && next < job->nr_ops && !error) {
+			struct io_uring_sqe	*sqe;
+			unsigned int		idx = tail & *ur->sq_mask;
+			unsigned int		slot = free_slots[--nr_free];
+			off64_t			off;
+			size_t			len;
+
+			uring_op_range(job, next++, &off, &len);
+			sqe = &ur->sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			if (job->fixed_bufs) {
+				sqe->opcode = job->write ?
+					IORING_OP_WRITE_FIXED :
+					IORING_OP_READ_FIXED;
+				sqe->buf_index = slot;
+			} else {
+				sqe->opcode = job->write ?
+					IORING_OP_WRITE : IORING_OP_READ;
+			}
+			if (job->fixed_file) {
+				sqe->fd = 0;
+				sqe->flags |= IOSQE_FIXED_FILE;
+			} else {
+				sqe->fd = fd;
+			}
+			sqe->addr = (unsigned long)bufs[slot];
+			sqe->len = len;
+			sqe->off = off;
+			sqe->user_data = slot;
+			ur->sq_array[idx] = idx;
+			issued[slot].lat = latency_start();
+			issued[slot].off = off;
+			tail++;
+			to_submit++;
+		}
+		__atomic_store_n(ur->sq_tail, tail, __ATOMIC_RELEASE);
+		inflight += to_submit;
+
+		/* Anything the kernel didn't take last time goes again. */
+		to_submit = tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+		ret = syscall(__NR_io_uring_enter, ur->fd, to_submit,
+				inflight ? 1 : 0, IORING_ENTER_GETEVENTS,
+				NULL, 0);
+		if (ret < 0) {
+			int	err = errno;
+
+			if (err == EINTR)
+				continue;
+			if (!error)
+				error = -err;
+
+			/*
+			 * Submit nothing more: take back the entries that the
+			 * kernel hasn't consumed, then keep reaping until the
+			 * I/Os it did take have completed, as their buffers
+			 * can't be freed before then.  If even waiting fails
+			 * for good, give up and leave them to the caller.
+			 */
+			head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+			for (i = head; i != tail; i++) {
+				unsigned int	idx;
+
+				idx = ur->sq_array[i & *ur->sq_mask];
+				free_slots[nr_free++] = ur->sqes[idx].user_data;
+				inflight--;
+			}
+			__atomic_store_n(ur->sq_tail, head, __ATOMIC_RELEASE);
+			if (!to_submit && err != EAGAIN && err != EBUSY)
+				break;
+			continue;
+		}
+
+		/* Reap whatever has completed. */
+		head = *ur->cq_head;
+		while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe	*cqe;
+
+			cqe = &ur->cqes[head & *ur->cq_mask];
+			if (cqe->res < 0 && !error)
+				error = cqe->res;
+			else if (cqe->res > 0) {
+				latency_end(issued[cqe->user_data].lat,
+						issued[cqe->user_data].off,
+						cqe->res);
+				ops++;
+				*total += cqe->res;
+			}
+			free_slots[nr_free++] = cqe->user_data;
+			inflight--;
+			head++;
+		}
+		__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	ur->inflight = inflight;
+	free(free_slots);
+	free(issued);
+	return error ? error : ops;
+}
+
+static int
+uring_io(
+	struct uring_job	*job,
+	long long		*total)
+{
+	struct uring		ur = { .fd = -1 };
+	struct iovec		*iovs;
+	void			**bufs;
+	unsigned int		i;
+	int			ret;
+
+	bufs = calloc(job->depth, sizeof(void *));
+	iovs = calloc(job->depth, sizeof(struct iovec));
+	if (!bufs || !iovs) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	for (i = 0; i < job->depth; i++) {
+		bufs[i] = memalign(pagesize, job->bsize);
+		if (!bufs[i]) {
+			ret = -ENOMEM;
+			goto out_bufs;
+		}
+		memset(bufs[i], job->write ? job->seed : 0xab, job->bsize);
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = job->bsize;
+	}
+
+	ret = uring_setup(&ur, job->depth, job->polled);
+	if (ret) {
+		fprintf(stderr, _("io_uring_setup: %s\n"), strerror(-ret));
+		goto out_bufs;
+	}
+	if (job->fixed_bufs) {
+		ret = uring_register(&ur, IORING_REGISTER_BUFFERS, iovs,
+				job->depth);
+		if (ret) {
+			fprintf(stderr, _("registering buffers: %s\n"),
+					strerror(-ret));
+			goto out_ring;
+		}
+	}
+	if (job->fixed_file) {
+		ret = uring_register(&ur, IORING_REGISTER_FILES, &file->fd, 1);
+		if (ret) {
+			fprintf(stderr, _("registering file: %s\n"),
+					strerror(-ret));
+			goto out_ring;
+		}
+	}
+
+	if (job->direction == IO_RANDOM)
+		srandom(job->zeed);
+	ret = uring_run(&ur, job, file->fd, bufs, total);
+	if (ret < 0)
+		fprintf(stderr, "%s: %s\n", job->write ? "awrite" : "aread",
+				strerror(-ret));
+	if (ur.inflight) {
+		/* the kernel may still be using the ring and the buffers */
+		fprintf(stderr, _("%s: %u I/Os could not be reaped\n"),
+				job->write ? "awrite" : "aread", ur.inflight);
+		return ret;
+	}
+
+out_ring:
+	uring_teardown(&ur);
+out_bufs:
+	for (i = 0; i < job->depth; i++)
+		free(bufs[i]);
+out_free:
+	free(iovs);
+	free(bufs);
+	return ret;
+}
+
+static int
+uring_f(
+	int			argc,
+	char			**argv,
+	int			write)
+{
+	struct uring_job	job = {
+		.write		= write,
+		.direction	= IO_FORWARD,
+		.depth		= URING_DEFAULT_DEPTH,
+	};
+	const cmdinfo_t		*ct = write ? &awrite_cmd : &aread_cmd;
+	unsigned int		seed = 0xcdcdcdcd;
+	unsigned int		zeed = 0;
+	size_t			fsblocksize, fssectsize;
+	off64_t			offset;
+	long long		count, total, tmp;
+	struct timeval		t1, t2;
+	char			*sp;
+	int			Cflag = 0, qflag = 0;
+	int			c;
+
+	init_cvtnum(&fsblocksize, &fssectsize);
+	job.bsize = fsblocksize;
+
+	while ((c = getopt(argc, argv, write ? "b:BCfFpqQ:rRS:Z:" :
+					       "b:BCfFpqQ:rRZ:")) != EOF) {
+		switch (c) {
+		case 'b':
+			tmp = cvtnum(fsblocksize, fssectsize, optarg);
+			if (tmp <= 0) {
+				printf(_("non-numeric bsize -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			job.bsize = tmp;
+			break;
+		case 'B':
+			job.direction = IO_BACKWARD;
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'f':
+			job.fixed_file = 1;
+			break;
+		case 'F':
+			job.direction = IO_FORWARD;
+			break;
+		case 'p':
+			job.polled = 1;
+			break;
+		case 'q':
+			qflag = 1;
+			break;
+		case 'Q':
+			job.depth = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || job.depth == 0) {
+				printf(_("non-numeric queue depth -- %s\n"),
+					optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'r':
+			job.fixed_bufs = 1;
+			break;
+		case 'R':
+			job.direction = IO_RANDOM;
+			break;
+		case 'S':
+			seed = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg) {
+				printf(_("non-numeric seed -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'Z':
+			zeed = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg) {
+				printf(_("non-numeric seed -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(ct);
+		}
+	}
+	if (optind != argc - 2) {
+		exitcode = 1;
+		return command_usage(ct);
+	}
+
+	offset = cvtnum(fsblocksize, fssectsize, argv[optind]);
+	if (offset < 0) {
+		printf(_("non-numeric offset argument -- %s\n"), argv[optind]);
+		exitcode = 1;
+		return 0;
+	}
+	optind++;
+	count = cvtnum(fsblocksize, fssectsize, argv[optind]);
+	if (count < 0) {
+		printf(_("non-numeric length argument -- %s\n"), argv[optind]);
+		exitcode = 1;
+		return 0;
+	}
+
+	if (job.direction == IO_BACKWARD) {
+		job.end = offset;
+		job.start = max((off64_t)0, offset - count);
+	} else {
+		job.start = offset;
+		job.end = offset + count;
+	}
+	/* Reads stop at EOF, just like pread. */
+	if (!write) {
+		off64_t		eof = filesize();
+
+		if (eof < 0) {
+			exitcode = 1;
+			return 0;
+		}
+		job.end = min(job.end, eof);
+		job.start = min(job.start, job.end);
+	}
+	count = job.end - job.start;
+	job.nr_ops = (count + job.bsize - 1) / job.bsize;
+	job.seed = seed;
+	if (job.direction == IO_RANDOM) {
+		/* Random I/O only ever transfers whole aligned blocks. */
+		job.start -= job.start % job.bsize;
+		job.zeed = zeed ? zeed : time(NULL);
+	}
+
+	latency_begin(write ? "awrite" : "aread");
+	gettimeofday(&t1, NULL);
+	c = job.nr_ops ? uring_io(&job, &total) : 0;
+	if (c < 0) {
+		exitcode = 1;
+		return 0;
+	}
+	if (!job.nr_ops)
+		total = 0;
+
+	if (qflag)
+		return 0;
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+
+	report_io_times(write ? "wrote" : "read", &t2,
+			(long long)(job.direction == IO_BACKWARD ?
+				    job.end : job.start),
+			count, total, c, Cflag);
+	latency_report(Cflag);
+	return 0;
+}
+
+static int
+aread_f(
+	int		argc,
+	char		**argv)
+{
+	return uring_f(argc, argv, 0);
+}
+
+static int
+awrite_f(
+	int		argc,
+	char		**argv)
+{
+	return uring_f(argc, argv, 1);
+}
+
+void
+uring_init(void)
+{
+	aread_cmd.name = "aread";
+	aread_cmd.cfunc = aread_f;
+	aread_cmd.argmin = 2;
+	aread_cmd.argmax = -1;
+	aread_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	aread_cmd.args =
+		_("[-b bs] [-Q depth] [-rfpqC] [-FBR [-Z N]] off len");
+	aread_cmd.oneline =
+		_("reads a number of bytes with many reads in flight");
+	aread_cmd.help = aread_help;
+
+	awrite_cmd.name = "awrite";
+	awrite_cmd.cfunc = awrite_f;
+	awrite_cmd.argmin = 2;
+	awrite_cmd.argmax = -1;
+	awrite_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	awrite_cmd.args =
+		_("[-b bs] [-Q depth] [-S seed] [-rfpqC] [-FBR [-Z N]] off len");
+	awrite_cmd.oneline =
+		_("writes a number of bytes with many writes in flight");
+	awrite_cmd.help = awrite_help;
+
+	add_command(&aread_cmd);
+	add_command(&awrite_cmd);
+}
@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Log-linear latency histograms, in the style of HdrHistogram.
+ *
+ * Values below 2^LATENCY_SUB_BITS get a bucket each.  Above that, the
+ * values in [2^e, 2^(e+1)) share 2^LATENCY_SUB_BITS equal buckets, so the
+ * memory used is fixed while the relative error stays the same from
+ * nanoseconds to hours.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform_defs.h"
+#include "latency.h"
+
+#define SUB_COUNT	(1ULL << LATENCY_SUB_BITS)
+
+static unsigned int
+bucket_of(
+	uint64_t	val)
+{
+	unsigned int	e;
+
+	if (val < SUB_COUNT)
+		return val;
+	e = 63 - __builtin_clzll(val);
+	return ((e - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+		(val >> (e - LATENCY_SUB_BITS)) - SUB_COUNT;
+}
+
+/* Largest value that lands in this bucket. */
+static uint64_t
+bucket_max(
+	unsigned int	idx)
+{
+	unsigned int	group = idx >> LATENCY_SUB_BITS;
+	uint64_t	sub = idx & (SUB_COUNT - 1);
+
+	if (group == 0)
+		return sub;
+	return ((SUB_COUNT + sub + 1) << (group - 1)) - 1;
+}
+
+int
+latency_hist_init(
+	struct latency_hist	*lh)
+{
+	memset(lh, 0, sizeof(*lh));
+	lh->buckets = calloc(LATENCY_BUCKETS, sizeof(uint64_t));
+	if (!lh->buckets)
+		return -ENOMEM;
+	lh->min = UINT64_MAX;
+	return 0;
+}
+
+void
+latency_hist_free(
+	struct latency_hist	*lh)
+{
+	free(lh->buckets);
+	lh->buckets = NULL;
+}
+
+void
+latency_hist_reset(
+	struct latency_hist	*lh)
+{
+	memset(lh->buckets, 0, LATENCY_BUCKETS * sizeof(uint64_t));
+	lh->count = lh->sum = lh->max = 0;
+	lh->min = UINT64_MAX;
+}
+
+void
+latency_hist_add(
+	struct latency_hist	*lh,
+	uint64_t		val)
+{
+	uint64_t		old;
+
+	uatomic_inc(&lh->buckets[bucket_of(val)]);
+	uatomic_inc(&lh->count);
+	uatomic_add(&lh->sum, val);
+
+	old = uatomic_read(&lh->min);
+	while (val < old) {
+		uint64_t	cur = uatomic_cmpxchg(&lh->min, old, val);
+
+		if (cur == old)
+			break;
+		old = cur;
+	}
+	old = uatomic_read(&lh->max);
+	while (val > old) {
+		uint64_t	cur = uatomic_cmpxchg(&lh->max, old, val);
+
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+uint64_t
+latency_hist_pct(
+	const struct latency_hist	*lh,
+	double				pct)
+{
+	double				w = pct / 100.0 * lh->count;
+	uint64_t			want, seen = 0;
+	unsigned int			i;
+
+	if (!lh->count)
+		return 0;
+
+	want = w;
+	if (want < w)
+		want++;
+	if (want < 1)
+		want = 1;
+	if (want > lh->count)
+		want = lh->count;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += lh->buckets[i];
+		if (seen >= want)
+			return min(bucket_max(i), lh->max);
+	}
+	return lh->max;
+}
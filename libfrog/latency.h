@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Log-linear latency histograms, in the style of HdrHistogram.
+ */
+#ifndef __LIBFROG_LATENCY_H__
+#define __LIBFROG_LATENCY_H__
+
+/*
+ * Each power of two is split into 2^LATENCY_SUB_BITS buckets, so a value
+ * is only ever reported to within 1/64th (about 1.6%) of what it was.
+ */
+#define LATENCY_SUB_BITS	6
+#define LATENCY_BUCKETS		((65 - LATENCY_SUB_BITS) << LATENCY_SUB_BITS)
+
+struct latency_hist {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	*buckets;
+};
+
+int latency_hist_init(struct latency_hist *lh);
+void latency_hist_free(struct latency_hist *lh);
+void latency_hist_reset(struct latency_hist *lh);
+
+/* Safe to call from several threads at once. */
+void latency_hist_add(struct latency_hist *lh, uint64_t val);
+
+/* Smallest sample that at least pct percent of the samples don't exceed. */
+uint64_t latency_hist_pct(const struct latency_hist *lh, double pct);
+
+#endif /* __LIBFROG_LATENCY_H__ */
@@ -359,6 +359,34 @@ __cache_node_purge(
 	return 0;
 }
 
+/*
+ * Take a reference to a node, removing it from its MRU list if nobody else
+ * had one.  The caller holds the node's mutex.
+ */
+static void
+__cache_node_hold(
+	struct cache *		cache,
+	struct cache_node *	node)
+{
+	struct cache_mru *	mru;
+
+	if (node->cn_count == 0) {
+		ASSERT(node->cn_priority >= 0);
+		ASSERT(!list_empty(&node->cn_mru));
+		mru = &cache->c_mrus[node->cn_priority];
+		pthread_mutex_lock(&mru->cm_mutex);
+		mru->cm_count--;
+		list_del_init(&node->cn_mru);
+		pthread_mutex_unlock(&mru->cm_mutex);
+		if (node->cn_old_priority != -1) {
+			ASSERT(node->cn_priority == CACHE_DIRTY_PRIORITY);
+			node->cn_priority = node->cn_old_priority;
+			node->cn_old_priority = -1;
+		}
+	}
+	node->cn_count++;
+}
+
 /*
  * Lookup in the cache hash table.  With any luck we'll get a cache
  * hit, in which case this will all be over quickly and painlessly.
@@ -375,7 +403,6 @@ cache_node_get(
 {
 	struct cache_node *	node = NULL;
 	struct cache_hash *	hash;
-	struct cache_mru *	mru;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
@@ -414,24 +441,7 @@ cache_node_get(
 			 * from its MRU list, and update stats.
 			 */
 			pthread_mutex_lock(&node->cn_mutex);
-
-			if (node->cn_count == 0) {
-				ASSERT(node->cn_priority >= 0);
-				ASSERT(!list_empty(&node->cn_mru));
-				mru = &cache->c_mrus[node->cn_priority];
-				pthread_mutex_lock(&mru->cm_mutex);
-				mru->cm_count--;
-				list_del_init(&node->cn_mru);
-				pthread_mutex_unlock(&mru->cm_mutex);
-				if (node->cn_old_priority != -1) {
-					ASSERT(node->cn_priority ==
-							CACHE_DIRTY_PRIORITY);
-					node->cn_priority = node->cn_old_priority;
-					node->cn_old_priority = -1;
-				}
-			}
-			node->cn_count++;
-
+			__cache_node_hold(cache, node);
 			pthread_mutex_unlock(&node->cn_mutex);
 			pthread_mutex_unlock(&hash->ch_mutex);
 
@@ -652,6 +662,64 @@ cache_flush(
 	}
 }
 
+/*
+ * Take a reference to every node that want() picks, checked under the node
+ * mutex, and hand back the array of them.  The caller must drop each
+ * reference with cache_node_put() and free the array.
+ */
+int
+cache_node_get_all(
+	struct cache *		cache,
+	bool			(*want)(struct cache_node *),
+	struct cache_node ***	nodesp,
+	unsigned int *		nrp)
+{
+	struct cache_node **	nodes = NULL;
+	struct cache_node **	n;
+	struct cache_hash *	hash;
+	struct list_head *	head;
+	struct list_head *	pos;
+	struct cache_node *	node;
+	unsigned int		nr = 0, max = 0;
+	int			i;
+
+	for (i = 0; i < cache->c_hashsize; i++) {
+		hash = &cache->c_hash[i];
+
+		pthread_mutex_lock(&hash->ch_mutex);
+		head = &hash->ch_list;
+		for (pos = head->next; pos != head; pos = pos->next) {
+			node = (struct cache_node *)pos;
+			if (nr == max) {
+				max = max ? max * 2 : 1024;
+				n = realloc(nodes, max * sizeof(*nodes));
+				if (!n) {
+					pthread_mutex_unlock(&hash->ch_mutex);
+					goto out_put;
+				}
+				nodes = n;
+			}
+			pthread_mutex_lock(&node->cn_mutex);
+			if (want(node)) {
+				__cache_node_hold(cache, node);
+				nodes[nr++] = node;
+			}
+			pthread_mutex_unlock(&node->cn_mutex);
+		}
+		pthread_mutex_unlock(&hash->ch_mutex);
+	}
+
+	*nodesp = nodes;
+	*nrp = nr;
+	return 0;
+
+out_put:
+	while (nr > 0)
+		cache_node_put(cache, nodes[--nr]);
+	free(nodes);
+	return -ENOMEM;
+}
+
 #define	HASH_REPORT	(3 * HASH_CACHE_RATIO)
 void
 cache_report(
@@ -605,6 +605,9 @@ libxfs_buftarg_alloc(
 	btp->bt_mount = mp;
 	btp->bt_bdev = dev;
 	btp->flags = 0;
+	btp->reads = btp->bytes_read = 0;
+	btp->writes = btp->bytes_written = 0;
+	btp->bytes_zeroed = 0;
 	if (write_fails) {
 		btp->writes_left = write_fails;
 		btp->flags |= XFS_BUFTARG_INJECT_WRITE_FAIL;
@@ -26,6 +26,12 @@ struct xfs_buftarg {
 	unsigned long		writes_left;
 	dev_t			bt_bdev;
 	unsigned int		flags;
+	/* I/O sent to the device, protected by @lock */
+	unsigned long long	reads;
+	unsigned long long	bytes_read;
+	unsigned long long	writes;
+	unsigned long long	bytes_written;
+	unsigned long long	bytes_zeroed;	/* by the device, not written */
 };
 
 /* We purged a dirty buffer and lost a write. */
@@ -34,6 +40,10 @@ struct xfs_buftarg {
 #define XFS_BUFTARG_CORRUPT_WRITE	(1 << 1)
 /* Simulate failure after a certain number of writes. */
 #define XFS_BUFTARG_INJECT_WRITE_FAIL	(1 << 2)
+/* Zero ranges by unmapping them if the device can guarantee zeroes. */
+#define XFS_BUFTARG_UNMAP_ZERO		(1 << 3)
+/* Ranges to be zeroed already read back as zeroes, so skip them. */
+#define XFS_BUFTARG_ZEROED		(1 << 4)
 
 /* Simulate the system crashing after a certain number of writes. */
 static inline void
@@ -50,6 +60,41 @@ xfs_buftarg_trip_write(
 	pthread_mutex_unlock(&btp->lock);
 }
 
+/* Account for data we've read from the device. */
+static inline void
+xfs_buftarg_account_read(
+	struct xfs_buftarg	*btp,
+	size_t			len)
+{
+	pthread_mutex_lock(&btp->lock);
+	btp->reads++;
+	btp->bytes_read += len;
+	pthread_mutex_unlock(&btp->lock);
+}
+
+/* Account for data we've sent to the device. */
+static inline void
+xfs_buftarg_account_write(
+	struct xfs_buftarg	*btp,
+	size_t			len)
+{
+	pthread_mutex_lock(&btp->lock);
+	btp->writes++;
+	btp->bytes_written += len;
+	pthread_mutex_unlock(&btp->lock);
+}
+
+/* Account for a range the device zeroed without us sending any data. */
+static inline void
+xfs_buftarg_account_zero(
+	struct xfs_buftarg	*btp,
+	size_t			len)
+{
+	pthread_mutex_lock(&btp->lock);
+	btp->bytes_zeroed += len;
+	pthread_mutex_unlock(&btp->lock);
+}
+
 extern void	libxfs_buftarg_init(struct xfs_mount *mp, dev_t ddev,
 				    dev_t logdev, dev_t rtdev);
 int libxfs_blkdev_issue_flush(struct xfs_buftarg *btp);
@@ -186,7 +231,9 @@ struct xfs_buf *libxfs_getsb(struct xfs_mount *mp);
 extern void	libxfs_bcache_purge(void);
 extern void	libxfs_bcache_free(void);
 extern void	libxfs_bcache_flush(void);
+extern int	libxfs_bcache_flush_sorted(void);
 extern int	libxfs_bcache_overflowed(void);
+bool		libxfs_buf_set_locking(bool enable);
 
 /* Buffer (Raw) Interfaces */
 int		libxfs_bwrite(struct xfs_buf *bp);
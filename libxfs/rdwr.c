@@ -18,6 +18,8 @@
 #include "xfs_inode.h"
 #include "xfs_trans.h"
 #include "libfrog/platform.h"
+#include "libfrog/workqueue.h"
+#include <sys/uio.h>
 
 #include "libxfs.h"
 
@@ -58,28 +60,42 @@ static void libxfs_brelse(struct cache_node *node);
 
 #define IO_BCOMPARE_CHECK
 
-/* XXX: (dgc) Propagate errors, only exit if fail-on-error flag set */
-int
-libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
-{
-	xfs_off_t	start_offset, end_offset, offset;
-	ssize_t		zsize, bytes;
-	size_t		len_bytes;
-	char		*z;
-	int		error, fd;
+/* Zeroing by writing is done in buffers of this size... */
+#define ZERO_WRITE_SIZE		(1024 * 1024)
 
-	fd = libxfs_device_to_fd(btp->bt_bdev);
-	start_offset = LIBXFS_BBTOOFF64(start);
+/* ...and large ranges are split into chunks of this size, zeroed in parallel */
+#define ZERO_CHUNK_SIZE		(256ULL * 1024 * 1024)
+#define ZERO_MAX_THREADS	8
 
-	/* try to use special zeroing methods, fall back to writes if needed */
-	len_bytes = LIBXFS_BBTOOFF64(len);
-	error = platform_zero_range(fd, start_offset, len_bytes);
-	if (!error) {
+struct zero_chunk {
+	struct xfs_buftarg	*btp;
+	int			fd;
+	xfs_off_t		start;
+	xfs_off_t		len;
+};
+
+/*
+ * Zero a range of a device, preferring the block device's write zeroes
+ * command and falling back to writing out a large zeroed buffer.
+ */
+static void
+libxfs_zero_chunk(
+	struct xfs_buftarg	*btp,
+	int			fd,
+	xfs_off_t		start,
+	xfs_off_t		len)
+{
+	xfs_off_t		offset;
+	ssize_t			zsize, bytes;
+	char			*z;
+
+	if (platform_zero_out(fd, start, len) == 0) {
+		xfs_buftarg_account_zero(btp, len);
 		xfs_buftarg_trip_write(btp);
-		return 0;
+		return;
 	}
 
-	zsize = min(BDSTRAT_SIZE, BBTOB(len));
+	zsize = min_t(xfs_off_t, ZERO_WRITE_SIZE, len);
 	if ((z = memalign(libxfs_device_alignment(), zsize)) == NULL) {
 		fprintf(stderr,
 			_("%s: %s can't memalign %d bytes: %s\n"),
@@ -88,17 +104,9 @@ libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
 	}
 	memset(z, 0, zsize);
 
-	if ((lseek(fd, start_offset, SEEK_SET)) < 0) {
-		fprintf(stderr, _("%s: %s seek to offset %llu failed: %s\n"),
-			progname, __FUNCTION__,
-			(unsigned long long)start_offset, strerror(errno));
-		exit(1);
-	}
-
-	end_offset = LIBXFS_BBTOOFF64(start + len) - start_offset;
-	for (offset = 0; offset < end_offset; ) {
-		bytes = min((ssize_t)(end_offset - offset), zsize);
-		if ((bytes = write(fd, z, bytes)) < 0) {
+	for (offset = start; offset < start + len; ) {
+		bytes = min_t(xfs_off_t, start + len - offset, zsize);
+		if ((bytes = pwrite(fd, z, bytes, offset)) < 0) {
 			fprintf(stderr, _("%s: %s write failed: %s\n"),
 				progname, __FUNCTION__, strerror(errno));
 			exit(1);
@@ -107,10 +115,93 @@ libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
 				progname, __FUNCTION__);
 			exit(1);
 		}
+		xfs_buftarg_account_write(btp, bytes);
 		xfs_buftarg_trip_write(btp);
 		offset += bytes;
 	}
 	free(z);
+}
+
+static void
+libxfs_zero_chunk_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct zero_chunk	*zc = arg;
+
+	libxfs_zero_chunk(zc->btp, zc->fd, zc->start, zc->len);
+	free(zc);
+}
+
+/* XXX: (dgc) Propagate errors, only exit if fail-on-error flag set */
+int
+libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
+{
+	struct workqueue	wq;
+	struct zero_chunk	*zc;
+	xfs_off_t		start_offset, offset;
+	size_t			len_bytes;
+	unsigned int		nr_threads;
+	int			error, fd;
+
+	if (btp->flags & XFS_BUFTARG_ZEROED)
+		return 0;
+
+	fd = libxfs_device_to_fd(btp->bt_bdev);
+	start_offset = LIBXFS_BBTOOFF64(start);
+	len_bytes = LIBXFS_BBTOOFF64(len);
+
+	/* unmapping doesn't write anything at all, if we're allowed to */
+	if ((btp->flags & XFS_BUFTARG_UNMAP_ZERO) &&
+	    platform_unmap_range(fd, start_offset, len_bytes) == 0) {
+		xfs_buftarg_trip_write(btp);
+		return 0;
+	}
+
+	/* try to use special zeroing methods, fall back to writes if needed */
+	error = platform_zero_range(fd, start_offset, len_bytes);
+	if (!error) {
+		xfs_buftarg_account_zero(btp, len_bytes);
+		xfs_buftarg_trip_write(btp);
+		return 0;
+	}
+
+	if (len_bytes <= ZERO_CHUNK_SIZE) {
+		libxfs_zero_chunk(btp, fd, start_offset, len_bytes);
+		return 0;
+	}
+
+	/* keep several chunks of a large range in flight at once */
+	nr_threads = min_t(unsigned int, platform_nproc(), ZERO_MAX_THREADS);
+	nr_threads = min_t(unsigned int, nr_threads,
+			howmany(len_bytes, ZERO_CHUNK_SIZE));
+	error = -workqueue_create(&wq, NULL, nr_threads);
+	if (error) {
+		libxfs_zero_chunk(btp, fd, start_offset, len_bytes);
+		return 0;
+	}
+
+	for (offset = 0; offset < len_bytes; offset += ZERO_CHUNK_SIZE) {
+		zc = malloc(sizeof(struct zero_chunk));
+		if (!zc) {
+			fprintf(stderr, _("%s: %s can't allocate memory: %s\n"),
+				progname, __FUNCTION__, strerror(errno));
+			exit(1);
+		}
+		zc->btp = btp;
+		zc->fd = fd;
+		zc->start = start_offset + offset;
+		zc->len = min_t(xfs_off_t, ZERO_CHUNK_SIZE, len_bytes - offset);
+		if (workqueue_add(&wq, libxfs_zero_chunk_worker, 0, zc)) {
+			free(zc);
+			libxfs_zero_chunk(btp, fd, start_offset + offset,
+					min_t(xfs_off_t, ZERO_CHUNK_SIZE,
+					      len_bytes - offset));
+		}
+	}
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
 	return 0;
 }
 
@@ -384,6 +475,23 @@ xfs_buf_lock(
 		pthread_mutex_lock(&bp->b_lock);
 }
 
+/*
+ * Turn buffer locking on or off around a section of an otherwise single
+ * threaded program where several threads share the buffer cache, and return
+ * the old setting so that it can be restored afterwards.  Buffers held when
+ * locking is turned on aren't locked, so the caller must leave them alone
+ * until it is turned off again.
+ */
+bool
+libxfs_buf_set_locking(
+	bool		enable)
+{
+	bool		old = use_xfs_buf_lock;
+
+	use_xfs_buf_lock = enable;
+	return old;
+}
+
 static int
 __cache_lookup(
 	struct xfs_bufkey	*key,
@@ -568,7 +676,8 @@ libxfs_balloc(
 
 
 static int
-__read_buf(int fd, void *buf, int len, off64_t offset, int flags)
+__read_buf(struct xfs_buftarg *btp, int fd, void *buf, int len,
+	   off64_t offset, int flags)
 {
 	int	sts;
 
@@ -583,6 +692,7 @@ __read_buf(int fd, void *buf, int len, off64_t offset, int flags)
 			progname, sts, len);
 		return -EIO;
 	}
+	xfs_buftarg_account_read(btp, len);
 	return 0;
 }
 
@@ -596,7 +706,8 @@ libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, struct xfs_buf *bp,
 
 	ASSERT(len <= bp->b_length);
 
-	error = __read_buf(fd, bp->b_addr, bytes, LIBXFS_BBTOOFF64(blkno), flags);
+	error = __read_buf(btp, fd, bp->b_addr, bytes, LIBXFS_BBTOOFF64(blkno),
+			flags);
 	if (!error &&
 	    bp->b_target->bt_bdev == btp->bt_bdev &&
 	    bp->b_cache_key == blkno &&
@@ -634,7 +745,7 @@ libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
 		off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
 		int len = BBTOB(bp->b_maps[i].bm_len);
 
-		error = __read_buf(fd, buf, len, offset, flags);
+		error = __read_buf(btp, fd, buf, len, offset, flags);
 		if (error) {
 			bp->b_error = error;
 			break;
@@ -790,7 +901,8 @@ err:
 }
 
 static int
-__write_buf(int fd, void *buf, int len, off64_t offset, int flags)
+__write_buf(struct xfs_buftarg *btp, int fd, void *buf, int len,
+	    off64_t offset, int flags)
 {
 	int	sts;
 
@@ -805,15 +917,15 @@ __write_buf(int fd, void *buf, int len, off64_t offset, int flags)
 			progname, sts, len);
 		return -EIO;
 	}
+	xfs_buftarg_account_write(btp, len);
 	return 0;
 }
 
-int
-libxfs_bwrite(
+/* Get a buffer ready to be written: check state and run the verifier. */
+static int
+libxfs_bwrite_prep(
 	struct xfs_buf	*bp)
 {
-	int		fd = libxfs_device_to_fd(bp->b_target->bt_bdev);
-
 	/*
 	 * we never write buffers that are marked stale. This indicates they
 	 * contain data that has been invalidated, and even if the buffer is
@@ -846,9 +958,42 @@ libxfs_bwrite(
 			return bp->b_error;
 		}
 	}
+	return 0;
+}
+
+/* Record the outcome of writing a buffer. */
+static int
+libxfs_bwrite_done(
+	struct xfs_buf	*bp)
+{
+	if (bp->b_error) {
+		fprintf(stderr,
+	_("%s: write failed on %s bno 0x%llx/0x%x, err=%d\n"),
+			__func__, bp->b_ops ? bp->b_ops->name : "(unknown)",
+			(unsigned long long)xfs_buf_daddr(bp),
+			bp->b_length, -bp->b_error);
+	} else {
+		bp->b_flags |= LIBXFS_B_UPTODATE;
+		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_UNCHECKED);
+		xfs_buftarg_trip_write(bp->b_target);
+	}
+	return bp->b_error;
+}
+
+int
+libxfs_bwrite(
+	struct xfs_buf	*bp)
+{
+	int		fd = libxfs_device_to_fd(bp->b_target->bt_bdev);
+	int		error;
+
+	error = libxfs_bwrite_prep(bp);
+	if (error)
+		return error;
 
 	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
-		bp->b_error = __write_buf(fd, bp->b_addr, BBTOB(bp->b_length),
+		bp->b_error = __write_buf(bp->b_target, fd, bp->b_addr,
+				    BBTOB(bp->b_length),
 				    LIBXFS_BBTOOFF64(xfs_buf_daddr(bp)),
 				    bp->b_flags);
 	} else {
@@ -859,26 +1004,15 @@ libxfs_bwrite(
 			off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
 			int len = BBTOB(bp->b_maps[i].bm_len);
 
-			bp->b_error = __write_buf(fd, buf, len, offset,
-						  bp->b_flags);
+			bp->b_error = __write_buf(bp->b_target, fd, buf, len,
+						  offset, bp->b_flags);
 			if (bp->b_error)
 				break;
 			buf += len;
 		}
 	}
 
-	if (bp->b_error) {
-		fprintf(stderr,
-	_("%s: write failed on %s bno 0x%llx/0x%x, err=%d\n"),
-			__func__, bp->b_ops ? bp->b_ops->name : "(unknown)",
-			(unsigned long long)xfs_buf_daddr(bp),
-			bp->b_length, -bp->b_error);
-	} else {
-		bp->b_flags |= LIBXFS_B_UPTODATE;
-		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_UNCHECKED);
-		xfs_buftarg_trip_write(bp->b_target);
-	}
-	return bp->b_error;
+	return libxfs_bwrite_done(bp);
 }
 
 /*
@@ -1165,6 +1299,98 @@ libxfs_blkdev_issue_flush(
 	return ret ? -errno : 0;
 }
 
+/* Sort delwri buffers by device and then by disk address. */
+static int
+xfs_buf_cmp(
+	void			*priv,
+	struct list_head	*a,
+	struct list_head	*b)
+{
+	struct xfs_buf		*ap = container_of(a, struct xfs_buf, b_list);
+	struct xfs_buf		*bp = container_of(b, struct xfs_buf, b_list);
+
+	if (ap->b_target->bt_bdev != bp->b_target->bt_bdev)
+		return ap->b_target->bt_bdev > bp->b_target->bt_bdev ? 1 : -1;
+	if (xfs_buf_daddr(ap) > xfs_buf_daddr(bp))
+		return 1;
+	if (xfs_buf_daddr(ap) < xfs_buf_daddr(bp))
+		return -1;
+	return 0;
+}
+
+/* Can this buffer be written in the same I/O as the buffers before it? */
+static inline bool
+xfs_buf_delwri_contig(
+	struct xfs_buf		*prev,
+	struct xfs_buf		*bp)
+{
+	if (bp->b_flags & (LIBXFS_B_DISCONTIG | LIBXFS_B_STALE))
+		return false;
+	return prev->b_target->bt_bdev == bp->b_target->bt_bdev &&
+	       xfs_buf_daddr(prev) + prev->b_length == xfs_buf_daddr(bp);
+}
+
+#define DELWRI_MAX_IOVECS	64
+
+/*
+ * Write out a run of buffers that are contiguous on disk with a single
+ * vectored write.  If any buffer fails its write verifier, fall back to
+ * writing them one at a time so that only the bad buffer is not written.
+ */
+static int
+xfs_buf_delwri_write_run(
+	struct xfs_buf		**run,
+	int			nr)
+{
+	struct iovec		iov[DELWRI_MAX_IOVECS];
+	struct xfs_buf		*bp = run[0];
+	int			fd = libxfs_device_to_fd(bp->b_target->bt_bdev);
+	off64_t			offset = LIBXFS_BBTOOFF64(xfs_buf_daddr(bp));
+	ssize_t			len = 0;
+	ssize_t			sts;
+	int			error = 0;
+	int			i;
+
+	if (nr == 1)
+		return libxfs_bwrite(bp);
+
+	for (i = 0; i < nr; i++) {
+		if (libxfs_bwrite_prep(run[i]))
+			goto write_singly;
+		iov[i].iov_base = run[i]->b_addr;
+		iov[i].iov_len = BBTOB(run[i]->b_length);
+		len += iov[i].iov_len;
+	}
+
+	sts = pwritev(fd, iov, nr, offset);
+	if (sts < 0) {
+		error = -errno;
+		fprintf(stderr, _("%s: pwritev failed: %s\n"),
+			progname, strerror(errno));
+	} else if (sts != len) {
+		error = -EIO;
+		fprintf(stderr, _("%s: error - pwritev only %zd of %zd bytes\n"),
+			progname, sts, len);
+	} else {
+		xfs_buftarg_account_write(run[0]->b_target, len);
+	}
+
+	for (i = 0; i < nr; i++) {
+		run[i]->b_error = error;
+		libxfs_bwrite_done(run[i]);
+	}
+	return error;
+
+write_singly:
+	for (i = 0; i < nr; i++) {
+		int	error2 = libxfs_bwrite(run[i]);
+
+		if (!error)
+			error = error2;
+	}
+	return error;
+}
+
 /*
  * Write out a buffer list synchronously.
  *
@@ -1172,22 +1398,178 @@ libxfs_blkdev_issue_flush(
  * completion on all of the buffers. @buffer_list is consumed by the function,
  * so callers must have some other way of tracking buffers if they require such
  * functionality.
+ *
+ * Like the kernel, we sort the list so that the buffers go out in disk order.
+ * Buffers that are adjacent on disk are written with a single I/O.
  */
 int
 xfs_buf_delwri_submit(
 	struct list_head	*buffer_list)
 {
+	struct xfs_buf		*run[DELWRI_MAX_IOVECS];
 	struct xfs_buf		*bp, *n;
+	int			nr = 0;
 	int			error = 0, error2;
+	int			i;
+
+	list_sort(NULL, buffer_list, xfs_buf_cmp);
 
 	list_for_each_entry_safe(bp, n, buffer_list, b_list) {
 		list_del_init(&bp->b_list);
-		error2 = libxfs_bwrite(bp);
+
+		if (nr > 0 && (nr == DELWRI_MAX_IOVECS ||
+			       !xfs_buf_delwri_contig(run[nr - 1], bp))) {
+			error2 = xfs_buf_delwri_write_run(run, nr);
+			if (!error)
+				error = error2;
+			for (i = 0; i < nr; i++)
+				libxfs_buf_relse(run[i]);
+			nr = 0;
+		}
+
+		/* discontiguous buffers always go out on their own */
+		if (bp->b_flags & (LIBXFS_B_DISCONTIG | LIBXFS_B_STALE)) {
+			error2 = libxfs_bwrite(bp);
+			if (!error)
+				error = error2;
+			libxfs_buf_relse(bp);
+			continue;
+		}
+		run[nr++] = bp;
+	}
+
+	if (nr > 0) {
+		error2 = xfs_buf_delwri_write_run(run, nr);
+		if (!error)
+			error = error2;
+		for (i = 0; i < nr; i++)
+			libxfs_buf_relse(run[i]);
+	}
+
+	return error;
+}
+
+static int
+xfs_buf_ptr_cmp(
+	const void		*a,
+	const void		*b)
+{
+	struct xfs_buf		*ap = *(struct xfs_buf **)a;
+	struct xfs_buf		*bp = *(struct xfs_buf **)b;
+
+	return xfs_buf_cmp(NULL, &ap->b_list, &bp->b_list);
+}
+
+/* Write out a run of locked buffers and let go of them. */
+static int
+xfs_buf_flush_run(
+	struct xfs_buf		**run,
+	int			nr)
+{
+	int			error;
+	int			i;
+
+	error = xfs_buf_delwri_write_run(run, nr);
+	for (i = 0; i < nr; i++)
+		libxfs_buf_relse(run[i]);
+	return error;
+}
+
+static bool
+xfs_buf_want_flush(
+	struct cache_node	*cn)
+{
+	struct xfs_buf		*bp = container_of(cn, struct xfs_buf, b_node);
+
+	return !bp->b_error && (bp->b_flags & LIBXFS_B_DIRTY);
+}
+
+/*
+ * Lock a buffer we already hold a reference to, unless this thread has it
+ * locked already, in which case its owner will write it.
+ */
+static bool
+xfs_buf_flush_lock(
+	struct xfs_buf		*bp)
+{
+	if (!use_xfs_buf_lock)
+		return true;
+	if (pthread_equal(bp->b_holder, pthread_self()))
+		return false;
+	pthread_mutex_lock(&bp->b_lock);
+	bp->b_holder = pthread_self();
+	return true;
+}
+
+/*
+ * Write back every dirty buffer in the cache in disk order, coalescing
+ * adjacent buffers into single I/Os.  This is for callers that build up a
+ * lot of new metadata in memory and want it to hit the disk in one sweep;
+ * the buffers stay cached and clean afterwards.
+ */
+int
+libxfs_bcache_flush_sorted(void)
+{
+	struct xfs_buf		*run[DELWRI_MAX_IOVECS];
+	struct cache_node	**nodes;
+	struct xfs_buf		**bufs;
+	struct xfs_buf		*bp;
+	unsigned int		nr_nodes;
+	unsigned int		nr_bufs = 0;
+	unsigned int		i;
+	int			nr = 0;
+	int			error = 0, error2;
+
+	/* Hold every dirty buffer so that none is reclaimed under us. */
+	if (cache_node_get_all(libxfs_bcache, xfs_buf_want_flush, &nodes,
+				&nr_nodes)) {
+		/* fall back to an unsorted flush */
+		cache_flush(libxfs_bcache);
+		return 0;
+	}
+
+	/* Lock them, and skip any that were cleaned meanwhile. */
+	bufs = (struct xfs_buf **)nodes;
+	for (i = 0; i < nr_nodes; i++) {
+		bp = container_of(nodes[i], struct xfs_buf, b_node);
+		if (!xfs_buf_flush_lock(bp)) {
+			cache_node_put(libxfs_bcache, &bp->b_node);
+			continue;
+		}
+		if (!(bp->b_flags & LIBXFS_B_DIRTY)) {
+			libxfs_buf_relse(bp);
+			continue;
+		}
+		bufs[nr_bufs++] = bp;
+	}
+
+	qsort(bufs, nr_bufs, sizeof(struct xfs_buf *), xfs_buf_ptr_cmp);
+
+	for (i = 0; i < nr_bufs; i++) {
+		bp = bufs[i];
+		if (nr > 0 && (nr == DELWRI_MAX_IOVECS ||
+			       !xfs_buf_delwri_contig(run[nr - 1], bp))) {
+			error2 = xfs_buf_flush_run(run, nr);
+			if (!error)
+				error = error2;
+			nr = 0;
+		}
+		if (bp->b_flags & (LIBXFS_B_DISCONTIG | LIBXFS_B_STALE)) {
+			error2 = libxfs_bwrite(bp);
+			if (!error)
+				error = error2;
+			libxfs_buf_relse(bp);
+			continue;
+		}
+		run[nr++] = bp;
+	}
+	if (nr > 0) {
+		error2 = xfs_buf_flush_run(run, nr);
 		if (!error)
 			error = error2;
-		libxfs_buf_relse(bp);
 	}
 
+	free(nodes);
 	return error;
 }
 
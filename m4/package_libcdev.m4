@@ -183,6 +183,35 @@ syscall(__NR_copy_file_range, 0, 0, 0, 0, 0, 0);
     AC_SUBST(have_copy_file_range)
   ])
 
+#
+# Check if we have the io_uring system calls and their header (Linux).  The
+# plain read and write opcodes and the single mmap feature came later than
+# io_uring itself, so make sure the header knows about them too.
+#
+AC_DEFUN([AC_HAVE_IO_URING],
+  [ AC_MSG_CHECKING([for io_uring])
+    AC_LINK_IFELSE(
+    [	AC_LANG_PROGRAM([[
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+	]], [[
+struct io_uring_params p = { .flags = IORING_SETUP_IOPOLL };
+struct io_uring_sqe sqe = { .opcode = IORING_OP_READ };
+sqe.opcode = IORING_OP_WRITE;
+sqe.flags = IOSQE_FIXED_FILE;
+p.features = IORING_FEAT_SINGLE_MMAP;
+syscall(__NR_io_uring_setup, 1, &p);
+syscall(__NR_io_uring_enter, 0, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+syscall(__NR_io_uring_register, 0, IORING_REGISTER_BUFFERS, NULL, 0);
+	]])
+    ], have_io_uring=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_io_uring)
+  ])
+
 #
 # Check if we have a sync_file_range libc call (Linux)
 #
@@ -0,0 +1,286 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Quick device write benchmark so that mkfs can pick the AG count and log
+ * geometry from what the storage actually does rather than from its size.
+ *
+ * Everything written is zeroes, and only to the start of the device that
+ * mkfs is about to overwrite anyway.
+ */
+
+#include "libxfs.h"
+#include "libfrog/workqueue.h"
+#include "bench.h"
+
+/* Test no more than this much of the device... */
+#define BENCH_REGION		(1ULL << 30)
+
+/* ...for about this long per measurement. */
+#define BENCH_RUNTIME		0.25
+#define BENCH_SEQ_SIZE		(1U << 20)
+#define BENCH_MAX_WRITE_UNIT	(256U * 1024)
+#define BENCH_FLUSHES		16
+
+/* Concurrency is the lowest queue depth getting this close to peak IOPS. */
+#define BENCH_PEAK_PCT		90
+
+struct bench_run {
+	int			fd;
+	uint64_t		nr_units;	/* region size in I/O units */
+	unsigned int		iosize;
+	bool			sequential;
+	struct timespec		deadline;
+
+	pthread_mutex_t		lock;
+	uint64_t		ops;
+};
+
+static inline double
+ts_to_sec(
+	struct timespec		*ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1000000000.0;
+}
+
+static bool
+bench_expired(
+	struct timespec		*deadline)
+{
+	struct timespec		now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec ||
+	       (now.tv_sec == deadline->tv_sec &&
+		now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void *
+bench_buffer(
+	size_t			len)
+{
+	void			*buf;
+
+	buf = memalign(libxfs_device_alignment(), len);
+	if (!buf) {
+		fprintf(stderr, _("%s: cannot allocate benchmark buffer\n"),
+			progname);
+		exit(1);
+	}
+	memset(buf, 0, len);
+	return buf;
+}
+
+static void
+bench_write(
+	int			fd,
+	void			*buf,
+	size_t			len,
+	off_t			offset)
+{
+	if (pwrite(fd, buf, len, offset) != (ssize_t)len) {
+		fprintf(stderr, _("%s: benchmark write failed: %s\n"),
+			progname, strerror(errno));
+		exit(1);
+	}
+}
+
+/* One writer; run until the deadline and add our op count to the total. */
+static void
+bench_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct bench_run	*run = wq->wq_ctx;
+	unsigned int		seed = index + 1;
+	uint64_t		ops = 0;
+	uint64_t		unit;
+	void			*buf;
+
+	buf = bench_buffer(run->iosize);
+	while (!bench_expired(&run->deadline)) {
+		if (run->sequential)
+			unit = ops % run->nr_units;
+		else
+			unit = (((uint64_t)rand_r(&seed) << 31) |
+				rand_r(&seed)) % run->nr_units;
+		bench_write(run->fd, buf, run->iosize, unit * run->iosize);
+		ops++;
+	}
+	free(buf);
+
+	pthread_mutex_lock(&run->lock);
+	run->ops += ops;
+	pthread_mutex_unlock(&run->lock);
+}
+
+/* Run @nr_writers for BENCH_RUNTIME; returns the number of I/Os done. */
+static double
+bench_run(
+	int			fd,
+	uint64_t		bytes,
+	unsigned int		iosize,
+	bool			sequential,
+	unsigned int		nr_writers,
+	double			*elapsed)
+{
+	struct workqueue	wq;
+	struct bench_run	run = {
+		.fd		= fd,
+		.nr_units	= bytes / iosize,
+		.iosize		= iosize,
+		.sequential	= sequential,
+	};
+	struct timespec		start, stop;
+	unsigned int		i;
+	int			error;
+
+	pthread_mutex_init(&run.lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run.deadline = start;
+	run.deadline.tv_nsec += BENCH_RUNTIME * 1000000000.0;
+	if (run.deadline.tv_nsec >= 1000000000) {
+		run.deadline.tv_sec++;
+		run.deadline.tv_nsec -= 1000000000;
+	}
+
+	error = -workqueue_create(&wq, &run, nr_writers);
+	if (error) {
+		fprintf(stderr, _("%s: cannot start benchmark threads: %s\n"),
+			progname, strerror(error));
+		exit(1);
+	}
+	for (i = 0; i < nr_writers; i++) {
+		error = -workqueue_add(&wq, bench_worker, i, NULL);
+		if (error) {
+			fprintf(stderr,
+				_("%s: cannot start benchmark threads: %s\n"),
+				progname, strerror(error));
+			exit(1);
+		}
+	}
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+	pthread_mutex_destroy(&run.lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	*elapsed = ts_to_sec(&stop) - ts_to_sec(&start);
+	return run.ops;
+}
+
+/* Average time to write a block and flush it to stable storage. */
+static double
+bench_flush(
+	int			fd,
+	unsigned int		blocksize)
+{
+	struct timespec		start, stop;
+	void			*buf;
+	int			i;
+
+	buf = bench_buffer(blocksize);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_FLUSHES; i++) {
+		bench_write(fd, buf, blocksize, (off_t)i * blocksize);
+		if (fdatasync(fd) < 0) {
+			fprintf(stderr, _("%s: benchmark flush failed: %s\n"),
+				progname, strerror(errno));
+			exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	free(buf);
+	return (ts_to_sec(&stop) - ts_to_sec(&start)) / BENCH_FLUSHES;
+}
+
+/*
+ * Measure random block write IOPS at increasing queue depths (one thread
+ * per queue slot), the latency of single random writes of increasing size,
+ * sequential write bandwidth and cache flush latency of the first @bytes of
+ * the device open on @fd.
+ */
+void
+bench_device(
+	int			fd,
+	uint64_t		bytes,
+	unsigned int		blocksize,
+	struct mkfs_bench	*bench)
+{
+	unsigned int		qd, size;
+	double			peak = 0, elapsed, ops;
+	unsigned int		i;
+
+	memset(bench, 0, sizeof(*bench));
+	bytes = min(bytes, (uint64_t)BENCH_REGION);
+	if (bytes < BENCH_SEQ_SIZE * 4) {
+		fprintf(stderr,
+	_("%s: device too small to benchmark\n"), progname);
+		exit(1);
+	}
+
+	for (qd = 1; bench->nr_qd < BENCH_MAX_QD; qd *= 2) {
+		ops = bench_run(fd, bytes, blocksize, false, qd, &elapsed);
+		bench->qd[bench->nr_qd] = qd;
+		bench->iops[bench->nr_qd] = ops / elapsed;
+		peak = max(peak, bench->iops[bench->nr_qd]);
+		bench->nr_qd++;
+	}
+
+	for (size = blocksize;
+	     size <= BENCH_MAX_WRITE_UNIT && bench->nr_sizes < BENCH_MAX_SIZES;
+	     size *= 2) {
+		ops = bench_run(fd, bytes, size, false, 1, &elapsed);
+		bench->size[bench->nr_sizes] = size;
+		bench->size_lat[bench->nr_sizes] = elapsed / max(ops, 1.0);
+		bench->nr_sizes++;
+	}
+
+	ops = bench_run(fd, bytes, BENCH_SEQ_SIZE, true, 1, &elapsed);
+	bench->seq_bw = ops * BENCH_SEQ_SIZE / elapsed;
+
+	bench->flush_lat = bench_flush(fd, blocksize);
+
+	/* How many writers does it take to get close to peak IOPS? */
+	for (i = 0; i < bench->nr_qd; i++) {
+		if (bench->iops[i] * 100 >= peak * BENCH_PEAK_PCT) {
+			bench->concurrency = bench->qd[i];
+			bench->peak_pct = bench->iops[i] * 100 / peak;
+			break;
+		}
+	}
+
+	/*
+	 * The write unit is the largest write that costs no more than 10%
+	 * over a single block write.  Padding log writes out to it is free,
+	 * and saves the device a read-modify-write cycle if it has a larger
+	 * internal write unit than the filesystem block size.
+	 */
+	bench->write_unit = blocksize;
+	for (i = 1; i < bench->nr_sizes; i++) {
+		if (bench->size_lat[i] * 10 > bench->size_lat[0] * 11)
+			break;
+		bench->write_unit = bench->size[i];
+	}
+}
+
+void
+bench_report(
+	const char		*name,
+	struct mkfs_bench	*bench)
+{
+	unsigned int		i;
+
+	printf(_("Benchmark of %s:\n"), name);
+	printf(_("  random %u byte writes:"), bench->size[0]);
+	for (i = 0; i < bench->nr_qd; i++)
+		printf(_(" qd%u %.0f"), bench->qd[i], bench->iops[i]);
+	printf(_(" IOPS\n"));
+	printf(_("  queue depth 1 write latency:"));
+	for (i = 0; i < bench->nr_sizes; i++)
+		printf(_(" %uk %.0fus"), bench->size[i] / 1024,
+			bench->size_lat[i] * 1000000);
+	printf("\n");
+	printf(_("  sequential writes: %.1f MiB/s\n"),
+		bench->seq_bw / (1024 * 1024));
+	printf(_("  write and flush latency: %.2f ms\n"),
+		bench->flush_lat * 1000);
+}
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef MKFS_BENCH_H_
+#define MKFS_BENCH_H_
+
+#define BENCH_MAX_QD		8
+#define BENCH_MAX_SIZES		8
+
+/*
+ * An advised log holds this many seconds of sequential writes, but is no
+ * more than this fraction of the filesystem.
+ */
+#define BENCH_LOG_SECONDS	1
+#define BENCH_LOG_FS_RATIO	128
+
+/* Results of a short write benchmark of a device, and what we make of them. */
+struct mkfs_bench {
+	/* random writes of one block at increasing queue depths */
+	unsigned int	nr_qd;
+	unsigned int	qd[BENCH_MAX_QD];
+	double		iops[BENCH_MAX_QD];
+
+	/* queue depth 1 random write latency for increasing write sizes */
+	unsigned int	nr_sizes;
+	unsigned int	size[BENCH_MAX_SIZES];
+	double		size_lat[BENCH_MAX_SIZES];	/* seconds */
+
+	double		seq_bw;			/* bytes per second */
+	double		flush_lat;		/* seconds */
+
+	/* derived advice */
+	unsigned int	concurrency;		/* writers to reach peak IOPS */
+	unsigned int	peak_pct;		/* of peak IOPS at concurrency */
+	unsigned int	write_unit;		/* bytes, cheapest large write */
+};
+
+void bench_device(int fd, uint64_t bytes, unsigned int blocksize,
+		struct mkfs_bench *bench);
+void bench_report(const char *name, struct mkfs_bench *bench);
+
+#endif /* MKFS_BENCH_H_ */
@@ -6,7 +6,10 @@
 
 #include "libxfs.h"
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
 #include "libfrog/convert.h"
+#include "libfrog/workqueue.h"
 #include "proto.h"
 
 /*
@@ -18,7 +21,9 @@ static struct xfs_trans * getres(struct xfs_mount *mp, uint blocks);
 static void rsvfile(xfs_mount_t *mp, xfs_inode_t *ip, long long len);
 static int newfile(xfs_trans_t *tp, xfs_inode_t *ip, int symlink, int logit,
 			char *buf, int len);
-static char *newregfile(char **pp, int *len);
+static int newregfile(char **pp, char **fname, off_t *len);
+static void copyregfile(struct xfs_mount *mp, struct xfs_inode *ip, int fd,
+			char *fname, off_t len);
 static void rtinit(xfs_mount_t *mp);
 static long filesize(int fd);
 
@@ -32,6 +37,54 @@ static long filesize(int fd);
 	((uint)(MKFS_BLOCKRES_INODE + XFS_DA_NODE_MAXDEPTH + \
 	(XFS_BM_MAXLEVELS(mp, XFS_DATA_FORK) - 1) + (rb)))
 
+/*
+ * Regular file contents are streamed from the source file to the device in
+ * chunks of this size, and space for them is allocated at most this many
+ * bytes per transaction.
+ */
+#define	PROTO_COPY_CHUNK	(8 << 20)
+#define	PROTO_ALLOC_CHUNK	(1ULL << 30)
+#define	PROTO_COPY_THREADS	8
+
+/*
+ * Each queued chunk keeps its source file open until it has been copied, so
+ * cap the copy queue to keep the number of open files well below the usual
+ * descriptor limit no matter how many files the tree has.
+ */
+#define	PROTO_COPY_QUEUE	(4 * PROTO_COPY_THREADS)
+
+/* Source file shared by all the copy jobs for its contents. */
+struct proto_src {
+	pthread_mutex_t	lock;
+	int		fd;
+	int		refcount;
+	char		*fname;
+};
+
+/* One contiguous range of a source file to write out to the device. */
+struct proto_copy {
+	struct proto_src *src;
+	struct xfs_buftarg *btp;
+	int		dfd;
+	off_t		offset;		/* offset in the source file */
+	off_t		daddr;		/* byte offset on the device */
+	size_t		len;
+};
+
+static struct workqueue	proto_copy_wq;
+static bool		proto_copy_wq_live;
+
+/* An entry in a source directory tree, as found by setup_proto_dir(). */
+struct proto_dent {
+	char			*name;
+	char			*path;
+	struct stat		st;
+	char			*target;	/* symlink target */
+	struct proto_dent	**children;	/* sorted by name */
+	unsigned int		nr_children;
+	xfs_ino_t		ino;
+};
+
 static long long
 getnum(
 	const char	*str,
@@ -286,33 +339,260 @@ newfile(
 	return flags;
 }
 
-static char *
+static int
 newregfile(
 	char		**pp,
-	int		*len)
+	char		**fname,
+	off_t		*len)
 {
-	char		*buf;
+	struct stat	stb;
 	int		fd;
-	char		*fname;
-	long		size;
 
-	fname = getstr(pp);
-	if ((fd = open(fname, O_RDONLY)) < 0 || (size = filesize(fd)) < 0) {
+	*fname = getstr(pp);
+	if ((fd = open(*fname, O_RDONLY)) < 0 || fstat(fd, &stb) < 0) {
 		fprintf(stderr, _("%s: cannot open %s: %s\n"),
-			progname, fname, strerror(errno));
+			progname, *fname, strerror(errno));
+		exit(1);
+	}
+	*len = stb.st_size;
+	return fd;
+}
+
+static void
+proto_src_put(
+	struct proto_src	*src)
+{
+	int			refcount;
+
+	pthread_mutex_lock(&src->lock);
+	refcount = --src->refcount;
+	pthread_mutex_unlock(&src->lock);
+	if (refcount)
+		return;
+	close(src->fd);
+	pthread_mutex_destroy(&src->lock);
+	free(src);
+}
+
+/*
+ * Copy a chunk of a source file straight to its newly allocated blocks on
+ * the device.  Short reads at EOF are zero filled out to the end of the
+ * last block.
+ */
+static void
+proto_copy_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct proto_copy	*pc = arg;
+	char			*buf;
+	ssize_t			bytes;
+	size_t			done = 0;
+
+	buf = memalign(libxfs_device_alignment(), pc->len);
+	if (!buf) {
+		fprintf(stderr, _("%s: cannot allocate copy buffer\n"),
+			progname);
 		exit(1);
 	}
-	if ((*len = (int)size)) {
-		buf = malloc(size);
-		if (read(fd, buf, size) < size) {
+
+	while (done < pc->len) {
+		bytes = pread(pc->src->fd, buf + done, pc->len - done,
+				pc->offset + done);
+		if (bytes < 0) {
 			fprintf(stderr, _("%s: read failed on %s: %s\n"),
-				progname, fname, strerror(errno));
+				progname, pc->src->fname, strerror(errno));
 			exit(1);
 		}
-	} else
-		buf = NULL;
-	close(fd);
-	return buf;
+		if (bytes == 0)
+			break;
+		done += bytes;
+	}
+	if (done < pc->len)
+		memset(buf + done, 0, pc->len - done);
+
+	bytes = pwrite(pc->dfd, buf, pc->len, pc->daddr);
+	if (bytes < 0 || (size_t)bytes != pc->len) {
+		fprintf(stderr, _("%s: write failed for %s: %s\n"),
+			progname, pc->src->fname,
+			bytes < 0 ? strerror(errno) : _("short write"));
+		exit(1);
+	}
+	xfs_buftarg_account_write(pc->btp, pc->len);
+
+	free(buf);
+	proto_src_put(pc->src);
+	free(pc);
+}
+
+/* Queue up the copy of a mapped range of a source file. */
+static void
+queue_copy(
+	struct xfs_mount	*mp,
+	struct proto_src	*src,
+	struct xfs_bmbt_irec	*map)
+{
+	struct proto_copy	*pc;
+	off_t			offset = XFS_FSB_TO_B(mp, map->br_startoff);
+	off_t			end = XFS_FSB_TO_B(mp, map->br_startoff +
+						   map->br_blockcount);
+	off_t			daddr = BBTOB(XFS_FSB_TO_DADDR(mp,
+						   map->br_startblock));
+	int			dfd;
+
+	dfd = libxfs_device_to_fd(mp->m_ddev_targp->bt_bdev);
+	while (offset < end) {
+		pc = malloc(sizeof(struct proto_copy));
+		if (!pc) {
+			fprintf(stderr, _("%s: cannot allocate copy job\n"),
+				progname);
+			exit(1);
+		}
+		pc->src = src;
+		pc->btp = mp->m_ddev_targp;
+		pc->dfd = dfd;
+		pc->offset = offset;
+		pc->daddr = daddr;
+		pc->len = min(end - offset, (off_t)PROTO_COPY_CHUNK);
+
+		pthread_mutex_lock(&src->lock);
+		src->refcount++;
+		pthread_mutex_unlock(&src->lock);
+
+		if (!proto_copy_wq_live ||
+		    workqueue_add(&proto_copy_wq, proto_copy_worker, 0, pc))
+			proto_copy_worker(NULL, 0, pc);
+
+		offset += pc->len;
+		daddr += pc->len;
+	}
+}
+
+/*
+ * Allocate written extents backing the byte range [start, end) of a file,
+ * a transaction at a time, and queue the copy of the source data into them.
+ */
+static void
+copy_segment(
+	struct xfs_mount	*mp,
+	struct xfs_inode	*ip,
+	struct proto_src	*src,
+	xfs_fileoff_t		bno,
+	xfs_fileoff_t		ebno)
+{
+	struct xfs_bmbt_irec	map[XFS_BMAP_MAX_NMAP];
+	struct xfs_trans	*tp;
+	xfs_filblks_t		len;
+	int			nmap;
+	int			error;
+	int			i;
+
+	while (bno < ebno) {
+		len = min(ebno - bno,
+			  (xfs_filblks_t)XFS_B_TO_FSB(mp, PROTO_ALLOC_CHUNK));
+		tp = getres(mp, len);
+		libxfs_trans_ijoin(tp, ip, 0);
+
+		nmap = XFS_BMAP_MAX_NMAP;
+		error = -libxfs_bmapi_write(tp, ip, bno, len, 0, len, map,
+				&nmap);
+		if (error == ENOSYS && XFS_IS_REALTIME_INODE(ip)) {
+			fprintf(stderr,
+	_("%s: creating realtime files from proto file not supported.\n"),
+					progname);
+			exit(1);
+		}
+		if (error)
+			fail(_("error allocating space for a file"), error);
+		if (nmap == 0) {
+			fprintf(stderr,
+				_("%s: cannot allocate space for file\n"),
+				progname);
+			exit(1);
+		}
+
+		for (i = 0; i < nmap; i++) {
+			queue_copy(mp, src, &map[i]);
+			bno = map[i].br_startoff + map[i].br_blockcount;
+		}
+
+		error = -libxfs_trans_commit(tp);
+		if (error)
+			fail(_("error allocating space for a file"), error);
+	}
+}
+
+/*
+ * Stream the contents of a regular file into the new inode.  Only the data
+ * regions of a sparse source file are allocated and copied; the copies
+ * themselves run in the background while we carry on with the prototype.
+ */
+static void
+copyregfile(
+	struct xfs_mount	*mp,
+	struct xfs_inode	*ip,
+	int			fd,
+	char			*fname,
+	off_t			len)
+{
+	struct proto_src	*src;
+	struct xfs_trans	*tp;
+	xfs_fileoff_t		last = 0;
+	xfs_fileoff_t		bno, ebno;
+	off_t			data, hole;
+	int			error;
+
+	if (len == 0) {
+		close(fd);
+		return;
+	}
+
+	src = malloc(sizeof(struct proto_src));
+	if (!src) {
+		fprintf(stderr, _("%s: cannot allocate copy job\n"),
+			progname);
+		exit(1);
+	}
+	pthread_mutex_init(&src->lock, NULL);
+	src->fd = fd;
+	src->refcount = 1;
+	src->fname = fname;
+
+	for (data = 0; data < len; data = hole) {
+		data = lseek(fd, data, SEEK_DATA);
+		if (data < 0) {
+			/* no more data, or no SEEK_DATA support at all */
+			if (errno == ENXIO)
+				break;
+			data = 0;
+			hole = len;
+		} else {
+			hole = lseek(fd, data, SEEK_HOLE);
+			if (hole < 0)
+				hole = len;
+		}
+		hole = min(hole, len);
+
+		bno = max(XFS_B_TO_FSBT(mp, data), last);
+		ebno = XFS_B_TO_FSB(mp, hole);
+		if (bno < ebno)
+			copy_segment(mp, ip, src, bno, ebno);
+		last = ebno;
+	}
+	proto_src_put(src);
+
+	/* the file size covers any trailing hole */
+	error = -libxfs_trans_alloc_rollable(mp, 0, &tp);
+	if (error)
+		fail(_("allocating transaction for a file"), error);
+	libxfs_trans_ijoin(tp, ip, 0);
+	ip->i_disk_size = len;
+	libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+	error = -libxfs_trans_commit(tp);
+	if (error)
+		fail(_("Error encountered creating file from prototype file"),
+			error);
 }
 
 static void
@@ -367,10 +647,12 @@ parseproto(
 	int		error;
 	int		flags;
 	int		fmt;
+	int		fd;
 	int		i;
 	xfs_inode_t	*ip;
 	int		len;
 	long long	llen;
+	off_t		size;
 	int		majdev;
 	int		mindev;
 	int		mode;
@@ -453,19 +735,22 @@ parseproto(
 	flags = XFS_ILOG_CORE;
 	switch (fmt) {
 	case IF_REGULAR:
-		buf = newregfile(pp, &len);
-		tp = getres(mp, XFS_B_TO_FSB(mp, len));
+		fd = newregfile(pp, &buf, &size);
+		tp = getres(mp, 0);
 		error = -libxfs_dir_ialloc(&tp, pip, mode|S_IFREG, 1, 0,
 					   &creds, fsxp, &ip);
 		if (error)
 			fail(_("Inode allocation failed"), error);
-		flags |= newfile(tp, ip, 0, 0, buf, len);
-		if (buf)
-			free(buf);
 		libxfs_trans_ijoin(tp, pip, 0);
 		xname.type = XFS_DIR3_FT_REG_FILE;
 		newdirent(mp, tp, pip, &xname, ip->i_ino);
-		break;
+		libxfs_trans_log_inode(tp, ip, flags);
+		error = -libxfs_trans_commit(tp);
+		if (error)
+			fail(_("Inode allocation failed"), error);
+		copyregfile(mp, ip, fd, buf, size);
+		libxfs_irele(ip);
+		return;
 
 	case IF_RESERVED:			/* pre-allocated space only */
 		value = getstr(pp);
@@ -602,13 +887,413 @@ parseproto(
 	libxfs_irele(ip);
 }
 
+/*
+ * File data is copied by a pool of threads while the inodes and directories
+ * are built up in this one.  If we can't start the pool, copy everything
+ * synchronously instead.
+ */
+static void
+start_copy_workers(void)
+{
+	unsigned int	nr_threads;
+
+	nr_threads = min(platform_nproc(), PROTO_COPY_THREADS);
+	proto_copy_wq_live = workqueue_create_bound(&proto_copy_wq, NULL,
+			nr_threads, PROTO_COPY_QUEUE) == 0;
+}
+
+static void
+stop_copy_workers(void)
+{
+	if (!proto_copy_wq_live)
+		return;
+	workqueue_terminate(&proto_copy_wq);
+	workqueue_destroy(&proto_copy_wq);
+	proto_copy_wq_live = false;
+}
+
 void
 parse_proto(
 	xfs_mount_t	*mp,
 	struct fsxattr	*fsx,
 	char		**pp)
 {
+	start_copy_workers();
 	parseproto(mp, NULL, fsx, pp, NULL);
+	stop_copy_workers();
+}
+
+static int
+dent_name_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct proto_dent	*ad = *(struct proto_dent **)a;
+	const struct proto_dent	*bd = *(struct proto_dent **)b;
+
+	return strcmp(ad->name, bd->name);
+}
+
+static int
+dent_ino_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct proto_dent	*ad = *(struct proto_dent **)a;
+	const struct proto_dent	*bd = *(struct proto_dent **)b;
+
+	if (ad->ino < bd->ino)
+		return -1;
+	return ad->ino > bd->ino;
+}
+
+static void *
+proto_alloc(
+	size_t		size)
+{
+	void		*p = calloc(1, size);
+
+	if (!p) {
+		fprintf(stderr, _("%s: out of memory scanning source tree\n"),
+			progname);
+		exit(1);
+	}
+	return p;
+}
+
+/* Record one entry of the source tree, and everything below it. */
+static struct proto_dent *
+scan_dent(
+	char			*path,
+	char			*name)
+{
+	struct proto_dent	*dent;
+	struct dirent		*de;
+	DIR			*dir;
+	unsigned int		max_children = 0;
+	ssize_t			len;
+
+	dent = proto_alloc(sizeof(struct proto_dent));
+	dent->path = path;
+	dent->name = name;
+	if (lstat(path, &dent->st) < 0) {
+		fprintf(stderr, _("%s: cannot stat %s: %s\n"),
+			progname, path, strerror(errno));
+		exit(1);
+	}
+
+	switch (dent->st.st_mode & S_IFMT) {
+	case S_IFLNK:
+		dent->target = proto_alloc(dent->st.st_size + 1);
+		len = readlink(path, dent->target, dent->st.st_size + 1);
+		if (len < 0 || len > dent->st.st_size) {
+			fprintf(stderr, _("%s: cannot read link %s: %s\n"),
+				progname, path,
+				len < 0 ? strerror(errno) : _("link changed"));
+			exit(1);
+		}
+		dent->target[len] = '\0';
+		return dent;
+	case S_IFDIR:
+		break;
+	default:
+		return dent;
+	}
+
+	if ((dir = opendir(path)) == NULL) {
+		fprintf(stderr, _("%s: cannot open directory %s: %s\n"),
+			progname, path, strerror(errno));
+		exit(1);
+	}
+	while ((de = readdir(dir)) != NULL) {
+		char	*cpath;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (strlen(de->d_name) > MAXNAMELEN - 1) {
+			fprintf(stderr, _("%s: name too long in %s: %s\n"),
+				progname, path, de->d_name);
+			exit(1);
+		}
+		if (dent->nr_children == max_children) {
+			max_children = max_children ? max_children * 2 : 16;
+			dent->children = realloc(dent->children,
+				max_children * sizeof(struct proto_dent *));
+			if (!dent->children) {
+				fprintf(stderr,
+			_("%s: out of memory scanning source tree\n"),
+					progname);
+				exit(1);
+			}
+		}
+		cpath = proto_alloc(strlen(path) + strlen(de->d_name) + 2);
+		sprintf(cpath, "%s/%s", path, de->d_name);
+		dent->children[dent->nr_children++] = scan_dent(cpath,
+				cpath + strlen(path) + 1);
+	}
+	closedir(dir);
+
+	qsort(dent->children, dent->nr_children, sizeof(struct proto_dent *),
+			dent_name_cmp);
+	return dent;
+}
+
+/*
+ * If the prototype given to mkfs is a directory, scan the whole tree up front
+ * so that we fail before touching the device if any of it is unreadable.
+ */
+struct proto_dent *
+setup_proto_dir(
+	char		*fname)
+{
+	struct stat	stb;
+
+	if (!fname)
+		return NULL;
+	if (stat(fname, &stb) < 0) {
+		fprintf(stderr, _("%s: failed to open %s: %s\n"),
+			progname, fname, strerror(errno));
+		exit(1);
+	}
+	if (!S_ISDIR(stb.st_mode))
+		return NULL;
+	return scan_dent(fname, NULL);
+}
+
+/* Give a new inode the ownership and timestamps of its source. */
+static void
+set_dent_attrs(
+	struct xfs_inode	*ip,
+	struct proto_dent	*dent)
+{
+	struct inode		*inode = VFS_I(ip);
+
+	inode->i_atime.tv_sec = dent->st.st_atim.tv_sec;
+	inode->i_atime.tv_nsec = dent->st.st_atim.tv_nsec;
+	inode->i_mtime.tv_sec = dent->st.st_mtim.tv_sec;
+	inode->i_mtime.tv_nsec = dent->st.st_mtim.tv_nsec;
+}
+
+/* Undo the timestamp updates from adding entries to a directory. */
+static void
+reset_dir_times(
+	struct xfs_mount	*mp,
+	struct xfs_inode	*dp,
+	struct proto_dent	*dent)
+{
+	struct xfs_trans	*tp;
+	int			error;
+
+	error = -libxfs_trans_alloc_rollable(mp, 0, &tp);
+	if (error)
+		fail(_("allocating transaction for a directory"), error);
+	libxfs_trans_ijoin(tp, dp, 0);
+	set_dent_attrs(dp, dent);
+	libxfs_trans_log_inode(tp, dp, XFS_ILOG_CORE);
+	error = -libxfs_trans_commit(tp);
+	if (error)
+		fail(_("Error encountered creating file from source directory"),
+			error);
+}
+
+/*
+ * Create the inode for a source tree entry and link it into its parent.
+ * Regular file contents are left for later so that all the inodes of a
+ * directory end up next to each other.
+ */
+static void
+create_dent(
+	struct xfs_mount	*mp,
+	struct xfs_inode	*pip,
+	struct fsxattr		*fsxp,
+	struct proto_dent	*dent)
+{
+	struct xfs_trans	*tp;
+	struct xfs_inode	*ip;
+	struct xfs_name		xname;
+	struct cred		creds;
+	mode_t			mode = dent->st.st_mode;
+	xfs_dev_t		rdev = 0;
+	int			flags = XFS_ILOG_CORE;
+	int			error;
+	int			len;
+
+	memset(&creds, 0, sizeof(creds));
+	creds.cr_uid = dent->st.st_uid;
+	creds.cr_gid = dent->st.st_gid;
+	creds.cr_flags = CRED_FORCE_GID;
+	xname.name = (unsigned char *)dent->name;
+	xname.len = dent->name ? strlen(dent->name) : 0;
+
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		xname.type = XFS_DIR3_FT_REG_FILE;
+		break;
+	case S_IFDIR:
+		xname.type = XFS_DIR3_FT_DIR;
+		break;
+	case S_IFLNK:
+		xname.type = XFS_DIR3_FT_SYMLINK;
+		break;
+	case S_IFCHR:
+		xname.type = XFS_DIR3_FT_CHRDEV;
+		rdev = IRIX_MKDEV(major(dent->st.st_rdev),
+				  minor(dent->st.st_rdev));
+		flags |= XFS_ILOG_DEV;
+		break;
+	case S_IFBLK:
+		xname.type = XFS_DIR3_FT_BLKDEV;
+		rdev = IRIX_MKDEV(major(dent->st.st_rdev),
+				  minor(dent->st.st_rdev));
+		flags |= XFS_ILOG_DEV;
+		break;
+	case S_IFIFO:
+		xname.type = XFS_DIR3_FT_FIFO;
+		break;
+	case S_IFSOCK:
+		xname.type = XFS_DIR3_FT_SOCK;
+		break;
+	default:
+		fprintf(stderr, _("%s: unknown file type for %s\n"),
+			progname, dent->path);
+		exit(1);
+	}
+
+	len = dent->target ? strlen(dent->target) : 0;
+	tp = getres(mp, XFS_B_TO_FSB(mp, len));
+	error = -libxfs_dir_ialloc(&tp, pip, mode, 1, rdev, &creds, fsxp, &ip);
+	if (error)
+		fail(_("Inode allocation failed"), error);
+	set_dent_attrs(ip, dent);
+
+	if (S_ISLNK(mode))
+		flags |= newfile(tp, ip, 1, 1, dent->target, len);
+	if (S_ISDIR(mode))
+		inc_nlink(VFS_I(ip));		/* account for . */
+
+	if (!pip) {
+		pip = ip;
+		mp->m_sb.sb_rootino = ip->i_ino;
+		libxfs_log_sb(tp);
+	} else {
+		libxfs_trans_ijoin(tp, pip, 0);
+		newdirent(mp, tp, pip, &xname, ip->i_ino);
+		if (S_ISDIR(mode)) {
+			inc_nlink(VFS_I(pip));
+			libxfs_trans_log_inode(tp, pip, XFS_ILOG_CORE);
+		}
+	}
+	if (S_ISDIR(mode))
+		newdirectory(mp, tp, ip, pip);
+
+	libxfs_trans_log_inode(tp, ip, flags);
+	error = -libxfs_trans_commit(tp);
+	if (error)
+		fail(_("Error encountered creating file from source directory"),
+			error);
+	dent->ino = ip->i_ino;
+	libxfs_irele(ip);
+}
+
+static void
+append_dent(
+	struct proto_dent	***list,
+	size_t			*nr,
+	size_t			*max,
+	struct proto_dent	*dent)
+{
+	if (*nr == *max) {
+		*max = *max ? *max * 2 : 1024;
+		*list = realloc(*list, *max * sizeof(struct proto_dent *));
+		if (!*list) {
+			fprintf(stderr, _("%s: out of memory building tree\n"),
+				progname);
+			exit(1);
+		}
+	}
+	(*list)[(*nr)++] = dent;
+}
+
+/*
+ * Build the filesystem namespace from a scanned source directory.
+ *
+ * Directories are populated breadth first, each one in a single sweep, so
+ * that a directory's inodes are allocated together in its parent's AG.
+ * Only once every inode exists do we allocate and copy the file data, in
+ * inode number (and hence AG) order, so that the data of the files in a
+ * directory lands contiguously near their inodes.  The metadata mostly stays
+ * dirty in the buffer cache while the tree is built, although the cache may
+ * write some of it back under memory pressure; whatever is still dirty at the
+ * end is written in one pass sorted by disk address.
+ */
+void
+populate_proto_dir(
+	struct xfs_mount	*mp,
+	struct fsxattr		*fsxp,
+	struct proto_dent	*root)
+{
+	struct proto_dent	**dirs = NULL, **files = NULL;
+	size_t			nr_dirs = 0, max_dirs = 0;
+	size_t			nr_files = 0, max_files = 0;
+	struct proto_dent	*dent;
+	struct xfs_inode	*dp, *ip;
+	size_t			i;
+	unsigned int		j;
+	int			error;
+	int			fd;
+
+	create_dent(mp, NULL, fsxp, root);
+	/*
+	 * RT initialization.  Do this here to ensure that the RT inodes get
+	 * placed after the root inode.
+	 */
+	rtinit(mp);
+
+	append_dent(&dirs, &nr_dirs, &max_dirs, root);
+	for (i = 0; i < nr_dirs; i++) {
+		dent = dirs[i];
+		error = -libxfs_iget(mp, NULL, dent->ino, 0, &dp);
+		if (error)
+			fail(_("could not read directory inode"), error);
+		for (j = 0; j < dent->nr_children; j++) {
+			struct proto_dent	*child = dent->children[j];
+
+			create_dent(mp, dp, fsxp, child);
+			if (S_ISDIR(child->st.st_mode))
+				append_dent(&dirs, &nr_dirs, &max_dirs, child);
+			else if (S_ISREG(child->st.st_mode) &&
+				 child->st.st_size > 0)
+				append_dent(&files, &nr_files, &max_files,
+						child);
+		}
+		if (dent->nr_children)
+			reset_dir_times(mp, dp, dent);
+		libxfs_irele(dp);
+	}
+	free(dirs);
+
+	qsort(files, nr_files, sizeof(struct proto_dent *), dent_ino_cmp);
+
+	start_copy_workers();
+	for (i = 0; i < nr_files; i++) {
+		dent = files[i];
+		if ((fd = open(dent->path, O_RDONLY)) < 0) {
+			fprintf(stderr, _("%s: cannot open %s: %s\n"),
+				progname, dent->path, strerror(errno));
+			exit(1);
+		}
+		error = -libxfs_iget(mp, NULL, dent->ino, 0, &ip);
+		if (error)
+			fail(_("could not read file inode"), error);
+		copyregfile(mp, ip, fd, dent->path, dent->st.st_size);
+		libxfs_irele(ip);
+	}
+	stop_copy_workers();
+	free(files);
+
+	error = -libxfs_bcache_flush_sorted();
+	if (error)
+		fail(_("error writing filesystem metadata"), error);
 }
 
 /*
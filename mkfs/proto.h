@@ -6,8 +6,13 @@
 #ifndef MKFS_PROTO_H_
 #define MKFS_PROTO_H_
 
+struct proto_dent;
+
 char *setup_proto(char *fname);
 void parse_proto(struct xfs_mount *mp, struct fsxattr *fsx, char **pp);
+struct proto_dent *setup_proto_dir(char *fname);
+void populate_proto_dir(struct xfs_mount *mp, struct fsxattr *fsx,
+		struct proto_dent *root);
 void res_failed(int err);
 
 #endif /* MKFS_PROTO_H_ */
@@ -11,7 +11,9 @@
 #include "libfrog/fsgeom.h"
 #include "libfrog/convert.h"
 #include "libfrog/crc32cselftest.h"
+#include "libfrog/workqueue.h"
 #include "proto.h"
+#include "bench.h"
 #include <ini.h>
 
 #define TERABYTES(count, blog)	((uint64_t)(count) << (40 - (blog)))
@@ -860,6 +862,8 @@ struct cli_params {
 	int	loginternal;
 	int	lsunit;
 	int	is_supported;
+	int	benchmark;
+	int	thin;
 
 	/* parameters where 0 is not a valid value */
 	int64_t	agcount;
@@ -877,6 +881,10 @@ struct cli_params {
 
 	/* libxfs device setup */
 	struct libxfs_xinit	*xi;
+
+	/* device benchmark results, if we were asked to measure them */
+	struct mkfs_bench	*dbench;
+	struct mkfs_bench	*lbench;
 };
 
 /*
@@ -972,11 +980,14 @@ usage( void )
 /* label */		[-L label (maximum 12 characters)]\n\
 /* naming */		[-n size=num,version=2|ci,ftype=0|1]\n\
 /* no-op info only */	[-N]\n\
-/* prototype file */	[-p fname]\n\
+/* prototype file */	[-p fname|dirname]\n\
 /* quiet */		[-q]\n\
+/* verbose */		[-v]\n\
 /* realtime subvol */	[-r extsize=num,size=num,rtdev=xxx]\n\
 /* sectorsize */	[-s size=num]\n\
 /* version */		[-V]\n\
+/* benchmark */		[--benchmark]\n\
+/* thin provisioned */	[--thin]\n\
 			devicename\n\
 <devicename> is required unless -d name=xxx is given.\n\
 <num> is xxx (bytes), xxxs (sectors), xxxb (fs blocks), xxxk (xxx KiB),\n\
@@ -1293,45 +1304,119 @@ done:
 	free(buf);
 }
 
+/* Discard the device 2G at a time */
+#define DISCARD_STEP		(2ULL << 30)
+#define DISCARD_MAX_THREADS	8
+
+struct discard_ctx {
+	int			fd;
+	uint64_t		count;
+	int			failed;		/* set by any worker */
+};
+
 static void
-discard_blocks(dev_t dev, uint64_t nsectors, int quiet)
+discard_step(
+	struct discard_ctx	*dc,
+	uint64_t		index)
 {
-	int		fd;
-	uint64_t	offset = 0;
-	/* Discard the device 2G at a time */
-	const uint64_t	step = 2ULL << 30;
-	const uint64_t	count = BBTOB(nsectors);
+	uint64_t		offset = index * DISCARD_STEP;
 
-	fd = libxfs_device_to_fd(dev);
-	if (fd <= 0)
+	/* Once one discard has failed, don't bother with the rest. */
+	if (uatomic_read(&dc->failed))
 		return;
+	if (platform_discard_blocks(dc->fd, offset,
+			min(DISCARD_STEP, dc->count - offset)) != 0)
+		uatomic_set(&dc->failed, 1);
+}
+
+static void
+discard_blocks_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	discard_step(wq->wq_ctx, index);
+}
+
+/* Discard a whole device.  Returns true if every discard succeeded. */
+static bool
+discard_blocks(dev_t dev, uint64_t nsectors, int quiet)
+{
+	struct workqueue	wq;
+	struct discard_ctx	dc = { 0 };
+	uint64_t		nr_steps;
+	uint64_t		i;
+	unsigned int		nr_threads;
+
+	dc.fd = libxfs_device_to_fd(dev);
+	if (dc.fd <= 0)
+		return false;
+	dc.count = BBTOB(nsectors);
+	if (dc.count == 0)
+		return false;
 
-	/* The block discarding happens in smaller batches so it can be
-	 * interrupted prematurely
+	/*
+	 * We intentionally ignore errors from the discard ioctl. It is
+	 * not necessary for the mkfs functionality but just an
+	 * optimization. If the first batch fails, assume the device doesn't
+	 * support discard at all and say nothing.
 	 */
-	while (offset < count) {
-		uint64_t	tmp_step = min(step, count - offset);
+	if (platform_discard_blocks(dc.fd, 0, min(DISCARD_STEP, dc.count)) != 0)
+		return false;
+	if (!quiet) {
+		printf("Discarding blocks...");
+		fflush(stdout);
+	}
 
-		/*
-		 * We intentionally ignore errors from the discard ioctl. It is
-		 * not necessary for the mkfs functionality but just an
-		 * optimization. However we should stop on error.
-		 */
-		if (platform_discard_blocks(fd, offset, tmp_step) == 0) {
-			if (offset == 0 && !quiet) {
-				printf("Discarding blocks...");
-				fflush(stdout);
-			}
-		} else {
-			if (offset > 0 && !quiet)
-				printf("\n");
-			return;
-		}
+	/*
+	 * The rest of the device is discarded in smaller batches so it can be
+	 * interrupted prematurely, with several batches in flight at once so
+	 * that devices with multiple queues can process them concurrently.
+	 */
+	nr_steps = howmany(dc.count, DISCARD_STEP);
+	nr_threads = min((uint64_t)platform_nproc(), nr_steps - 1);
+	nr_threads = min(nr_threads, DISCARD_MAX_THREADS);
+	if (nr_threads == 0 ||
+	    workqueue_create(&wq, &dc, nr_threads) != 0) {
+		for (i = 1; i < nr_steps && !dc.failed; i++)
+			discard_step(&dc, i);
+		goto done;
+	}
 
-		offset += tmp_step;
+	for (i = 1; i < nr_steps && !uatomic_read(&dc.failed); i++) {
+		if (workqueue_add(&wq, discard_blocks_worker, i, NULL) != 0) {
+			uatomic_set(&dc.failed, 1);
+			break;
+		}
 	}
-	if (offset > 0 && !quiet)
-		printf("Done.\n");
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+done:
+	if (!quiet)
+		printf("%s\n", dc.failed ? "" : "Done.");
+	return !dc.failed;
+}
+
+/*
+ * Ask the block layer to zero a whole device that has just been discarded.
+ * This is a write zeroes request that is allowed to unmap the blocks, so it
+ * only succeeds if the device can zero them without writing any data and
+ * guarantees that they read back as zeroes afterwards.  The discard zeroes
+ * flag devices used to report for this is no longer set by the kernel.
+ *
+ * If the device can't do that we don't fall back to zeroing the whole
+ * device, as that would allocate all of a thin device.  Instead the few
+ * ranges that need zeroing are unmapped, zeroed or written individually.
+ */
+static bool
+zero_discarded_blocks(dev_t dev, uint64_t nsectors)
+{
+	int			fd;
+
+	fd = libxfs_device_to_fd(dev);
+	if (fd <= 0 || nsectors == 0)
+		return false;
+	return platform_unmap_range(fd, 0, BBTOB(nsectors)) == 0;
 }
 
 static __attribute__((noreturn)) void
@@ -2795,18 +2880,33 @@ open_devices(
 static void
 discard_devices(
 	struct libxfs_xinit	*xi,
-	int			quiet)
+	int			quiet,
+	bool			thin,
+	bool			*data_zeroed,
+	bool			*log_zeroed)
 {
 	/*
 	 * This function has to be called after libxfs has been initialized.
+	 *
+	 * With --thin, try to turn each discarded device into one that is
+	 * known to read back as zeroes so that we can skip zeroing parts of
+	 * it later.
 	 */
 
-	if (!xi->disfile)
-		discard_blocks(xi->ddev, xi->dsize, quiet);
+	if (!xi->disfile && discard_blocks(xi->ddev, xi->dsize, quiet))
+		*data_zeroed = thin &&
+			zero_discarded_blocks(xi->ddev, xi->dsize);
+	*log_zeroed = *data_zeroed;
 	if (xi->rtdev && !xi->risfile)
 		discard_blocks(xi->rtdev, xi->rtsize, quiet);
-	if (xi->logdev && xi->logdev != xi->ddev && !xi->lisfile)
-		discard_blocks(xi->logdev, xi->logBBsize, quiet);
+	if (xi->logdev && xi->logdev != xi->ddev) {
+		*log_zeroed = false;
+		if (!xi->lisfile &&
+		    discard_blocks(xi->logdev, xi->logBBsize, quiet))
+			*log_zeroed = thin &&
+				zero_discarded_blocks(xi->logdev,
+						xi->logBBsize);
+	}
 }
 
 static void
@@ -3000,6 +3100,32 @@ reported by the device (%u).\n"),
 						NBBY * cfg->blocksize);
 }
 
+/*
+ * Make sure there are at least as many AGs as it took concurrent writers to
+ * get close to the peak IOPS of the device, so that allocation in the new
+ * filesystem can keep the device busy.  Don't shrink the AGs below the
+ * minimum size to do so.
+ */
+static void
+advise_ag_geometry(
+	struct mkfs_params	*cfg,
+	struct mkfs_bench	*bench)
+{
+	uint64_t		agcount = bench->concurrency;
+	uint64_t		min_agblocks = XFS_AG_MIN_BLOCKS(cfg->blocklog);
+
+	if (agcount <= cfg->agcount)
+		return;
+	if (cfg->dblocks / agcount < min_agblocks)
+		agcount = cfg->dblocks / min_agblocks;
+	if (agcount <= cfg->agcount)
+		return;
+
+	cfg->agcount = agcount;
+	cfg->agsize = cfg->dblocks / cfg->agcount +
+			(cfg->dblocks % cfg->agcount != 0);
+}
+
 static void
 calculate_initial_ag_geometry(
 	struct mkfs_params	*cfg,
@@ -3029,6 +3155,8 @@ _("agsize (%s) not a multiple of fs blk size (%d)\n"),
 		calc_default_ag_geometry(cfg->blocklog, cfg->dblocks,
 					 cfg->dsunit, &cfg->agsize,
 					 &cfg->agcount);
+		if (cli->dbench)
+			advise_ag_geometry(cfg, cli->dbench);
 	}
 }
 
@@ -3504,6 +3632,20 @@ _("max log size %d smaller than min log size %d, filesystem is too small\n"),
 		cfg->logblocks = (cfg->dblocks << cfg->blocklog) / 2048;
 		cfg->logblocks = cfg->logblocks >> cfg->blocklog;
 
+		/*
+		 * If we measured the device, make the log big enough to
+		 * absorb a burst of metadata updates at full speed while the
+		 * tail is pushed, but keep it to a small fraction of the fs.
+		 */
+		if (cli->lbench) {
+			uint64_t	advised;
+
+			advised = cli->lbench->seq_bw * BENCH_LOG_SECONDS;
+			advised = min(advised >> cfg->blocklog,
+				      cfg->dblocks / BENCH_LOG_FS_RATIO);
+			cfg->logblocks = max(cfg->logblocks, advised);
+		}
+
 		/* But don't go below a reasonable size */
 		cfg->logblocks = max(cfg->logblocks,
 				XFS_MIN_REALISTIC_LOG_BLOCKS(cfg->blocklog));
@@ -3701,6 +3843,38 @@ alloc_write_buf(
 	return bp;
 }
 
+/*
+ * Zero @len sectors at @daddr on the data device.  On thin devices try to
+ * unmap the range first so that we don't allocate space just to hold zeroes,
+ * then have the device zero it without a data transfer.
+ */
+static void
+whack_range(
+	struct xfs_mount	*mp,
+	xfs_daddr_t		daddr,
+	int			len,
+	bool			thin)
+{
+	struct xfs_buf		*buf;
+	int			fd;
+
+	if (thin) {
+		fd = libxfs_device_to_fd(mp->m_ddev_targp->bt_bdev);
+		if (platform_unmap_range(fd, BBTOB(daddr), BBTOB(len)) == 0)
+			return;
+		if (platform_zero_range(fd, BBTOB(daddr), BBTOB(len)) == 0) {
+			xfs_buftarg_account_zero(mp->m_ddev_targp,
+					BBTOB(len));
+			return;
+		}
+	}
+
+	buf = alloc_write_buf(mp->m_ddev_targp, daddr, len);
+	memset(buf->b_addr, 0, BBTOB(len));
+	libxfs_buf_mark_dirty(buf);
+	libxfs_buf_relse(buf);
+}
+
 /*
  * Sanitise the data and log devices and prepare them so libxfs can mount the
  * device successfully. Also check we can access the rt device if configured.
@@ -3711,11 +3885,15 @@ prepare_devices(
 	struct libxfs_xinit	*xi,
 	struct xfs_mount	*mp,
 	struct xfs_sb		*sbp,
-	bool			clear_stale)
+	bool			clear_stale,
+	bool			thin,
+	bool			data_zeroed,
+	bool			log_zeroed)
 {
 	struct xfs_buf		*buf;
 	int			whack_blks = BTOBB(WHACK_SIZE);
 	int			lsunit;
+	int			error;
 
 	/*
 	 * If there's an old XFS filesystem on the device with enough intact
@@ -3723,7 +3901,7 @@ prepare_devices(
 	 * information on disk to confuse a future xfs_repair call. To avoid
 	 * this, whack all the old secondary superblocks that we can find.
 	 */
-	if (clear_stale)
+	if (clear_stale && !data_zeroed)
 		zero_old_xfs_structures(xi, sbp);
 
 	/*
@@ -3748,23 +3926,18 @@ prepare_devices(
 	 * Zero out the end to obliterate any old MD RAID (or other) metadata at
 	 * the end of the device.  (MD sb is ~64k from the end, take out a wider
 	 * swath to be sure)
-	 */
-	buf = alloc_write_buf(mp->m_ddev_targp, (xi->dsize - whack_blks),
-			whack_blks);
-	memset(buf->b_addr, 0, WHACK_SIZE);
-	libxfs_buf_mark_dirty(buf);
-	libxfs_buf_relse(buf);
-
-	/*
+	 *
 	 * Now zero out the beginning of the device, to obliterate any old
 	 * filesystem signatures out there.  This should take care of
 	 * swap (somewhere around the page size), jfs (32k),
 	 * ext[2,3] and reiserfs (64k) - and hopefully all else.
+	 *
+	 * None of that is necessary if the discard already zeroed the device.
 	 */
-	buf = alloc_write_buf(mp->m_ddev_targp, 0, whack_blks);
-	memset(buf->b_addr, 0, WHACK_SIZE);
-	libxfs_buf_mark_dirty(buf);
-	libxfs_buf_relse(buf);
+	if (!data_zeroed) {
+		whack_range(mp, xi->dsize - whack_blks, whack_blks, thin);
+		whack_range(mp, 0, whack_blks, thin);
+	}
 
 	/* OK, now write the superblock... */
 	buf = alloc_write_buf(mp->m_ddev_targp, XFS_SB_DADDR,
@@ -3780,14 +3953,31 @@ prepare_devices(
 	if (lsunit == 1)
 		lsunit = sbp->sb_logsectsize;
 
+	if (log_zeroed)
+		mp->m_logdev_targp->flags |= XFS_BUFTARG_ZEROED;
 	libxfs_log_clear(mp->m_logdev_targp, NULL,
 			 XFS_FSB_TO_DADDR(mp, cfg->logstart),
 			 (xfs_extlen_t)XFS_FSB_TO_BB(mp, cfg->logblocks),
 			 &sbp->sb_uuid, cfg->sb_feat.log_version,
 			 lsunit, XLOG_FMT, XLOG_INIT_CYCLE, false);
+	mp->m_logdev_targp->flags &= ~XFS_BUFTARG_ZEROED;
 
-	/* finally, check we can write the last block in the realtime area */
-	if (mp->m_rtdev_targp->bt_bdev && cfg->rtblocks > 0) {
+	/*
+	 * finally, check we can write the last block in the realtime area.
+	 * Reading it is enough to prove it exists if we're avoiding writes.
+	 */
+	if (mp->m_rtdev_targp->bt_bdev && cfg->rtblocks > 0 && thin) {
+		error = -libxfs_buf_read_uncached(mp->m_rtdev_targp,
+				XFS_FSB_TO_BB(mp, cfg->rtblocks - 1LL),
+				BTOBB(cfg->blocksize), 0, &buf, NULL);
+		if (error) {
+			fprintf(stderr,
+	_("%s: cannot read the last block of the realtime area: %s\n"),
+				progname, strerror(error));
+			exit(1);
+		}
+		libxfs_buf_relse(buf);
+	} else if (mp->m_rtdev_targp->bt_bdev && cfg->rtblocks > 0) {
 		buf = alloc_write_buf(mp->m_rtdev_targp,
 				XFS_FSB_TO_BB(mp, cfg->rtblocks - 1LL),
 				BTOBB(cfg->blocksize));
@@ -3804,13 +3994,16 @@ initialise_ag_headers(
 	struct xfs_mount	*mp,
 	xfs_agnumber_t		agno,
 	int			*worst_freelist,
-	struct list_head	*buffer_list)
+	struct list_head	*buffer_list,
+	bool			pad)
 {
 	struct aghdr_init_data	id = {
 		.agno		= agno,
 		.agsize		= cfg->agsize,
 	};
 	struct xfs_perag	*pag = libxfs_perag_get(mp, agno);
+	struct xfs_buf		*bp;
+	xfs_daddr_t		pad_start, pad_end;
 	int			error;
 
 	if (agno == cfg->agcount - 1)
@@ -3823,6 +4016,29 @@ initialise_ag_headers(
 		exit(1);
 	}
 
+	/*
+	 * The sector headers and the btree root blocks are separated by the
+	 * rest of the first block.  Fill the gap with zeroes so that all of
+	 * this AG's headers go out in one aligned write rather than having the
+	 * device do a read-modify-write cycle of the first block.
+	 */
+	pad_start = XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR(mp)) +
+			XFS_FSS_TO_BB(mp, 1);
+	pad_end = XFS_AGB_TO_DADDR(mp, agno, XFS_BNO_BLOCK(mp));
+	if (pad && pad_end > pad_start) {
+		error = -libxfs_buf_get_uncached(mp->m_ddev_targp,
+				pad_end - pad_start, 0, &bp);
+		if (error) {
+			fprintf(stderr, _("AG header init failed, error %d\n"),
+					error);
+			exit(1);
+		}
+		bp->b_maps[0].bm_bn = pad_start;
+		memset(bp->b_addr, 0, BBTOB(bp->b_length));
+		xfs_buf_delwri_queue(bp, &id.buffer_list);
+		libxfs_buf_relse(bp);
+	}
+
 	list_splice_tail_init(&id.buffer_list, buffer_list);
 
 	if (libxfs_alloc_min_freelist(mp, pag) > *worst_freelist)
@@ -3830,6 +4046,118 @@ initialise_ag_headers(
 	libxfs_perag_put(pag);
 }
 
+/*
+ * AG headers are built by several threads, each working through its own
+ * range of AGs with its own buffer list.
+ */
+struct ag_headers_batch {
+	struct mkfs_params	*cfg;
+	xfs_agnumber_t		start_agno;
+	xfs_agnumber_t		end_agno;
+	int			worst_freelist;
+	bool			pad;
+};
+
+/* Number of AGs of headers to build up before writing them out. */
+#define AG_HEADERS_BATCH	16
+
+static void
+write_ag_headers(
+	struct list_head	*buffer_list)
+{
+	int			error;
+
+	/* the list is sorted and adjacent buffers are written together */
+	error = -libxfs_buf_delwri_submit(buffer_list);
+	if (error) {
+		fprintf(stderr, _("%s: writing AG headers failed, err=%d\n"),
+				progname, error);
+		exit(1);
+	}
+}
+
+static void
+initialise_ag_headers_batch(
+	struct workqueue	*wq,
+	xfs_agnumber_t		index,
+	void			*arg)
+{
+	struct ag_headers_batch	*batch = arg;
+	struct xfs_mount	*mp = wq->wq_ctx;
+	struct list_head	buffer_list;
+	xfs_agnumber_t		agno;
+
+	INIT_LIST_HEAD(&buffer_list);
+	for (agno = batch->start_agno; agno < batch->end_agno; agno++) {
+		initialise_ag_headers(batch->cfg, mp, agno,
+				&batch->worst_freelist, &buffer_list,
+				batch->pad);
+
+		if ((agno - batch->start_agno + 1) % AG_HEADERS_BATCH == 0)
+			write_ag_headers(&buffer_list);
+	}
+	write_ag_headers(&buffer_list);
+}
+
+/*
+ * Initialise all the static on disk metadata in parallel.  Returns the
+ * largest AG freelist size that any AG needs.
+ */
+static int
+initialise_all_ag_headers(
+	struct mkfs_params	*cfg,
+	struct xfs_mount	*mp,
+	unsigned int		nr_threads,
+	bool			pad)
+{
+	struct ag_headers_batch	*batches;
+	struct workqueue	wq;
+	xfs_agnumber_t		per_batch;
+	unsigned int		i;
+	int			worst_freelist = 0;
+	int			error;
+
+	per_batch = howmany(cfg->agcount, nr_threads);
+	nr_threads = howmany(cfg->agcount, per_batch);
+
+	batches = calloc(nr_threads, sizeof(struct ag_headers_batch));
+	if (!batches) {
+		fprintf(stderr, _("%s: cannot allocate AG header batches\n"),
+				progname);
+		exit(1);
+	}
+
+	error = -workqueue_create(&wq, mp, nr_threads);
+	if (error)
+		goto out_error;
+
+	for (i = 0; i < nr_threads; i++) {
+		batches[i].cfg = cfg;
+		batches[i].pad = pad;
+		batches[i].start_agno = i * per_batch;
+		batches[i].end_agno = min(cfg->agcount, (i + 1) * per_batch);
+		error = -workqueue_add(&wq, initialise_ag_headers_batch, i,
+				&batches[i]);
+		if (error)
+			goto out_error;
+	}
+
+	error = -workqueue_terminate(&wq);
+	if (error)
+		goto out_error;
+	workqueue_destroy(&wq);
+
+	for (i = 0; i < nr_threads; i++)
+		worst_freelist = max(worst_freelist, batches[i].worst_freelist);
+	free(batches);
+	return worst_freelist;
+
+out_error:
+	fprintf(stderr, _("%s: initialising AG headers failed, err=%d\n"),
+			progname, error);
+	exit(1);
+}
+
 static void
 initialise_ag_freespace(
 	struct xfs_mount	*mp,
@@ -3861,6 +4189,52 @@ initialise_ag_freespace(
 	}
 }
 
+static void
+initialise_ag_freespace_worker(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	initialise_ag_freespace(wq->wq_ctx, agno, *(int *)arg);
+}
+
+/*
+ * Fix up the freelists of all AGs in parallel.  Each AG is a separate
+ * transaction that only touches that AG's headers and btrees.
+ */
+static void
+initialise_all_ag_freespace(
+	struct xfs_mount	*mp,
+	int			worst_freelist,
+	unsigned int		nr_threads)
+{
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	int			error;
+
+	error = -workqueue_create(&wq, mp, nr_threads);
+	if (error)
+		goto out_error;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		error = -workqueue_add(&wq, initialise_ag_freespace_worker,
+				agno, &worst_freelist);
+		if (error)
+			goto out_error;
+	}
+
+	error = -workqueue_terminate(&wq);
+	if (error)
+		goto out_error;
+	workqueue_destroy(&wq);
+	return;
+
+out_error:
+	fprintf(stderr, _("%s: initialising AG free space failed, err=%d\n"),
+			progname, error);
+	exit(1);
+}
+
 /*
  * rewrite several secondary superblocks with the root inode number filled out.
  * This can help repair recovery from a trashed primary superblock without
@@ -3998,12 +4372,193 @@ cfgfile_parse(
 		cli->cfgfile);
 }
 
+/*
+ * Run a short write benchmark against the data device, and the log device if
+ * it is external, so that the AG and log geometry calculations can take the
+ * results into account.  Log stripe unit advice is applied right here since
+ * the stripe geometry has already been worked out.
+ */
+static void
+benchmark_devices(
+	struct mkfs_params	*cfg,
+	struct cli_params	*cli,
+	struct mkfs_bench	*dbench,
+	struct mkfs_bench	*lbench,
+	int			quiet)
+{
+	struct libxfs_xinit	*xi = cli->xi;
+
+	bench_device(xi->dfd, min(BBTOB(xi->dsize),
+				  cfg->dblocks << cfg->blocklog),
+			cfg->blocksize, dbench);
+	cli->dbench = dbench;
+	if (!quiet)
+		bench_report(_("data device"), dbench);
+
+	if (cfg->loginternal) {
+		cli->lbench = dbench;
+	} else {
+		bench_device(xi->logfd, min(BBTOB(xi->logBBsize),
+					    cfg->logblocks << cfg->blocklog),
+				cfg->blocksize, lbench);
+		cli->lbench = lbench;
+		if (!quiet)
+			bench_report(_("log device"), lbench);
+	}
+
+	/*
+	 * Pad log writes out to the largest size the device writes as
+	 * cheaply as a single block, unless we've been told otherwise or
+	 * the log already follows the data stripe unit.
+	 */
+	if (cfg->sb_feat.log_version == 2 && cfg->lsunit <= 1 &&
+	    !cli_opt_set(&lopts, L_SUNIT) && !cli_opt_set(&lopts, L_SU) &&
+	    cli->lbench->write_unit > cfg->blocksize)
+		cfg->lsunit = cli->lbench->write_unit / cfg->blocksize;
+}
+
+/*
+ * Work out and check the AG, log and superblock geometry from the options
+ * and the device sizes, exiting if they don't describe a supported
+ * filesystem.
+ */
+static void
+calculate_geometry(
+	struct mkfs_params	*cfg,
+	struct cli_params	*cli,
+	struct xfs_mount	*mp,
+	struct xfs_sb		*sbp)
+{
+	/* Make sure everything aligns to device geometry correctly. */
+	calculate_initial_ag_geometry(cfg, cli);
+	align_ag_geometry(cfg);
+
+	calculate_imaxpct(cfg, cli);
+
+	/*
+	 * Set up the basic superblock parameters now so that we can use
+	 * the geometry information we've already validated in libxfs
+	 * provided functions to determine on-disk format information.
+	 */
+	start_superblock_setup(cfg, mp, sbp);
+	initialise_mount(mp, sbp);
+
+	/*
+	 * With the mount set up, we can finally calculate the log size
+	 * constraints and do default size calculations and final validation
+	 */
+	calculate_log_size(cfg, cli, mp);
+
+	finish_superblock_setup(cfg, mp, sbp);
+
+	/* Validate the extent size hints now that @mp is fully set up. */
+	validate_extsize_hint(mp, cli);
+	validate_cowextsize_hint(mp, cli);
+
+	validate_supported(mp, cli);
+}
+
+/* Explain which parts of the geometry came from the device benchmark. */
+static void
+explain_benchmark(
+	struct mkfs_params	*cfg,
+	struct cli_params	*cli)
+{
+	struct mkfs_bench	*dbench = cli->dbench;
+	struct mkfs_bench	*lbench = cli->lbench;
+
+	printf(_("Geometry chosen from benchmark:\n"));
+	if (cli->agcount || cli->agsize)
+		printf(_("  agcount=%llu: set on the command line\n"),
+			(unsigned long long)cfg->agcount);
+	else if (cfg->agcount >= dbench->concurrency)
+		printf(
+_("  agcount=%llu: %u concurrent writers reach %u%% of peak write IOPS\n"),
+			(unsigned long long)cfg->agcount,
+			dbench->concurrency, dbench->peak_pct);
+	else
+		printf(
+_("  agcount=%llu: %u concurrent writers would need AGs below the minimum size\n"),
+			(unsigned long long)cfg->agcount, dbench->concurrency);
+
+	if (!cfg->loginternal)
+		printf(_("  log size=%llu blocks: external log device\n"),
+			(unsigned long long)cfg->logblocks);
+	else if (cli->logsize)
+		printf(_("  log size=%llu blocks: set on the command line\n"),
+			(unsigned long long)cfg->logblocks);
+	else
+		printf(
+_("  log size=%llu blocks: %.2f seconds of sequential writes, limited to 1/%d of the filesystem\n"),
+			(unsigned long long)cfg->logblocks,
+			(double)(cfg->logblocks << cfg->blocklog) /
+				lbench->seq_bw,
+			BENCH_LOG_FS_RATIO);
+
+	if (cli_opt_set(&lopts, L_SUNIT) || cli_opt_set(&lopts, L_SU))
+		printf(_("  log sunit=%d blocks: set on the command line\n"),
+			cfg->lsunit);
+	else if (cfg->lsunit > 1 && cfg->lsunit == cfg->dsunit)
+		printf(_("  log sunit=%d blocks: matches the data stripe unit\n"),
+			cfg->lsunit);
+	else if (cfg->lsunit > 1)
+		printf(
+_("  log sunit=%d blocks: %u byte writes cost no more than %d byte writes\n"),
+			cfg->lsunit, lbench->write_unit, cfg->blocksize);
+	else
+		printf(
+_("  log sunit=%d blocks: larger writes cost more than single blocks\n"),
+			cfg->lsunit);
+}
+
+/*
+ * Total bytes we sent to all the devices holding the filesystem, and bytes
+ * the devices zeroed for us without a data transfer.
+ */
+static void
+mkfs_device_bytes(
+	struct xfs_mount	*mp,
+	unsigned long long	*written,
+	unsigned long long	*zeroed)
+{
+	*written = mp->m_ddev_targp->bytes_written;
+	*zeroed = mp->m_ddev_targp->bytes_zeroed;
+	if (mp->m_logdev_targp != mp->m_ddev_targp) {
+		*written += mp->m_logdev_targp->bytes_written;
+		*zeroed += mp->m_logdev_targp->bytes_zeroed;
+	}
+	if (mp->m_rtdev_targp != mp->m_ddev_targp) {
+		*written += mp->m_rtdev_targp->bytes_written;
+		*zeroed += mp->m_rtdev_targp->bytes_zeroed;
+	}
+}
+
+/*
+ * Report how long a stage of filesystem construction took, and restart the
+ * clock for the next one.
+ */
+static void
+report_stage(
+	int			verbose,
+	const char		*stage,
+	struct timespec		*start)
+{
+	struct timespec		now;
+
+	if (!verbose)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf(_("%-30s %8.3f seconds\n"), stage,
+		(now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1000000000.0);
+	*start = now;
+}
+
 int
 main(
 	int			argc,
 	char			**argv)
 {
-	xfs_agnumber_t		agno;
 	struct xfs_buf		*buf;
 	int			c;
 	char			*dfile = NULL;
@@ -4013,9 +4568,15 @@ main(
 	int			discard = 1;
 	int			force_overwrite = 0;
 	int			quiet = 0;
+	int			verbose = 0;
+	struct timespec		stage_start;
+	bool			data_zeroed = false;
+	bool			log_zeroed = false;
 	char			*protofile = NULL;
 	char			*protostring = NULL;
+	struct proto_dent	*protodir = NULL;
 	int			worst_freelist = 0;
+	unsigned int		nr_threads;
 
 	struct libxfs_xinit	xi = {
 		.isdirect = LIBXFS_DIRECT,
@@ -4032,6 +4593,9 @@ main(
 		.is_supported	= 1,
 	};
 	struct mkfs_params	cfg = {};
+	struct mkfs_bench	dbench, lbench;
+	struct mkfs_params	saved_cfg;
+	struct xfs_mount	saved_mount;
 
 	struct option		long_options[] = {
 	{
@@ -4040,6 +4604,18 @@ main(
 		.flag		= &cli.is_supported,
 		.val		= 0,
 	},
+	{
+		.name		= "benchmark",
+		.has_arg	= no_argument,
+		.flag		= &cli.benchmark,
+		.val		= 1,
+	},
+	{
+		.name		= "thin",
+		.has_arg	= no_argument,
+		.flag		= &cli.thin,
+		.val		= 1,
+	},
 	{NULL, 0, NULL, 0 },
 	};
 	int			option_index = 0;
@@ -4076,7 +4652,6 @@ main(
 		},
 	};
 
-	struct list_head	buffer_list;
 	int			error;
 
 	platform_uuid_generate(&cli.uuid);
@@ -4103,7 +4678,7 @@ main(
 	memcpy(&cli.sb_feat, &dft.sb_feat, sizeof(cli.sb_feat));
 	memcpy(&cli.fsx, &dft.fsx, sizeof(cli.fsx));
 
-	while ((c = getopt_long(argc, argv, "b:c:d:i:l:L:m:n:KNp:qr:s:CfV",
+	while ((c = getopt_long(argc, argv, "b:c:d:i:l:L:m:n:KNp:qr:s:vCfV",
 					long_options, &option_index)) != EOF) {
 		switch (c) {
 		case 0:
@@ -4142,6 +4717,9 @@ main(
 		case 'q':
 			quiet = 1;
 			break;
+		case 'v':
+			verbose = 1;
+			break;
 		case 'V':
 			printf(_("%s version %s\n"), progname, VERSION);
 			exit(0);
@@ -4157,6 +4735,12 @@ main(
 	} else
 		dfile = xi.dname;
 
+	if (cli.benchmark && dry_run) {
+		fprintf(stderr,
+_("--benchmark writes to the device and cannot be used with -N\n"));
+		usage();
+	}
+
 	/*
 	 * Now we have all the options parsed, we can read in the option file
 	 * specified on the command line via "-c options=xxx". Once we have all
@@ -4165,7 +4749,9 @@ main(
 	 */
 	cfgfile_parse(&cli);
 
-	protostring = setup_proto(protofile);
+	protodir = setup_proto_dir(protofile);
+	if (!protodir)
+		protostring = setup_proto(protofile);
 
 	/*
 	 * Extract as much of the valid config as we can from the CLI input
@@ -4217,35 +4803,34 @@ main(
 	/*
 	 * At this point when know exactly what size all the devices are,
 	 * so we can start validating and calculating layout options that are
-	 * dependent on device sizes. Once calculated, make sure everything
-	 * aligns to device geometry correctly.
+	 * dependent on device sizes.
 	 */
-	calculate_initial_ag_geometry(&cfg, &cli);
-	align_ag_geometry(&cfg);
-
-	calculate_imaxpct(&cfg, &cli);
+	if (cli.benchmark) {
+		saved_cfg = cfg;
+		saved_mount = mbuf;
+	}
+	calculate_geometry(&cfg, &cli, mp, sbp);
 
-	/*
-	 * Set up the basic superblock parameters now so that we can use
-	 * the geometry information we've already validated in libxfs
-	 * provided functions to determine on-disk format information.
-	 */
-	start_superblock_setup(&cfg, mp, sbp);
-	initialise_mount(mp, sbp);
+	/* Make sure our checksum algorithm really works. */
+	if (crc32c_test(CRC32CTEST_QUIET) != 0) {
+		fprintf(stderr,
+ _("crc32c self-test failed, will not create a filesystem here.\n"));
+		return 1;
+	}
 
 	/*
-	 * With the mount set up, we can finally calculate the log size
-	 * constraints and do default size calculations and final validation
+	 * The benchmark writes to the devices, so only run it once we know
+	 * the options describe a filesystem we will go on to make.  Then
+	 * work the geometry out again with what it found.
 	 */
-	calculate_log_size(&cfg, &cli, mp);
-
-	finish_superblock_setup(&cfg, mp, sbp);
-
-	/* Validate the extent size hints now that @mp is fully set up. */
-	validate_extsize_hint(mp, &cli);
-	validate_cowextsize_hint(mp, &cli);
-
-	validate_supported(mp, &cli);
+	if (cli.benchmark) {
+		cfg = saved_cfg;
+		mbuf = saved_mount;
+		benchmark_devices(&cfg, &cli, &dbench, &lbench, quiet);
+		calculate_geometry(&cfg, &cli, mp, sbp);
+		if (!quiet)
+			explain_benchmark(&cfg, &cli);
+	}
 
 	/* Print the intended geometry of the fs. */
 	if (!quiet || dry_run) {
@@ -4257,74 +4842,65 @@ main(
 			exit(0);
 	}
 
-	/* Make sure our checksum algorithm really works. */
-	if (crc32c_test(CRC32CTEST_QUIET) != 0) {
-		fprintf(stderr,
- _("crc32c self-test failed, will not create a filesystem here.\n"));
-		return 1;
-	}
-
 	/*
 	 * All values have been validated, discard the old device layout.
 	 */
-	if (discard && !dry_run)
-		discard_devices(&xi, quiet);
+	clock_gettime(CLOCK_MONOTONIC, &stage_start);
+	if (discard && !dry_run) {
+		discard_devices(&xi, quiet, cli.thin, &data_zeroed,
+				&log_zeroed);
+		report_stage(verbose, _("discard"), &stage_start);
+	}
 
 	/*
 	 * we need the libxfs buffer cache from here on in.
 	 */
 	libxfs_buftarg_init(mp, xi.ddev, xi.logdev, xi.rtdev);
+	if (cli.thin) {
+		mp->m_ddev_targp->flags |= XFS_BUFTARG_UNMAP_ZERO;
+		mp->m_logdev_targp->flags |= XFS_BUFTARG_UNMAP_ZERO;
+		mp->m_rtdev_targp->flags |= XFS_BUFTARG_UNMAP_ZERO;
+	}
 
 	/*
 	 * Before we mount the filesystem we need to make sure the devices have
 	 * enough of the filesystem structure on them that allows libxfs to
 	 * mount.
 	 */
-	prepare_devices(&cfg, &xi, mp, sbp, force_overwrite);
+	prepare_devices(&cfg, &xi, mp, sbp, force_overwrite, cli.thin,
+			data_zeroed, log_zeroed);
 	mp = libxfs_mount(mp, sbp, xi.ddev, xi.logdev, xi.rtdev, 0);
 	if (mp == NULL) {
 		fprintf(stderr, _("%s: filesystem failed to initialize\n"),
 			progname);
 		exit(1);
 	}
+	report_stage(verbose, _("device preparation"), &stage_start);
 
 	/*
-	 * Initialise all the static on disk metadata.
+	 * Initialise all the static on disk metadata, spread over as many
+	 * threads as we have CPUs.
 	 */
-	INIT_LIST_HEAD(&buffer_list);
-	for (agno = 0; agno < cfg.agcount; agno++) {
-		initialise_ag_headers(&cfg, mp, agno, &worst_freelist,
-				&buffer_list);
-
-		if (agno % 16)
-			continue;
-
-		error = -libxfs_buf_delwri_submit(&buffer_list);
-		if (error) {
-			fprintf(stderr,
-	_("%s: writing AG headers failed, err=%d\n"),
-					progname, error);
-			exit(1);
-		}
-	}
-
-	error = -libxfs_buf_delwri_submit(&buffer_list);
-	if (error) {
-		fprintf(stderr, _("%s: writing AG headers failed, err=%d\n"),
-				progname, error);
-		exit(1);
-	}
+	nr_threads = min((uint64_t)platform_nproc(), cfg.agcount);
+	worst_freelist = initialise_all_ag_headers(&cfg, mp, nr_threads,
+			cli.thin);
+	report_stage(verbose, _("AG headers"), &stage_start);
 
 	/*
 	 * Initialise the freespace freelists (i.e. AGFLs) in each AG.
 	 */
-	for (agno = 0; agno < cfg.agcount; agno++)
-		initialise_ag_freespace(mp, agno, worst_freelist);
+	initialise_all_ag_freespace(mp, worst_freelist, nr_threads);
+	report_stage(verbose, _("AG free space"), &stage_start);
 
 	/*
-	 * Allocate the root inode and anything else in the proto file.
+	 * Allocate the root inode and anything else in the proto file or
+	 * source directory.
 	 */
-	parse_proto(mp, &cli.fsx, &protostring);
+	if (protodir)
+		populate_proto_dir(mp, &cli.fsx, protodir);
+	else
+		parse_proto(mp, &cli.fsx, &protostring);
+	report_stage(verbose, _("root directory and protofile"), &stage_start);
 
 	/*
 	 * Protect ourselves against possible stupidity
@@ -4334,8 +4910,11 @@ main(
 	/*
 	 * Re-write multiple secondary superblocks with rootinode field set
 	 */
-	if (mp->m_sb.sb_agcount > 1)
+	if (mp->m_sb.sb_agcount > 1) {
 		rewrite_secondary_superblocks(mp);
+		report_stage(verbose, _("secondary superblocks"),
+				&stage_start);
+	}
 
 	/*
 	 * Dump all inodes and buffers before marking us all done.
@@ -4355,10 +4934,33 @@ main(
 	libxfs_buf_mark_dirty(buf);
 	libxfs_buf_relse(buf);
 
+	/*
+	 * With --thin, write everything back in disk order now so that we can
+	 * count it; unmounting frees the buffer targets.
+	 */
+	if (cli.thin) {
+		error = -libxfs_bcache_flush_sorted();
+		if (error) {
+			fprintf(stderr,
+		_("%s: writing filesystem metadata failed: %s\n"),
+					progname, strerror(error));
+			exit(1);
+		}
+		if (!quiet) {
+			unsigned long long	written, zeroed;
+
+			mkfs_device_bytes(mp, &written, &zeroed);
+			printf(
+		_("%llu bytes written, %llu bytes zeroed by the device\n"),
+					written, zeroed);
+		}
+	}
+
 	/* Exit w/ failure if anything failed to get written to our new fs. */
 	error = -libxfs_umount(mp);
 	if (error)
 		exit(1);
+	report_stage(verbose, _("final flush"), &stage_start);
 
 	libxfs_destroy(&xi);
 	return 0;